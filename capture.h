@@ -0,0 +1,98 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Command capture for replay.
+//
+// S1 started with -r <file> appends a line to the file for every downlf,
+// uploadf, dispfnames, removef and downltar it serves:
+//
+//   <at_us> <command> <dur_us> <ok|error> <bytes_in> <bytes_out> <arguments>
+//
+// at_us is when the command arrived, counted from the start of the
+// capture, and dur_us how long it took to serve. bytes_in is the file
+// bytes received (an upload's size) and bytes_out the bytes sent back.
+// The arguments are those of the command line, so names and paths are
+// kept, but no file contents. replay re-drives a capture and writes its
+// own runs in the same format.
+//
+// Each line is written out as its command finishes, one write(2) per
+// command, so a capture is complete up to the moment S1 stops.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hist.h"
+
+#define CAPTURE_ARGS 320
+
+typedef struct {
+    long long at_us;
+    char cmd[16];
+    long long dur_us;
+    int failed;
+    long long bytes_in;
+    long long bytes_out;
+    char args[CAPTURE_ARGS];
+} capture_rec_t;
+
+typedef struct {
+    FILE *fp;
+    long long start_us;
+} capture_t;
+
+// Start a capture into path, replacing what was there. Returns 0 on
+// success.
+static inline int capture_open(capture_t *c, const char *path) {
+    c->fp = fopen(path, "w");
+    if (!c->fp) {
+        return -1;
+    }
+    setvbuf(c->fp, NULL, _IOLBF, 0);
+    c->start_us = hist_now_us();
+    fprintf(c->fp, "# at_us command dur_us outcome bytes_in bytes_out arguments\n");
+    return 0;
+}
+
+static inline void capture_write(FILE *fp, const capture_rec_t *r) {
+    fprintf(fp, "%lld %s %lld %s %lld %lld %s\n", r->at_us, r->cmd, r->dur_us, r->failed ? "error" : "ok",
+            r->bytes_in, r->bytes_out, r->args);
+}
+
+// Record command line (without its request id) that arrived at started_us
+// and has just been served
+static inline void capture_done(capture_t *c, const char *line, long long started_us, int failed,
+                                long long bytes_in, long long bytes_out) {
+    capture_rec_t r;
+    long long now = hist_now_us();
+    size_t n = strcspn(line, " ");
+    if (n >= sizeof(r.cmd)) n = sizeof(r.cmd) - 1;
+    memcpy(r.cmd, line, n);
+    r.cmd[n] = '\0';
+    line += n + strspn(line + n, " ");
+    n = strcspn(line, "\r\n");
+    if (n >= sizeof(r.args)) n = sizeof(r.args) - 1;
+    memcpy(r.args, line, n);
+    r.args[n] = '\0';
+    r.at_us = started_us - c->start_us;
+    r.dur_us = now - started_us;
+    r.failed = failed;
+    r.bytes_in = bytes_in;
+    r.bytes_out = bytes_out;
+    capture_write(c->fp, &r);
+}
+
+// Parse a capture line. Returns 0, or -1 for comments and bad lines.
+static inline int capture_parse(const char *line, capture_rec_t *r) {
+    char outcome[8];
+    int used = 0;
+    if (line[0] == '#' ||
+        sscanf(line, "%lld %15s %lld %7s %lld %lld %n", &r->at_us, r->cmd, &r->dur_us, outcome, &r->bytes_in,
+               &r->bytes_out, &used) != 6 || used == 0) {
+        return -1;
+    }
+    r->failed = strcmp(outcome, "ok") != 0;
+    snprintf(r->args, sizeof(r->args), "%.*s", (int)strcspn(line + used, "\r\n"), line + used);
+    return 0;
+}
+
+#endif
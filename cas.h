@@ -0,0 +1,794 @@
+#ifndef CAS_H
+#define CAS_H
+
+// Content-addressed chunk store, optionally used by S1-S4 to keep a single
+// copy of data shared by several files.
+//
+// A stored file is split into content-defined chunks (see cdc.h) named by
+// their BLAKE2b-256 hash and kept once under <base>/.cas/chunks/<xx>/<hash>.
+// The file's own path then holds a small manifest listing its chunks, so
+// names, directories and listings look exactly as before; reads reassemble
+// the data. Files written
+// before the store was enabled stay plain and are read as they are.
+//
+// Reference counts live in memory and are rebuilt from the manifests when
+// the store is opened, so they cannot drift from what is on disk. A chunk
+// whose count drops to zero is deleted by a background thread once it has
+// been unreferenced for CAS_GC_GRACE seconds.
+//
+// Every file written here, plain file, manifest or chunk, is tagged with
+// the CRC32C of the data it holds (see crc.h) in a user.crc32c extended
+// attribute, so whole-file downloads send the checksum taken when the data
+// was stored and a copy that has since rotted on disk fails the client's
+// check. The tag records the file's size and mtime and is ignored once
+// either changes.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+
+#include "cdc.h"
+#include "crc.h"
+#include "log.h"
+
+#define CAS_DIR ".cas"
+#define CAS_MAGIC "\x7f" "CAS1\n"
+#define CAS_GC_INTERVAL 5           // seconds between collections
+#define CAS_GC_GRACE 5              // seconds a chunk stays after its last reference
+#define CAS_CRC_XATTR "user.crc32c"
+
+// Chunk table
+
+typedef struct {
+    uint8_t hash[CDC_HASH_LEN];
+    uint32_t size;
+    int32_t refs;               // manifests that list the chunk
+    uint8_t used;
+    uint8_t stored;             // the chunk file exists
+    uint8_t writing;            // a put is writing the chunk file, unlocked
+    time_t unused_since;        // when refs last dropped to zero
+} cas_chunk_t;
+
+typedef struct {
+    int enabled;
+    char base[256];
+    char root[512];             // <base>/.cas/chunks
+    pthread_mutex_t lock;
+    pthread_cond_t written;     // a chunk's writing flag was cleared
+    cas_chunk_t *slots;
+    size_t cap;                 // power of two
+    size_t count;
+    // Totals for dedupstats
+    unsigned long long files;   // files stored as manifests
+    unsigned long long logical_bytes;
+    unsigned long long stored_bytes;
+    unsigned long long chunks;
+    unsigned long long ingest_bytes;
+    double ingest_sec;
+    // Chunks put and how many of them were already stored, for metrics
+    unsigned long long chunk_puts;
+    unsigned long long chunk_hits;
+} cas_t;
+
+typedef struct {
+    uint8_t hash[CDC_HASH_LEN];
+    uint32_t len;
+} cas_ref_t;
+
+static cas_chunk_t *cas_find(cas_t *c, const uint8_t *hash, int insert) {
+    if (insert && (c->count + 1) * 2 > c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 1024;
+        cas_chunk_t *slots = calloc(cap, sizeof(cas_chunk_t));
+        if (!slots) return NULL;
+        for (size_t i = 0; i < c->cap; i++) {
+            if (!c->slots[i].used) continue;
+            size_t j = cdc_load64(c->slots[i].hash) & (cap - 1);
+            while (slots[j].used) j = (j + 1) & (cap - 1);
+            slots[j] = c->slots[i];
+        }
+        free(c->slots);
+        c->slots = slots;
+        c->cap = cap;
+    }
+    if (!c->cap) return NULL;
+    size_t j = cdc_load64(hash) & (c->cap - 1);
+    while (c->slots[j].used) {
+        if (memcmp(c->slots[j].hash, hash, CDC_HASH_LEN) == 0) {
+            return &c->slots[j];
+        }
+        j = (j + 1) & (c->cap - 1);
+    }
+    if (!insert) return NULL;
+    cas_chunk_t *e = &c->slots[j];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->hash, hash, CDC_HASH_LEN);
+    e->used = 1;
+    e->unused_since = time(NULL);
+    c->count++;
+    return e;
+}
+
+static void cas_chunk_path(const cas_t *c, const uint8_t *hash, char *out, size_t size) {
+    char hex[2 * CDC_HASH_LEN + 1];
+    cdc_hex(hash, hex);
+    snprintf(out, size, "%s/%.2s/%s", c->root, hex, hex);
+}
+
+static void cas_release(cas_t *c, const cas_ref_t *refs, int n) {
+    for (int i = 0; i < n; i++) {
+        cas_chunk_t *e = cas_find(c, refs[i].hash, 0);
+        if (e && e->refs > 0 && --e->refs == 0) {
+            e->unused_since = time(NULL);
+        }
+    }
+}
+
+// Manifests
+
+// Parse the manifest at path. Returns 1 with a malloc'd *refs, 0 if the
+// file is a plain file, or -1 if it cannot be read.
+static int cas_read_manifest(const char *path, cas_ref_t **refs, int *n, uint64_t *size) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+    char line[128];
+    if (!fgets(line, sizeof(line), fp) || strcmp(line, CAS_MAGIC) != 0 ||
+        !fgets(line, sizeof(line), fp)) {
+        fclose(fp);
+        return 0;
+    }
+    *size = strtoull(line, NULL, 10);
+
+    int count = 0, cap = 0;
+    cas_ref_t *list = NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        cas_ref_t r;
+        if (strlen(line) < 2 * CDC_HASH_LEN + 2 || cdc_unhex(line, r.hash) < 0) {
+            continue;
+        }
+        r.len = strtoul(line + 2 * CDC_HASH_LEN + 1, NULL, 10);
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            cas_ref_t *grown = realloc(list, cap * sizeof(cas_ref_t));
+            if (!grown) {
+                free(list);
+                fclose(fp);
+                return -1;
+            }
+            list = grown;
+        }
+        list[count++] = r;
+    }
+    fclose(fp);
+    *refs = list;
+    *n = count;
+    return 1;
+}
+
+// Add every manifest under dir to the reference counts
+static void cas_scan_manifests(cas_t *c, const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, CAS_DIR) == 0) {
+            continue;
+        }
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            cas_scan_manifests(c, path);
+            continue;
+        }
+        cas_ref_t *refs;
+        int n;
+        uint64_t size;
+        if (!S_ISREG(st.st_mode) || cas_read_manifest(path, &refs, &n, &size) != 1) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            cas_chunk_t *e = cas_find(c, refs[i].hash, 1);
+            if (e) e->refs++;
+        }
+        c->files++;
+        c->logical_bytes += size;
+        free(refs);
+    }
+    closedir(d);
+}
+
+// Register the chunk files already on disk
+static void cas_scan_chunks(cas_t *c) {
+    DIR *d = opendir(c->root);
+    if (!d) return;
+    struct dirent *sub;
+    while ((sub = readdir(d)) != NULL) {
+        if (sub->d_name[0] == '.') continue;
+        char dir[768];
+        snprintf(dir, sizeof(dir), "%s/%s", c->root, sub->d_name);
+        DIR *cd = opendir(dir);
+        if (!cd) continue;
+        struct dirent *entry;
+        while ((entry = readdir(cd)) != NULL) {
+            uint8_t hash[CDC_HASH_LEN];
+            if (strlen(entry->d_name) != 2 * CDC_HASH_LEN || cdc_unhex(entry->d_name, hash) < 0) {
+                continue;
+            }
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            struct stat st;
+            cas_chunk_t *e;
+            if (stat(path, &st) < 0 || !(e = cas_find(c, hash, 1))) {
+                continue;
+            }
+            e->stored = 1;
+            e->size = st.st_size;
+            c->chunks++;
+            c->stored_bytes += st.st_size;
+        }
+        closedir(cd);
+    }
+    closedir(d);
+}
+
+// Garbage collector thread: delete chunks that have been unreferenced for
+// at least CAS_GC_GRACE seconds
+static void *cas_gc(void *arg) {
+    cas_t *c = arg;
+    while (1) {
+        sleep(CAS_GC_INTERVAL);
+        int freed = 0;
+        pthread_mutex_lock(&c->lock);
+        time_t now = time(NULL);
+        for (size_t i = 0; i < c->cap; i++) {
+            cas_chunk_t *e = &c->slots[i];
+            if (!e->used || !e->stored || e->refs > 0 || now - e->unused_since < CAS_GC_GRACE) {
+                continue;
+            }
+            char path[1024];
+            cas_chunk_path(c, e->hash, path, sizeof(path));
+            if (unlink(path) == 0 || errno == ENOENT) {
+                e->stored = 0;
+                c->chunks--;
+                c->stored_bytes -= e->size;
+                freed++;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (freed) {
+            log_info("cas: Collected %d unreferenced chunks", freed);
+        }
+    }
+    return NULL;
+}
+
+// Open the chunk store of a server whose files live under base, counting
+// references from the manifests already there and starting the collector
+static int cas_open(cas_t *c, const char *base) {
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->written, NULL);
+    snprintf(c->base, sizeof(c->base), "%s", base);
+    char dir[300];
+    snprintf(dir, sizeof(dir), "%s/%s", base, CAS_DIR);
+    snprintf(c->root, sizeof(c->root), "%s/chunks", dir);
+    if ((mkdir(dir, 0755) < 0 && errno != EEXIST) || (mkdir(c->root, 0755) < 0 && errno != EEXIST)) {
+        return -1;
+    }
+
+    cas_scan_manifests(c, base);
+    cas_scan_chunks(c);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, cas_gc, c) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    c->enabled = 1;
+    return 0;
+}
+
+// Reading and writing files
+
+// A file being written before it appears at its path. It starts as an
+// unnamed O_TMPFILE in the target directory, preallocated to its final
+// size, and is only linked in once complete and then renamed over the
+// path, so readers see either the old file or all of the new one and a
+// crash cannot leave a truncated file behind. Where O_TMPFILE is
+// unavailable a named temporary file is used.
+typedef struct {
+    int fd;
+    int named;                  // 1 once it has a temporary name
+    char tmp[1100];
+} cas_tmp_t;
+
+static void cas_tmp_discard(cas_tmp_t *t) {
+    int saved = errno;
+    close(t->fd);
+    if (t->named) unlink(t->tmp);
+    errno = saved;
+}
+
+// Open a temporary file for len bytes that will become path
+static int cas_tmp_open(cas_tmp_t *t, const char *path, size_t len) {
+    static unsigned seq;
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        slash[slash == dir] = '\0';
+    }
+    snprintf(t->tmp, sizeof(t->tmp), "%s.tmp.%d.%u", path, (int)getpid(), __sync_fetch_and_add(&seq, 1));
+    unlink(t->tmp);
+
+    t->fd = -1;
+    t->named = 0;
+#ifdef O_TMPFILE
+    t->fd = open(dir, O_TMPFILE | O_RDWR, 0644);
+#endif
+    if (t->fd < 0) {
+        t->fd = open(t->tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        t->named = 1;
+        if (t->fd < 0) return -1;
+    }
+#ifdef O_TMPFILE
+    // Reserve the space up front so the file is laid out in one piece and a
+    // full disk fails the write before any data is sent
+    if (len > 0 && fallocate(t->fd, 0, 0, len) < 0 && errno != EOPNOTSUPP) {
+        cas_tmp_discard(t);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Put a complete temporary file in place at path. It is closed either way.
+static int cas_tmp_publish(cas_tmp_t *t, const char *path) {
+    int ok = 1;
+    if (!t->named) {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", t->fd);
+        ok = linkat(AT_FDCWD, proc, AT_FDCWD, t->tmp, AT_SYMLINK_FOLLOW) == 0;
+        t->named = ok;
+    }
+    if (close(t->fd) != 0) {
+        ok = 0;
+    }
+    if (ok && rename(t->tmp, path) == 0) {
+        return 0;
+    }
+    int saved = errno;
+    if (t->named) unlink(t->tmp);
+    errno = saved;
+    return -1;
+}
+
+// Checksum tag kept with a file
+typedef struct {
+    uint32_t crc;               // CRC32C of the data the file holds
+    uint32_t pad;
+    uint64_t len;               // length of that data
+    uint64_t st_size;           // the file's own size and mtime when tagged
+    int64_t mtime_ns;
+} cas_crc_tag_t;
+
+// Tag the file open at fd, once all of it is written, with the checksum
+// of the len bytes of data it holds. Returns 0, or -1 with errno set if
+// the tag could not be stored (ENOTSUP on filesystems without user
+// extended attributes), which leaves the file usable but untagged.
+static int cas_crc_tag(int fd, uint32_t crc, uint64_t len) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    cas_crc_tag_t tag = { crc, 0, len, st.st_size, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec };
+    return fsetxattr(fd, CAS_CRC_XATTR, &tag, sizeof(tag), 0);
+}
+
+// Read the tag of the file at path. Returns 1 if it is there and still
+// describes the file, 0 otherwise.
+static int cas_crc_get(const char *path, uint32_t *crc, uint64_t *len) {
+    cas_crc_tag_t tag;
+    struct stat st;
+    if (getxattr(path, CAS_CRC_XATTR, &tag, sizeof(tag)) != sizeof(tag) || stat(path, &st) < 0 ||
+        tag.st_size != (uint64_t)st.st_size ||
+        tag.mtime_ns != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) {
+        return 0;
+    }
+    *crc = tag.crc;
+    if (len) *len = tag.len;
+    return 1;
+}
+
+// Write data to path atomically through a temporary file, tagged with the
+// checksum crc of the size bytes it stands for (itself, or for a manifest
+// the file it lists)
+static int cas_write_tagged(const char *path, const void *data, size_t len, uint32_t crc, uint64_t size) {
+    cas_tmp_t t;
+    if (cas_tmp_open(&t, path, len) < 0) {
+        return -1;
+    }
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(t.fd, (const char *)data + done, len - done);
+        if (n <= 0) {
+            cas_tmp_discard(&t);
+            return -1;
+        }
+        done += n;
+    }
+    cas_crc_tag(t.fd, crc, size);
+    return cas_tmp_publish(&t, path);
+}
+
+static int cas_write_all(const char *path, const void *data, size_t len) {
+    return cas_write_tagged(path, data, len, crc32c(0, data, len), len);
+}
+
+// Store one chunk unless it is already there and take a reference to it.
+// The chunk file is written without the lock, so puts of different chunks
+// run side by side; a put of the same chunk waits for it to be written.
+static int cas_put_chunk(cas_t *c, const char *data, uint32_t len, cas_ref_t *ref) {
+    cdc_hash(data, len, ref->hash);
+    ref->len = len;
+
+    pthread_mutex_lock(&c->lock);
+    c->chunk_puts++;
+    cas_chunk_t *e;
+    while ((e = cas_find(c, ref->hash, 1)) && e->writing) {
+        pthread_cond_wait(&c->written, &c->lock);
+    }
+    if (!e) {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    if (e->stored) {
+        c->chunk_hits++;
+        e->refs++;
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    e->writing = 1;
+    pthread_mutex_unlock(&c->lock);
+
+    char path[1024];
+    cas_chunk_path(c, ref->hash, path, sizeof(path));
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+    int status = cas_write_all(path, data, len);
+
+    // Entries are never removed, but the table may have grown meanwhile
+    pthread_mutex_lock(&c->lock);
+    e = cas_find(c, ref->hash, 0);
+    e->writing = 0;
+    if (status == 0) {
+        e->stored = 1;
+        e->size = len;
+        e->refs++;
+        c->chunks++;
+        c->stored_bytes += len;
+    }
+    pthread_cond_broadcast(&c->written);
+    pthread_mutex_unlock(&c->lock);
+    return status;
+}
+
+// Save data at path. With the store enabled the data is chunked and path
+// gets a manifest; otherwise it is written as a plain file.
+static int cas_save(cas_t *c, const char *path, const char *data, size_t len) {
+    if (!c->enabled) {
+        return cas_write_all(path, data, len);
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Every chunk but the last is longer than CDC_MIN
+    int max = len / CDC_MIN + 1;
+    cas_ref_t *refs = malloc(max * sizeof(cas_ref_t));
+    char *manifest = malloc(64 + (size_t)max * (2 * CDC_HASH_LEN + 16));
+    if (!refs || !manifest) {
+        free(refs);
+        free(manifest);
+        return -1;
+    }
+
+    size_t mlen = snprintf(manifest, 64, "%s%zu\n", CAS_MAGIC, len);
+    int n = 0;
+    for (size_t off = 0; off < len; off += refs[n++].len) {
+        uint32_t clen = cdc_cut((const uint8_t *)data + off, len - off);
+        if (cas_put_chunk(c, data + off, clen, &refs[n]) < 0) {
+            pthread_mutex_lock(&c->lock);
+            cas_release(c, refs, n);
+            pthread_mutex_unlock(&c->lock);
+            free(refs);
+            free(manifest);
+            return -1;
+        }
+        cdc_hex(refs[n].hash, manifest + mlen);
+        mlen += 2 * CDC_HASH_LEN;
+        mlen += sprintf(manifest + mlen, " %u\n", clen);
+    }
+
+    // Swap in the new manifest, then drop the references of the old one
+    cas_ref_t *old = NULL;
+    int nold = 0;
+    uint64_t old_size = 0;
+    int had = cas_read_manifest(path, &old, &nold, &old_size) == 1;
+    int status = cas_write_tagged(path, manifest, mlen, crc32c(0, data, len), len);
+
+    pthread_mutex_lock(&c->lock);
+    if (status == 0) {
+        if (had) {
+            cas_release(c, old, nold);
+            c->files--;
+            c->logical_bytes -= old_size;
+        }
+        c->files++;
+        c->logical_bytes += len;
+    } else {
+        cas_release(c, refs, n);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c->ingest_bytes += len;
+    c->ingest_sec += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    pthread_mutex_unlock(&c->lock);
+
+    free(old);
+    free(refs);
+    free(manifest);
+    return status;
+}
+
+// Size of the data stored at path, whether a manifest or a plain file
+static long cas_file_size(const char *path) {
+    cas_ref_t *refs;
+    int n;
+    uint64_t size;
+    int status = cas_read_manifest(path, &refs, &n, &size);
+    if (status == 1) {
+        free(refs);
+        return size;
+    }
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+// Read the data stored at path into buf, which holds cap bytes. Returns
+// the length, or -1 with errno set (EFBIG if it does not fit).
+static long cas_load(cas_t *c, const char *path, char *buf, size_t cap) {
+    cas_ref_t *refs;
+    int n;
+    uint64_t size;
+    int status = cas_read_manifest(path, &refs, &n, &size);
+    if (status < 0) {
+        return -1;
+    }
+    if (status == 0) {
+        FILE *fp = fopen(path, "rb");
+        if (!fp) return -1;
+        fseek(fp, 0, SEEK_END);
+        long len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if (len < 0 || (size_t)len > cap) {
+            fclose(fp);
+            errno = EFBIG;
+            return -1;
+        }
+        size_t got = fread(buf, 1, len, fp);
+        fclose(fp);
+        if (got != (size_t)len) {
+            errno = EIO;
+            return -1;
+        }
+        return len;
+    }
+
+    size_t off = 0;
+    for (int i = 0; i < n; i++) {
+        if (off + refs[i].len > cap) {
+            free(refs);
+            errno = EFBIG;
+            return -1;
+        }
+        char chunk[1024];
+        cas_chunk_path(c, refs[i].hash, chunk, sizeof(chunk));
+        FILE *fp = fopen(chunk, "rb");
+        size_t got = fp ? fread(buf + off, 1, refs[i].len, fp) : 0;
+        if (fp) fclose(fp);
+        if (got != refs[i].len) {
+            log_warn("cas: Chunk %s of %s is missing or short", chunk, path);
+            free(refs);
+            errno = EIO;
+            return -1;
+        }
+        off += got;
+    }
+    free(refs);
+    return off;
+}
+
+// Send len bytes of the file open at fd, starting at off, to sock without
+// copying them through user space. If crc is given, the checksum of the
+// bytes is carried on in *crc; they are read back for it in 1MB pieces
+// just after sending, while still in the page cache.
+static int cas_sendfile(int sock, int fd, uint64_t off, uint64_t len, uint32_t *crc) {
+    off_t pos = off;
+    size_t max = crc ? (1u << 20) : (1u << 30);
+    char *buf = crc ? malloc(max) : NULL;
+    if (crc && !buf) {
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = sendfile(sock, fd, &pos, len > max ? max : len);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;        // the file is shorter than expected
+            free(buf);
+            return -1;
+        }
+        if (crc) {
+            if (pread(fd, buf, n, pos - n) != n) {
+                errno = EIO;
+                free(buf);
+                return -1;
+            }
+            *crc = crc32c(*crc, buf, n);
+        }
+        len -= n;
+    }
+    free(buf);
+    return 0;
+}
+
+// Send bytes [off, off + len) of the data stored at path to sock. A plain
+// file is sent straight from the page cache, and so is the overlapping
+// part of each chunk of a manifest. crc is as for cas_sendfile.
+static int cas_send_range(cas_t *c, const char *path, int sock, uint64_t off, uint64_t len, uint32_t *crc) {
+    cas_ref_t *refs;
+    int n;
+    uint64_t size;
+    int status = cas_read_manifest(path, &refs, &n, &size);
+    if (status < 0) {
+        return -1;
+    }
+    if (status == 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return -1;
+        status = cas_sendfile(sock, fd, off, len, crc);
+        close(fd);
+        return status;
+    }
+
+    uint64_t pos = 0;
+    status = 0;
+    for (int i = 0; i < n && len > 0 && status == 0; pos += refs[i++].len) {
+        if (off >= pos + refs[i].len) continue;
+        uint64_t take = pos + refs[i].len - off;
+        if (take > len) take = len;
+        char chunk[1024];
+        cas_chunk_path(c, refs[i].hash, chunk, sizeof(chunk));
+        int fd = open(chunk, O_RDONLY);
+        status = fd < 0 ? -1 : cas_sendfile(sock, fd, off - pos, take, crc);
+        if (fd >= 0) close(fd);
+        off += take;
+        len -= take;
+    }
+    free(refs);
+    if (status == 0 && len > 0) {
+        errno = EIO;
+        status = -1;
+    }
+    return status;
+}
+
+// BLAKE2b (into out) and CRC32C (into *crc) of the data stored at path,
+// either of them NULL if not wanted, read a piece at a time so files of
+// any size can be checked. Returns its length or -1.
+static long long cas_checksum(cas_t *c, const char *path, uint8_t out[CDC_HASH_LEN], uint32_t *crc) {
+    cas_ref_t *refs;
+    int n;
+    uint64_t size;
+    int status = cas_read_manifest(path, &refs, &n, &size);
+    if (status < 0) {
+        return -1;
+    }
+    char *buf = malloc(1 << 20);
+    if (!buf) {
+        if (status == 1) free(refs);
+        return -1;
+    }
+    cdc_hash_t h;
+    cdc_hash_init(&h);
+    if (crc) *crc = 0;
+    long long total = 0;
+    int ok = 1;
+    if (status == 0) {
+        int fd = open(path, O_RDONLY);
+        ssize_t got = 0;
+        while (fd >= 0 && (got = read(fd, buf, 1 << 20)) > 0) {
+            if (out) cdc_hash_update(&h, buf, got);
+            if (crc) *crc = crc32c(*crc, buf, got);
+            total += got;
+        }
+        ok = fd >= 0 && got == 0;
+        if (fd >= 0) close(fd);
+    } else {
+        for (int i = 0; i < n && ok; i++) {
+            char chunk[1024];
+            cas_chunk_path(c, refs[i].hash, chunk, sizeof(chunk));
+            int fd = open(chunk, O_RDONLY);
+            ok = fd >= 0 && read(fd, buf, refs[i].len) == refs[i].len;
+            if (fd >= 0) close(fd);
+            if (ok) {
+                if (out) cdc_hash_update(&h, buf, refs[i].len);
+                if (crc) *crc = crc32c(*crc, buf, refs[i].len);
+                total += refs[i].len;
+            }
+        }
+        free(refs);
+    }
+    free(buf);
+    if (!ok) {
+        errno = EIO;
+        return -1;
+    }
+    if (out) cdc_hash_final(&h, out);
+    return total;
+}
+
+// Delete the file at path, releasing its chunks if it is a manifest
+static int cas_remove(cas_t *c, const char *path) {
+    cas_ref_t *refs = NULL;
+    int n = 0;
+    uint64_t size = 0;
+    int manifest = c->enabled && cas_read_manifest(path, &refs, &n, &size) == 1;
+    if (unlink(path) < 0) {
+        free(refs);
+        return -1;
+    }
+    if (manifest) {
+        pthread_mutex_lock(&c->lock);
+        cas_release(c, refs, n);
+        c->files--;
+        c->logical_bytes -= size;
+        pthread_mutex_unlock(&c->lock);
+    }
+    free(refs);
+    return 0;
+}
+
+// One-line summary of the store for dedupstats
+static void cas_stats(cas_t *c, const char *label, char *out, size_t size) {
+    if (!c->enabled) {
+        snprintf(out, size, "%s: dedup disabled\n", label);
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    unsigned long long garbage = 0;
+    for (size_t i = 0; i < c->cap; i++) {
+        if (c->slots[i].used && c->slots[i].stored && c->slots[i].refs == 0) garbage++;
+    }
+    snprintf(out, size,
+             "%s: %llu files, %llu bytes stored as %llu bytes in %llu chunks (dedup ratio %.2f), "
+             "%llu chunks awaiting GC, ingest %.1f MB/s\n",
+             label, c->files, c->logical_bytes, c->stored_bytes, c->chunks,
+             c->stored_bytes ? (double)c->logical_bytes / c->stored_bytes : 1.0, garbage,
+             c->ingest_sec > 0 ? c->ingest_bytes / c->ingest_sec / (1 << 20) : 0.0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+#endif
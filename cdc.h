@@ -0,0 +1,442 @@
+#ifndef CDC_H
+#define CDC_H
+
+// Content-defined chunking (FastCDC) shared by the client and the servers.
+//
+// Chunk boundaries are chosen by a gear hash over the data itself rather
+// than at fixed offsets, so an edit only changes the chunks it touches and
+// the rest of a file splits exactly as before. uploadf uses this to send
+// a file as a delta: the client lists the hashes of its chunks, the server
+// answers with the ones it cannot find in its current copy of the path,
+// and only those are transferred. The chunk store splits files the same
+// way so that edited versions share most of their chunks.
+//
+// Boundaries use normalized chunking: below CDC_AVG a stricter mask makes
+// a cut unlikely, above it a looser one makes it likely, which keeps chunk
+// sizes close to the average between the CDC_MIN and CDC_MAX limits.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "log.h"
+
+#define CDC_HASH_LEN 32
+#define CDC_MIN 2048
+#define CDC_AVG 8192
+#define CDC_MAX 65536
+#define CDC_MASK_S 0x0003590703530000ull    // 15 bits, before CDC_AVG
+#define CDC_MASK_L 0x0000d90003530000ull    // 11 bits, after it
+#define CDC_DELTA_MIN 65536                 // smaller uploads are sent whole
+
+// BLAKE2b (RFC 7693), unkeyed, 32-byte digest
+
+static const uint64_t cdc_b2b_iv[8] = {
+    0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+    0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull
+};
+
+static const uint8_t cdc_b2b_sigma[12][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+    { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+    { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+    { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+    { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+    { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+    { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+    { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+    { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 }
+};
+
+static inline uint64_t cdc_rotr64(uint64_t x, int n) {
+    return (x >> n) | (x << (64 - n));
+}
+
+static inline uint64_t cdc_load64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+#define CDC_B2B_G(a, b, c, d, x, y) do {                 \
+        v[a] = v[a] + v[b] + (x); v[d] = cdc_rotr64(v[d] ^ v[a], 32); \
+        v[c] = v[c] + v[d];       v[b] = cdc_rotr64(v[b] ^ v[c], 24); \
+        v[a] = v[a] + v[b] + (y); v[d] = cdc_rotr64(v[d] ^ v[a], 16); \
+        v[c] = v[c] + v[d];       v[b] = cdc_rotr64(v[b] ^ v[c], 63); \
+    } while (0)
+
+static inline void cdc_b2b_compress(uint64_t h[8], const uint8_t *block, uint64_t count, int last) {
+    uint64_t v[16], m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = cdc_load64(block + 8 * i);
+    }
+    for (int i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = cdc_b2b_iv[i];
+    }
+    v[12] ^= count;
+    if (last) {
+        v[14] = ~v[14];
+    }
+    for (int r = 0; r < 12; r++) {
+        const uint8_t *s = cdc_b2b_sigma[r];
+        CDC_B2B_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+        CDC_B2B_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+        CDC_B2B_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+        CDC_B2B_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+        CDC_B2B_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+        CDC_B2B_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+        CDC_B2B_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+        CDC_B2B_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+static inline void cdc_hash(const void *data, size_t len, uint8_t out[CDC_HASH_LEN]) {
+    const uint8_t *p = data;
+    uint64_t h[8];
+    memcpy(h, cdc_b2b_iv, sizeof(h));
+    h[0] ^= 0x01010000 ^ CDC_HASH_LEN;
+
+    size_t off = 0;
+    while (len - off > 128) {
+        cdc_b2b_compress(h, p + off, off + 128, 0);
+        off += 128;
+    }
+    uint8_t block[128] = {0};
+    memcpy(block, p + off, len - off);
+    cdc_b2b_compress(h, block, len, 1);
+
+    for (int i = 0; i < CDC_HASH_LEN; i++) {
+        out[i] = (uint8_t)(h[i / 8] >> (8 * (i % 8)));
+    }
+}
+
+// Incremental form of cdc_hash, for whole files that are hashed as they
+// are read or received
+typedef struct {
+    uint64_t h[8];
+    uint8_t block[128];
+    size_t used;                // bytes in block; the last block is held back
+    uint64_t count;             // bytes compressed so far
+} cdc_hash_t;
+
+static inline void cdc_hash_init(cdc_hash_t *s) {
+    memcpy(s->h, cdc_b2b_iv, sizeof(s->h));
+    s->h[0] ^= 0x01010000 ^ CDC_HASH_LEN;
+    s->used = 0;
+    s->count = 0;
+}
+
+static inline void cdc_hash_update(cdc_hash_t *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        if (s->used == 128) {
+            s->count += 128;
+            cdc_b2b_compress(s->h, s->block, s->count, 0);
+            s->used = 0;
+        }
+        size_t take = 128 - s->used < len ? 128 - s->used : len;
+        memcpy(s->block + s->used, p, take);
+        s->used += take;
+        p += take;
+        len -= take;
+    }
+}
+
+static inline void cdc_hash_final(cdc_hash_t *s, uint8_t out[CDC_HASH_LEN]) {
+    s->count += s->used;
+    memset(s->block + s->used, 0, 128 - s->used);
+    cdc_b2b_compress(s->h, s->block, s->count, 1);
+    for (int i = 0; i < CDC_HASH_LEN; i++) {
+        out[i] = (uint8_t)(s->h[i / 8] >> (8 * (i % 8)));
+    }
+}
+
+static inline void cdc_hex(const uint8_t hash[CDC_HASH_LEN], char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < CDC_HASH_LEN; i++) {
+        out[2 * i] = digits[hash[i] >> 4];
+        out[2 * i + 1] = digits[hash[i] & 15];
+    }
+    out[2 * CDC_HASH_LEN] = '\0';
+}
+
+static inline int cdc_unhex(const char *s, uint8_t hash[CDC_HASH_LEN]) {
+    for (int i = 0; i < 2 * CDC_HASH_LEN; i++) {
+        int c = s[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) return -1;
+        if (i & 1) hash[i / 2] |= v; else hash[i / 2] = v << 4;
+    }
+    return 0;
+}
+
+// Gear table: 256 random 64-bit values (splitmix64). Client and servers
+// must agree on it, or no chunk boundary would match.
+static const uint64_t cdc_gear[256] = {
+    0xc0e16b163a85a4dcull, 0x890acd8dd443c47cull, 0xb3889d8a6dc47761ull, 0x6a0398e528f0ae6aull,
+    0x048344ece48a855eull, 0xf175cfea21871330ull, 0x391ceef02702c2fdull, 0x4baf8cac4784cb12ull,
+    0x3547744583a3f88eull, 0xd9cf2b15c6b6c90eull, 0x961facc76d5fe21cull, 0x0094ab49d50f11f9ull,
+    0xe3211e37bdbeb6dcull, 0x62fe6c274ff3511aull, 0x5ac30b329fdf0574ull, 0x1450582c6b65b406ull,
+    0x7a30fcc7888eb791ull, 0x5540f5ba6a15576eull, 0x16cef0559096d3e9ull, 0x2cf8f14b06874899ull,
+    0xc9c9263b6e2ce103ull, 0xd6ff920b0a9faa6dull, 0x53192697db998dc1ull, 0x73ea9b9bc7cd18d7ull,
+    0x102713f872c33fceull, 0xf4183a0e5d2a033eull, 0x71b63e307eebb517ull, 0xda61f5713d036000ull,
+    0x46eb7409ae691b21ull, 0xb23ad691d6707698ull, 0x67c8fe11d22fc4b9ull, 0x7eb4661419481338ull,
+    0x98077547fb070efcull, 0x1ee63336c2e3a9a8ull, 0xbc353656348c36f6ull, 0xce3898cbf1bb1bd8ull,
+    0x265b1c23c82915cbull, 0xfd1948c91687e355ull, 0xd976893961980ffaull, 0x336e77a6288e4c34ull,
+    0x16f8956d7b76d269ull, 0xda7cd844690d4669ull, 0x1e8cf85f253a581eull, 0x3ea68129e923e53aull,
+    0xa080a077c9e9fd79ull, 0x4469a19c673c14cfull, 0xbd5b9351b2d0963cull, 0xb46a749cad9df6b7ull,
+    0x07da714e59c7d362ull, 0x393a84bb5af17618ull, 0xb3ae08f3c86dfc0cull, 0x642a350ed7c82c93ull,
+    0x547bdec029cd3fa3ull, 0x778debb21b67fc3dull, 0xb1e26d886eaed22bull, 0x49fb5996898a7303ull,
+    0x5e245bcec3e007b3ull, 0x1f6818e4a739f61bull, 0xad694562d6313affull, 0xded7c324e96e3a09ull,
+    0x0e181ef86a661cf8ull, 0x675448d833ac146bull, 0xf047e1b493d6b255ull, 0xe3d9f8b33d92678cull,
+    0x62648db4d3b1b3acull, 0x5e772e6b32ded778ull, 0x6bc2ea32285bad33ull, 0x298b58c7b2262c2dull,
+    0x89a142e7a847c68full, 0x07b170d776f29a64ull, 0x754b9d28182fd07full, 0x934990332438604cull,
+    0xa1ab48a85cc22bbbull, 0xff5aa2d675545595ull, 0x32a5a207c5c3eed3ull, 0xd9970e23aebb3d51ull,
+    0xd9d01979fc161649ull, 0x437a2ed7a4fca264ull, 0x30fa485d263c4dd1ull, 0xaab6790590cb5b06ull,
+    0x65091913e11e2cfaull, 0x51b90f06b259b46bull, 0x8289d10138b1d6b4ull, 0x88ae7e8730e361fbull,
+    0x0833a622304c447bull, 0xe2e55431bf4b1b54ull, 0xdde9371fc120d32full, 0x5751a8d978ce73ddull,
+    0xbf1f19e0e1fbd33dull, 0x75374f1247e3cdaaull, 0x9f1ca64eb4d3ce97ull, 0x38136f3a3d5ace59ull,
+    0xd47963dbf7f8dc43ull, 0xd87428ff43dd9d86ull, 0x2607e8bece834053ull, 0x3c7a84fa12044c87ull,
+    0x8c7f4bfac5f7e4bbull, 0xed4a244966996f87ull, 0x36c97138af16e719ull, 0x08d81534dedb7662ull,
+    0xac7c55978241afc4ull, 0xdf1b8863c9332ce7ull, 0x620ee7f218ea0997ull, 0x38d1df383ce89b65ull,
+    0xe719097929758713ull, 0x9ec6cd248c58ad3cull, 0xf54bd98a78d9f340ull, 0x6498bc6124519df3ull,
+    0x198e656271e64fa2ull, 0xa43fd5dd0d813097ull, 0x35ad65fea929819aull, 0x2f00139d2a8cd90cull,
+    0x155f41d97478845cull, 0x3f2b6a8cfea779b9ull, 0x4b7264199d7c962aull, 0xa26165f55b57273full,
+    0xb7a6f3f0ecf5b89full, 0x8e0692470e1ee509ull, 0x23234da5964b213aull, 0x6461d9c18fb4c2b9ull,
+    0x9c44cac712b73113ull, 0x93de0e8d937a2da0ull, 0x88c84529e3843d70ull, 0x70daad40227330ceull,
+    0x7ab855c449ec8acaull, 0xc8de7a81906c8be8ull, 0x5f5627df47641ddaull, 0xdd60bf81e2586cbcull,
+    0x3cfc1ba44eaf2468ull, 0x405a9309613ad882ull, 0x4de7eb21b0277f28ull, 0x86e512678e4dd45aull,
+    0x0f1286efd6bdd066ull, 0x1c8aca34c2fa6773ull, 0x1da8e48b2342e347ull, 0x1890dcd0a94893e7ull,
+    0x2b1aaf97ef6b4dffull, 0xb32b16249647a7ecull, 0x9fb5f0bced31ea58ull, 0x3d78f7907627c61full,
+    0x1841958c7d191f94ull, 0xa18a85a96a78b19eull, 0x631e9abbb0213210ull, 0x3dab614952cc05a9ull,
+    0x017020b874beabd6ull, 0xfa59da85e751094cull, 0x29cd811450b5412eull, 0x8d15c850af2489a8ull,
+    0x950b3bdd58d563a0ull, 0x836cb8f306d51f7eull, 0x4065efde02b744e8ull, 0xb9baecb669369d99ull,
+    0x7b378c9248d47dc4ull, 0x4ddd25d48cdc6168ull, 0xa732d6380105f470ull, 0x75c8d0927bb9c613ull,
+    0x6785a012497a2d75ull, 0xffca85e4ac7617e9ull, 0xc6f2129203f39492ull, 0x3ed2bc376029332eull,
+    0xd0dc8d146f7e2680ull, 0x513f8ed97341b4a1ull, 0x4324394cfa366d32ull, 0x7cbea6ee7da29a4aull,
+    0x69707125ac82ecfaull, 0xdd4ba7a8ed6c0ef7ull, 0x100210a42564a9efull, 0xaf1101e77e76c1c2ull,
+    0x140a33b32394451bull, 0xce3748ebe86fd0f9ull, 0x763b94236a3c95dcull, 0x0e82087dbe388ce4ull,
+    0x8a3f991981c24d6eull, 0x31b399f558c60586ull, 0xf50ea2c64afdfe9bull, 0x6c02449c992ff889ull,
+    0x7914a6531aeeb744ull, 0xb75f86f73f2f4ec2ull, 0x1bdb24c7bd571df8ull, 0x06e4e518ae8f033eull,
+    0xffe622dab44f3689ull, 0xf2792f1385db0e95ull, 0x2aad6ff4838907b8ull, 0x0d649d2b9341accaull,
+    0x2aef8ac693c156cdull, 0xb86c9e57fa18942eull, 0xe85e3cf930ed3877ull, 0xb3fb466dd31f94a2ull,
+    0xac8d03c007f25604ull, 0xa9eec498626ff508ull, 0xf47be033dda3f9b0ull, 0xa4f748b538e6f27dull,
+    0xc01bb10959d5e985ull, 0x89079de7dda37d8full, 0xd7007ba815cc0658ull, 0xc4da1bb45a7b871aull,
+    0x98185ba52f9d9cd4ull, 0x4242c91a500844e5ull, 0x07965f1aa6863c5dull, 0x0359ccaad9aea599ull,
+    0xe7a54bf05004eddbull, 0x333aa1cd725ff5e8ull, 0x94c18d8184570964ull, 0xee0303af7e757a57ull,
+    0xbbc38705003c82ecull, 0xc57a6bbdbb7edfbdull, 0xbaea4e697c235ee2ull, 0x9f1ed9c9b4707ea2ull,
+    0x3845a969b77941f0ull, 0x1f02624c80d73ce6ull, 0x4820b4e1649d1ddcull, 0x77d1259b2f0be5fbull,
+    0xa495f4fdba5cccddull, 0x5ce421e295346c68ull, 0x0dfd63adc1c5bc74ull, 0x570045b98cbc93e3ull,
+    0x5b7317cd17a15f04ull, 0x6defb13e4a48fa9cull, 0x9d2540358539f109ull, 0xdff1d3db7af0541bull,
+    0xa786c0d906df090eull, 0x9c8aa8553f5db609ull, 0x2d5d59b48454ab11ull, 0x73fbfbfd57360323ull,
+    0xe045969a1fe274d6ull, 0xb374b31ccc1c9668ull, 0xee53c1d82d9ced9cull, 0x02ee16f7445f3d27ull,
+    0x43d17009acf06ed8ull, 0xd17f5baf03dd6e26ull, 0xbddf2289ed7719ffull, 0xf9b980d54f117273ull,
+    0xcdd05dc90b2c3b5bull, 0xae6df7dd9d557455ull, 0xa6a0e6779f5dfb3full, 0xd85269b48de6f619ull,
+    0x43b0855155163e1cull, 0x716aa342eaa75e67ull, 0xf601d8d15e1709aeull, 0x9ce1c4f19d6c405bull,
+    0x8e5d480bf2121c70ull, 0x5cd643cb24cbaa78ull, 0x44ecfa2a75ca3a34ull, 0x390f2eddea3099a2ull,
+    0xdfea67149da0609full, 0xb734297101779a59ull, 0xc3f3700cbb0afe9full, 0x403cae0119d1bb35ull,
+    0x23853b00d0e1076bull, 0x63dc284ae4cf5983ull, 0x252721131cfe91aeull, 0xdbe6d98b3113e9d6ull,
+    0xf3f923744c247687ull, 0x01ef9061730e4ab6ull, 0x7f2a753307b3391cull, 0xfd4cbb1b3007d376ull,
+};
+
+// Length of the chunk starting at src, which has n bytes left
+static inline size_t cdc_cut(const uint8_t *src, size_t n) {
+    if (n <= CDC_MIN) {
+        return n;
+    }
+    if (n > CDC_MAX) {
+        n = CDC_MAX;
+    }
+    size_t normal = n < CDC_AVG ? n : CDC_AVG;
+    uint64_t fp = 0;
+    size_t i = CDC_MIN;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + cdc_gear[src[i]];
+        if (!(fp & CDC_MASK_S)) return i + 1;
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + cdc_gear[src[i]];
+        if (!(fp & CDC_MASK_L)) return i + 1;
+    }
+    return n;
+}
+
+typedef struct {
+    uint8_t hash[CDC_HASH_LEN];
+    size_t off;
+    uint32_t len;
+} cdc_chunk_t;
+
+// Split data into chunks, returning their number with a malloc'd *chunks,
+// or -1
+static inline int cdc_split(const char *data, size_t len, cdc_chunk_t **chunks) {
+    int n = 0, cap = len / CDC_AVG + 16;
+    cdc_chunk_t *list = malloc(cap * sizeof(cdc_chunk_t));
+    if (!list) return -1;
+    for (size_t off = 0; off < len; n++) {
+        if (n == cap) {
+            cap *= 2;
+            cdc_chunk_t *grown = realloc(list, cap * sizeof(cdc_chunk_t));
+            if (!grown) {
+                free(list);
+                return -1;
+            }
+            list = grown;
+        }
+        list[n].off = off;
+        list[n].len = cdc_cut((const uint8_t *)data + off, len - off);
+        cdc_hash(data + off, list[n].len, list[n].hash);
+        off += list[n].len;
+    }
+    *chunks = list;
+    return n;
+}
+
+static inline int cdc_cmp(const void *a, const void *b) {
+    return memcmp(((const cdc_chunk_t *)a)->hash, ((const cdc_chunk_t *)b)->hash, CDC_HASH_LEN);
+}
+
+// Find a chunk by hash in a list sorted with cdc_cmp
+static inline const cdc_chunk_t *cdc_lookup(const cdc_chunk_t *sorted, int n, const uint8_t *hash) {
+    cdc_chunk_t key;
+    memcpy(key.hash, hash, CDC_HASH_LEN);
+    return bsearch(&key, sorted, n, sizeof(cdc_chunk_t), cdc_cmp);
+}
+
+// Parse a "<hash> <len>" manifest line. Returns 0 or -1.
+static inline int cdc_parse_line(const char *line, cdc_chunk_t *c) {
+    if (strlen(line) < 2 * CDC_HASH_LEN + 2 || line[2 * CDC_HASH_LEN] != ' ' || cdc_unhex(line, c->hash) < 0) {
+        return -1;
+    }
+    c->len = strtoul(line + 2 * CDC_HASH_LEN + 1, NULL, 10);
+    return 0;
+}
+
+// Receiving side of a delta upload, shared by the servers. recv_line is
+// the newline-terminated read each program defines for itself.
+int recv_line(int sockfd, char *buf, size_t size);
+
+// Read the chunk list of a delta upload, tell the sender which chunks the
+// old contents lack and assemble the new contents in content. label
+// prefixes the log lines; *wanted gets the bytes that had to be sent.
+static inline long cdc_recv_chunks(const char *label, int connfd, cdc_chunk_t *chunks, int n, size_t total,
+                                   const char *old, long old_len, char *need, char *content, size_t *wanted) {
+    char line[128];
+    size_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        if (recv_line(connfd, line, sizeof(line)) < 0 || cdc_parse_line(line, &chunks[i]) < 0 ||
+            chunks[i].len == 0 || chunks[i].len > total - sum) {
+            log_warn("%s: uploadf: Bad delta chunk %d", label, i);
+            send(connfd, "ERROR: Invalid delta manifest", strlen("ERROR: Invalid delta manifest"), 0);
+            return -1;
+        }
+        chunks[i].off = sum;
+        sum += chunks[i].len;
+    }
+    if (sum != total) {
+        log_debug("%s: uploadf: Delta chunks cover %zu of %zu bytes", label, sum, total);
+        send(connfd, "ERROR: Invalid delta manifest", strlen("ERROR: Invalid delta manifest"), 0);
+        return -1;
+    }
+
+    // Copy what the old contents already hold and ask for the rest
+    cdc_chunk_t *have = NULL;
+    int nhave = old_len > 0 ? cdc_split(old, old_len, &have) : 0;
+    if (nhave > 0) {
+        qsort(have, nhave, sizeof(cdc_chunk_t), cdc_cmp);
+    }
+    int missing = 0;
+    *wanted = 0;
+    memcpy(need, "NEED ", 5);
+    for (int i = 0; i < n; i++) {
+        const cdc_chunk_t *h = nhave > 0 ? cdc_lookup(have, nhave, chunks[i].hash) : NULL;
+        if (h && h->len == chunks[i].len) {
+            memcpy(content + chunks[i].off, old + h->off, h->len);
+            need[5 + i] = '0';
+        } else {
+            need[5 + i] = '1';
+            missing++;
+            *wanted += chunks[i].len;
+        }
+    }
+    need[5 + n] = '\n';
+    free(have);
+    log_debug("%s: uploadf: Delta of %d chunks, %d missing (%zu of %zu bytes)", label, n, missing, *wanted, total);
+    if (send(connfd, need, n + 6, 0) < 0) {
+        log_error("%s: uploadf: Send chunk request failed: %s", label, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (need[5 + i] != '1') continue;
+        size_t got = 0;
+        while (got < chunks[i].len) {
+            int r = recv(connfd, content + chunks[i].off + got, chunks[i].len - got, 0);
+            if (r <= 0) {
+                if (r < 0) log_error("%s: uploadf: Receive chunk failed: %s", label, strerror(errno));
+                else log_warn("%s: uploadf: Sender disconnected", label);
+                send(connfd, "ERROR: Failed to receive content", 
+                     strlen("ERROR: Failed to receive content"), 0);
+                return -1;
+            }
+            got += r;
+        }
+    }
+    // Checked only once everything has arrived, so an error reply never
+    // lands in the middle of the sender's chunks
+    for (int i = 0; i < n; i++) {
+        uint8_t hash[CDC_HASH_LEN];
+        if (need[5 + i] != '1') continue;
+        cdc_hash(content + chunks[i].off, chunks[i].len, hash);
+        if (memcmp(hash, chunks[i].hash, CDC_HASH_LEN) != 0) {
+            log_warn("%s: uploadf: Chunk %d does not match its hash", label, i);
+            send(connfd, "ERROR: Chunk hash mismatch", strlen("ERROR: Chunk hash mismatch"), 0);
+            return -1;
+        }
+    }
+    return total;
+}
+
+// Receive a delta upload, sent with a "CDC <len> <chunks>" header in place
+// of the length, against the old contents of the path (old_len < 0 when
+// there are none, which has the sender transfer every chunk). Returns the
+// length of the contents assembled in content, which holds cap bytes, or
+// -1 after sending an error.
+static inline long cdc_recv_upload(const char *label, int connfd, const char *header, const char *old, long old_len,
+                                   char *content, size_t cap, size_t *wanted) {
+    size_t total;
+    int n;
+    if (sscanf(header, "CDC %zu %d", &total, &n) != 2 || total == 0 || total >= cap ||
+        n <= 0 || (size_t)n > total / CDC_MIN + 1) {
+        log_warn("%s: uploadf: Bad delta header: %s", label, header);
+        send(connfd, "ERROR: Invalid delta manifest", strlen("ERROR: Invalid delta manifest"), 0);
+        return -1;
+    }
+
+    cdc_chunk_t *chunks = malloc(n * sizeof(cdc_chunk_t));
+    char *need = malloc(n + 6);
+    long status = -1;
+    if (chunks && need) {
+        status = cdc_recv_chunks(label, connfd, chunks, n, total, old, old_len, need, content, wanted);
+    } else {
+        log_warn("%s: uploadf: Malloc failed", label);
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+    }
+    free(chunks);
+    free(need);
+    return status;
+}
+
+#endif
@@ -2,15 +2,132 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
+
+#include "cdc.h"
+#include "crc.h"
 
 #define MAXLINE 1024
 #define MAXCONTENT 5242880 // 5MB for tar files
 #define MAXPATH 512
 
+// Receive a newline-terminated line, returning its length or -1
+int recv_line(int sockfd, char *buf, size_t size) {
+    size_t i = 0;
+    while (i < size - 1) {
+        int n = recv(sockfd, &buf[i], 1, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            return i;
+        }
+        i++;
+    }
+    buf[i] = '\0';
+    return -1;
+}
+
+// Receive a response header line such as "FILE_INFO:<name>". Error replies
+// have no trailing newline, so they are taken whole from what has arrived.
+int recv_header(int sockfd, char *buf, size_t size) {
+    int n = recv(sockfd, buf, size - 1, MSG_PEEK);
+    if (n <= 0) {
+        return n;
+    }
+    buf[n] = '\0';
+
+    char *nl = strchr(buf, '\n');
+    if (strncmp(buf, "ERROR:", 6) != 0 && !nl) {
+        return recv_line(sockfd, buf, size);
+    }
+
+    size_t want = strncmp(buf, "ERROR:", 6) == 0 ? (size_t)n : (size_t)(nl - buf) + 1;
+    n = recv(sockfd, buf, want, 0);
+    if (n <= 0) {
+        return n;
+    }
+    buf[n] = '\0';
+    if (buf[n - 1] == '\n') {
+        buf[--n] = '\0';
+    }
+    return n;
+}
+
+// Upload content as a delta (see cdc.h): send the hashes of its chunks,
+// then only the chunks the server asks for. Returns 0 once they are sent,
+// 1 if the server refused (its reply has been printed), or -1.
+int send_delta_upload(int sockfd, const char *content, size_t len) {
+    cdc_chunk_t *chunks;
+    int n = cdc_split(content, len, &chunks);
+    if (n < 0) {
+        printf("Chunking failed\n");
+        return -1;
+    }
+
+    size_t cap = 64 + (size_t)n * (2 * CDC_HASH_LEN + 16);
+    char *manifest = malloc(cap);
+    char *need = malloc(n + 16);
+    if (!manifest || !need) {
+        printf("Memory allocation failed\n");
+        free(chunks);
+        free(manifest);
+        free(need);
+        return -1;
+    }
+    size_t mlen = snprintf(manifest, cap, "CDC %zu %d\n", len, n);
+    for (int i = 0; i < n; i++) {
+        cdc_hex(chunks[i].hash, manifest + mlen);
+        mlen += 2 * CDC_HASH_LEN;
+        mlen += snprintf(manifest + mlen, cap - mlen, " %u\n", chunks[i].len);
+    }
+
+    int status = 0;
+    if (send(sockfd, manifest, mlen, 0) < 0) {
+        perror("Send manifest failed");
+        status = -1;
+    } else {
+        int got = recv_header(sockfd, need, n + 16);
+        if (got <= 0) {
+            printf("Server disconnected\n");
+            status = -1;
+        } else if (strncmp(need, "NEED ", 5) != 0 || got != n + 5) {
+            printf("Server response: %s\n", need);
+            status = 1;
+        }
+    }
+
+    size_t sent = 0;
+    int sent_chunks = 0;
+    for (int i = 0; i < n && status == 0; i++) {
+        if (need[5 + i] != '1') continue;
+        if (send(sockfd, content + chunks[i].off, chunks[i].len, 0) < 0) {
+            perror("Send chunk failed");
+            status = -1;
+            break;
+        }
+        sent += chunks[i].len;
+        sent_chunks++;
+    }
+    if (status == 0) {
+        printf("Delta upload: sent %d of %d chunks (%zu of %zu bytes, %zu bytes of hashes)\n",
+               sent_chunks, n, sent, len, mlen);
+    }
+
+    free(chunks);
+    free(manifest);
+    free(need);
+    return status;
+}
+
 // Create directories recursively
 int create_dirs(const char *path) {
     char tmp[512];
@@ -41,6 +158,360 @@ int create_dirs(const char *path) {
     return 0;
 }
 
+// Connect to a storage server given as host:port
+int connect_to(const char *spec) {
+    char host[80];
+    snprintf(host, sizeof(host), "%s", spec);
+    char *colon = strrchr(host, ':');
+    if (!colon) {
+        return -1;
+    }
+    *colon = '\0';
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+// One byte range of a parallel download
+typedef struct {
+    const char *fname;
+    int fd;                         // the local file
+    long long offset;
+    long long length;
+    char (*servers)[80];
+    int nservers;
+    int first;                      // index of the server tried first
+    long long done;                 // bytes written so far
+    int ok;
+} stripe_t;
+
+// Fetch a stripe, carrying on from the next server where one failed
+void *fetch_stripe(void *arg) {
+    stripe_t *s = arg;
+    char *buf = malloc(1 << 20);
+    for (int attempt = 0; buf && attempt < s->nservers && s->done < s->length; attempt++) {
+        const char *server = s->servers[(s->first + attempt) % s->nservers];
+        int sock = connect_to(server);
+        if (sock < 0) {
+            printf("Cannot connect to %s\n", server);
+            continue;
+        }
+        char line[MAXLINE], header[MAXLINE], len_str[32];
+        long long want = s->length - s->done;
+        snprintf(line, sizeof(line), "downlf %s %lld %lld\n", s->fname, s->offset + s->done, want);
+        if (send(sock, line, strlen(line), 0) < 0 || shutdown(sock, SHUT_WR) < 0 ||
+            recv_line(sock, header, sizeof(header)) < 0 || strncmp(header, "FILE_INFO:", 10) != 0 ||
+            recv_line(sock, len_str, sizeof(len_str)) < 0 || atoll(len_str) != want) {
+            printf("%s did not send bytes %lld-%lld\n", server, s->offset + s->done, s->offset + s->length - 1);
+            close(sock);
+            continue;
+        }
+        // What this server sent only counts once its checksum matches
+        long long start = s->done;
+        uint32_t crc = 0, expected;
+        while (s->done < s->length) {
+            size_t chunk = s->length - s->done < (1 << 20) ? s->length - s->done : (1 << 20);
+            int n = recv(sock, buf, chunk, 0);
+            if (n <= 0 || pwrite(s->fd, buf, n, s->offset + s->done) != n) {
+                break;
+            }
+            crc = crc32c(crc, buf, n);
+            s->done += n;
+        }
+        if (s->done == s->length && (crc_recv_trailer(sock, &expected) < 0 || crc != expected)) {
+            printf("%s sent bytes %lld-%lld with a bad checksum\n", server, s->offset + start,
+                   s->offset + s->length - 1);
+            s->done = start;
+        }
+        close(sock);
+    }
+    free(buf);
+    s->ok = s->done == s->length;
+    return NULL;
+}
+
+// Download a file as byte ranges fetched concurrently over separate
+// connections, straight from the storage servers S1 says hold it and
+// spread over them, each written into place with pwrite. The result is
+// checked against the file's checksum. Returns 0 on success, 1 if S1
+// cannot locate the file this way, or -1 on failure.
+int parallel_download(int sockfd, const char *fname, int streams) {
+    char line[MAXLINE], reply[MAXLINE];
+    snprintf(line, sizeof(line), "locate %s\n", fname);
+    if (send(sockfd, line, strlen(line), 0) < 0) {
+        perror("Send failed");
+        return -1;
+    }
+    int n = recv_header(sockfd, reply, sizeof(reply));
+    if (n <= 0) {
+        printf("Server disconnected\n");
+        return -1;
+    }
+    if (strncmp(reply, "LOCATION:", 9) != 0) {
+        printf("Server response: %s\n", reply);
+        return 1;
+    }
+
+    long long size;
+    char hex[2 * CDC_HASH_LEN + 1];
+    char servers[16][80];
+    int nservers = 0, pos = 0;
+    if (sscanf(reply + 9, "%lld %64s %n", &size, hex, &pos) < 2) {
+        printf("Invalid server response: %s\n", reply);
+        return -1;
+    }
+    for (char *tok = strtok(reply + 9 + pos, " "); tok && nservers < 16; tok = strtok(NULL, " ")) {
+        snprintf(servers[nservers++], sizeof(servers[0]), "%s", tok);
+    }
+    if (nservers == 0) {
+        printf("No server holds %s\n", fname);
+        return -1;
+    }
+
+    // Stripes of at least 64KB
+    if (streams > 64) streams = 64;
+    if (streams > size / 65536) streams = size / 65536;
+    if (streams < 1) streams = 1;
+
+    const char *local = strrchr(fname, '/') ? strrchr(fname, '/') + 1 : fname;
+    int fd = open(local, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        perror("File save failed");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    stripe_t stripes[64];
+    pthread_t tids[64];
+    for (int i = 0; i < streams; i++) {
+        long long from = size * i / streams;
+        stripes[i] = (stripe_t){ fname, fd, from, size * (i + 1) / streams - from, servers, nservers,
+                                 i % nservers, 0, 0 };
+        if (pthread_create(&tids[i], NULL, fetch_stripe, &stripes[i]) != 0) {
+            fetch_stripe(&stripes[i]);
+            tids[i] = 0;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < streams; i++) {
+        if (tids[i]) pthread_join(tids[i], NULL);
+        failed += !stripes[i].ok;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (failed) {
+        printf("%d of %d stripes failed\n", failed, streams);
+        close(fd);
+        return -1;
+    }
+
+    // Check the assembled file as a whole
+    cdc_hash_t h;
+    cdc_hash_init(&h);
+    char *buf = malloc(1 << 20);
+    ssize_t got = 0;
+    for (off_t off = 0; buf && (got = pread(fd, buf, 1 << 20, off)) > 0; off += got) {
+        cdc_hash_update(&h, buf, got);
+    }
+    free(buf);
+    close(fd);
+    uint8_t hash[CDC_HASH_LEN];
+    char sum[2 * CDC_HASH_LEN + 1];
+    cdc_hash_final(&h, hash);
+    cdc_hex(hash, sum);
+    if (strcmp(sum, hex) != 0) {
+        printf("Checksum mismatch for %s: expected %s, got %s\n", local, hex, sum);
+        return -1;
+    }
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("File saved successfully (%lld bytes in %d streams from %d servers, %.1f MB/s, checksum verified)\n",
+           size, streams, nservers, secs > 0 ? size / secs / 1e6 : 0.0);
+    return 0;
+}
+
+// Parts of a multipart upload, claimed in turn by the upload threads
+#define PART_SIZE (8 << 20)
+#define PART_TRIES 3
+
+typedef struct {
+    const char *server;
+    const char *id;
+    int fd;                         // the local file
+    long long size;
+    int nparts;
+    int next;                       // next part to claim
+    int failed;
+    pthread_mutex_t lock;
+} upload_t;
+
+// Send one part of the local file straight to the storage server. Returns
+// 0 once the server has written it.
+int send_part(upload_t *u, long long offset, long long len, char *buf) {
+    int sock = connect_to(u->server);
+    if (sock < 0) {
+        return -1;
+    }
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "mppart %s %lld %lld\n", u->id, offset, len);
+    int ok = send(sock, line, strlen(line), 0) == (ssize_t)strlen(line);
+    for (long long done = 0; ok && done < len;) {
+        ssize_t n = pread(u->fd, buf, len - done < (1 << 20) ? len - done : (1 << 20), offset + done);
+        ok = n > 0;
+        for (ssize_t sent = 0, k; ok && sent < n; sent += k) {
+            k = send(sock, buf + sent, n - sent, 0);
+            ok = k > 0;
+        }
+        done += n;
+    }
+    char reply[MAXLINE];
+    ok = ok && shutdown(sock, SHUT_WR) == 0 && recv_line(sock, reply, sizeof(reply)) >= 0 &&
+         strcmp(reply, "PART OK") == 0;
+    close(sock);
+    return ok ? 0 : -1;
+}
+
+void *upload_parts(void *arg) {
+    upload_t *u = arg;
+    char *buf = malloc(1 << 20);
+    while (1) {
+        pthread_mutex_lock(&u->lock);
+        int part = u->failed ? u->nparts : u->next++;
+        if (!buf && part < u->nparts) u->failed = 1;
+        pthread_mutex_unlock(&u->lock);
+        if (!buf || part >= u->nparts) {
+            break;
+        }
+        long long offset = (long long)part * PART_SIZE;
+        long long len = u->size - offset < PART_SIZE ? u->size - offset : PART_SIZE;
+        int tries = 0;
+        while (send_part(u, offset, len, buf) < 0) {
+            if (++tries == PART_TRIES) {
+                printf("Part %d failed %d times, giving up\n", part, tries);
+                pthread_mutex_lock(&u->lock);
+                u->failed = 1;
+                pthread_mutex_unlock(&u->lock);
+                break;
+            }
+            printf("Part %d failed, sending it again\n", part);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// Upload a file as 8MB parts sent concurrently over separate connections,
+// straight to the storage server S1 picks for it, which writes each at
+// its offset. Failed parts are retried, and the assembled file is checked
+// against the checksum sent on commit. Returns 0 on success, 1 if S1 cannot
+// take the file this way, or -1 on failure.
+int parallel_upload(int sockfd, const char *fname, const char *dpath, int streams) {
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("File open failed");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    char line[MAXLINE], reply[MAXLINE];
+    snprintf(line, sizeof(line), "mpinit %s %s %lld\n", fname, dpath, (long long)st.st_size);
+    if (send(sockfd, line, strlen(line), 0) < 0) {
+        perror("Send failed");
+        close(fd);
+        return -1;
+    }
+    int n = recv_header(sockfd, reply, sizeof(reply));
+    if (n <= 0) {
+        printf("Server disconnected\n");
+        close(fd);
+        return -1;
+    }
+    char id[40], server[80];
+    if (strncmp(reply, "MULTIPART:", 10) != 0 || sscanf(reply + 10, "%39s %79s", id, server) != 2) {
+        printf("Server response: %s\n", reply);
+        close(fd);
+        return 1;
+    }
+
+    upload_t u = { server, id, fd, st.st_size, (st.st_size + PART_SIZE - 1) / PART_SIZE, 0, 0,
+                   PTHREAD_MUTEX_INITIALIZER };
+    if (streams > 64) streams = 64;
+    if (streams > u.nparts) streams = u.nparts;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t tids[64];
+    for (int i = 0; i < streams; i++) {
+        if (pthread_create(&tids[i], NULL, upload_parts, &u) != 0) {
+            upload_parts(&u);
+            tids[i] = 0;
+        }
+    }
+    for (int i = 0; i < streams; i++) {
+        if (tids[i]) pthread_join(tids[i], NULL);
+    }
+
+    // The checksum of the whole file goes with the commit
+    cdc_hash_t h;
+    cdc_hash_init(&h);
+    char *buf = u.failed ? NULL : malloc(1 << 20);
+    ssize_t got = 0;
+    off_t off = 0;
+    for (; buf && (got = pread(fd, buf, 1 << 20, off)) > 0; off += got) {
+        cdc_hash_update(&h, buf, got);
+    }
+    free(buf);
+    close(fd);
+    uint8_t hash[CDC_HASH_LEN];
+    char sum[2 * CDC_HASH_LEN + 1];
+    cdc_hash_final(&h, hash);
+    cdc_hex(hash, sum);
+
+    if (u.failed || off != st.st_size) {
+        snprintf(line, sizeof(line), "mpabort %s\n", id);
+    } else {
+        snprintf(line, sizeof(line), "mpcommit %s %s\n", id, sum);
+    }
+    int sock = connect_to(server);
+    n = -1;
+    if (sock >= 0 && send(sock, line, strlen(line), 0) >= 0 && shutdown(sock, SHUT_WR) == 0) {
+        int k;
+        n = 0;
+        while (n < (int)sizeof(reply) - 1 && (k = recv(sock, reply + n, sizeof(reply) - 1 - n, 0)) > 0) {
+            n += k;
+        }
+        reply[n] = '\0';
+    }
+    if (sock >= 0) close(sock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (u.failed || off != st.st_size) {
+        printf("Upload of %s failed\n", fname);
+        return -1;
+    }
+    if (n <= 0) {
+        printf("Cannot reach %s to commit the upload\n", server);
+        return -1;
+    }
+    printf("Server response: %s\n", reply);
+    if (strncmp(reply, "ERROR", 5) == 0) {
+        return -1;
+    }
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Uploaded %lld bytes in %d parts over %d streams (%.1f MB/s)\n",
+           (long long)st.st_size, u.nparts, streams, secs > 0 ? st.st_size / secs / 1e6 : 0.0);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 2) {
         fprintf(stderr, "Usage: %s <S1_port>\n", argv[0]);
@@ -53,6 +524,9 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Checksum tables are built before any transfer thread runs
+    crc_init();
+
     int sockfd;
     struct sockaddr_in servaddr;
     char buffer[MAXLINE];
@@ -77,11 +551,20 @@ int main(int argc, char *argv[]) {
 
     while (1) {
         printf("\nAvailable commands:\n");
-        printf("  downlf <filename>           - Download a file\n");
+        printf("  downlf <filename> [offset] [length] - Download a file or a byte range of it\n");
+        printf("  resumef <filename>          - Finish a partly downloaded file\n");
+        printf("  downlfp <filename> [streams] - Download a large file over parallel connections\n");
         printf("  uploadf <filename> <path>   - Upload a file\n");
+        printf("  uploadfp <filename> <path> [streams] - Upload a large file over parallel connections\n");
         printf("  dispfnames <path>           - Display filenames in path\n");
         printf("  removef <filename>          - Remove a file\n");
         printf("  downltar <.c|.pdf|.txt|.zip> - Download tar of all specified files\n");
+        printf("  members                     - Show storage server health and load\n");
+        printf("  scrubstats                  - Show integrity scrubber progress and corrupt files\n");
+        printf("  stats                       - Show command latency percentiles for S1 and the storage servers\n");
+        printf("  trace [request id]          - Save the servers' request traces as a Chrome trace file\n");
+        printf("  rebalance <.ext> <host:port> [KB/s] - Add a storage server and move files onto it\n");
+        printf("  rebalance status            - Show progress of the last rebalance\n");
         printf("  exit                        - Exit the client\n");
         printf("Enter command: ");
 
@@ -98,23 +581,79 @@ int main(int argc, char *argv[]) {
             continue;
         }
 
-        // Send command to S1
-        if (send(sockfd, input, strlen(input), 0) < 0) {
-            perror("Send failed");
-            continue;
-        }
-
         char cmd[50], fname[100], dpath[200];
         cmd[0] = fname[0] = dpath[0] = '\0';
         sscanf(input, "%49s %99s %199s", cmd, fname, dpath);
 
+        // A byte range is written at its offset in the local file, so
+        // resumef only has to ask for what is not there yet
+        long long offset = 0, length = -1;
+        int ranged = 0;
+        if (strcmp(cmd, "resumef") == 0) {
+            if (strlen(fname) == 0) {
+                printf("Filename must be specified\n");
+                continue;
+            }
+            struct stat st;
+            const char *local = strrchr(fname, '/') ? strrchr(fname, '/') + 1 : fname;
+            offset = stat(local, &st) == 0 ? st.st_size : 0;
+            printf("Resuming %s from byte %lld\n", fname, offset);
+            snprintf(input, sizeof(input), "downlf %s %lld", fname, offset);
+            strcpy(cmd, "downlf");
+            ranged = 1;
+        } else if (strcmp(cmd, "downlf") == 0) {
+            ranged = sscanf(input, "%*s %*s %lld %lld", &offset, &length) >= 1;
+        } else if (strcmp(cmd, "downlfp") == 0) {
+            if (strlen(fname) == 0) {
+                printf("Filename must be specified\n");
+                continue;
+            }
+            int status = parallel_download(sockfd, fname, atoi(dpath) > 0 ? atoi(dpath) : 4);
+            if (status <= 0) {
+                continue;
+            }
+            printf("Downloading %s over a single connection instead\n", fname);
+            snprintf(input, sizeof(input), "downlf %s", fname);
+            strcpy(cmd, "downlf");
+        } else if (strcmp(cmd, "uploadfp") == 0) {
+            if (strlen(fname) == 0 || strlen(dpath) == 0) {
+                printf("Filename and path must be specified\n");
+                continue;
+            }
+            int streams = 4;
+            sscanf(input, "%*s %*s %*s %d", &streams);
+            int status = parallel_upload(sockfd, fname, dpath, streams > 0 ? streams : 4);
+            if (status <= 0) {
+                continue;
+            }
+            printf("Uploading %s over a single connection instead\n", fname);
+            snprintf(input, sizeof(input), "uploadf %s %s", fname, dpath);
+            strcpy(cmd, "uploadf");
+        }
+
+        // Send command line to S1, behind the request id the servers
+        // record its trace under
+        static unsigned requests;
+        char rid[16];
+        snprintf(rid, sizeof(rid), "%04x%04x%04x", (unsigned)getpid() & 0xffff,
+                 (unsigned)time(NULL) & 0xffff, ++requests & 0xffff);
+        char line[sizeof(input) + sizeof(rid) + 3];
+        snprintf(line, sizeof(line), "@%s %s\n", rid, input);
+        if (send(sockfd, line, strlen(line), 0) < 0) {
+            perror("Send failed");
+            continue;
+        }
+        if (strcmp(cmd, "exit") != 0) {
+            printf("Request id: %s\n", rid);
+        }
+
         if (strcmp(cmd, "exit") == 0) {
             printf("Exiting client\n");
             break;
         }
-        else if (strcmp(cmd, "downlf") == 0 || strcmp(cmd, "downltar") == 0) {
+        else if (strcmp(cmd, "downlf") == 0 || strcmp(cmd, "downltar") == 0 || strcmp(cmd, "trace") == 0) {
             // Receive file or tar info
-            int n = recv(sockfd, buffer, MAXLINE - 1, 0);
+            int n = recv_header(sockfd, buffer, MAXLINE);
             if (n <= 0) {
                 if (n < 0) perror("Receive file info failed");
                 else printf("Server disconnected\n");
@@ -133,6 +672,8 @@ int main(int argc, char *argv[]) {
                 filename = buffer + 10;
             } else if (strncmp(buffer, "TAR_FILE:", 9) == 0) {
                 filename = buffer + 9;
+            } else if (strncmp(buffer, "TRACE_FILE:", 11) == 0) {
+                filename = buffer + 11;
             } else {
                 printf("Invalid server response: %s\n", buffer);
                 continue;
@@ -160,9 +701,62 @@ int main(int argc, char *argv[]) {
                 break;
             }
 
-            size_t content_len = atoi(len_str);
+            size_t content_len = strtoull(len_str, NULL, 10);
             printf("Content length: %zu bytes\n", content_len);
 
+            if (strcmp(cmd, "downlf") == 0) {
+                // Stream the file into place; a whole download replaces the
+                // local copy, a range is written at its offset
+                char *save_filename = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+                char filepath[512];
+                snprintf(filepath, sizeof(filepath), "./%.500s", save_filename);
+                printf("Saving to: %s\n", filepath);
+                int fd = open(filepath, O_WRONLY | O_CREAT | (ranged ? 0 : O_TRUNC), 0644);
+                if (fd < 0) {
+                    perror("File save failed");
+                    break;
+                }
+                size_t total = 0;
+                uint32_t crc = 0, expected;
+                n = 1;
+                while (total < content_len) {
+                    size_t want = content_len - total < MAXCONTENT ? content_len - total : MAXCONTENT;
+                    n = recv(sockfd, content, want, 0);
+                    if (n <= 0) {
+                        if (n < 0) perror("Receive content failed");
+                        break;
+                    }
+                    if (pwrite(fd, content, n, offset + total) != n) {
+                        perror("File write failed");
+                        break;
+                    }
+                    crc = crc32c(crc, content, n);
+                    total += n;
+                }
+                close(fd);
+                if (total < content_len) {
+                    printf("Download interrupted after %zu of %zu bytes; resumef %s continues it\n",
+                           total, content_len, fname);
+                    break;
+                }
+                if (crc_recv_trailer(sockfd, &expected) < 0) {
+                    printf("Missing checksum after %s\n", filepath);
+                    break;
+                }
+                if (crc != expected) {
+                    // A damaged whole file is not kept; a damaged range is
+                    // reported so it can be fetched again
+                    printf("Checksum mismatch for %s: expected %08x, got %08x\n", filepath, expected, crc);
+                    if (!ranged) {
+                        unlink(filepath);
+                    }
+                    continue;
+                }
+                printf("File saved successfully (%zu bytes at offset %lld, CRC32C %08x verified)\n",
+                       total, offset, crc);
+                continue;
+            }
+
             if (content_len >= MAXCONTENT) {
                 printf("Content too large to receive\n");
                 continue;
@@ -185,7 +779,17 @@ int main(int argc, char *argv[]) {
                 break;
             }
 
-            printf("Received %zu bytes\n", total);
+            uint32_t crc = crc32c(0, content, total), expected;
+            if (crc_recv_trailer(sockfd, &expected) < 0) {
+                printf("Missing checksum after content\n");
+                break;
+            }
+            if (crc != expected) {
+                printf("Checksum mismatch: expected %08x, got %08x; not saving\n", expected, crc);
+                continue;
+            }
+
+            printf("Received %zu bytes, CRC32C %08x verified\n", total, crc);
 
             // Save the file locally
             char *save_filename = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
@@ -236,16 +840,24 @@ int main(int argc, char *argv[]) {
                 continue;
             }
 
-            char len_str[32];
-            snprintf(len_str, sizeof(len_str), "%zu\n", bytes_read);
-            if (send(sockfd, len_str, strlen(len_str), 0) < 0) {
-                perror("Send length failed");
-                continue;
-            }
+            // Larger files go as a delta against the server's copy
+            if (bytes_read >= CDC_DELTA_MIN) {
+                if (send_delta_upload(sockfd, content, bytes_read) != 0) {
+                    continue;
+                }
+            } else {
+                char len_str[32];
+                snprintf(len_str, sizeof(len_str), "%zu\n", bytes_read);
+                if (send(sockfd, len_str, strlen(len_str), 0) < 0) {
+                    perror("Send length failed");
+                    continue;
+                }
 
-            if (send(sockfd, content, bytes_read, 0) < 0) {
-                perror("Send content failed");
-                continue;
+                if (send(sockfd, content, bytes_read, 0) < 0 ||
+                    crc_send_trailer(sockfd, crc32c(0, content, bytes_read)) < 0) {
+                    perror("Send content failed");
+                    continue;
+                }
             }
 
             // Receive response
@@ -258,16 +870,18 @@ int main(int argc, char *argv[]) {
             buffer[n] = '\0';
             printf("Server response: %s\n", buffer);
         }
-        else if (strcmp(cmd, "dispfnames") == 0 || strcmp(cmd, "removef") == 0) {
-            // Receive response
-            int n = recv(sockfd, buffer, MAXCONTENT - 1, 0);
+        else if (strcmp(cmd, "dispfnames") == 0 || strcmp(cmd, "removef") == 0 ||
+                 strcmp(cmd, "rebalance") == 0 || strcmp(cmd, "members") == 0 ||
+                 strcmp(cmd, "scrubstats") == 0 || strcmp(cmd, "stats") == 0) {
+            // Receive response, which may be longer than a line
+            int n = recv(sockfd, content, MAXCONTENT - 1, 0);
             if (n <= 0) {
                 if (n < 0) perror("Receive response failed");
                 else printf("Server disconnected\n");
                 break;
             }
-            buffer[n] = '\0';
-            printf("Server response:\n%s\n", buffer);
+            content[n] = '\0';
+            printf("Server response:\n%s\n", content);
         }
         else {
             // Receive response for unknown commands
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE  // nftw
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "dfs.h"
+#include "hist.h"
+
+// Starts a whole cluster from one command and measures it: S2-S4 and S1
+// on free loopback ports, each with a fresh temporary $HOME, driven
+// through the calls in dfs.h. Nothing is shared with a cluster already
+// running on the machine, so it can run as part of a build. The servers
+// are the built s1-s4 binaries, run as children that exit with the
+// harness.
+//
+// The latency scenario runs one request at a time through upload,
+// download (checked against what was uploaded), listing, tar and removal
+// for each file type. The throughput scenario runs -c clients that upload
+// and download as fast as the cluster lets them for -d seconds. The exit
+// status is non-zero if a request fails, or with -b and -f if a median or
+// the throughput is more than -f percent worse than in a run saved with -o.
+
+#define NSERVERS 4
+#define MAX_SERVER_ARGS 16
+#define START_TIMEOUT 5.0           // seconds for a server to start listening
+#define MAX_SIZE (4 << 20)
+#define MAX_REPLY (6 << 20)          // a downlf or downltar reply of up to 5MB
+
+static const char *exts[] = { ".c", ".pdf", ".txt", ".zip" };   // S1, S2, S3, S4
+#define NEXTS 4
+
+enum { OP_UPLOAD, OP_DOWNLOAD, OP_LIST, OP_TAR, OP_REMOVE, NOPS };
+static const char *op_names[NOPS] = { "uploadf", "downlf", "dispfnames", "downltar", "removef" };
+
+typedef struct {
+    char home[256];
+    int port[NSERVERS];
+    pid_t pid[NSERVERS];
+} cluster_t;
+
+static cluster_t cluster;
+static dfs_t dfs;
+static char *payload;
+static size_t file_size = 64 << 10;
+static double duration = 2;
+static int clients = 8, rounds = 20;
+static volatile int running;
+
+static hist_t lat_hist[NOPS], tput_hist[NOPS];
+static long long lat_errors[NOPS], tput_errors[NOPS], tput_bytes;
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A loopback port nobody is listening on. Another process could take it
+// before the server binds it, which start_server reports.
+static int free_port(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    int port = -1;
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    if (fd >= 0) close(fd);
+    return port;
+}
+
+// Wait until something accepts connections on port
+static int wait_port(int port, pid_t pid) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    for (double start = now_sec(); now_sec() - start < START_TIMEOUT;) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ok = fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) close(fd);
+        if (ok) {
+            return 0;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+// Run server i (0 for S1) from bin_dir with args, logging to its own file
+// in the cluster's home
+static int start_server(int i, const char *bin_dir, char *args[]) {
+    char prog[512], log_path[512];
+    snprintf(prog, sizeof(prog), "%s/s%d", bin_dir, i + 1);
+    snprintf(log_path, sizeof(log_path), "%s/s%d.log", cluster.home, i + 1);
+    args[0] = prog;
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        setenv("HOME", cluster.home, 1);
+        execv(prog, args);
+        fprintf(stderr, "cannot run %s: %s\n", prog, strerror(errno));
+        _exit(127);
+    }
+    cluster.pid[i] = pid;
+    if (wait_port(cluster.port[i], pid) < 0) {
+        fprintf(stderr, "cluster_bench: S%d did not start listening on %d; see %s\n", i + 1,
+                cluster.port[i], log_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_cluster(void) {
+    for (int i = 0; i < NSERVERS; i++) {
+        if (cluster.pid[i] > 0) {
+            kill(cluster.pid[i], SIGTERM);
+            waitpid(cluster.pid[i], NULL, 0);
+            cluster.pid[i] = 0;
+        }
+    }
+}
+
+static int remove_one(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// Start S2-S4, then S1 routing to them, each with flags (e.g. "-d -p")
+static int start_cluster(const char *bin_dir, const char *level, char *flags) {
+    snprintf(cluster.home, sizeof(cluster.home), "/tmp/cluster_bench.XXXXXX");
+    if (!mkdtemp(cluster.home)) {
+        fprintf(stderr, "cluster_bench: cannot create a directory in /tmp: %s\n", strerror(errno));
+        return -1;
+    }
+    char ports[NSERVERS][16];
+    for (int i = 0; i < NSERVERS; i++) {
+        cluster.port[i] = free_port();
+        snprintf(ports[i], sizeof(ports[i]), "%d", cluster.port[i]);
+    }
+
+    char *args[MAX_SERVER_ARGS + 8];
+    int n = 1;
+    args[n++] = "-l";
+    args[n++] = (char *)level;
+    for (char *save, *f = strtok_r(flags, " ", &save); f && n < MAX_SERVER_ARGS; f = strtok_r(NULL, " ", &save)) {
+        args[n++] = f;
+    }
+    for (int i = NSERVERS - 1; i >= 0; i--) {
+        int k = n;
+        args[k++] = ports[i];
+        if (i == 0) {
+            for (int j = 1; j < NSERVERS; j++) {
+                args[k++] = ports[j];
+            }
+        }
+        args[k] = NULL;
+        if (start_server(i, bin_dir, args) < 0) {
+            return -1;
+        }
+    }
+    return dfs_open(&dfs, ports[0]);
+}
+
+// Time one request into h; ok is whether it succeeded
+static void record(hist_t *h, long long *errors, int op, double start, int ok) {
+    hist_record(&h[op], (long long)((now_sec() - start) * 1e6));
+    if (!ok) {
+        __atomic_fetch_add(&errors[op], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// One request at a time, every command, every file type
+static int run_latency(void) {
+    char *buf = malloc(MAX_REPLY);
+    char list[1 << 16], name[64], path[128];
+    if (!buf) {
+        return -1;
+    }
+    for (int r = 0; r < rounds; r++) {
+        for (int x = 0; x < NEXTS; x++) {
+            snprintf(name, sizeof(name), "lat%d%s", r, exts[x]);
+            snprintf(path, sizeof(path), "~/S1/bench/%s", name);
+            memcpy(payload, &r, sizeof(r));
+
+            double t = now_sec();
+            int ok = dfs_upload(&dfs, NULL, name, "~/S1/bench/", payload, file_size) == 0;
+            record(lat_hist, lat_errors, OP_UPLOAD, t, ok);
+            if (!ok) {
+                fprintf(stderr, "cluster_bench: uploadf %s: %s\n", name, dfs_reply);
+                continue;
+            }
+            t = now_sec();
+            long len = dfs_download(&dfs, NULL, path, buf, MAX_REPLY);
+            ok = len == (long)file_size && memcmp(buf, payload, file_size) == 0;
+            record(lat_hist, lat_errors, OP_DOWNLOAD, t, ok);
+            if (!ok) {
+                fprintf(stderr, "cluster_bench: downlf %s: %s\n", path, len < 0 ? dfs_reply : "content differs");
+            }
+            t = now_sec();
+            ok = dfs_list(&dfs, NULL, "~/S1/bench", list, sizeof(list)) > 0 && strstr(list, name);
+            record(lat_hist, lat_errors, OP_LIST, t, ok);
+            if (!ok) {
+                fprintf(stderr, "cluster_bench: dispfnames does not list %s\n", name);
+            }
+            t = now_sec();
+            ok = dfs_tar(&dfs, NULL, exts[x], buf, MAX_REPLY) > (long)file_size;
+            record(lat_hist, lat_errors, OP_TAR, t, ok);
+            if (!ok) {
+                fprintf(stderr, "cluster_bench: downltar %s: %s\n", exts[x], dfs_reply);
+            }
+            t = now_sec();
+            ok = dfs_remove(&dfs, NULL, path) == 0;
+            record(lat_hist, lat_errors, OP_REMOVE, t, ok);
+            if (!ok) {
+                fprintf(stderr, "cluster_bench: removef %s: %s\n", path, dfs_reply);
+            }
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// A client uploading files of its own and reading them back
+static void *tput_client(void *arg) {
+    int id = (int)(size_t)arg;
+    char *buf = malloc(MAX_REPLY);
+    char name[64], path[128];
+    if (!buf) {
+        return NULL;
+    }
+    for (int n = 0; __atomic_load_n(&running, __ATOMIC_RELAXED); n++) {
+        snprintf(name, sizeof(name), "tput%d_%d%s", id, n, exts[(id + n) % NEXTS]);
+        snprintf(path, sizeof(path), "~/S1/bench/%s", name);
+        double t = now_sec();
+        int ok = dfs_upload(&dfs, NULL, name, "~/S1/bench/", payload, file_size) == 0;
+        record(tput_hist, tput_errors, OP_UPLOAD, t, ok);
+        if (!ok) {
+            continue;
+        }
+        t = now_sec();
+        ok = dfs_download(&dfs, NULL, path, buf, MAX_REPLY) == (long)file_size;
+        record(tput_hist, tput_errors, OP_DOWNLOAD, t, ok);
+        __atomic_fetch_add(&tput_bytes, (long long)file_size * (1 + ok), __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return NULL;
+}
+
+static double run_throughput(void) {
+    pthread_t tids[256];
+    int started = 0;
+    running = 1;
+    double start = now_sec();
+    for (; started < clients && started < 256; started++) {
+        if (pthread_create(&tids[started], NULL, tput_client, (void *)(size_t)started) != 0) {
+            break;
+        }
+    }
+    usleep((useconds_t)(duration * 1e6));
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return now_sec() - start;
+}
+
+// Value saved under key in a file written with -o, or -1
+static double baseline(const char *file, const char *key) {
+    FILE *fp = file ? fopen(file, "r") : NULL;
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    double v = -1;
+    size_t n = strlen(key);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, n) == 0 && line[n] == ' ') {
+            v = atof(line + n + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return v;
+}
+
+static FILE *out;
+static const char *base_file;
+static double fail_pct;
+static int regressed;
+
+// Print the change of value from the baseline, higher being worse unless
+// higher_better, and save it
+static void compare(const char *key, double value, int higher_better, char *change, size_t size) {
+    double was = baseline(base_file, key);
+    change[0] = '\0';
+    if (was > 0) {
+        double pct = (value - was) / was * 100;
+        snprintf(change, size, "%+.1f%%", pct);
+        if (fail_pct > 0 && (higher_better ? -pct : pct) > fail_pct) {
+            regressed = 1;
+            snprintf(change + strlen(change), size - strlen(change), " !");
+        }
+    }
+    if (out) {
+        fprintf(out, "%s %.1f\n", key, value);
+    }
+}
+
+static void print_table(const char *scenario, hist_t *h, long long *errors) {
+    printf("%-10s %-10s %7s %6s %9s %9s %9s %9s %10s\n", "scenario", "op", "count", "errors", "p50", "p99",
+           "max", "p50 was", "change");
+    for (int op = 0; op < NOPS; op++) {
+        if (h[op].count == 0) continue;
+        char p50[16], p99[16], max[16], was[16] = "-", key[64], change[24];
+        unsigned long long median = hist_percentile(&h[op], 0.5);
+        snprintf(key, sizeof(key), "%s %s p50_us", scenario, op_names[op]);
+        double prev = baseline(base_file, key);
+        if (prev > 0) {
+            hist_fmt((unsigned long long)prev, was, sizeof(was));
+        }
+        compare(key, median, 0, change, sizeof(change));
+        printf("%-10s %-10s %7llu %6lld %9s %9s %9s %9s %10s\n", scenario, op_names[op], h[op].count, errors[op],
+               hist_fmt(median, p50, 16), hist_fmt(hist_percentile(&h[op], 0.99), p99, 16),
+               hist_fmt(h[op].max, max, 16), was, change);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *bin_dir = ".", *level = "warn", *out_file = NULL, *only = NULL;
+    char flags[256] = "";
+    int keep = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "B:s:c:d:n:t:x:l:o:b:f:k")) != -1) {
+        switch (opt) {
+        case 'B': bin_dir = optarg; break;
+        case 's': file_size = strtoull(optarg, NULL, 10); break;
+        case 'c': clients = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'n': rounds = atoi(optarg); break;
+        case 't': only = optarg; break;
+        case 'x': snprintf(flags, sizeof(flags), "%s", optarg); break;
+        case 'l': level = optarg; break;
+        case 'o': out_file = optarg; break;
+        case 'b': base_file = optarg; break;
+        case 'f': fail_pct = atof(optarg); break;
+        case 'k': keep = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-B bin_dir] [-s file_bytes] [-c clients] [-d seconds] [-n rounds]\n"
+                            "       [-t latency|throughput] [-x \"server flags\"] [-l server_log_level]\n"
+                            "       [-o results.txt] [-b baseline.txt] [-f max_slowdown_pct] [-k]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (file_size == 0 || file_size > MAX_SIZE || clients < 1 || clients > 256 || duration <= 0 || rounds < 1) {
+        fprintf(stderr, "cluster_bench: need 0 < file_bytes <= %d, 1 <= clients <= 256, seconds > 0, rounds >= 1\n",
+                MAX_SIZE);
+        exit(1);
+    }
+    if (base_file && access(base_file, R_OK) < 0) {
+        fprintf(stderr, "cluster_bench: cannot read %s: %s\n", base_file, strerror(errno));
+        exit(1);
+    }
+    if (out_file && !(out = fopen(out_file, "w"))) {
+        fprintf(stderr, "cluster_bench: cannot write %s: %s\n", out_file, strerror(errno));
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    payload = malloc(MAX_SIZE);
+    if (!payload) {
+        fprintf(stderr, "cluster_bench: out of memory\n");
+        exit(1);
+    }
+    srand(1);
+    for (int i = 0; i < MAX_SIZE; i++) {
+        payload[i] = rand();
+    }
+
+    double t0 = now_sec();
+    int started = start_cluster(bin_dir, level, flags) == 0, failed = !started;
+    if (started) {
+        printf("Cluster in %s: S1 %d, S2 %d, S3 %d, S4 %d, started in %.0f ms\n", cluster.home, cluster.port[0],
+               cluster.port[1], cluster.port[2], cluster.port[3], (now_sec() - t0) * 1e3);
+        printf("%zu-byte files\n", file_size);
+    }
+
+    if (!failed && (!only || strstr(only, "latency"))) {
+        run_latency();
+        print_table("latency", lat_hist, lat_errors);
+        for (int op = 0; op < NOPS; op++) {
+            failed |= lat_errors[op] > 0;
+        }
+    }
+    if (!failed && (!only || strstr(only, "throughput"))) {
+        double secs = run_throughput();
+        unsigned long long done = tput_hist[OP_UPLOAD].count + tput_hist[OP_DOWNLOAD].count;
+        char change[24];
+        compare("throughput ops_per_s", done / secs, 1, change, sizeof(change));
+        printf("Throughput: %d clients, %.1f s: %.0f requests/s, %.1f MB/s %s\n", clients, secs, done / secs,
+               tput_bytes / secs / (1 << 20), change);
+        print_table("throughput", tput_hist, tput_errors);
+        failed |= tput_errors[OP_UPLOAD] + tput_errors[OP_DOWNLOAD] > 0;
+    }
+
+    stop_cluster();
+    if (out) {
+        fclose(out);
+    }
+    if (failed || regressed) {
+        fprintf(stderr, "cluster_bench: %s; server logs kept in %s\n",
+                !started ? "cluster did not start" : failed ? "requests failed" : "slower than baseline", cluster.home);
+        return 1;
+    }
+    if (!keep) {
+        nftw(cluster.home, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+#ifndef DFS_H
+#define DFS_H
+
+// Client calls for programs that drive a cluster from code rather than
+// through the client's prompt, such as cluster_bench.
+//
+// Each call opens a connection to S1, sends one command, closes its side
+// and reads the reply until S1 closes the connection: replies carry no
+// length, so the connection's end is what marks the end of one. S1 serves
+// each connection on a thread of its own, so calls made from different
+// threads are served side by side. dfs_upload and the calls after it
+// return -1 when the cluster could not be reached or answered with an
+// error. The start of the reply, or the reason for the failure, is left
+// in dfs_reply for the calling thread.
+//
+// Paths are given as to the client: "~/S1/dir/" for uploadf, and
+// "~/S1/dir/name" for downlf and removef.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "crc.h"
+
+#define DFS_TIMEOUT 60              // seconds to wait for a reply
+#define DFS_REPLY 256
+
+typedef struct {
+    struct sockaddr_in addr;        // S1
+} dfs_t;
+
+static __thread char dfs_reply[DFS_REPLY];
+
+// Resolve S1 at "[host:]port". Returns 0 on success.
+static inline int dfs_open(dfs_t *d, const char *spec) {
+    char host[128] = "127.0.0.1";
+    const char *port = spec, *colon = strrchr(spec, ':');
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - spec), spec);
+        port = colon + 1;
+    }
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        return -1;
+    }
+    memcpy(&d->addr, ai->ai_addr, sizeof(d->addr));
+    freeaddrinfo(ai);
+    crc_init();
+    return 0;
+}
+
+// Send cmd, as request rid unless it is NULL, followed by data as an
+// upload's content when data is not NULL. The reply goes to reply, cut off
+// at cap bytes. Returns the full length of the reply, which may be an
+// error, or -1 if there was none.
+static inline long dfs_call(const dfs_t *d, const char *rid, const char *cmd, const void *data, size_t len,
+                            char *reply, size_t cap) {
+    char line[1024];
+    int n = snprintf(line, sizeof(line), "%s%s%s%s\n", rid ? "@" : "", rid ? rid : "", rid ? " " : "", cmd);
+    if (data && n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, "%zu\n", len);
+    }
+    if (n >= (int)sizeof(line)) {
+        snprintf(dfs_reply, DFS_REPLY, "command too long");
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        snprintf(dfs_reply, DFS_REPLY, "socket: %s", strerror(errno));
+        return -1;
+    }
+    struct timeval tv = { .tv_sec = DFS_TIMEOUT, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&d->addr, sizeof(d->addr)) < 0 ||
+        send(fd, line, n, MSG_NOSIGNAL) != n ||
+        (data && (send(fd, data, len, MSG_NOSIGNAL) != (ssize_t)len ||
+                  crc_send_trailer(fd, crc32c(0, data, len)) < 0))) {
+        snprintf(dfs_reply, DFS_REPLY, "send to S1: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    static __thread char sink[1 << 16];
+    long got = 0;
+    size_t head = 0;
+    ssize_t r;
+    while ((r = recv(fd, sink, sizeof(sink), 0)) > 0) {
+        if (head < DFS_REPLY - 1) {
+            size_t k = (size_t)r < DFS_REPLY - 1 - head ? (size_t)r : DFS_REPLY - 1 - head;
+            memcpy(dfs_reply + head, sink, k);
+            head += k;
+        }
+        if (reply && (size_t)got < cap) {
+            memcpy(reply + got, sink, (size_t)r < cap - got ? (size_t)r : cap - got);
+        }
+        got += r;
+    }
+    close(fd);
+    dfs_reply[head] = '\0';
+    if (r < 0) {
+        snprintf(dfs_reply, DFS_REPLY, "receive from S1: %s", strerror(errno));
+        return -1;
+    }
+    if (got == 0) {
+        snprintf(dfs_reply, DFS_REPLY, "no reply");
+        return -1;
+    }
+    return got;
+}
+
+// Content of a "<header><name>\n<len>\n<content><crc>" reply in buf, moved
+// to the start of buf. Returns its length, or -1 if the reply is not one
+// or the checksum does not match.
+static inline long dfs_unwrap(char *buf, long got, size_t cap, const char *header) {
+    if (got < 0 || (size_t)got > cap) {
+        if (got >= 0) snprintf(dfs_reply, DFS_REPLY, "reply larger than %zu bytes", cap);
+        return -1;
+    }
+    char *name_end = memchr(buf, '\n', got);
+    char *len_end = name_end ? memchr(name_end + 1, '\n', got - (name_end + 1 - buf)) : NULL;
+    if (strncmp(buf, header, strlen(header)) != 0 || !len_end) {
+        return -1;
+    }
+    long len = atol(name_end + 1);
+    char *content = len_end + 1;
+    long trailer = got - (content - buf) - len;
+    unsigned crc;
+    if (len < 0 || trailer < (long)strlen(CRC_TRAILER) + 8 || strncmp(content + len, CRC_TRAILER, strlen(CRC_TRAILER)) != 0 ||
+        sscanf(content + len + strlen(CRC_TRAILER), "%8x", &crc) != 1 || crc != crc32c(0, content, len)) {
+        snprintf(dfs_reply, DFS_REPLY, "bad %.*s reply", (int)strcspn(header, ":"), header);
+        return -1;
+    }
+    memmove(buf, content, len);
+    return len;
+}
+
+// Store len bytes of data as name in dir. Returns 0 once stored.
+static inline int dfs_upload(const dfs_t *d, const char *rid, const char *name, const char *dir,
+                             const void *data, size_t len) {
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd), "uploadf %s %s", name, dir);
+    if (dfs_call(d, rid, cmd, data, len, NULL, 0) < 0) {
+        return -1;
+    }
+    return strncmp(dfs_reply, "File saved", 10) == 0 ? 0 : -1;
+}
+
+// Fetch path into buf. Returns the file's length, or -1.
+static inline long dfs_download(const dfs_t *d, const char *rid, const char *path, char *buf, size_t cap) {
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd), "downlf %s", path);
+    return dfs_unwrap(buf, dfs_call(d, rid, cmd, NULL, 0, buf, cap), cap, "FILE_INFO:");
+}
+
+// Fetch a tar of every file of type ext (".c") into buf. Returns the
+// archive's length, or -1.
+static inline long dfs_tar(const dfs_t *d, const char *rid, const char *ext, char *buf, size_t cap) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "downltar %s", ext);
+    return dfs_unwrap(buf, dfs_call(d, rid, cmd, NULL, 0, buf, cap), cap, "TAR_FILE:");
+}
+
+// List the files in dir, one per line, into buf. Servers that fail add
+// an ERROR line instead of theirs. Returns the number of files listed, or
+// -1 if none could be.
+static inline int dfs_list(const dfs_t *d, const char *rid, const char *dir, char *buf, size_t cap) {
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd), "dispfnames %s", dir);
+    long got = dfs_call(d, rid, cmd, NULL, 0, buf, cap - 1);
+    if (got < 0) {
+        return -1;
+    }
+    buf[(size_t)got < cap - 1 ? (size_t)got : cap - 1] = '\0';
+    int files = 0, errors = 0;
+    for (char *p = buf; *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p)) {
+        int error = strncmp(p, "ERROR", 5) == 0;
+        files += *p != '\n' && !error;
+        errors += error;
+    }
+    return files == 0 && errors ? -1 : files;
+}
+
+// Remove path. Returns 0 once removed.
+static inline int dfs_remove(const dfs_t *d, const char *rid, const char *path) {
+    char cmd[768];
+    snprintf(cmd, sizeof(cmd), "removef %s", path);
+    return dfs_call(d, rid, cmd, NULL, 0, NULL, 0) < 0 || strncmp(dfs_reply, "ERROR", 5) == 0 ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef HIST_H
+#define HIST_H
+
+// Latency histograms for the stats command.
+//
+// Values are microseconds, kept HDR-style: exact below HIST_SUB, then
+// HIST_SUB buckets per power of two, so a percentile read back is within
+// 1/HIST_SUB (about 6%) of the true value at any scale, from a cached
+// lookup to a tar build that takes seconds. Recording is a relaxed atomic
+// add on the bucket, count and sum, plus a compare-and-swap while the
+// max grows, so request threads never take a lock. Readers see a
+// snapshot that may miss a request recorded at the same moment.
+//
+// Histograms with the same layout add up, which is how S1 builds one
+// view of all storage servers: each sends its histograms as
+// "HIST <name> <count> <sum> <max> <bucket>:<n> ..." lines (hist_dump)
+// and S1 adds them together (hist_load).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;     // microseconds
+    unsigned long long max;
+} hist_t;
+
+static inline long long hist_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static inline int hist_bucket(unsigned long long v) {
+    if (v < HIST_SUB) return v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Highest value that falls in bucket i
+static inline unsigned long long hist_bucket_high(int i) {
+    if (i < HIST_SUB) return i;
+    int g = i / HIST_SUB;
+    unsigned long long low = (unsigned long long)(HIST_SUB + i % HIST_SUB) << (g - 1);
+    return low + (1ULL << (g - 1)) - 1;
+}
+
+static inline void hist_record(hist_t *h, long long us) {
+    unsigned long long v = us > 0 ? us : 0;
+    __atomic_fetch_add(&h->counts[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Add src to dst, which no other thread may be recording into
+static inline void hist_merge(hist_t *dst, const hist_t *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+}
+
+// Value below which a fraction q of the recorded values fall
+static inline unsigned long long hist_percentile(const hist_t *h, double q) {
+    unsigned long long total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+    if (total == 0) return 0;
+    unsigned long long rank = q * total + 0.5, seen = 0;
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    unsigned long long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            unsigned long long v = hist_bucket_high(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+// Format a duration in microseconds as "850us", "12.3ms" or "4.56s"
+static inline const char *hist_fmt(unsigned long long us, char *buf, size_t size) {
+    if (us < 1000) {
+        snprintf(buf, size, "%lluus", us);
+    } else if (us < 1000000) {
+        snprintf(buf, size, "%.1fms", us / 1e3);
+    } else {
+        snprintf(buf, size, "%.2fs", us / 1e6);
+    }
+    return buf;
+}
+
+// One line with the count, mean, p50/p90/p99/p99.9 and max of h
+static inline int hist_summary(const hist_t *h, const char *label, const char *name, char *out, size_t size) {
+    unsigned long long count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        return snprintf(out, size, "%s: %s: 0 requests\n", label, name);
+    }
+    char mean[16], p50[16], p90[16], p99[16], p999[16], max[16];
+    return snprintf(out, size, "%s: %s: %llu requests, mean %s, p50 %s, p90 %s, p99 %s, p99.9 %s, max %s\n",
+                    label, name, count, hist_fmt(__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count, mean, 16),
+                    hist_fmt(hist_percentile(h, 0.5), p50, 16), hist_fmt(hist_percentile(h, 0.9), p90, 16),
+                    hist_fmt(hist_percentile(h, 0.99), p99, 16), hist_fmt(hist_percentile(h, 0.999), p999, 16),
+                    hist_fmt(__atomic_load_n(&h->max, __ATOMIC_RELAXED), max, 16));
+}
+
+// Append h as a HIST line to out. Returns the length written, or what it
+// would have been (as snprintf) if out is too small.
+static inline int hist_dump(const hist_t *h, const char *name, char *out, size_t size) {
+    size_t len = snprintf(out, size, "HIST %s %llu %llu %llu", name,
+                          __atomic_load_n(&h->count, __ATOMIC_RELAXED),
+                          __atomic_load_n(&h->sum, __ATOMIC_RELAXED),
+                          __atomic_load_n(&h->max, __ATOMIC_RELAXED));
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        unsigned long long n = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (n) {
+            len += snprintf(out + (len < size ? len : size), len < size ? size - len : 0, " %d:%llu", i, n);
+        }
+    }
+    len += snprintf(out + (len < size ? len : size), len < size ? size - len : 0, "\n");
+    return len;
+}
+
+// Add a HIST line to h if it is for histogram name. Returns 1 if it was
+// added, 0 if it is for another histogram and -1 if it is malformed.
+static inline int hist_load(hist_t *h, const char *name, const char *line) {
+    char got[64];
+    unsigned long long count, sum, max;
+    int used;
+    if (sscanf(line, "HIST %63s %llu %llu %llu%n", got, &count, &sum, &max, &used) != 4) {
+        return -1;
+    }
+    if (strcmp(got, name) != 0) {
+        return 0;
+    }
+    hist_t add;
+    memset(&add, 0, sizeof(add));
+    const char *p = line + used;
+    int i, n;
+    unsigned long long c;
+    while (sscanf(p, " %d:%llu%n", &i, &c, &n) == 2) {
+        if (i < 0 || i >= HIST_BUCKETS) {
+            return -1;
+        }
+        add.counts[i] += c;
+        p += n;
+    }
+    add.count = count;
+    add.sum = sum;
+    add.max = max;
+    hist_merge(h, &add);
+    return 1;
+}
+
+#endif
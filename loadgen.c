@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "crc.h"
+#include "hist.h"
+
+// Open-loop load generator for the whole cluster, driven through S1.
+//
+// Requests arrive on a Poisson schedule at the rate given with -r whatever
+// the cluster's speed, and each one's latency is counted from the moment
+// it was due, not from when a connection was free to send it. A cluster
+// that falls behind therefore shows up as queueing delay in the
+// percentiles instead of quietly lowering the offered load (coordinated
+// omission). Replies carry no length, so every request uses a connection
+// of its own; S1 serves them side by side, and -c caps how many are in
+// flight.
+//
+// Downloads and removals pick among the files this run has uploaded, and
+// -w uploads some of each type first so there is something to fetch.
+
+enum { CMD_UPLOADF, CMD_DOWNLF, CMD_DISPFNAMES, CMD_REMOVEF, CMD_DOWNLTAR, NCMDS };
+static const char *cmd_names[NCMDS] = { "uploadf", "downlf", "dispfnames", "removef", "downltar" };
+
+#define MAX_EXTS 8
+#define MAX_SIZES 16
+#define QUEUE_MAX 65536
+#define POOL_MAX 100000
+#define MAX_UPLOAD 5242879      // S1 takes uploads below 5MB
+#define REPLY_TIMEOUT 60        // seconds
+
+typedef struct {
+    double due;                 // when the request should have been sent
+    int cmd;
+    int ext;
+    size_t size;
+} job_t;
+
+static struct sockaddr_in server;
+static char remote_dir[200] = "~/S1/loadgen/";
+static char exts[MAX_EXTS][8];
+static int nexts;
+static char *payload;           // upload content, read-only while running
+
+// Arrivals waiting for a connection
+static job_t queue[QUEUE_MAX];
+static int qhead, qcount, generating = 1;
+static long long dropped;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+
+// Files uploaded by this run, by extension
+static char (*pool[MAX_EXTS])[64];
+static int npool[MAX_EXTS];
+static pthread_mutex_t plock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long name_seq;
+
+static hist_t lat[NCMDS];
+static long long errors[NCMDS], bytes[NCMDS];
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, one state per thread
+static double next_rand(unsigned long long *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return ((*s * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+// Parse "4k", "64k" or "1m"
+static size_t parse_size(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (*end == 'k' || *end == 'K') v *= 1024;
+    if (*end == 'm' || *end == 'M') v *= 1024 * 1024;
+    return v > 0 ? (size_t)v : 0;
+}
+
+// Parse "name=weight,name=weight" into cumulative weights, with names
+// looked up by key(). Returns the number of entries, or -1.
+static int parse_weights(const char *spec, double *cum, int *keys, int max, int (*key)(const char *, int *)) {
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    int n = 0;
+    double total = 0;
+    char *save, *item = strtok_r(copy, ",", &save);
+    for (; item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        double w = eq ? atof(eq + 1) : 1;
+        if (eq) *eq = '\0';
+        if (n >= max || w < 0 || key(item, &keys[n]) < 0) {
+            return -1;
+        }
+        total += w;
+        cum[n++] = total;
+    }
+    if (n == 0 || total <= 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        cum[i] /= total;
+    }
+    return n;
+}
+
+static int cmd_key(const char *name, int *out) {
+    for (int i = 0; i < NCMDS; i++) {
+        if (strcmp(name, cmd_names[i]) == 0) {
+            *out = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static size_t sizes[MAX_SIZES];
+static int size_key(const char *name, int *out) {
+    static int n;
+    size_t v = parse_size(name);
+    if (v == 0 || v > MAX_UPLOAD || n >= MAX_SIZES) {
+        return -1;
+    }
+    sizes[n] = v;
+    *out = n++;
+    return 0;
+}
+
+static int pick(const double *cum, int n, double u) {
+    for (int i = 0; i < n - 1; i++) {
+        if (u < cum[i]) return i;
+    }
+    return n - 1;
+}
+
+static void pool_add(int ext, const char *name) {
+    pthread_mutex_lock(&plock);
+    if (npool[ext] < POOL_MAX) {
+        snprintf(pool[ext][npool[ext]++], 64, "%s", name);
+    }
+    pthread_mutex_unlock(&plock);
+}
+
+// A random uploaded file of type ext, taken out of the pool if take is
+// set. Returns 0 if there is none.
+static int pool_get(int ext, int take, double u, char *name) {
+    pthread_mutex_lock(&plock);
+    int n = npool[ext];
+    if (n > 0) {
+        int i = (int)(u * n) % n;
+        snprintf(name, 64, "%s", pool[ext][i]);
+        if (take) {
+            memcpy(pool[ext][i], pool[ext][n - 1], 64);
+            npool[ext]--;
+        }
+    }
+    pthread_mutex_unlock(&plock);
+    return n > 0;
+}
+
+// Send one request on a connection of its own and read the reply until S1
+// closes it. Returns 0 if the cluster served it.
+static int run_job(const job_t *j, double u, long long *moved) {
+    char line[512], name[64], reply[64];
+    int cmd = j->cmd;
+    const char *ext = exts[j->ext];
+    unsigned long long seq = __atomic_add_fetch(&name_seq, 1, __ATOMIC_RELAXED);
+
+    // The request id lets a slow request be found with S1's trace command
+    int len = snprintf(line, sizeof(line), "@lg%05x%08llx ", (unsigned)getpid() & 0xfffff, seq);
+    switch (cmd) {
+    case CMD_UPLOADF:
+        snprintf(name, sizeof(name), "lg%d_%llu%s", (int)getpid(), seq, ext);
+        snprintf(line + len, sizeof(line) - len, "uploadf %s %s\n%zu\n", name, remote_dir, j->size);
+        break;
+    case CMD_DOWNLF:
+    case CMD_REMOVEF:
+        if (!pool_get(j->ext, cmd == CMD_REMOVEF, u, name)) {
+            return -1;
+        }
+        snprintf(line + len, sizeof(line) - len, "%s %s%s\n", cmd_names[cmd], remote_dir, name);
+        break;
+    case CMD_DISPFNAMES:
+        snprintf(line + len, sizeof(line) - len, "dispfnames %s\n", remote_dir);
+        break;
+    default:
+        snprintf(line + len, sizeof(line) - len, "downltar %s\n", ext);
+        break;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval tv = { .tv_sec = REPLY_TIMEOUT, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0 ||
+        send(fd, line, strlen(line), MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (cmd == CMD_UPLOADF) {
+        // Each upload differs in its first bytes, so a deduplicating store
+        // still has to take it in. Those bytes go out from the stack; the
+        // shared payload is never written once the workers have started.
+        char head[sizeof(seq)];
+        size_t k = j->size < sizeof(head) ? j->size : sizeof(head);
+        memcpy(head, &seq, k);
+        uint32_t crc = crc32c(crc32c(0, head, k), payload + k, j->size - k);
+        if (send(fd, head, k, MSG_NOSIGNAL) < 0 || send(fd, payload + k, j->size - k, MSG_NOSIGNAL) < 0 ||
+            crc_send_trailer(fd, crc) < 0) {
+            close(fd);
+            return -1;
+        }
+        *moved += j->size;
+    }
+    shutdown(fd, SHUT_WR);
+
+    static __thread char sink[1 << 16];
+    size_t got = 0;
+    ssize_t n;
+    while ((n = recv(fd, sink, sizeof(sink), 0)) > 0) {
+        if (got < sizeof(reply) - 1) {
+            size_t keep = (size_t)n < sizeof(reply) - 1 - got ? (size_t)n : sizeof(reply) - 1 - got;
+            memcpy(reply + got, sink, keep);
+        }
+        got += n;
+    }
+    close(fd);
+    reply[got < sizeof(reply) - 1 ? got : sizeof(reply) - 1] = '\0';
+    if (n < 0 || got == 0 || strncmp(reply, "ERROR", 5) == 0) {
+        return -1;
+    }
+    if (cmd == CMD_UPLOADF) {
+        if (strncmp(reply, "File saved", 10) != 0) {
+            return -1;
+        }
+        pool_add(j->ext, name);
+    } else if (cmd == CMD_DOWNLF || cmd == CMD_DOWNLTAR) {
+        if (strncmp(reply, cmd == CMD_DOWNLF ? "FILE_INFO:" : "TAR_FILE:", cmd == CMD_DOWNLF ? 10 : 9) != 0) {
+            return -1;
+        }
+        *moved += got;
+    }
+    return 0;
+}
+
+static void *worker(void *arg) {
+    unsigned long long rng = (unsigned long long)(size_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+    while (1) {
+        pthread_mutex_lock(&qlock);
+        while (qcount == 0 && generating) {
+            pthread_cond_wait(&qcond, &qlock);
+        }
+        if (qcount == 0) {
+            pthread_mutex_unlock(&qlock);
+            return NULL;
+        }
+        job_t j = queue[qhead];
+        qhead = (qhead + 1) % QUEUE_MAX;
+        qcount--;
+        pthread_mutex_unlock(&qlock);
+
+        long long moved = 0;
+        int status = run_job(&j, next_rand(&rng), &moved);
+        hist_record(&lat[j.cmd], (long long)((now_sec() - j.due) * 1e6));
+        if (status < 0) {
+            __atomic_fetch_add(&errors[j.cmd], 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&bytes[j.cmd], moved, __ATOMIC_RELAXED);
+    }
+}
+
+static void print_row(FILE *text, FILE *out, const char *name, const hist_t *h, long long errs, long long moved, double secs) {
+    char p50[16], p99[16], p999[16], max[16];
+    fprintf(text, "%-10s %8llu %7lld %9.1f %9s %9s %9s %9s %9.2f\n", name, h->count, errs, h->count / secs,
+           hist_fmt(hist_percentile(h, 0.5), p50, 16), hist_fmt(hist_percentile(h, 0.99), p99, 16),
+           hist_fmt(hist_percentile(h, 0.999), p999, 16), hist_fmt(h->max, max, 16), moved / secs / (1 << 20));
+    if (out) {
+        fprintf(out, "\"%s\":{\"count\":%llu,\"errors\":%lld,\"throughput\":%.3f,\"mean_us\":%llu,"
+                "\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu,\"bytes\":%lld}",
+                name, h->count, errs, h->count / secs, h->count ? h->sum / h->count : 0,
+                hist_percentile(h, 0.5), hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max, moved);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double rate = 50, duration = 10;
+    int conns = 16, warm = 10;
+    unsigned long long seed = 1;
+    const char *mix = "uploadf=30,downlf=50,dispfnames=10,removef=5,downltar=5";
+    const char *size_spec = "4k=60,64k=30,1m=10";
+    const char *ext_spec = ".pdf,.txt,.zip,.c";
+    const char *json = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:c:m:s:x:p:w:S:j:")) != -1) {
+        switch (opt) {
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'm': mix = optarg; break;
+        case 's': size_spec = optarg; break;
+        case 'x': ext_spec = optarg; break;
+        case 'p': snprintf(remote_dir, sizeof(remote_dir), "%s", optarg); break;
+        case 'w': warm = atoi(optarg); break;
+        case 'S': seed = strtoull(optarg, NULL, 10); break;
+        case 'j': json = optarg; break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || rate <= 0 || duration <= 0 || conns <= 0) {
+usage:
+        fprintf(stderr, "Usage: %s [-r req_per_sec] [-d seconds] [-c connections] [-m cmd=weight,...]\n"
+                        "       [-s size=weight,...] [-x .ext,...] [-p remote_dir] [-w warmup_files]\n"
+                        "       [-S seed] [-j results.json|-] [host:]<S1_port>\n", argv[0]);
+        exit(1);
+    }
+
+    double mix_cum[NCMDS], size_cum[MAX_SIZES];
+    int mix_cmd[NCMDS], size_idx[MAX_SIZES];
+    int nmix = parse_weights(mix, mix_cum, mix_cmd, NCMDS, cmd_key);
+    int nsizes = parse_weights(size_spec, size_cum, size_idx, MAX_SIZES, size_key);
+    if (nmix < 0 || nsizes < 0) {
+        fprintf(stderr, "loadgen: bad %s: %s\n", nmix < 0 ? "mix" : "sizes", nmix < 0 ? mix : size_spec);
+        exit(1);
+    }
+    char copy[128];
+    snprintf(copy, sizeof(copy), "%s", ext_spec);
+    char *save, *e = strtok_r(copy, ",", &save);
+    for (; e && nexts < MAX_EXTS; e = strtok_r(NULL, ",", &save)) {
+        snprintf(exts[nexts++], sizeof(exts[0]), "%s", e);
+    }
+    if (nexts == 0) {
+        fprintf(stderr, "loadgen: no file types\n");
+        exit(1);
+    }
+
+    char host[128] = "127.0.0.1";
+    const char *port = argv[optind], *colon = strrchr(argv[optind], ':');
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - argv[optind]), argv[optind]);
+        port = colon + 1;
+    }
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(host, port, &hints, &ai) != 0) {
+        fprintf(stderr, "loadgen: cannot resolve %s\n", argv[optind]);
+        exit(1);
+    }
+    memcpy(&server, ai->ai_addr, sizeof(server));
+    freeaddrinfo(ai);
+
+    crc_init();
+    payload = malloc(MAX_UPLOAD);
+    for (int i = 0; i < MAX_EXTS; i++) {
+        pool[i] = malloc(POOL_MAX * sizeof(*pool[i]));
+    }
+    if (!payload || !pool[MAX_EXTS - 1]) {
+        fprintf(stderr, "loadgen: out of memory\n");
+        exit(1);
+    }
+    unsigned long long rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    for (size_t i = 0; i < MAX_UPLOAD; i++) {
+        payload[i] = next_rand(&rng) * 256;
+    }
+
+    // Files to download and remove, uploaded one at a time and not counted
+    int warmed = 0;
+    for (int x = 0; x < nexts; x++) {
+        for (int i = 0; i < warm; i++) {
+            job_t j = { now_sec(), CMD_UPLOADF, x, sizes[size_idx[pick(size_cum, nsizes, next_rand(&rng))]] };
+            long long moved = 0;
+            warmed += run_job(&j, 0, &moved) == 0;
+        }
+    }
+    if (warm > 0 && warmed == 0) {
+        fprintf(stderr, "loadgen: warm-up uploads to %s failed; is S1 running?\n", argv[optind]);
+        exit(1);
+    }
+    fprintf(json && strcmp(json, "-") == 0 ? stderr : stdout, "Warm-up: %d of %d files uploaded to %s\n", warmed, warm * nexts, remote_dir);
+
+    pthread_t *tids = malloc(conns * sizeof(pthread_t));
+    for (int i = 0; i < conns; i++) {
+        if (pthread_create(&tids[i], NULL, worker, (void *)(size_t)(i + seed * 131)) != 0) {
+            fprintf(stderr, "loadgen: cannot start connection threads\n");
+            exit(1);
+        }
+    }
+
+    // Arrivals: exponential gaps at the target rate, each due at its own
+    // time however busy the connections are
+    double start = now_sec(), due = start;
+    long long offered = 0;
+    while (1) {
+        due += -log(1 - next_rand(&rng)) / rate;
+        if (due - start >= duration) {
+            break;
+        }
+        double wait = due - now_sec();
+        if (wait > 0) {
+            struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+            nanosleep(&ts, NULL);
+        }
+        job_t j = { due, mix_cmd[pick(mix_cum, nmix, next_rand(&rng))], (int)(next_rand(&rng) * nexts) % nexts,
+                    sizes[size_idx[pick(size_cum, nsizes, next_rand(&rng))]] };
+        offered++;
+        pthread_mutex_lock(&qlock);
+        if (qcount == QUEUE_MAX) {
+            dropped++;
+        } else {
+            queue[(qhead + qcount) % QUEUE_MAX] = j;
+            qcount++;
+            pthread_cond_signal(&qcond);
+        }
+        pthread_mutex_unlock(&qlock);
+    }
+    pthread_mutex_lock(&qlock);
+    generating = 0;
+    pthread_cond_broadcast(&qcond);
+    pthread_mutex_unlock(&qlock);
+    for (int i = 0; i < conns; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double secs = now_sec() - start;
+
+    hist_t all;
+    memset(&all, 0, sizeof(all));
+    long long all_errors = 0, all_bytes = 0;
+    for (int i = 0; i < NCMDS; i++) {
+        hist_merge(&all, &lat[i]);
+        all_errors += errors[i];
+        all_bytes += bytes[i];
+    }
+
+    FILE *out = NULL;
+    if (json) {
+        out = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+        if (!out) {
+            fprintf(stderr, "loadgen: cannot write %s: %s\n", json, strerror(errno));
+            exit(1);
+        }
+    }
+    // With JSON on stdout the table goes to stderr
+    FILE *text = out == stdout ? stderr : stdout;
+    fprintf(text, "Target %.1f req/s for %.0f s over %d connections: %lld offered, %llu done in %.1f s "
+           "(%.1f req/s), %lld dropped\n", rate, duration, conns, offered, all.count, secs,
+           all.count / secs, dropped);
+    fprintf(text, "%-10s %8s %7s %9s %9s %9s %9s %9s %9s\n", "command", "count", "errors", "req/s",
+           "p50", "p99", "p99.9", "max", "MB/s");
+    if (out) {
+        fprintf(out, "{\"target_rate\":%.3f,\"duration_s\":%.3f,\"connections\":%d,\"offered\":%lld,"
+                "\"completed\":%llu,\"dropped\":%lld,\"elapsed_s\":%.3f,\"commands\":{",
+                rate, duration, conns, offered, all.count, dropped, secs);
+    }
+    int first = 1;
+    for (int i = 0; i < NCMDS; i++) {
+        if (lat[i].count == 0) continue;
+        if (out && !first) fputc(',', out);
+        first = 0;
+        print_row(text, out, cmd_names[i], &lat[i], errors[i], bytes[i], secs);
+    }
+    if (out) fputs("},", out);
+    print_row(text, out, "all", &all, all_errors, all_bytes, secs);
+    if (out) {
+        fputs("}\n", out);
+        if (out != stdout) fclose(out);
+    }
+    return all_errors > 0;
+}
@@ -0,0 +1,268 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Leveled logging through per-thread rings.
+//
+// log_debug/log_info/log_warn/log_error format the message into the
+// calling thread's ring and return; they never take a lock or make a
+// system call other than reading the clock. A background thread drains
+// the rings, merges them into timestamp order and writes the lines to
+// stdout in batches, so a slow terminal or pipe only ever stalls that
+// thread. When a ring is full because the writer has fallen behind, the
+// line is dropped and counted, and the writer reports how many it lost.
+//
+// Lines look like
+//
+//   2026-10-18 14:03:07.123456 INFO  t1 S1: Received: downlf ~/S1/a.txt
+//
+// where t1 is the ring the line came through. A ring belongs to one
+// thread at a time and is handed on to a new thread when its owner
+// exits, so the number is stable for long-lived threads and reused for
+// short-lived ones.
+//
+// Messages above LOG_COMPILED_LEVEL (set with -DLOG_COMPILED_LEVEL=...)
+// are compiled out; messages above log_level, set at startup with
+// log_set_level, cost one comparison.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_SLOTS 128               // lines per ring, a power of two
+#define LOG_LINE 512                // longest message kept
+#define LOG_IDLE_NS 5000000         // writer sleep when there is nothing to write
+#define LOG_BATCH 65536             // bytes per write(2)
+
+typedef struct {
+    long long us;                   // wall clock, microseconds
+    int level;
+    int len;
+    char msg[LOG_LINE];
+} log_slot_t;
+
+typedef struct log_ring {
+    log_slot_t slots[LOG_SLOTS];
+    unsigned head;                  // next slot to fill, written by the owner
+    unsigned tail;                  // next slot to write out, written by the writer
+    unsigned long long dropped;
+    int free;                       // owner has exited, ring may be taken
+    int id;
+    struct log_ring *next;
+} log_ring_t;
+
+static int log_level = LOG_INFO;
+static log_ring_t *log_rings;       // every ring ever made, newest first
+static int log_nrings;
+static __thread log_ring_t *log_ring;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *log_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+// Set the runtime level from "error", "warn", "info" or "debug"
+static inline int log_set_level(const char *name) {
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(name, log_names[i]) == 0 || (i == LOG_WARN && strcasecmp(name, "warning") == 0)) {
+            log_level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static inline void log_flush_out(const char *out, size_t *len) {
+    for (size_t off = 0; off < *len;) {
+        ssize_t w = write(STDOUT_FILENO, out + off, *len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += w;
+    }
+    *len = 0;
+}
+
+// Append a line to the batch in out, writing the batch first if full
+static inline void log_out(char *out, size_t *len, const char *s, size_t n) {
+    if (*len + n > LOG_BATCH) {
+        log_flush_out(out, len);
+    }
+    memcpy(out + *len, s, n);
+    *len += n;
+}
+
+// Write out everything queued so far, oldest first across threads.
+// Returns the number of lines written.
+static inline int log_drain(void) {
+    static char out[LOG_BATCH];
+    static log_ring_t **rings;
+    static unsigned *heads;
+    static int cap;
+    static time_t last_sec = -1;
+    static char stamp[32];
+
+    pthread_mutex_lock(&log_drain_lock);
+    int n = __atomic_load_n(&log_nrings, __ATOMIC_ACQUIRE);
+    if (n > cap) {
+        int want = n * 2;
+        log_ring_t **r = realloc(rings, want * sizeof(*r));
+        if (r) rings = r;
+        unsigned *h = realloc(heads, want * sizeof(*h));
+        if (h) heads = h;
+        if (r && h) cap = want;
+    }
+    int count = 0;
+    for (log_ring_t *r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r && count < cap; r = r->next) {
+        rings[count] = r;
+        heads[count] = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        count++;
+    }
+
+    size_t len = 0;
+    int written = 0;
+    char line[LOG_LINE + 64];
+    for (int i = 0; i < count; i++) {
+        unsigned long long lost = __atomic_exchange_n(&rings[i]->dropped, 0, __ATOMIC_RELAXED);
+        if (lost) {
+            int k = snprintf(line, sizeof(line), "log: t%d dropped %llu lines\n", rings[i]->id, lost);
+            log_out(out, &len, line, k);
+        }
+    }
+    while (1) {
+        // Oldest pending line across the rings
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            log_ring_t *r = rings[i];
+            if (r->tail != heads[i] &&
+                (best < 0 || r->slots[r->tail % LOG_SLOTS].us < rings[best]->slots[rings[best]->tail % LOG_SLOTS].us)) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        log_ring_t *r = rings[best];
+        log_slot_t *s = &r->slots[r->tail % LOG_SLOTS];
+        time_t sec = s->us / 1000000;
+        if (sec != last_sec) {
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            last_sec = sec;
+        }
+        int k = snprintf(line, sizeof(line), "%s.%06lld %-5s t%d %.*s\n", stamp, s->us % 1000000,
+                         log_names[s->level], r->id, s->len, s->msg);
+        log_out(out, &len, line, k < (int)sizeof(line) ? k : (int)sizeof(line) - 1);
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+    log_flush_out(out, &len);
+    pthread_mutex_unlock(&log_drain_lock);
+    return written;
+}
+
+static void *log_writer(void *arg) {
+    (void)arg;
+    while (1) {
+        if (log_drain() == 0) {
+            struct timespec ts = { 0, LOG_IDLE_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Writes out what is left when the process exits
+static void log_flush(void) {
+    log_drain();
+}
+
+// Hand the exiting thread's ring to the next thread that needs one
+static void log_release(void *arg) {
+    log_ring_t *r = arg;
+    __atomic_store_n(&r->free, 1, __ATOMIC_RELEASE);
+}
+
+static void log_init(void) {
+    pthread_key_create(&log_key, log_release);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_writer, NULL) == 0) {
+        pthread_detach(tid);
+    }
+    atexit(log_flush);
+}
+
+static log_ring_t *log_attach(void) {
+    pthread_once(&log_once, log_init);
+    log_ring_t *r;
+    for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 1;
+        if (__atomic_compare_exchange_n(&r->free, &expected, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) {
+            return NULL;
+        }
+        r->id = __atomic_add_fetch(&log_nrings, 1, __ATOMIC_RELAXED);
+        r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(log_key, r);
+    log_ring = r;
+    return r;
+}
+
+__attribute__((format(printf, 2, 3)))
+static inline void log_write(int level, const char *fmt, ...) {
+    log_ring_t *r = log_ring ? log_ring : log_attach();
+    if (!r) {
+        return;
+    }
+    unsigned head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_SLOTS) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_slot_t *s = &r->slots[head % LOG_SLOTS];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    s->level = level;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(s->msg, LOG_LINE, fmt, ap);
+    va_end(ap);
+    if (n < 0) n = 0;
+    if (n >= LOG_LINE) n = LOG_LINE - 1;
+    while (n > 0 && s->msg[n - 1] == '\n') n--;
+    s->len = n;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILED_LEVEL && (level) <= log_level) log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+
+#endif
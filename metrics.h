@@ -0,0 +1,184 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Prometheus metrics over HTTP.
+//
+// A server started with -m <port> answers GET /metrics on 127.0.0.1:<port>
+// with its counters and histograms in the Prometheus text format. Each
+// server numbers its counters and renders them itself (see
+// render_metrics in the servers); this file holds the storage and the
+// HTTP side.
+//
+// Counters are kept in METRICS_SHARDS cache-line aligned shards. A thread
+// is given a shard the first time it counts something and adds to it
+// with a relaxed atomic add. Threads rarely share a shard, so counting
+// does not bounce cache lines between cores. A scrape adds the shards
+// up and never writes to them. Gauges are counters that also go down,
+// read back as signed values.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "hist.h"
+
+#define METRICS_SHARDS 64
+#define METRICS_MAX 128             // counters per server
+#define METRICS_BODY (1 << 20)
+
+typedef struct {
+    unsigned long long v[METRICS_MAX];
+} __attribute__((aligned(64))) metrics_shard_t;
+
+static metrics_shard_t metrics_shards[METRICS_SHARDS];
+static unsigned metrics_next_shard;
+static __thread int metrics_shard = -1;
+
+static inline void metrics_add(int id, long long n) {
+    if (metrics_shard < 0) {
+        metrics_shard = __atomic_fetch_add(&metrics_next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS;
+    }
+    __atomic_fetch_add(&metrics_shards[metrics_shard].v[id], (unsigned long long)n, __ATOMIC_RELAXED);
+}
+
+static inline long long metrics_get(int id) {
+    unsigned long long sum = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        sum += __atomic_load_n(&metrics_shards[i].v[id], __ATOMIC_RELAXED);
+    }
+    return (long long)sum;
+}
+
+// Output being rendered for a scrape
+typedef struct {
+    char *p;
+    size_t len;
+    size_t size;
+} metrics_buf_t;
+
+__attribute__((format(printf, 2, 3)))
+static inline void metrics_printf(metrics_buf_t *b, const char *fmt, ...) {
+    if (b->len >= b->size) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->p + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) b->len = b->len + n < b->size ? b->len + n : b->size;
+}
+
+// HELP and TYPE lines that start a metric family
+static inline void metrics_family(metrics_buf_t *b, const char *name, const char *type, const char *help) {
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// A histogram sample set in seconds, labels as in "command=\"downlf\"" or
+// "" for none. Bucket bounds are read from h's buckets, so each count is
+// within h's precision of the bound.
+static inline void metrics_hist(metrics_buf_t *b, const char *name, const char *labels, const hist_t *h) {
+    static const double bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+                                     0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+    const char *sep = labels[0] ? "," : "";
+    unsigned long long seen = 0;
+    int i = 0;
+    for (size_t k = 0; k < sizeof(bounds) / sizeof(bounds[0]); k++) {
+        unsigned long long le_us = bounds[k] * 1e6 + 0.5;
+        for (; i < HIST_BUCKETS && hist_bucket_high(i) <= le_us; i++) {
+            seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        }
+        metrics_printf(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, bounds[k], seen);
+    }
+    unsigned long long total = seen;
+    for (; i < HIST_BUCKETS; i++) {
+        total += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+    metrics_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, total);
+    metrics_printf(b, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+                   __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e6);
+    metrics_printf(b, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", total);
+}
+
+typedef struct {
+    int fd;
+    void (*render)(metrics_buf_t *b);
+} metrics_server_t;
+
+static void *metrics_listener(void *arg) {
+    metrics_server_t *m = arg;
+    char *body = malloc(METRICS_BODY);
+    if (!body) {
+        return NULL;
+    }
+    while (1) {
+        int fd = accept(m->fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        struct timeval tv = { .tv_sec = 2, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        // Only the request line matters; the rest of the request is read
+        // until its blank line so the reply is not cut off by a reset
+        char req[4096];
+        size_t len = 0;
+        while (len < sizeof(req) - 1) {
+            ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+            if (n <= 0) break;
+            len += n;
+            req[len] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+        }
+        req[len] = '\0';
+
+        char head[256];
+        int hlen;
+        metrics_buf_t b = { body, 0, METRICS_BODY };
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0) {
+            m->render(&b);
+            hlen = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", b.len);
+        } else {
+            metrics_printf(&b, "Not found\n");
+            hlen = snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+                            "Content-Length: %zu\r\nConnection: close\r\n\r\n", b.len);
+        }
+        if (send(fd, head, hlen, MSG_NOSIGNAL) == hlen) {
+            send(fd, body, b.len, MSG_NOSIGNAL);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Serve metrics rendered by render on 127.0.0.1:port from a thread of
+// their own. Returns 0 once listening.
+static inline int metrics_start(int port, void (*render)(metrics_buf_t *b)) {
+    static metrics_server_t m;
+    m.render = render;
+    m.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m.fd < 0) {
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(m.fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port),
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    if (bind(m.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(m.fd, 8) < 0) {
+        close(m.fd);
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_listener, &m) != 0) {
+        close(m.fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,770 @@
+#ifndef PACK_H
+#define PACK_H
+
+// Small-file packing, optionally used by S1-S4 to keep files of up to
+// PACK_MAX_FILE bytes out of the directory tree.
+//
+// Small files are appended as records to segment files under
+// <base>/.pack/ (seg-000001, seg-000002, ...), a new segment being started
+// once the current one reaches PACK_SEGMENT_SIZE. An in-memory index maps
+// every packed path to its latest record, so a packed file costs no inode,
+// directory entry or stat in lookups, listings and tar builds. Larger files
+// stay in the tree as before.
+//
+// Replacing or removing a packed file appends a newer record or a
+// tombstone. The index is rebuilt at startup by replaying the segments in
+// order; a record cut short by a crash ends its segment and is truncated.
+// A background thread compacts sealed segments that are mostly dead by
+// copying their live records to the current segment and deleting them.
+//
+// The store_* functions at the end put packed files and the files kept in
+// the tree (plain or chunk store manifests, see cas.h) behind one interface.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "cas.h"
+#include "log.h"
+
+#define PACK_DIR ".pack"
+#define PACK_MAX_FILE 4096              // larger files stay in the tree
+#define PACK_SEGMENT_SIZE (64 << 20)
+#define PACK_MAX_SEGMENTS 4096
+#define PACK_MAX_PATH 512
+#define PACK_COMPACT_INTERVAL 10        // seconds between compaction passes
+#define PACK_MAGIC "PKR1"
+#define PACK_TOMBSTONE 1
+
+// Record header, followed by the path (relative to the base directory)
+// and the data. check is a hash of all three, taken with check = 0.
+typedef struct {
+    char magic[4];
+    uint32_t path_len;
+    uint32_t data_len;
+    uint32_t flags;
+    int64_t mtime;
+    uint64_t check;
+} pack_rec_t;
+
+typedef struct pack_entry {
+    struct pack_entry *next;
+    uint64_t hash;
+    uint32_t seg;               // segment id
+    uint64_t off;               // start of the record
+    uint32_t data_len;
+    uint32_t rec_len;
+    int64_t mtime;
+    char path[];                // relative to the base directory
+} pack_entry_t;
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    uint64_t live;              // bytes of records the index points to
+} pack_seg_t;
+
+typedef struct {
+    int enabled;
+    char base[256];
+    char dir[300];              // <base>/.pack
+    pthread_mutex_t lock;
+    pack_entry_t **buckets;
+    size_t cap;                 // power of two
+    size_t count;
+    pack_seg_t segs[PACK_MAX_SEGMENTS];     // by increasing id, the last one open for appends
+    int nsegs;
+    uint32_t next_id;
+    unsigned long long compactions;
+    unsigned long long reclaimed;
+} pack_t;
+
+static inline uint64_t pack_fnv(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static inline uint64_t pack_check(const pack_rec_t *rec, const char *path, const char *data) {
+    pack_rec_t h = *rec;
+    h.check = 0;
+    uint64_t sum = pack_fnv(14695981039346656037ull, &h, sizeof(h));
+    sum = pack_fnv(sum, path, rec->path_len);
+    return pack_fnv(sum, data, rec->data_len);
+}
+
+// Path of a file relative to the base directory, with doubled and
+// trailing slashes dropped. Returns -1 if it is not under the base directory.
+static inline int pack_rel(const pack_t *p, const char *path, char *rel, size_t size) {
+    char clean[PACK_MAX_PATH];
+    size_t n = 0;
+    for (const char *s = path; *s && n < sizeof(clean) - 1; s++) {
+        if (*s == '/' && n > 0 && clean[n - 1] == '/') continue;
+        clean[n++] = *s;
+    }
+    while (n > 1 && clean[n - 1] == '/') n--;
+    clean[n] = '\0';
+    size_t blen = strlen(p->base);
+    while (blen > 1 && p->base[blen - 1] == '/') blen--;
+    if (strncmp(clean, p->base, blen) != 0 || (clean[blen] != '/' && clean[blen] != '\0')) {
+        return -1;
+    }
+    const char *r = clean + blen;
+    while (*r == '/') r++;
+    if (strlen(r) >= size) {
+        return -1;
+    }
+    strcpy(rel, r);
+    return 0;
+}
+
+// Index
+
+static inline pack_entry_t **pack_slot(pack_t *p, const char *rel, uint64_t hash) {
+    pack_entry_t **e = &p->buckets[hash & (p->cap - 1)];
+    while (*e && ((*e)->hash != hash || strcmp((*e)->path, rel) != 0)) {
+        e = &(*e)->next;
+    }
+    return e;
+}
+
+static inline pack_entry_t *pack_lookup(pack_t *p, const char *rel) {
+    if (!p->cap) return NULL;
+    return *pack_slot(p, rel, pack_fnv(14695981039346656037ull, rel, strlen(rel)));
+}
+
+static inline pack_seg_t *pack_seg(pack_t *p, uint32_t id) {
+    for (int i = 0; i < p->nsegs; i++) {
+        if (p->segs[i].id == id) return &p->segs[i];
+    }
+    return NULL;
+}
+
+static inline void pack_unlink_entry(pack_t *p, pack_entry_t **slot) {
+    pack_entry_t *e = *slot;
+    pack_seg_t *s = pack_seg(p, e->seg);
+    if (s) s->live -= e->rec_len;
+    *slot = e->next;
+    free(e);
+    p->count--;
+}
+
+// Point the index entry for rel at a record, replacing any older one
+static inline int pack_index_set(pack_t *p, const char *rel, uint32_t seg, uint64_t off,
+                                 const pack_rec_t *rec) {
+    if (p->count + 1 > p->cap) {
+        size_t cap = p->cap ? p->cap * 2 : 1024;
+        pack_entry_t **buckets = calloc(cap, sizeof(pack_entry_t *));
+        if (!buckets) return -1;
+        for (size_t i = 0; i < p->cap; i++) {
+            for (pack_entry_t *e = p->buckets[i], *next; e; e = next) {
+                next = e->next;
+                e->next = buckets[e->hash & (cap - 1)];
+                buckets[e->hash & (cap - 1)] = e;
+            }
+        }
+        free(p->buckets);
+        p->buckets = buckets;
+        p->cap = cap;
+    }
+    uint64_t hash = pack_fnv(14695981039346656037ull, rel, strlen(rel));
+    pack_entry_t **slot = pack_slot(p, rel, hash);
+    if (*slot) {
+        pack_unlink_entry(p, slot);
+    }
+    pack_entry_t *e = malloc(sizeof(pack_entry_t) + strlen(rel) + 1);
+    if (!e) return -1;
+    e->hash = hash;
+    e->seg = seg;
+    e->off = off;
+    e->data_len = rec->data_len;
+    e->rec_len = sizeof(pack_rec_t) + rec->path_len + rec->data_len;
+    e->mtime = rec->mtime;
+    strcpy(e->path, rel);
+    e->next = *slot;
+    *slot = e;
+    p->count++;
+    pack_seg_t *s = pack_seg(p, seg);
+    if (s) s->live += e->rec_len;
+    return 0;
+}
+
+static inline void pack_index_del(pack_t *p, const char *rel) {
+    if (!p->cap) return;
+    pack_entry_t **slot = pack_slot(p, rel, pack_fnv(14695981039346656037ull, rel, strlen(rel)));
+    if (*slot) {
+        pack_unlink_entry(p, slot);
+    }
+}
+
+// Segments
+
+static inline int pack_open_segment(pack_t *p, uint32_t id, int create) {
+    if (p->nsegs == PACK_MAX_SEGMENTS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    char path[400];
+    snprintf(path, sizeof(path), "%s/seg-%06u", p->dir, id);
+    int fd = open(path, O_RDWR | O_APPEND | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    fstat(fd, &st);
+    pack_seg_t *s = &p->segs[p->nsegs++];
+    s->id = id;
+    s->fd = fd;
+    s->size = st.st_size;
+    s->live = 0;
+    if (id >= p->next_id) p->next_id = id + 1;
+    return 0;
+}
+
+// Append a record to the current segment, starting a new one when it is
+// full. Returns 0 with the record's location in *seg and *off.
+static inline int pack_append(pack_t *p, const char *rel, const char *data, uint32_t len, uint32_t flags,
+                              int64_t mtime, uint32_t *seg, uint64_t *off) {
+    pack_rec_t rec;
+    memcpy(rec.magic, PACK_MAGIC, 4);
+    rec.path_len = strlen(rel);
+    rec.data_len = len;
+    rec.flags = flags;
+    rec.mtime = mtime;
+    rec.check = pack_check(&rec, rel, data);
+    size_t rec_len = sizeof(rec) + rec.path_len + len;
+
+    pack_seg_t *s = p->nsegs ? &p->segs[p->nsegs - 1] : NULL;
+    if (!s || (s->size > 0 && s->size + rec_len > PACK_SEGMENT_SIZE)) {
+        if (pack_open_segment(p, p->next_id, 1) < 0) {
+            return -1;
+        }
+        s = &p->segs[p->nsegs - 1];
+    }
+
+    char *buf = malloc(rec_len);
+    if (!buf) return -1;
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), rel, rec.path_len);
+    memcpy(buf + sizeof(rec) + rec.path_len, data, len);
+    size_t done = 0;
+    while (done < rec_len) {
+        ssize_t n = write(s->fd, buf + done, rec_len - done);
+        if (n <= 0) {
+            // Leave no partial record behind
+            int saved = errno;
+            if (ftruncate(s->fd, s->size) < 0) {
+                log_warn("pack: Cannot truncate segment %u: %s", s->id, strerror(errno));
+            }
+            free(buf);
+            errno = saved;
+            return -1;
+        }
+        done += n;
+    }
+    free(buf);
+    *seg = s->id;
+    *off = s->size;
+    s->size += rec_len;
+    return 0;
+}
+
+// Read the record at off in segment s. Returns its length, 0 at the end of
+// the segment, or -1 if it is torn or corrupt. path and data are malloc'd.
+static inline long pack_read_record(const pack_seg_t *s, uint64_t off, pack_rec_t *rec, char **path, char **data) {
+    if (off == s->size) return 0;
+    if (s->size - off < sizeof(*rec) || pread(s->fd, rec, sizeof(*rec), off) != sizeof(*rec) ||
+        memcmp(rec->magic, PACK_MAGIC, 4) != 0 || rec->path_len == 0 || rec->path_len >= PACK_MAX_PATH ||
+        rec->data_len > PACK_MAX_FILE || s->size - off - sizeof(*rec) < (uint64_t)rec->path_len + rec->data_len) {
+        return -1;
+    }
+    *path = malloc(rec->path_len + 1);
+    *data = malloc(rec->data_len ? rec->data_len : 1);
+    if (!*path || !*data ||
+        pread(s->fd, *path, rec->path_len, off + sizeof(*rec)) != rec->path_len ||
+        pread(s->fd, *data, rec->data_len, off + sizeof(*rec) + rec->path_len) != rec->data_len ||
+        pack_check(rec, *path, *data) != rec->check) {
+        free(*path);
+        free(*data);
+        return -1;
+    }
+    (*path)[rec->path_len] = '\0';
+    return sizeof(*rec) + rec->path_len + rec->data_len;
+}
+
+// Apply the records of a segment to the index, cutting off a torn tail
+static inline void pack_replay(pack_t *p, pack_seg_t *s) {
+    uint64_t off = 0;
+    while (1) {
+        pack_rec_t rec;
+        char *path, *data;
+        long n = pack_read_record(s, off, &rec, &path, &data);
+        if (n == 0) break;
+        if (n < 0) {
+            log_warn("pack: Truncating segment %u at %llu of %llu bytes", s->id,
+                    (unsigned long long)off, (unsigned long long)s->size);
+            if (ftruncate(s->fd, off) == 0) {
+                s->size = off;
+            }
+            break;
+        }
+        if (rec.flags & PACK_TOMBSTONE) {
+            pack_index_del(p, path);
+        } else {
+            pack_index_set(p, path, s->id, off, &rec);
+        }
+        free(path);
+        free(data);
+        off += n;
+    }
+}
+
+// Copy the live records of the sealed segment at slot i to the current
+// segment and delete it. A tombstone is kept while an older segment may
+// still hold the record it cancels, unless the path has been written since.
+static inline int pack_compact(pack_t *p, int i) {
+    uint32_t id = p->segs[i].id;
+    uint64_t off = 0, size = p->segs[i].size, live = p->segs[i].live;
+    while (1) {
+        pack_rec_t rec;
+        char *path, *data;
+        long n = pack_read_record(&p->segs[i], off, &rec, &path, &data);
+        if (n <= 0) {
+            if (n < 0) {
+                log_warn("pack: Segment %u is corrupt at %llu, not compacting", id,
+                        (unsigned long long)off);
+                return -1;
+            }
+            break;
+        }
+        pack_entry_t *e = pack_lookup(p, path);
+        uint32_t seg;
+        uint64_t at;
+        int status = 0;
+        if (!(rec.flags & PACK_TOMBSTONE) && e && e->seg == id && e->off == off) {
+            status = pack_append(p, path, data, rec.data_len, rec.flags, rec.mtime, &seg, &at);
+            if (status == 0) {
+                status = pack_index_set(p, path, seg, at, &rec);
+            }
+        } else if ((rec.flags & PACK_TOMBSTONE) && !e && i > 0) {
+            status = pack_append(p, path, data, 0, rec.flags, rec.mtime, &seg, &at);
+        }
+        free(path);
+        free(data);
+        if (status < 0) {
+            log_warn("pack: Compacting segment %u failed: %s", id, strerror(errno));
+            return -1;
+        }
+        off += n;
+    }
+
+    pack_seg_t *s = pack_seg(p, id);
+    char path[400];
+    snprintf(path, sizeof(path), "%s/seg-%06u", p->dir, id);
+    unlink(path);
+    close(s->fd);
+    int slot = s - p->segs;
+    memmove(&p->segs[slot], &p->segs[slot + 1], (p->nsegs - slot - 1) * sizeof(pack_seg_t));
+    p->nsegs--;
+    p->compactions++;
+    p->reclaimed += size - live;
+    return 0;
+}
+
+// Compaction thread: rewrite sealed segments less than half live
+static void *pack_compactor(void *arg) {
+    pack_t *p = arg;
+    while (1) {
+        sleep(PACK_COMPACT_INTERVAL);
+        pthread_mutex_lock(&p->lock);
+        int compacted = 0;
+        for (int i = 0; i < p->nsegs - 1; ) {
+            if (p->segs[i].live * 2 < p->segs[i].size && pack_compact(p, i) == 0) {
+                compacted++;
+                continue;
+            }
+            i++;
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (compacted) {
+            log_info("pack: Compacted %d segments", compacted);
+        }
+    }
+    return NULL;
+}
+
+static inline int pack_cmp_id(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Open the segments of a server whose files live under base, rebuild the
+// index from them and start the compactor
+static inline int pack_open(pack_t *p, const char *base) {
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    p->next_id = 1;
+    snprintf(p->base, sizeof(p->base), "%s", base);
+    snprintf(p->dir, sizeof(p->dir), "%s/%s", base, PACK_DIR);
+    if (mkdir(p->dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    DIR *d = opendir(p->dir);
+    if (!d) return -1;
+    uint32_t ids[PACK_MAX_SEGMENTS];
+    int n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && n < PACK_MAX_SEGMENTS) {
+        unsigned id;
+        char extra;
+        if (sscanf(entry->d_name, "seg-%u%c", &id, &extra) == 1 && id > 0) {
+            ids[n++] = id;
+        }
+    }
+    closedir(d);
+    qsort(ids, n, sizeof(uint32_t), pack_cmp_id);
+    for (int i = 0; i < n; i++) {
+        if (pack_open_segment(p, ids[i], 0) < 0) {
+            return -1;
+        }
+        pack_replay(p, &p->segs[p->nsegs - 1]);
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, pack_compactor, p) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    p->enabled = 1;
+    return 0;
+}
+
+// Packed files
+
+// Append a small file. Fails with EINVAL for files that belong in the tree.
+static inline int pack_put(pack_t *p, const char *path, const char *data, size_t len) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || len > PACK_MAX_FILE || pack_rel(p, path, rel, sizeof(rel)) < 0 || !rel[0]) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&p->lock);
+    pack_rec_t rec = { .path_len = strlen(rel), .data_len = len, .mtime = time(NULL) };
+    uint32_t seg;
+    uint64_t off;
+    int status = pack_append(p, rel, data, len, 0, rec.mtime, &seg, &off);
+    if (status == 0) {
+        status = pack_index_set(p, rel, seg, off, &rec);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return status;
+}
+
+// Read a packed file into buf, which holds cap bytes. Returns its length,
+// or -1 with errno ENOENT if path is not packed (EFBIG if it does not fit).
+static inline long pack_get(pack_t *p, const char *path, char *buf, size_t cap) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || pack_rel(p, path, rel, sizeof(rel)) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    pthread_mutex_lock(&p->lock);
+    pack_entry_t *e = pack_lookup(p, rel);
+    long len = -1;
+    if (!e) {
+        errno = ENOENT;
+    } else if (e->data_len > cap) {
+        errno = EFBIG;
+    } else {
+        pack_seg_t *s = pack_seg(p, e->seg);
+        uint64_t at = e->off + sizeof(pack_rec_t) + strlen(e->path);
+        if (s && pread(s->fd, buf, e->data_len, at) == e->data_len) {
+            len = e->data_len;
+        } else {
+            errno = EIO;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return len;
+}
+
+// Send bytes [off, off + len) of a packed file to sock, with their
+// checksum in *crc as for cas_sendfile. The bytes are read under the lock
+// and sent after it is released, so a slow reader holds up no one else.
+// Returns 1 once sent, 0 if path is not packed, or -1.
+static inline int pack_send(pack_t *p, const char *path, int sock, uint64_t off, uint64_t len, uint32_t *crc) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || pack_rel(p, path, rel, sizeof(rel)) < 0) {
+        return 0;
+    }
+    char buf[PACK_MAX_FILE];
+    pthread_mutex_lock(&p->lock);
+    pack_entry_t *e = pack_lookup(p, rel);
+    int status = 0;
+    if (e) {
+        pack_seg_t *s = pack_seg(p, e->seg);
+        uint64_t at = e->off + sizeof(pack_rec_t) + strlen(e->path) + off;
+        if (off + len > e->data_len || !s) {
+            errno = EINVAL;
+            status = -1;
+        } else if (pread(s->fd, buf, len, at) != (ssize_t)len) {
+            errno = EIO;
+            status = -1;
+        } else {
+            status = 1;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    for (size_t sent = 0; status == 1 && sent < len;) {
+        ssize_t n = send(sock, buf + sent, len - sent, 0);
+        if (n < 0) {
+            status = -1;
+        } else {
+            sent += n;
+        }
+    }
+    if (status == 1 && crc) {
+        *crc = crc32c(*crc, buf, len);
+    }
+    return status;
+}
+
+// Remove a packed file. Returns -1 with errno ENOENT if path is not packed.
+static inline int pack_del(pack_t *p, const char *path) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || pack_rel(p, path, rel, sizeof(rel)) < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    pthread_mutex_lock(&p->lock);
+    int status = -1;
+    uint32_t seg;
+    uint64_t off;
+    if (!pack_lookup(p, rel)) {
+        errno = ENOENT;
+    } else if ((status = pack_append(p, rel, "", 0, PACK_TOMBSTONE, time(NULL), &seg, &off)) == 0) {
+        pack_index_del(p, rel);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return status;
+}
+
+// Size and modification time of a packed file. Returns 1 if path is packed.
+static inline int pack_stat(pack_t *p, const char *path, long *size, time_t *mtime) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || pack_rel(p, path, rel, sizeof(rel)) < 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&p->lock);
+    pack_entry_t *e = pack_lookup(p, rel);
+    if (e) {
+        if (size) *size = e->data_len;
+        if (mtime) *mtime = e->mtime;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return e != NULL;
+}
+
+// Whether a packed path lies under the directory with relative path dir
+static inline int pack_under(const char *path, const char *dir) {
+    size_t n = strlen(dir);
+    return n == 0 || (strncmp(path, dir, n) == 0 && path[n] == '/');
+}
+
+// Find a packed file named name under dir, like find_file, leaving its
+// path relative to the base directory in found. Returns 1 if found.
+static inline int pack_find(pack_t *p, const char *dir, const char *name, char *found, size_t size) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || pack_rel(p, dir, rel, sizeof(rel)) < 0) {
+        return 0;
+    }
+    const char *slash = strrchr(name, '/');
+    const char *want = slash ? slash + 1 : name;
+    int status = 0;
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 0; i < p->cap && !status; i++) {
+        for (pack_entry_t *e = p->buckets[i]; e; e = e->next) {
+            const char *base = strrchr(e->path, '/');
+            base = base ? base + 1 : e->path;
+            if (strcmp(base, want) == 0 && pack_under(e->path, rel) && strlen(e->path) < size) {
+                strcpy(found, e->path);
+                status = 1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return status;
+}
+
+// Add the full paths of packed files with extension ext under dir to
+// files, like collect_files_recursive
+static inline void pack_collect(pack_t *p, const char *dir, const char *ext, char files[][512], int *count, int max) {
+    char rel[PACK_MAX_PATH];
+    if (!p->enabled || pack_rel(p, dir, rel, sizeof(rel)) < 0) {
+        return;
+    }
+    size_t elen = strlen(ext);
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 0; i < p->cap && *count < max; i++) {
+        for (pack_entry_t *e = p->buckets[i]; e && *count < max; e = e->next) {
+            size_t plen = strlen(e->path);
+            if (plen > elen && strcasecmp(e->path + plen - elen, ext) == 0 && pack_under(e->path, rel)) {
+                snprintf(files[(*count)++], 512, "%s/%s", p->base, e->path);
+            }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// One-line summary of the packed files
+static inline void pack_stats(pack_t *p, const char *label, char *out, size_t size) {
+    if (!p->enabled) {
+        snprintf(out, size, "%s: packing disabled\n", label);
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    unsigned long long total = 0, live = 0;
+    for (int i = 0; i < p->nsegs; i++) {
+        total += p->segs[i].size;
+        live += p->segs[i].live;
+    }
+    snprintf(out, size, "%s: %zu files packed in %d segments, %llu of %llu bytes live, "
+             "%llu compactions reclaimed %llu bytes\n",
+             label, p->count, p->nsegs, live, total, p->compactions, p->reclaimed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Storage layer: files of up to PACK_MAX_FILE bytes are packed when
+// packing is enabled, everything else goes through the chunk store (which
+// writes plain files when it is disabled). Packed copies take precedence.
+
+static inline int store_save(cas_t *c, pack_t *p, const char *path, const char *data, size_t len) {
+    if (p->enabled && len <= PACK_MAX_FILE && pack_put(p, path, data, len) == 0) {
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            cas_remove(c, path);
+        }
+        return 0;
+    }
+    if (cas_save(c, path, data, len) != 0) {
+        return -1;
+    }
+    if (p->enabled) {
+        pack_del(p, path);
+    }
+    return 0;
+}
+
+// Store a complete temporary file, such as an assembled multipart upload,
+// as path. Files kept plain are linked in place without copying them;
+// packed and chunked ones are read back through a mapping. The temporary
+// file is consumed either way.
+static inline int store_save_tmp(cas_t *c, pack_t *p, cas_tmp_t *t, const char *path, size_t len) {
+    if (!c->enabled && !(p->enabled && len <= PACK_MAX_FILE)) {
+        if (cas_tmp_publish(t, path) != 0) {
+            return -1;
+        }
+        if (p->enabled) {
+            pack_del(p, path);
+        }
+        return 0;
+    }
+    void *map = len ? mmap(NULL, len, PROT_READ, MAP_SHARED, t->fd, 0) : NULL;
+    if (map == MAP_FAILED) {
+        cas_tmp_discard(t);
+        return -1;
+    }
+    int status = store_save(c, p, path, map ? map : "", len);
+    int saved = errno;
+    if (map) munmap(map, len);
+    cas_tmp_discard(t);
+    errno = saved;
+    return status;
+}
+
+static inline long store_load(cas_t *c, pack_t *p, const char *path, char *buf, size_t cap) {
+    long len = pack_get(p, path, buf, cap);
+    if (len >= 0 || errno != ENOENT) {
+        return len;
+    }
+    return cas_load(c, path, buf, cap);
+}
+
+// Send bytes [off, off + len) of the file at path to sock with sendfile,
+// leaving their CRC32C in *crc. When that is the whole file and its tag is
+// current, the checksum taken when it was stored is used, so damage since
+// then shows up at the other end; otherwise it is computed as it is sent.
+static inline int store_send(cas_t *c, pack_t *p, const char *path, int sock, uint64_t off, uint64_t len,
+                             uint32_t *crc) {
+    *crc = 0;
+    int status = pack_send(p, path, sock, off, len, crc);
+    if (status != 0) {
+        return status < 0 ? -1 : 0;
+    }
+    uint64_t tagged;
+    if (off == 0 && cas_crc_get(path, crc, &tagged) && tagged == len) {
+        return cas_send_range(c, path, sock, off, len, NULL);
+    }
+    *crc = 0;
+    return cas_send_range(c, path, sock, off, len, crc);
+}
+
+// BLAKE2b and CRC32C of the file at path as for cas_checksum; returns its
+// length or -1
+static inline long long store_checksum(cas_t *c, pack_t *p, const char *path, uint8_t out[CDC_HASH_LEN],
+                                       uint32_t *crc) {
+    char buf[PACK_MAX_FILE];
+    long len = pack_get(p, path, buf, sizeof(buf));
+    if (len >= 0) {
+        if (out) cdc_hash(buf, len, out);
+        if (crc) *crc = crc32c(0, buf, len);
+        return len;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+    return cas_checksum(c, path, out, crc);
+}
+
+static inline int store_remove(cas_t *c, pack_t *p, const char *path) {
+    if (pack_del(p, path) == 0) {
+        return 0;
+    }
+    return cas_remove(c, path);
+}
+
+// Size of the file at path, or -1 if there is none; *mtime if given
+static inline long store_stat(pack_t *p, const char *path, time_t *mtime) {
+    long size;
+    if (pack_stat(p, path, &size, mtime)) {
+        return size;
+    }
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    if (mtime) *mtime = st.st_mtime;
+    return cas_file_size(path);
+}
+
+static inline int store_exists(pack_t *p, const char *path) {
+    return pack_stat(p, path, NULL, NULL) || access(path, F_OK) == 0;
+}
+
+#endif
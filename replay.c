@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dfs.h"
+#include "hist.h"
+#include "capture.h"
+
+// Re-drives a capture taken with S1's -r against a cluster and compares
+// the latencies with the capture's, or with an earlier replay's (-b).
+//
+// Commands are sent at their captured times, divided by the -s speed-up,
+// and each one's latency is counted from when it was due, as loadgen
+// does. Uploads send synthetic content of the captured size. Files the
+// capture reads or removes without having uploaded them first are
+// uploaded before the clock starts, sized from the captured downloads,
+// so a replay against an empty cluster sees the same hits and misses.
+// A command on a file waits for the upload or removal of that file
+// before it in the capture, even when that one is slow, so it finds the
+// file in the state it was captured in; the wait counts in its latency.
+// The content and the order of dispatch depend only on the capture and
+// -S, so two runs of the same capture send the same bytes.
+
+#define MAX_UPLOAD 5242879          // S1 takes uploads below 5MB
+#define SEED_SIZE 4096              // files only removed in the capture
+#define QUEUE_MAX 65536
+
+static const char *cmd_names[] = { "downlf", "uploadf", "dispfnames", "removef", "downltar" };
+#define NCMDS (int)(sizeof(cmd_names) / sizeof(cmd_names[0]))
+
+static dfs_t dfs;
+static char *payload;
+static capture_rec_t *recs, *runs;
+static int nrecs;
+static int *after;                  // the command each one waits for, or -1
+static char *done;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static int queue[QUEUE_MAX];
+static int qhead, qcount, generating = 1;
+static double due_at[QUEUE_MAX];
+static long long dropped;
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t qspace = PTHREAD_COND_INITIALIZER;
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmd_index(const char *cmd) {
+    for (int i = 0; i < NCMDS; i++) {
+        if (strcmp(cmd, cmd_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Read the commands of a capture. Returns how many, or -1.
+static int load_capture(const char *path, capture_rec_t **out) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    int n = 0, cap = 0;
+    capture_rec_t *r = NULL;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            capture_rec_t *grown = realloc(r, cap * sizeof(*r));
+            if (!grown) {
+                free(r);
+                fclose(fp);
+                return -1;
+            }
+            r = grown;
+        }
+        if (capture_parse(line, &r[n]) == 0 && cmd_index(r[n].cmd) >= 0) {
+            n++;
+        }
+    }
+    fclose(fp);
+    *out = r;
+    return n;
+}
+
+// Files seen so far: path hash -> last uploadf or removef of the file,
+// -1 if there was none
+static unsigned long long *path_keys;
+static int *path_last;
+static size_t path_cap;
+
+static unsigned long long path_hash(const char *dir, const char *name) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (const char *s = dir; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    if (dir[0] && dir[strlen(dir) - 1] != '/') h = (h ^ '/') * 1099511628211ULL;
+    for (const char *s = name; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    return h | 1;
+}
+
+// The entry of file h, added with last -1 if new (*added set)
+static int *path_slot(unsigned long long h, int *added) {
+    size_t i = h & (path_cap - 1);
+    while (path_keys[i] && path_keys[i] != h) i = (i + 1) & (path_cap - 1);
+    *added = !path_keys[i];
+    if (*added) {
+        path_keys[i] = h;
+        path_last[i] = -1;
+    }
+    return &path_last[i];
+}
+
+// Work out what each command waits for, and upload the files the capture
+// uses before uploading them. Returns the number uploaded, or -1.
+static int prepare(void) {
+    for (path_cap = 1024; path_cap < (size_t)nrecs * 2; path_cap *= 2) {
+    }
+    path_keys = calloc(path_cap, sizeof(*path_keys));
+    path_last = calloc(path_cap, sizeof(*path_last));
+    after = malloc(nrecs * sizeof(*after));
+    done = calloc(nrecs, 1);
+    if (!path_keys || !path_last || !after || !done) {
+        fprintf(stderr, "replay: out of memory\n");
+        return -1;
+    }
+    int seeded = 0;
+    for (int i = 0; i < nrecs; i++) {
+        const capture_rec_t *r = &recs[i];
+        char a[CAPTURE_ARGS], b[CAPTURE_ARGS] = "";
+        int upload = strcmp(r->cmd, "uploadf") == 0, remove = strcmp(r->cmd, "removef") == 0;
+        after[i] = -1;
+        if ((!upload && !remove && strcmp(r->cmd, "downlf") != 0) || sscanf(r->args, "%319s %319s", a, b) < 1) {
+            continue;
+        }
+        // Uploads name the file and its directory; the others give
+        // "~/S1/dir/name", or a bare name that S1 looks up anywhere
+        char dir[CAPTURE_ARGS] = "~/S1/", *name = a;
+        char *slash = strrchr(a, '/');
+        if (upload) {
+            snprintf(dir, sizeof(dir), "%s", b);
+        } else if (slash) {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash + 1 - a), a);
+            name = slash + 1;
+        }
+        int added;
+        int *last = path_slot(path_hash(dir, name), &added);
+        after[i] = *last;
+        if (upload || remove) {
+            *last = i;
+        }
+        if (!added || upload || r->failed) {
+            continue;
+        }
+        size_t size = strcmp(r->cmd, "downlf") == 0 && r->bytes_out > 0 ? (size_t)r->bytes_out : SEED_SIZE;
+        if (size > MAX_UPLOAD) size = MAX_UPLOAD;
+        memcpy(payload, &i, sizeof(i));
+        if (dfs_upload(&dfs, NULL, name, dir, payload, size) < 0) {
+            fprintf(stderr, "replay: cannot upload %s%s before the replay: %s\n", dir, name, dfs_reply);
+            return -1;
+        }
+        seeded++;
+    }
+    return seeded;
+}
+
+// Send capture line i, filling in runs[i]
+static void run_rec(int i, double due) {
+    if (after[i] >= 0) {
+        pthread_mutex_lock(&done_lock);
+        while (!done[after[i]]) {
+            pthread_cond_wait(&done_cond, &done_lock);
+        }
+        pthread_mutex_unlock(&done_lock);
+    }
+    const capture_rec_t *r = &recs[i];
+    capture_rec_t *out = &runs[i];
+    static __thread char *own;
+    char cmd[CAPTURE_ARGS + 32], rid[24];
+    *out = *r;
+    snprintf(cmd, sizeof(cmd), "%s %s", r->cmd, r->args);
+    snprintf(rid, sizeof(rid), "rp%d", i);
+
+    long got;
+    if (strcmp(r->cmd, "uploadf") == 0) {
+        size_t size = r->bytes_in < 0 ? 0 : r->bytes_in > MAX_UPLOAD ? MAX_UPLOAD : (size_t)r->bytes_in;
+        // Each upload differs in its first bytes, so a deduplicating store
+        // still has to take it in
+        if (!own && (own = malloc(MAX_UPLOAD))) {
+            memcpy(own, payload, MAX_UPLOAD);
+        }
+        if (!own) {
+            snprintf(dfs_reply, DFS_REPLY, "out of memory");
+            got = -1;
+        } else {
+            memcpy(own, &i, size < sizeof(i) ? size : sizeof(i));
+            got = dfs_call(&dfs, rid, cmd, own, size, NULL, 0);
+        }
+        out->failed = got < 0 || strncmp(dfs_reply, "File saved", 10) != 0;
+        out->bytes_in = size;
+    } else {
+        got = dfs_call(&dfs, rid, cmd, NULL, 0, NULL, 0);
+        out->failed = got < 0 || strncmp(dfs_reply, "ERROR", 5) == 0;
+        out->bytes_in = 0;
+    }
+    out->bytes_out = got < 0 ? 0 : got;
+    out->dur_us = (long long)((now_sec() - due) * 1e6);
+
+    pthread_mutex_lock(&done_lock);
+    done[i] = 1;
+    pthread_cond_broadcast(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&qlock);
+        while (qcount == 0 && generating) {
+            pthread_cond_wait(&qcond, &qlock);
+        }
+        if (qcount == 0) {
+            pthread_mutex_unlock(&qlock);
+            return NULL;
+        }
+        int i = queue[qhead];
+        double due = due_at[qhead];
+        qhead = (qhead + 1) % QUEUE_MAX;
+        qcount--;
+        pthread_cond_signal(&qspace);
+        pthread_mutex_unlock(&qlock);
+        run_rec(i, due);
+    }
+}
+
+static void fill_hists(const capture_rec_t *r, int n, hist_t *h) {
+    memset(h, 0, NCMDS * sizeof(*h));
+    for (int i = 0; i < n; i++) {
+        int c = cmd_index(r[i].cmd);
+        if (c >= 0 && r[i].dur_us >= 0) hist_record(&h[c], r[i].dur_us);
+    }
+}
+
+static void change(unsigned long long was, unsigned long long now, char *buf, size_t size) {
+    if (was > 0) {
+        snprintf(buf, size, "%+.0f%%", ((double)now - was) / was * 100);
+    } else {
+        snprintf(buf, size, "-");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    int conns = 16;
+    unsigned long long seed = 1;
+    const char *base_path = NULL, *out_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:b:o:S:")) != -1) {
+        switch (opt) {
+        case 's': speed = atof(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 'b': base_path = optarg; break;
+        case 'o': out_path = optarg; break;
+        case 'S': seed = strtoull(optarg, NULL, 10); break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 2 || speed < 0 || conns <= 0) {
+usage:
+        fprintf(stderr, "Usage: %s [-s speedup] [-c connections] [-b baseline_capture] [-o run_capture]\n"
+                        "       [-S seed] <capture_file> [host:]<S1_port>\n"
+                        "       -s 1 replays in real time, -s 10 ten times faster, -s 0 as fast as possible\n",
+                argv[0]);
+        exit(1);
+    }
+    const char *capture_path = argv[optind];
+    nrecs = load_capture(capture_path, &recs);
+    if (nrecs < 0) {
+        fprintf(stderr, "replay: cannot read %s: %s\n", capture_path, strerror(errno));
+        exit(1);
+    }
+    if (nrecs == 0) {
+        fprintf(stderr, "replay: no commands in %s\n", capture_path);
+        exit(1);
+    }
+    capture_rec_t *base = recs;
+    int nbase = nrecs;
+    if (base_path && (nbase = load_capture(base_path, &base)) < 0) {
+        fprintf(stderr, "replay: cannot read %s: %s\n", base_path, strerror(errno));
+        exit(1);
+    }
+    FILE *out = NULL;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        fprintf(stderr, "replay: cannot write %s: %s\n", out_path, strerror(errno));
+        exit(1);
+    }
+    if (dfs_open(&dfs, argv[optind + 1]) < 0) {
+        fprintf(stderr, "replay: cannot resolve %s\n", argv[optind + 1]);
+        exit(1);
+    }
+
+    payload = malloc(MAX_UPLOAD);
+    runs = calloc(nrecs, sizeof(*runs));
+    if (!payload || !runs) {
+        fprintf(stderr, "replay: out of memory\n");
+        exit(1);
+    }
+    unsigned long long rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+    for (size_t i = 0; i < MAX_UPLOAD; i++) {
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        payload[i] = (rng * 2685821657736338717ULL) >> 56;
+    }
+
+    int seeded = prepare();
+    if (seeded < 0) {
+        exit(1);
+    }
+    long long span_us = recs[nrecs - 1].at_us - recs[0].at_us;
+    printf("%d commands over %.1f s captured, %d files uploaded first\n", nrecs, span_us / 1e6, seeded);
+    if (speed > 0) {
+        printf("Replaying at %gx, %.1f s\n", speed, span_us / 1e6 / speed);
+    } else {
+        printf("Replaying as fast as %d connections allow\n", conns);
+    }
+
+    pthread_t *tids = malloc(conns * sizeof(pthread_t));
+    for (int i = 0; i < conns; i++) {
+        if (pthread_create(&tids[i], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "replay: cannot start connection threads\n");
+            exit(1);
+        }
+    }
+    double start = now_sec();
+    for (int i = 0; i < nrecs; i++) {
+        double due = speed > 0 ? start + (recs[i].at_us - recs[0].at_us) / 1e6 / speed : now_sec();
+        double wait = due - now_sec();
+        if (wait > 0) {
+            struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+            nanosleep(&ts, NULL);
+        }
+        pthread_mutex_lock(&qlock);
+        // Without pacing the queue is the only thing holding commands back
+        while (speed == 0 && qcount >= conns) {
+            pthread_cond_wait(&qspace, &qlock);
+        }
+        if (qcount == QUEUE_MAX) {
+            dropped++;
+            runs[i] = recs[i];
+            runs[i].failed = 1;
+            runs[i].dur_us = -1;        // not sent, left out of the latencies
+            pthread_mutex_lock(&done_lock);
+            done[i] = 1;
+            pthread_cond_broadcast(&done_cond);
+            pthread_mutex_unlock(&done_lock);
+        } else {
+            int slot = (qhead + qcount) % QUEUE_MAX;
+            queue[slot] = i;
+            due_at[slot] = speed > 0 ? due : now_sec();
+            qcount++;
+            pthread_cond_signal(&qcond);
+        }
+        pthread_mutex_unlock(&qlock);
+    }
+    pthread_mutex_lock(&qlock);
+    generating = 0;
+    pthread_cond_broadcast(&qcond);
+    pthread_mutex_unlock(&qlock);
+    for (int i = 0; i < conns; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double secs = now_sec() - start;
+
+    if (out) {
+        fprintf(out, "# replay of %s at %gx\n# at_us command dur_us outcome bytes_in bytes_out arguments\n",
+                capture_path, speed);
+        for (int i = 0; i < nrecs; i++) {
+            capture_write(out, &runs[i]);
+        }
+        fclose(out);
+    }
+
+    // Outcomes are compared line by line when the baseline is of the same
+    // capture
+    int mismatched = 0;
+    if (nbase == nrecs) {
+        for (int i = 0; i < nrecs; i++) {
+            mismatched += base[i].failed != runs[i].failed;
+        }
+    }
+    hist_t hb[NCMDS], hr[NCMDS];
+    fill_hists(base, nbase, hb);
+    fill_hists(runs, nrecs, hr);
+
+    printf("Replayed in %.1f s (%.1f commands/s), %lld dropped, %d outcomes differ from %s\n", secs, nrecs / secs,
+           dropped, mismatched, base_path ? base_path : "the capture");
+    printf("%-10s %7s  %9s %9s %9s  %9s %9s %9s  %7s %7s\n", "command", "count", "was p50", "p99", "p99.9",
+           "now p50", "p99", "p99.9", "p50", "p99");
+    for (int c = 0; c < NCMDS; c++) {
+        if (hr[c].count == 0 && hb[c].count == 0) continue;
+        const double q[3] = { 0.5, 0.99, 0.999 };
+        char was[3][16], now[3][16], d50[16], d99[16];
+        for (int k = 0; k < 3; k++) {
+            hist_fmt(hist_percentile(&hb[c], q[k]), was[k], 16);
+            hist_fmt(hist_percentile(&hr[c], q[k]), now[k], 16);
+        }
+        change(hist_percentile(&hb[c], 0.5), hist_percentile(&hr[c], 0.5), d50, sizeof(d50));
+        change(hist_percentile(&hb[c], 0.99), hist_percentile(&hr[c], 0.99), d99, sizeof(d99));
+        printf("%-10s %7llu  %9s %9s %9s  %9s %9s %9s  %7s %7s\n", cmd_names[c], hr[c].count, was[0], was[1],
+               was[2], now[0], now[1], now[2], d50, d99);
+    }
+    return mismatched > 0 || dropped > 0;
+}
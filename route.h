@@ -0,0 +1,482 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+// Routing table used by S1 to decide which server stores a file.
+//
+// Routes are loaded from a config file, one route per line:
+//
+//     <.ext> [prefix=<path>] [replicas=<R>] [quorum=<W>] [ec=<K>+<M>] [ec_min=<bytes>]
+//            [ec_quorum=<W>] <backend> [<backend> ...]
+//
+// where <backend> is either "local" (S1 stores the file itself) or
+// "host:port" of a storage server. Blank lines and text after '#' are
+// ignored. A route with a prefix only matches paths under that prefix;
+// the route without a prefix is the default for its extension.
+//
+// Extensions are looked up through an open-addressing hash table built at
+// load time, so dispatch cost does not grow with the number of routes.
+//
+// When a route lists several backends, its files are sharded across them
+// with consistent hashing: each backend owns ROUTE_VNODES points on a hash
+// ring and a file belongs to the first point at or after the hash of its
+// name. Points are derived from backend names, so adding a backend only
+// moves the files that land on its points.
+//
+// With replicas=R a file is stored on the first R distinct backends found
+// walking the ring from its point, and an upload succeeds once quorum=W of
+// them (default R) have acknowledged it.
+//
+// With ec=K+M, uploads of at least ec_min bytes (default 1MB) are erasure
+// coded instead: split into K data and M parity stripes stored on the first
+// K+M distinct backends of the walk, acknowledged once ec_quorum of them
+// (default K+M, at least K) hold their stripe. Smaller files are replicated.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define ROUTE_MAX_BACKENDS 32
+#define ROUTE_MAX_ROUTES 64
+#define ROUTE_MAX_TARGETS 16
+#define ROUTE_SLOTS 128 // power of two, at least twice ROUTE_MAX_ROUTES
+#define ROUTE_EXT_LEN 16
+#define ROUTE_PREFIX_LEN 256
+#define ROUTE_VNODES 64 // ring points per backend
+
+typedef struct {
+    char name[80];              // "local" or "host:port" as written in the config
+    int local;                  // 1 if S1 itself stores the files
+    struct sockaddr_in addr;    // resolved once at load time
+} backend_t;
+
+typedef struct {
+    uint32_t hash;
+    int backend;                // index into route_table_t.backends
+} vnode_t;
+
+typedef struct {
+    char ext[ROUTE_EXT_LEN];
+    char prefix[ROUTE_PREFIX_LEN];
+    size_t prefix_len;
+    int ntargets;
+    int targets[ROUTE_MAX_TARGETS]; // indices into route_table_t.backends
+    int replicas;               // copies of each file
+    int write_quorum;           // acknowledgements needed for an upload
+    int ec_data;                // K data stripes, 0 if not erasure coded
+    int ec_parity;              // M parity stripes
+    size_t ec_min;              // smallest upload that is erasure coded
+    int ec_quorum;              // stripes that must be stored
+    int next;                   // next route for the same ext, longest prefix first
+    int nvnodes;
+    vnode_t ring[ROUTE_MAX_TARGETS * ROUTE_VNODES]; // sorted by hash
+} route_t;
+
+typedef struct {
+    backend_t backends[ROUTE_MAX_BACKENDS];
+    int nbackends;
+    route_t routes[ROUTE_MAX_ROUTES];
+    int nroutes;
+    int slots[ROUTE_SLOTS];     // ext hash -> first route index, -1 if empty
+} route_table_t;
+
+// FNV-1a hash of a NUL-terminated string
+static uint32_t route_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Hash used for ring placement: 64-bit FNV-1a with a splitmix64 finalizer,
+// which spreads similar names far better than plain FNV
+static uint32_t route_key_hash(const char *s, size_t n) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+// Files are placed by name: downlf and removef locate files by their
+// basename anywhere under a server's directory, so the basename is the
+// part of the path every command carries
+static uint32_t route_path_hash(const char *path) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    return route_key_hash(name, strlen(name));
+}
+
+static int route_vnode_cmp(const void *a, const void *b) {
+    uint32_t x = ((const vnode_t *)a)->hash, y = ((const vnode_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static void route_init(route_table_t *t) {
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i < ROUTE_SLOTS; i++) {
+        t->slots[i] = -1;
+    }
+}
+
+// Strip the forms clients use to name a storage root ("~/S2/", "/", "./")
+// so prefixes match the path relative to the server's base directory
+static const char *route_norm_path(const char *path) {
+    if (!path) return "";
+    if (path[0] == '~' && path[1] == '/') {
+        path += 2;
+        if (path[0] == 'S' && path[1] >= '0' && path[1] <= '9' && (path[2] == '/' || path[2] == '\0')) {
+            path += path[2] ? 3 : 2;
+        }
+    }
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) {
+        path += path[0] == '/' ? 1 : 2;
+    }
+    return path;
+}
+
+// Find or add a backend by its config spec, returning its index or -1
+static int route_add_backend(route_table_t *t, const char *spec) {
+    for (int i = 0; i < t->nbackends; i++) {
+        if (strcmp(t->backends[i].name, spec) == 0) {
+            return i;
+        }
+    }
+    if (t->nbackends >= ROUTE_MAX_BACKENDS || strlen(spec) >= sizeof(t->backends[0].name)) {
+        fprintf(stderr, "route: too many backends or name too long: %s\n", spec);
+        return -1;
+    }
+
+    backend_t *b = &t->backends[t->nbackends];
+    memset(b, 0, sizeof(*b));
+    snprintf(b->name, sizeof(b->name), "%s", spec);
+
+    if (strcmp(spec, "local") == 0) {
+        b->local = 1;
+        return t->nbackends++;
+    }
+
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host)) {
+        fprintf(stderr, "route: backend must be local or host:port: %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    int port = atoi(colon + 1);
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "route: invalid port in %s\n", spec);
+        return -1;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res) {
+        fprintf(stderr, "route: cannot resolve %s\n", host);
+        return -1;
+    }
+    b->addr = *(struct sockaddr_in *)res->ai_addr;
+    b->addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return t->nbackends++;
+}
+
+// Place ROUTE_VNODES points on the route's ring for each of its backends
+static void route_build_ring(const route_table_t *t, route_t *r) {
+    r->nvnodes = 0;
+    for (int i = 0; i < r->ntargets; i++) {
+        const backend_t *b = &t->backends[r->targets[i]];
+        for (int v = 0; v < ROUTE_VNODES; v++) {
+            char label[96];
+            int n = snprintf(label, sizeof(label), "%s#%d", b->name, v);
+            r->ring[r->nvnodes].hash = route_key_hash(label, n);
+            r->ring[r->nvnodes].backend = r->targets[i];
+            r->nvnodes++;
+        }
+    }
+    qsort(r->ring, r->nvnodes, sizeof(vnode_t), route_vnode_cmp);
+}
+
+// Add a route for ext (and optional prefix) served by the given backends,
+// keeping replicas copies of each file (0 means 1) and acknowledging
+// uploads after quorum of them (0 means all). Erasure coding is enabled
+// separately with route_set_ec.
+static int route_add(route_table_t *t, const char *ext, const char *prefix, char *const specs[], int nspecs,
+                     int replicas, int quorum) {
+    if (ext[0] != '.' || strlen(ext) >= ROUTE_EXT_LEN) {
+        fprintf(stderr, "route: invalid extension: %s\n", ext);
+        return -1;
+    }
+    if (nspecs <= 0 || nspecs > ROUTE_MAX_TARGETS) {
+        fprintf(stderr, "route: %s needs 1 to %d backends\n", ext, ROUTE_MAX_TARGETS);
+        return -1;
+    }
+    if (t->nroutes >= ROUTE_MAX_ROUTES) {
+        fprintf(stderr, "route: too many routes\n");
+        return -1;
+    }
+
+    route_t *r = &t->routes[t->nroutes];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->ext, sizeof(r->ext), "%s", ext);
+    snprintf(r->prefix, sizeof(r->prefix), "%s", route_norm_path(prefix));
+    r->prefix_len = strlen(r->prefix);
+    while (r->prefix_len > 0 && r->prefix[r->prefix_len - 1] == '/') {
+        r->prefix[--r->prefix_len] = '\0';
+    }
+    for (int i = 0; i < nspecs; i++) {
+        int idx = route_add_backend(t, specs[i]);
+        if (idx < 0) return -1;
+        for (int j = 0; j < r->ntargets; j++) {
+            if (r->targets[j] == idx) {
+                fprintf(stderr, "route: %s lists %s twice\n", ext, specs[i]);
+                return -1;
+            }
+        }
+        r->targets[r->ntargets++] = idx;
+    }
+
+    route_build_ring(t, r);
+
+    r->replicas = replicas > 0 ? replicas : 1;
+    r->write_quorum = quorum > 0 ? quorum : r->replicas;
+    if (r->replicas > r->ntargets || r->write_quorum > r->replicas) {
+        fprintf(stderr, "route: %s needs replicas <= backends and quorum <= replicas\n", ext);
+        return -1;
+    }
+
+    // Insert into the ext's chain keeping longer prefixes first
+    uint32_t mask = ROUTE_SLOTS - 1;
+    uint32_t slot = route_hash(ext) & mask;
+    while (t->slots[slot] >= 0 && strcmp(t->routes[t->slots[slot]].ext, ext) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    int *link = &t->slots[slot];
+    while (*link >= 0) {
+        route_t *cur = &t->routes[*link];
+        if (cur->prefix_len == r->prefix_len && strcmp(cur->prefix, r->prefix) == 0) {
+            fprintf(stderr, "route: duplicate route for %s prefix '%s'\n", ext, r->prefix);
+            return -1;
+        }
+        if (cur->prefix_len < r->prefix_len) break;
+        link = &cur->next;
+    }
+    r->next = *link;
+    *link = t->nroutes;
+    return t->nroutes++;
+}
+
+// Add a backend to an existing route, returning its backend index or -1.
+// Only the files whose ring points it takes over change owner.
+static int route_add_target(route_table_t *t, int route, const char *spec) {
+    route_t *r = &t->routes[route];
+    if (r->ntargets >= ROUTE_MAX_TARGETS) {
+        fprintf(stderr, "route: %s already has %d backends\n", r->ext, ROUTE_MAX_TARGETS);
+        return -1;
+    }
+    int idx = route_add_backend(t, spec);
+    if (idx < 0) return -1;
+    for (int i = 0; i < r->ntargets; i++) {
+        if (r->targets[i] == idx) {
+            fprintf(stderr, "route: %s already uses %s\n", r->ext, spec);
+            return -1;
+        }
+    }
+    r->targets[r->ntargets++] = idx;
+    route_build_ring(t, r);
+    return idx;
+}
+
+// Erasure code the route's uploads of at least min_size bytes into k data
+// and m parity stripes, requiring quorum stripe writes (0 means k + m)
+static int route_set_ec(route_table_t *t, int route, int k, int m, size_t min_size, int quorum) {
+    route_t *r = &t->routes[route];
+    if (k < 1 || m < 1 || k + m > r->ntargets || k + m > ROUTE_MAX_TARGETS) {
+        fprintf(stderr, "route: %s needs ec=K+M with K,M >= 1 and K+M <= backends\n", r->ext);
+        return -1;
+    }
+    if (quorum && (quorum < k || quorum > k + m)) {
+        fprintf(stderr, "route: %s needs K <= ec_quorum <= K+M\n", r->ext);
+        return -1;
+    }
+    r->ec_data = k;
+    r->ec_parity = m;
+    r->ec_min = min_size;
+    r->ec_quorum = quorum ? quorum : k + m;
+    return 0;
+}
+
+// Load routes from a config file, returning the number of routes or -1
+static int route_load(route_table_t *t, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "route: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char *tokens[ROUTE_MAX_TARGETS + 4];
+        int ntokens = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+            if (ntokens == ROUTE_MAX_TARGETS + 4) {
+                fprintf(stderr, "route: %s:%d: too many fields\n", path, lineno);
+                fclose(fp);
+                return -1;
+            }
+            tokens[ntokens++] = tok;
+        }
+        if (ntokens == 0) continue;
+
+        // Options come before the backends
+        const char *prefix = "";
+        int replicas = 0, quorum = 0;
+        int ec_k = 0, ec_m = 0, ec_quorum = 0;
+        size_t ec_min = 1024 * 1024;
+        int first = 1;
+        for (; first < ntokens && strchr(tokens[first], '='); first++) {
+            if (strncmp(tokens[first], "prefix=", 7) == 0) {
+                prefix = tokens[first] + 7;
+            } else if (strncmp(tokens[first], "replicas=", 9) == 0) {
+                replicas = atoi(tokens[first] + 9);
+            } else if (strncmp(tokens[first], "quorum=", 7) == 0) {
+                quorum = atoi(tokens[first] + 7);
+            } else if (strncmp(tokens[first], "ec=", 3) == 0) {
+                if (sscanf(tokens[first] + 3, "%d+%d", &ec_k, &ec_m) != 2) {
+                    fprintf(stderr, "route: %s:%d: ec must be K+M\n", path, lineno);
+                    fclose(fp);
+                    return -1;
+                }
+            } else if (strncmp(tokens[first], "ec_min=", 7) == 0) {
+                ec_min = strtoull(tokens[first] + 7, NULL, 10);
+            } else if (strncmp(tokens[first], "ec_quorum=", 10) == 0) {
+                ec_quorum = atoi(tokens[first] + 10);
+            } else {
+                fprintf(stderr, "route: %s:%d: unknown option %s\n", path, lineno, tokens[first]);
+                fclose(fp);
+                return -1;
+            }
+        }
+        int route = route_add(t, tokens[0], prefix, &tokens[first], ntokens - first, replicas, quorum);
+        if (route < 0 || (ec_k && route_set_ec(t, route, ec_k, ec_m, ec_min, ec_quorum) < 0)) {
+            fprintf(stderr, "route: %s:%d: invalid route\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return t->nroutes;
+}
+
+// Return the first route for ext, or NULL if the type is not routed
+static const route_t *route_first(const route_table_t *t, const char *ext) {
+    if (!ext) return NULL;
+    uint32_t mask = ROUTE_SLOTS - 1;
+    uint32_t slot = route_hash(ext) & mask;
+    while (t->slots[slot] >= 0) {
+        const route_t *r = &t->routes[t->slots[slot]];
+        if (strcmp(r->ext, ext) == 0) {
+            return r;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+// Return the index of the first ring point at or after hash, wrapping around
+static int route_ring_find(const route_t *r, uint32_t hash) {
+    int lo = 0, hi = r->nvnodes;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->ring[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == r->nvnodes ? 0 : lo;
+}
+
+// Fill out with the first count distinct backends found walking the ring
+// from path's point. Returns the number found.
+static int route_walk(const route_t *r, const char *path, int out[], int count) {
+    if (r->ntargets == 1) {
+        out[0] = r->targets[0];
+        return 1;
+    }
+    int n = 0;
+    int start = route_ring_find(r, route_path_hash(path));
+    for (int i = 0; i < r->nvnodes && n < count; i++) {
+        int b = r->ring[(start + i) % r->nvnodes].backend;
+        int dup = 0;
+        for (int j = 0; j < n; j++) {
+            if (out[j] == b) dup = 1;
+        }
+        if (!dup) out[n++] = b;
+    }
+    return n;
+}
+
+// Fill out with the backends holding path on route r, primary first.
+// Returns the number of replicas.
+static int route_replicas(const route_t *r, const char *path, int out[]) {
+    return route_walk(r, path, out, r->replicas);
+}
+
+// Fill out with the backends holding the stripes of an erasure-coded path,
+// stripe i on out[i]. Returns K+M.
+static int route_stripes(const route_t *r, const char *path, int out[]) {
+    return route_walk(r, path, out, r->ec_data + r->ec_parity);
+}
+
+// Return the index of the primary backend that stores path on route r
+static int route_shard(const route_t *r, const char *path) {
+    int replicas[ROUTE_MAX_TARGETS];
+    route_replicas(r, path, replicas);
+    return replicas[0];
+}
+
+// Return 1 if S1 itself is one of the route's backends
+static int route_has_local(const route_table_t *t, const route_t *r) {
+    for (int i = 0; i < r->ntargets; i++) {
+        if (t->backends[r->targets[i]].local) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Return the route with the longest prefix matching path for ext, or NULL.
+// A prefix matches whole path components only, so "docs" covers
+// "docs/a.pdf" but not "docs2/a.pdf" or "docsfoo.pdf".
+static const route_t *route_lookup(const route_table_t *t, const char *ext, const char *path) {
+    const char *rel = route_norm_path(path);
+    for (const route_t *r = route_first(t, ext); r; r = r->next >= 0 ? &t->routes[r->next] : NULL) {
+        if (r->prefix_len == 0 ||
+            (strncmp(rel, r->prefix, r->prefix_len) == 0 &&
+             (rel[r->prefix_len] == '/' || rel[r->prefix_len] == '\0'))) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The test uses only part of route.h
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "route.h"
+
+// Checks which route route_lookup picks for paths around prefixed routes.
+// Prints each failure and exits non-zero if there was one.
+
+static int failures;
+
+static void expect(const route_table_t *t, const char *ext, const char *path, const route_t *want) {
+    const route_t *got = route_lookup(t, ext, path);
+    if (got != want) {
+        printf("FAIL %s %s: got prefix '%s', want '%s'\n", ext, path, got ? got->prefix : "(none)",
+               want ? want->prefix : "(none)");
+        failures++;
+    }
+}
+
+int main(void) {
+    route_table_t t;
+    route_init(&t);
+    char *local[] = { "local" }, *s2[] = { "127.0.0.1:8002" }, *s3[] = { "127.0.0.1:8003" };
+    int def = route_add(&t, ".pdf", "", local, 1, 0, 0);
+    int docs = route_add(&t, ".pdf", "docs", s2, 1, 0, 0);
+    int logs = route_add(&t, ".txt", "~/S1/logs/", s3, 1, 0, 0);
+    if (def < 0 || docs < 0 || logs < 0) {
+        printf("FAIL cannot build the table\n");
+        return 1;
+    }
+    const route_t *r_def = &t.routes[def], *r_docs = &t.routes[docs], *r_logs = &t.routes[logs];
+
+    expect(&t, ".pdf", "~/S1/docs/a.pdf", r_docs);
+    expect(&t, ".pdf", "~/S1/docs/sub/a.pdf", r_docs);
+    expect(&t, ".pdf", "~/S1/docs/", r_docs);
+    expect(&t, ".pdf", "~/S1/docs", r_docs);
+    expect(&t, ".pdf", "docs/a.pdf", r_docs);
+    // Siblings sharing the prefix's leading characters are not under it
+    expect(&t, ".pdf", "~/S1/docs2/a.pdf", r_def);
+    expect(&t, ".pdf", "~/S1/docsfoo.pdf", r_def);
+    expect(&t, ".pdf", "~/S1/a.pdf", r_def);
+    expect(&t, ".txt", "~/S1/logs/x.txt", r_logs);
+    expect(&t, ".txt", "~/S1/logs", r_logs);
+    expect(&t, ".txt", "~/S1/logsold/x.txt", NULL);
+    expect(&t, ".zip", "~/S1/docs/a.zip", NULL);
+
+    if (route_add(&t, ".pdf", "docs/", s3, 1, 0, 0) >= 0) {
+        printf("FAIL prefix=docs/ was accepted next to prefix=docs\n");
+        failures++;
+    }
+
+    printf("%s\n", failures ? "route_test: FAILED" : "route_test: ok");
+    return failures != 0;
+}
@@ -0,0 +1,249 @@
+#ifndef RS_H
+#define RS_H
+
+// Reed-Solomon erasure code over GF(2^8), used by S1 to split an object
+// into k data stripes and m parity stripes of which any k rebuild it.
+//
+// The code is systematic: the data stripes are the object itself and the
+// parity stripes are a Cauchy matrix times the data, so every k x k
+// submatrix of the encoding matrix is invertible. All the work is in
+// gf_region_mul, which multiplies a buffer by a constant and adds it to
+// another. The SIMD versions split each byte into nibbles and look both
+// products up with one shuffle each, 16 or 32 bytes per instruction; the
+// fastest one the CPU supports is chosen at startup.
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_X86 1
+#endif
+
+#define RS_MAX_SHARDS 16        // k + m
+#define GF_POLY 0x11d
+
+enum { GF_SCALAR, GF_SSSE3, GF_AVX2 };
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_tab[256][256];
+static uint8_t gf_nib_lo[256][16];  // c * x for x = 0..15
+static uint8_t gf_nib_hi[256][16];  // c * (x << 4) for x = 0..15
+static int gf_ready;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (!a || !b) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// dst ^= c * src
+static void gf_region_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    const uint8_t *row = gf_mul_tab[c];
+    for (size_t i = 0; i < len; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#ifdef GF_X86
+__attribute__((target("ssse3")))
+static void gf_region_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *)gf_nib_lo[c]);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)gf_nib_hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    gf_region_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_region_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nib_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nib_hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+    }
+    gf_region_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+static void (*gf_region_mul)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) = gf_region_scalar;
+
+// Select an implementation, falling back to the best one the CPU has.
+// Returns the level in use.
+static int gf_use(int level) {
+#ifdef GF_X86
+    __builtin_cpu_init();
+    if (level >= GF_AVX2 && __builtin_cpu_supports("avx2")) {
+        gf_region_mul = gf_region_avx2;
+        return GF_AVX2;
+    }
+    if (level >= GF_SSSE3 && __builtin_cpu_supports("ssse3")) {
+        gf_region_mul = gf_region_ssse3;
+        return GF_SSSE3;
+    }
+#endif
+    (void)level;
+    gf_region_mul = gf_region_scalar;
+    return GF_SCALAR;
+}
+
+// Build the tables and pick the fastest region multiply. Call once before
+// starting threads.
+static void gf_init(void) {
+    if (gf_ready) return;
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            gf_mul_tab[a][b] = gf_mul(a, b);
+        }
+        for (int n = 0; n < 16; n++) {
+            gf_nib_lo[a][n] = gf_mul(a, n);
+            gf_nib_hi[a][n] = gf_mul(a, n << 4);
+        }
+    }
+    gf_ready = 1;
+    gf_use(GF_AVX2);
+}
+
+typedef struct {
+    int k, m;
+    uint8_t parity[RS_MAX_SHARDS][RS_MAX_SHARDS]; // m x k Cauchy rows
+} rs_code_t;
+
+// Set up a k + m code. Returns -1 if the shape is not supported.
+static int rs_init(rs_code_t *rs, int k, int m) {
+    if (k < 1 || m < 0 || k + m > RS_MAX_SHARDS) {
+        return -1;
+    }
+    gf_init();
+    rs->k = k;
+    rs->m = m;
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < k; j++) {
+            rs->parity[i][j] = gf_inv((uint8_t)((k + i) ^ j));
+        }
+    }
+    return 0;
+}
+
+// Row r of the (k + m) x k encoding matrix
+static void rs_row(const rs_code_t *rs, int r, uint8_t *row) {
+    if (r < rs->k) {
+        memset(row, 0, rs->k);
+        row[r] = 1;
+    } else {
+        memcpy(row, rs->parity[r - rs->k], rs->k);
+    }
+}
+
+// Compute the m parity stripes from the k data stripes, each len bytes
+static void rs_encode(const rs_code_t *rs, uint8_t *const data[], uint8_t *const parity[], size_t len) {
+    for (int i = 0; i < rs->m; i++) {
+        memset(parity[i], 0, len);
+        for (int j = 0; j < rs->k; j++) {
+            gf_region_mul(parity[i], data[j], rs->parity[i][j], len);
+        }
+    }
+}
+
+// Invert the n x n matrix a in place, returning -1 if it is singular
+static int rs_invert(uint8_t a[][RS_MAX_SHARDS], int n) {
+    uint8_t inv[RS_MAX_SHARDS][RS_MAX_SHARDS] = {{0}};
+    for (int i = 0; i < n; i++) {
+        inv[i][i] = 1;
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && !a[pivot][col]) pivot++;
+        if (pivot == n) return -1;
+        if (pivot != col) {
+            uint8_t tmp[RS_MAX_SHARDS];
+            memcpy(tmp, a[col], n);   memcpy(a[col], a[pivot], n);   memcpy(a[pivot], tmp, n);
+            memcpy(tmp, inv[col], n); memcpy(inv[col], inv[pivot], n); memcpy(inv[pivot], tmp, n);
+        }
+        uint8_t scale = gf_inv(a[col][col]);
+        for (int j = 0; j < n; j++) {
+            a[col][j] = gf_mul(a[col][j], scale);
+            inv[col][j] = gf_mul(inv[col][j], scale);
+        }
+        for (int row = 0; row < n; row++) {
+            uint8_t f = a[row][col];
+            if (row == col || !f) continue;
+            for (int j = 0; j < n; j++) {
+                a[row][j] ^= gf_mul(f, a[col][j]);
+                inv[row][j] ^= gf_mul(f, inv[col][j]);
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        memcpy(a[i], inv[i], n);
+    }
+    return 0;
+}
+
+// Rebuild the missing data stripes. shards has k + m entries of len bytes;
+// present[i] says whether shard i holds valid data. Missing data shards
+// must point at writable buffers. Returns -1 with fewer than k shards.
+static int rs_decode(const rs_code_t *rs, uint8_t *const shards[], const int present[], size_t len) {
+    int k = rs->k;
+    int rows[RS_MAX_SHARDS];
+    int n = 0;
+    for (int i = 0; i < k + rs->m && n < k; i++) {
+        if (present[i]) rows[n++] = i;
+    }
+    if (n < k) {
+        return -1;
+    }
+
+    int missing = 0;
+    for (int i = 0; i < k; i++) {
+        if (!present[i]) missing = 1;
+    }
+    if (!missing) {
+        return 0;
+    }
+
+    uint8_t m[RS_MAX_SHARDS][RS_MAX_SHARDS];
+    for (int i = 0; i < k; i++) {
+        rs_row(rs, rows[i], m[i]);
+    }
+    if (rs_invert(m, k) < 0) {
+        return -1;
+    }
+    for (int d = 0; d < k; d++) {
+        if (present[d]) continue;
+        memset(shards[d], 0, len);
+        for (int j = 0; j < k; j++) {
+            gf_region_mul(shards[d], shards[rows[j]], m[d][j], len);
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // O_TMPFILE and fallocate for atomic uploads
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +14,20 @@
 #include <dirent.h>
 #include <time.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "route.h"
+#include "tar.h"
+#include "rs.h"
+#include "cas.h"
+#include "pack.h"
+#include "wal.h"
+#include "hist.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "capture.h"
 
 #define MAXLINE 1024
 #define MAXCONTENT 5242880 // 5MB for tar files
@@ -22,14 +38,88 @@
 // Global variable for S1 directory
 char s1_dir[256];
 
-// Global variables for server ports
-int S2_PORT;
-int S3_PORT;
-int S4_PORT;
+// Routing table mapping file types to backend servers. rebalance holds
+// routes_lock for writing while it adds a server to a route. Commands hold
+// it for reading only to copy out the route they use (routes_get), never
+// across network or disk I/O. Backend entries never change once added, so
+// indices and pointers into routes.backends stay valid without the lock.
+//
+// Each change bumps routes_gen, and a command counts itself against the
+// generation of the route it copied until it is done. The rebalancer waits
+// for the commands routed by the old table to finish (routes_drain) before
+// it lists the files to move, so none of their writes lands behind it.
+route_table_t routes;
+pthread_rwlock_t routes_lock;
+long routes_gen;                // changed with routes_lock held for writing
+int routes_users[2];            // commands in flight, by generation parity
+pthread_mutex_t routes_users_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t routes_drained = PTHREAD_COND_INITIALIZER;
+__thread long command_gen = -1; // generation the thread's command routes by
+
+// Deduplicating chunk store for files kept on S1, enabled with -d
+cas_t store;
+
+// Segments holding small files kept on S1, enabled with -p
+pack_t pack;
+
+// Write-ahead log for durable uploads to S1, enabled with -w
+wal_t wal;
+
+// Commands recorded for replay, enabled with -r
+capture_t capture;
+__thread long long upload_size;                         // file size of the upload being served
+__thread long long reply_bytes;                         // bytes sent back for it
+
+// Latency of each client command, and of the phases of a command
+// forward_command passes to a storage server: connecting, sending the
+// request (with an upload's content), waiting for the first byte of the
+// reply and relaying the rest. Reported by stats.
+const char *stat_names[] = { "downlf", "uploadf", "dispfnames", "removef", "downltar" };
+#define NSTATS (int)(sizeof(stat_names) / sizeof(stat_names[0]))
+hist_t stat_hist[NSTATS];
+
+enum { PHASE_CONNECT, PHASE_SEND, PHASE_WAIT, PHASE_RELAY, NPHASES };
+const char *phase_names[NPHASES] = { "forward connect", "forward send", "forward backend wait", "forward relay" };
+const char *phase_spans[NPHASES] = { "connect", "send", "backend wait", "relay" };
+hist_t phase_hist[NPHASES];
+
+int stat_index(const char *cmd) {
+    for (int i = 0; i < NSTATS; i++) {
+        if (strcmp(cmd, stat_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Counters served on the metrics port, enabled with -m
+enum {
+    M_REQUESTS,                                         // ok and failed for each stat_names entry
+    M_CONNECT_FAILURES = M_REQUESTS + 2 * NSTATS,       // per backend
+    M_BREAKER_REJECTS = M_CONNECT_FAILURES + ROUTE_MAX_BACKENDS,
+    M_BYTES_IN = M_BREAKER_REJECTS + ROUTE_MAX_BACKENDS,  // file bytes uploaded by clients
+    M_BYTES_OUT,                                        // bytes of replies sent to clients
+    M_CONNECTIONS,                                      // gauge
+};
+hist_t walk_hist;                                       // directory walks over S1's tree
+hist_t tar_hist;                                        // assembling a downltar archive
+
+// Count n bytes of a reply sent to the client
+void count_sent(long long n) {
+    metrics_add(M_BYTES_OUT, n);
+    reply_bytes += n;
+}
+
+// Record a finished command
+void stat_done(int i, long long started_us, int failed) {
+    hist_record(&stat_hist[i], hist_now_us() - started_us);
+    trace_span(stat_names[i], started_us);
+    metrics_add(M_REQUESTS + 2 * i + (failed != 0), 1);
+}
 
-// Signal handling
-void handle_sigpipe(int signum) {
-    printf("S1: Caught SIGPIPE signal\n");
+// Record a finished phase of a forwarded request, returning when it ended
+long long phase_done(int phase, long long start_us) {
+    long long now = trace_span(phase_spans[phase], start_us);
+    hist_record(&phase_hist[phase], now - start_us);
+    return now;
 }
 
 // Set socket timeout
@@ -38,6 +128,27 @@ int set_socket_timeout(int sockfd, int seconds) {
     return setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 }
 
+// Receive a newline-terminated line, returning its length or -1
+int recv_line(int sockfd, char *buf, size_t size) {
+    size_t i = 0;
+    while (i < size - 1) {
+        int n = recv(sockfd, &buf[i], 1, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            if (i > 0 && buf[i - 1] == '\r') {
+                buf[--i] = '\0';
+            }
+            return i;
+        }
+        i++;
+    }
+    buf[i] = '\0';
+    return -1;
+}
+
 // Clean path to remove double slashes
 void clean_path(char *path) {
     if (!path) return;
@@ -54,15 +165,15 @@ void clean_path(char *path) {
 
 // Function to recursively search for a file
 int find_file(const char *dirname, const char *filename, char *found_path, size_t path_size, const char *base_dir) {
-    printf("S1: find_file: Searching %s for %s\n", dirname, filename);
+    log_debug("S1: find_file: Searching %s for %s", dirname, filename);
     if (!dirname || !filename || !found_path || path_size == 0) {
-        printf("S1: find_file: Invalid arguments\n");
+        log_warn("S1: find_file: Invalid arguments");
         return -1;
     }
     
     DIR *dir = opendir(dirname);
     if (!dir) {
-        printf("S1: find_file: opendir %s failed: %s\n", dirname, strerror(errno));
+        log_warn("S1: find_file: opendir %s failed: %s", dirname, strerror(errno));
         return -1;
     }
     
@@ -71,7 +182,9 @@ int find_file(const char *dirname, const char *filename, char *found_path, size_
     int status = 0;
     
     while ((entry = readdir(dir))) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, CAS_DIR) == 0 || strcmp(entry->d_name, PACK_DIR) == 0 ||
+            strcmp(entry->d_name, WAL_DIR) == 0)
             continue;
         
         char path[MAXPATH];
@@ -79,7 +192,7 @@ int find_file(const char *dirname, const char *filename, char *found_path, size_
         clean_path(path);
         
         if (stat(path, &statbuf) == -1) {
-            printf("S1: find_file: stat %s failed: %s\n", path, strerror(errno));
+            log_warn("S1: find_file: stat %s failed: %s", path, strerror(errno));
             continue;
         }
         
@@ -93,7 +206,7 @@ int find_file(const char *dirname, const char *filename, char *found_path, size_
                     if (strlen(rel_path) < path_size) {
                         strncpy(found_path, rel_path, path_size - 1);
                         found_path[path_size - 1] = '\0';
-                        printf("S1: find_file: Found %s (relative)\n", found_path);
+                        log_debug("S1: find_file: Found %s (relative)", found_path);
                         closedir(dir);
                         return 1;
                     }
@@ -101,7 +214,7 @@ int find_file(const char *dirname, const char *filename, char *found_path, size_
                     if (strlen(path) < path_size) {
                         strncpy(found_path, path, path_size - 1);
                         found_path[path_size - 1] = '\0';
-                        printf("S1: find_file: Found %s (absolute)\n", found_path);
+                        log_debug("S1: find_file: Found %s (absolute)", found_path);
                         closedir(dir);
                         return 1;
                     }
@@ -119,15 +232,15 @@ int find_file(const char *dirname, const char *filename, char *found_path, size_
     }
     
     closedir(dir);
-    printf("S1: find_file: %s not found in %s\n", filename, dirname);
+    log_debug("S1: find_file: %s not found in %s", filename, dirname);
     return status;
 }
 
 // Create directories recursively
 int create_dirs(const char *path) {
-    printf("S1: create_dirs: Creating %s\n", path);
+    log_debug("S1: create_dirs: Creating %s", path);
     if (!path || strlen(path) == 0) {
-        printf("S1: create_dirs: Invalid path\n");
+        log_warn("S1: create_dirs: Invalid path");
         return -1;
     }
     
@@ -144,7 +257,7 @@ int create_dirs(const char *path) {
         if (*p == '/') {
             *p = '\0';
             if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
-                printf("S1: create_dirs: mkdir %s failed: %s\n", tmp, strerror(errno));
+                log_warn("S1: create_dirs: mkdir %s failed: %s", tmp, strerror(errno));
                 return -1;
             }
             *p = '/';
@@ -152,26 +265,26 @@ int create_dirs(const char *path) {
     }
     
     if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
-        printf("S1: create_dirs: mkdir %s failed: %s\n", tmp, strerror(errno));
+        log_warn("S1: create_dirs: mkdir %s failed: %s", tmp, strerror(errno));
         return -1;
     }
     
-    printf("S1: create_dirs: %s created\n", tmp);
+    log_debug("S1: create_dirs: %s created", tmp);
     return 0;
 }
 
 // Collect files with specific extension recursively
 int collect_files_recursive(const char *dirname, const char *base_dir, const char *ext, 
                            char files[][512], int *file_count, int max_files) {
-    printf("S1: collect_files: Scanning %s for %s\n", dirname, ext);
+    log_debug("S1: collect_files: Scanning %s for %s", dirname, ext);
     if (!dirname || !base_dir || !ext || !files || !file_count) {
-        printf("S1: collect_files: Invalid arguments\n");
+        log_warn("S1: collect_files: Invalid arguments");
         return -1;
     }
     
     DIR *dir = opendir(dirname);
     if (!dir) {
-        printf("S1: collect_files: opendir %s failed: %s\n", dirname, strerror(errno));
+        log_warn("S1: collect_files: opendir %s failed: %s", dirname, strerror(errno));
         return -1;
     }
     
@@ -179,7 +292,9 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
     struct stat statbuf;
     
     while ((entry = readdir(dir))) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, CAS_DIR) == 0 || strcmp(entry->d_name, PACK_DIR) == 0 ||
+            strcmp(entry->d_name, WAL_DIR) == 0)
             continue;
         
         char path[MAXPATH];
@@ -187,7 +302,7 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
         clean_path(path);
         
         if (stat(path, &statbuf) == -1) {
-            printf("S1: collect_files: stat %s failed: %s\n", path, strerror(errno));
+            log_warn("S1: collect_files: stat %s failed: %s", path, strerror(errno));
             continue;
         }
         
@@ -197,10 +312,10 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
                 if (*file_count < max_files) {
                     strncpy(files[*file_count], path, 511);
                     files[*file_count][511] = '\0';
-                    printf("S1: collect_files: Added %s\n", path);
+                    log_debug("S1: collect_files: Added %s", path);
                     (*file_count)++;
                 } else {
-                    printf("S1: collect_files: Max file count reached\n");
+                    log_warn("S1: collect_files: Max file count reached");
                     closedir(dir);
                     return 0;
                 }
@@ -211,442 +326,1177 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
     }
     
     closedir(dir);
-    printf("S1: collect_files: Found %d files in %s\n", *file_count, dirname);
+    log_debug("S1: collect_files: Found %d files in %s", *file_count, dirname);
+    return 0;
+}
+
+// collect_files_recursive under S1's directory, timed for the metrics
+int walk_collect(const char *dirname, const char *ext, char files[][512], int *file_count) {
+    long long start = hist_now_us();
+    int status = collect_files_recursive(dirname, s1_dir, ext, files, file_count, MAX_FILES);
+    hist_record(&walk_hist, hist_now_us() - start);
+    return status;
+}
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Copy out the route for a file of type ext under path, for a command to
+// use without holding routes_lock, and count the command against the
+// table's generation until routes_release. Returns 0, or -1 if no route
+// matches.
+int routes_get(const char *ext, const char *path, route_t *out) {
+    pthread_rwlock_rdlock(&routes_lock);
+    const route_t *r = route_lookup(&routes, ext, path);
+    if (r) {
+        *out = *r;
+        if (command_gen < 0) {
+            command_gen = routes_gen;
+            pthread_mutex_lock(&routes_users_lock);
+            routes_users[command_gen & 1]++;
+            pthread_mutex_unlock(&routes_users_lock);
+        }
+    }
+    pthread_rwlock_unlock(&routes_lock);
+    return r ? 0 : -1;
+}
+
+// The thread's command is done with the route it copied
+void routes_release(void) {
+    if (command_gen < 0) return;
+    pthread_mutex_lock(&routes_users_lock);
+    if (--routes_users[command_gen & 1] == 0) {
+        pthread_cond_broadcast(&routes_drained);
+    }
+    pthread_mutex_unlock(&routes_users_lock);
+    command_gen = -1;
+}
+
+// Wait until no command routed by the table from before generation gen is
+// still running. The next change waits for this one's rebalance to end,
+// so two slots are enough.
+void routes_drain(long gen) {
+    pthread_mutex_lock(&routes_users_lock);
+    while (routes_users[(gen - 1) & 1] > 0) {
+        pthread_cond_wait(&routes_drained, &routes_users_lock);
+    }
+    pthread_mutex_unlock(&routes_users_lock);
+}
+
+// Number of backends in the table; the entries below it never change
+int routes_backend_count(void) {
+    pthread_rwlock_rdlock(&routes_lock);
+    int n = routes.nbackends;
+    pthread_rwlock_unlock(&routes_lock);
+    return n;
+}
+
+// Membership of the storage servers. Servers started with S1's address
+// send a UDP heartbeat to S1's port every 100ms with their load and free
+// space; one that goes quiet is suspect after HEARTBEAT_SUSPECT_MS and
+// dead after HEARTBEAT_DEAD_MS. Servers that never sent one are assumed
+// up, as before heartbeats existed.
+//
+// Each server also has a circuit breaker. After BREAKER_FAILURES failed
+// connects in a row, or while it is dead, requests to it fail at once
+// instead of waiting for connect or receive timeouts. Once BREAKER_OPEN_MS
+// has passed one request is let through to probe it; a heartbeat or a
+// successful connect closes the breaker again.
+#define HEARTBEAT_SUSPECT_MS 250
+#define HEARTBEAT_DEAD_MS 500
+#define BREAKER_FAILURES 3
+#define BREAKER_OPEN_MS 2000
+
+enum { MEMBER_UNKNOWN, MEMBER_ALIVE, MEMBER_SUSPECT, MEMBER_DEAD };
+
+typedef struct {
+    double last_seen_ms;        // 0 until the first heartbeat
+    long long busy_ms;          // how long its current request has run
+    long long served;           // requests it has handled
+    unsigned long long free_kb; // free space on its storage directory
+    int failures;               // failed connects in a row
+    double open_until_ms;       // breaker open until then, 0 if closed
+    int probing;                // the request probing a half-open breaker is in flight
+} member_t;
+
+member_t members[ROUTE_MAX_BACKENDS];
+pthread_mutex_t member_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int member_state_locked(const member_t *m, double now) {
+    if (m->last_seen_ms == 0) return MEMBER_UNKNOWN;
+    if (now - m->last_seen_ms >= HEARTBEAT_DEAD_MS) return MEMBER_DEAD;
+    if (now - m->last_seen_ms >= HEARTBEAT_SUSPECT_MS) return MEMBER_SUSPECT;
+    return MEMBER_ALIVE;
+}
+
+int member_state(const backend_t *b) {
+    pthread_mutex_lock(&member_lock);
+    int state = member_state_locked(&members[b - routes.backends], now_ms());
+    pthread_mutex_unlock(&member_lock);
+    return state;
+}
+
+// Return 1 if a request may be sent to b now
+int breaker_allow(const backend_t *b) {
+    if (b->local) return 1;
+    pthread_mutex_lock(&member_lock);
+    member_t *m = &members[b - routes.backends];
+    double now = now_ms();
+    int allow = member_state_locked(m, now) != MEMBER_DEAD;
+    if (allow && m->open_until_ms != 0) {
+        allow = now >= m->open_until_ms && !m->probing;
+        if (allow) m->probing = 1;
+    }
+    pthread_mutex_unlock(&member_lock);
+    return allow;
+}
+
+void breaker_result(const backend_t *b, int ok) {
+    pthread_mutex_lock(&member_lock);
+    member_t *m = &members[b - routes.backends];
+    m->probing = 0;
+    if (ok) {
+        m->failures = 0;
+        m->open_until_ms = 0;
+    } else if (++m->failures >= BREAKER_FAILURES) {
+        if (m->open_until_ms == 0) {
+            log_warn("S1: breaker: Opening for %s after %d failures", b->name, m->failures);
+        }
+        m->open_until_ms = now_ms() + BREAKER_OPEN_MS;
+    }
+    pthread_mutex_unlock(&member_lock);
+}
+
+// Heartbeat listener thread. A heartbeat is
+// "HEARTBEAT <tcp_port> <busy_ms> <served> <free_kb>" and is matched to a
+// backend by the sender's address and the port it serves on.
+void *heartbeat_listener(void *arg) {
+    int fd = *(int *)arg;
+    char msg[256];
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        int n = recvfrom(fd, msg, sizeof(msg) - 1, 0, (struct sockaddr *)&from, &len);
+        if (n <= 0) {
+            continue;
+        }
+        msg[n] = '\0';
+        int port;
+        long long busy, served;
+        unsigned long long free_kb;
+        if (sscanf(msg, "HEARTBEAT %d %lld %lld %llu", &port, &busy, &served, &free_kb) != 4) {
+            continue;
+        }
+        
+        // A rebalance may be adding a backend meanwhile; the entries below
+        // the count read under routes_lock are complete and never change
+        int nbackends = routes_backend_count();
+        for (int i = 0; i < nbackends; i++) {
+            const backend_t *b = &routes.backends[i];
+            if (b->local || ntohs(b->addr.sin_port) != port || b->addr.sin_addr.s_addr != from.sin_addr.s_addr) {
+                continue;
+            }
+            pthread_mutex_lock(&member_lock);
+            member_t *m = &members[i];
+            double now = now_ms();
+            if (member_state_locked(m, now) != MEMBER_ALIVE) {
+                log_info("S1: heartbeat: %s is up", b->name);
+            }
+            m->last_seen_ms = now;
+            m->busy_ms = busy;
+            m->served = served;
+            m->free_kb = free_kb;
+            m->failures = 0;
+            m->open_until_ms = 0;
+            pthread_mutex_unlock(&member_lock);
+        }
+    }
+    return NULL;
+}
+
+// Start listening for heartbeats on UDP port
+int start_heartbeat_listener(int port) {
+    static int fd;
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    pthread_t tid;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        pthread_create(&tid, NULL, heartbeat_listener, &fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Handle members command: list each storage server with its heartbeat
+// state, load, free space and breaker state
+int handle_members(int connfd) {
+    static const char *states[] = { "unknown", "alive", "suspect", "dead" };
+    char buffer[MAXCONTENT / 64];
+    size_t offset = 0;
+    int nbackends = routes_backend_count();
+    pthread_mutex_lock(&member_lock);
+    double now = now_ms();
+    for (int i = 0; i < nbackends && offset < sizeof(buffer); i++) {
+        const backend_t *b = &routes.backends[i];
+        if (b->local) continue;
+        const member_t *m = &members[i];
+        const char *breaker = m->open_until_ms == 0 ? "closed" : now < m->open_until_ms ? "open" : "half-open";
+        if (m->last_seen_ms == 0) {
+            offset += snprintf(buffer + offset, sizeof(buffer) - offset, "%s: %s, breaker %s\n",
+                               b->name, states[MEMBER_UNKNOWN], breaker);
+        } else {
+            offset += snprintf(buffer + offset, sizeof(buffer) - offset,
+                               "%s: %s, seen %.0f ms ago, busy %lld ms, %lld served, %llu MB free, breaker %s\n",
+                               b->name, states[member_state_locked(m, now)], now - m->last_seen_ms,
+                               m->busy_ms, m->served, m->free_kb / 1024, breaker);
+        }
+    }
+    pthread_mutex_unlock(&member_lock);
+    if (offset == 0) {
+        snprintf(buffer, sizeof(buffer), "No storage servers configured");
+    }
+    send(connfd, buffer, strlen(buffer), 0);
     return 0;
 }
 
-// Connect to another server (S2, S3, or S4)
-int connect_to_server(int port) {
-    printf("S1: connect_to_server: Trying port %d\n", port);
+// Connect to a backend storage server, failing at once if its breaker is
+// open or it has stopped sending heartbeats
+int connect_to_server(const backend_t *backend) {
+    if (!breaker_allow(backend)) {
+        log_warn("S1: connect_to_server: %s is down, not trying", backend->name);
+        metrics_add(M_BREAKER_REJECTS + (backend - routes.backends), 1);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    log_debug("S1: connect_to_server: Trying %s", backend->name);
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
-        printf("S1: connect_to_server: Socket creation failed: %s\n", strerror(errno));
+        log_warn("S1: connect_to_server: Socket creation failed: %s", strerror(errno));
+        metrics_add(M_CONNECT_FAILURES + (backend - routes.backends), 1);
+        breaker_result(backend, 0);
         return -1;
     }
     
-    struct sockaddr_in servaddr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = inet_addr("127.0.0.1") };
-    
-    if (connect(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        printf("S1: connect_to_server: Connect to port %d failed: %s\n", port, strerror(errno));
+    if (connect(sockfd, (const struct sockaddr*)&backend->addr, sizeof(backend->addr)) < 0) {
+        log_warn("S1: connect_to_server: Connect to %s failed: %s", backend->name, strerror(errno));
+        metrics_add(M_CONNECT_FAILURES + (backend - routes.backends), 1);
         close(sockfd);
+        breaker_result(backend, 0);
         return -1;
     }
+    breaker_result(backend, 1);
     
     if (set_socket_timeout(sockfd, 30) < 0) {
-        printf("S1: connect_to_server: Set timeout failed: %s\n", strerror(errno));
+        log_warn("S1: connect_to_server: Set timeout failed: %s", strerror(errno));
         close(sockfd);
         return -1;
     }
     
-    printf("S1: connect_to_server: Connected to port %d\n", port);
+    // The id of the request being served goes in front of the command
+    // line the caller sends next
+    if (trace_rid[0]) {
+        char prefix[TRACE_RID + 2];
+        int n = snprintf(prefix, sizeof(prefix), "@%s ", trace_rid);
+        if (send(sockfd, prefix, n, 0) < 0) {
+            log_warn("S1: connect_to_server: Send to %s failed: %s", backend->name, strerror(errno));
+            close(sockfd);
+            return -1;
+        }
+    }
+    
+    log_debug("S1: connect_to_server: Connected to %s", backend->name);
     return sockfd;
 }
 
-// Forward command to another server and relay response
-int forward_command(int clientfd, char *cmd, char *fname, char *dpath, int port) {
-    printf("hi XOXO \n");
-    printf("hiiiii %d %d %s %s %s\n", clientfd, port, cmd, fname, dpath);
+// Load S1 observes on each backend, used to choose among replicas. Reads
+// record their time to first byte; a read cancelled by a faster hedge
+// records the time it had been waiting, a lower bound on its latency.
+// Requests in flight are counted across all the client threads.
+#define LOAD_SAMPLES 128        // latencies kept for the p95 estimate
+#define LOAD_EWMA_WEIGHT 0.2    // weight of the newest latency sample
+#define HEDGE_DEFAULT_MS 50.0   // hedge delay until a backend has samples
+#define HEDGE_MIN_MS 1.0
+#define HEDGE_MIN_SAMPLES 16
 
-    fflush(stdout);
+typedef struct {
+    int outstanding;            // requests in flight from all clients
+    double ewma_ms;             // smoothed time to first byte of reads
+    double samples[LOAD_SAMPLES];
+    int nsamples;
+    int next;
+} backend_load_t;
 
-    if (!cmd || !fname || !dpath) {
-        printf("S1: forward_command: Invalid arguments\n");
-        send(clientfd, "ERROR: Invalid command arguments", strlen("ERROR: Invalid command arguments"), 0);
+backend_load_t loads[ROUTE_MAX_BACKENDS];
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void load_begin(const backend_t *b) {
+    pthread_mutex_lock(&load_lock);
+    loads[b - routes.backends].outstanding++;
+    pthread_mutex_unlock(&load_lock);
+}
+
+void load_end(const backend_t *b) {
+    pthread_mutex_lock(&load_lock);
+    loads[b - routes.backends].outstanding--;
+    pthread_mutex_unlock(&load_lock);
+}
+
+void load_sample(const backend_t *b, double ms) {
+    pthread_mutex_lock(&load_lock);
+    backend_load_t *l = &loads[b - routes.backends];
+    l->ewma_ms = l->nsamples ? l->ewma_ms + LOAD_EWMA_WEIGHT * (ms - l->ewma_ms) : ms;
+    l->samples[l->next] = ms;
+    l->next = (l->next + 1) % LOAD_SAMPLES;
+    if (l->nsamples < LOAD_SAMPLES) l->nsamples++;
+    pthread_mutex_unlock(&load_lock);
+}
+
+// Expected wait for a new read: queued requests times typical latency,
+// plus however long the backend's last heartbeat said its current request
+// had run, since it serves one connection at a time and that request may
+// not be S1's. Backends without samples score 0 so they get tried.
+double load_score(const backend_t *b) {
+    pthread_mutex_lock(&load_lock);
+    const backend_load_t *l = &loads[b - routes.backends];
+    double score = (l->outstanding + 1) * l->ewma_ms;
+    pthread_mutex_unlock(&load_lock);
+    if (score > 0 && !b->local) {
+        pthread_mutex_lock(&member_lock);
+        const member_t *m = &members[b - routes.backends];
+        if (member_state_locked(m, now_ms()) == MEMBER_ALIVE) {
+            score += m->busy_ms;
+        }
+        pthread_mutex_unlock(&member_lock);
+    }
+    return score;
+}
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// How long to wait for a backend before hedging: its p95 read latency
+double hedge_delay_ms(const backend_t *b) {
+    double sorted[LOAD_SAMPLES];
+    pthread_mutex_lock(&load_lock);
+    const backend_load_t *l = &loads[b - routes.backends];
+    int n = l->nsamples;
+    memcpy(sorted, l->samples, n * sizeof(double));
+    pthread_mutex_unlock(&load_lock);
+    
+    if (n < HEDGE_MIN_SAMPLES) {
+        return HEDGE_DEFAULT_MS;
+    }
+    qsort(sorted, n, sizeof(double), cmp_double);
+    double p95 = sorted[(n * 95) / 100];
+    return p95 > HEDGE_MIN_MS ? p95 : HEDGE_MIN_MS;
+}
+
+// Send one command line to a backend and collect its whole response into
+// resp (NUL-terminated). Returns the response length or -1 on failure.
+int backend_request(const backend_t *backend, const char *line, char *resp, size_t cap) {
+    int serverfd = connect_to_server(backend);
+    if (serverfd < 0) {
         return -1;
     }
+    load_begin(backend);
     
-    printf("S1: forward_command: %s %s %s to port %d\n", cmd, fname, dpath, port);
+    char buffer[MAXLINE];
+    snprintf(buffer, sizeof(buffer), "%s\n", line);
+    if (send(serverfd, buffer, strlen(buffer), 0) < 0) {
+        log_warn("S1: backend_request: Send to %s failed: %s", backend->name, strerror(errno));
+        load_end(backend);
+        close(serverfd);
+        return -1;
+    }
+    shutdown(serverfd, SHUT_WR);
     
-    int serverfd = connect_to_server(port);
+    size_t offset = 0;
+    while (offset < cap - 1) {
+        int n = recv(serverfd, resp + offset, cap - offset - 1, 0);
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+    resp[offset] = '\0';
+    load_end(backend);
+    close(serverfd);
+    return offset;
+}
+
+// Send one command line to a backend and read a FILE_INFO/TAR_FILE reply,
+// checking the payload against its checksum trailer. Returns 1 with the
+// payload in a malloc'd *data, 0 if the backend answered with an error
+// (kept in header) or sent a damaged payload, or -1 if it could not be
+// reached.
+int backend_fetch(const backend_t *backend, const char *line, char *header, size_t hsize, char **data, size_t *len) {
+    int serverfd = connect_to_server(backend);
     if (serverfd < 0) {
-        printf("S1: forward_command: Connection to port %d failed\n", port);
-        send(clientfd, "ERROR: Failed to connect to server", strlen("ERROR: Failed to connect to server"), 0);
         return -1;
     }
+    load_begin(backend);
     
-    char buffer[MAXLINE] = {0};
-    snprintf(buffer, sizeof(buffer), "%s %s %s", cmd, fname, dpath);
-    printf("S1: forward_command: Sending: %s\n", buffer);
+    char buffer[MAXLINE];
+    snprintf(buffer, sizeof(buffer), "%s\n", line);
     if (send(serverfd, buffer, strlen(buffer), 0) < 0) {
-        printf("S1: forward_command: Send failed: %s\n", strerror(errno));
+        log_warn("S1: backend_fetch: Send to %s failed: %s", backend->name, strerror(errno));
+        load_end(backend);
         close(serverfd);
-        send(clientfd, "ERROR: Failed to send to server", strlen("ERROR: Failed to send to server"), 0);
         return -1;
     }
+    shutdown(serverfd, SHUT_WR);
     
-    if (strcmp(cmd, "uploadf") == 0) {
-        char len_str[32] = {0};
-        printf("S1: forward_command: Waiting for content length\n");
-        int i = 0;
-        while (i < sizeof(len_str) - 1) {
-            int n = recv(clientfd, &len_str[i], 1, 0);
-            if (n <= 0) {
-                printf("S1: forward_command: Recv length failed: %s\n", n == 0 ? "closed" : strerror(errno));
-                close(serverfd);
-                send(clientfd, "ERROR: Failed to receive length", strlen("ERROR: Failed to receive length"), 0);
-                return -1;
-            }
-            if (len_str[i] == '\n') {
-                len_str[i] = '\0';
-                break;
-            }
-            i++;
-        }
-        
-        if (i >= sizeof(len_str) - 1) {
-            printf("S1: forward_command: Length too long\n");
-            close(serverfd);
-            send(clientfd, "ERROR: Invalid content length", strlen("ERROR: Invalid content length"), 0);
-            return -1;
-        }
-        
-        size_t content_len = atoi(len_str);
-        printf("S1: forward_command: Content length: %zu\n", content_len);
-        if (content_len == 0 || content_len >= MAXCONTENT) {
-            printf("S1: forward_command: Invalid content length: %zu\n", content_len);
-            close(serverfd);
-            send(clientfd, content_len == 0 ? "ERROR: Invalid content length" : 
-                 "ERROR: Content too large", strlen(content_len == 0 ? 
-                 "ERROR: Invalid content length" : "ERROR: Content too large"), 0);
-            return -1;
-        }
-        
-        char *content = malloc(content_len + 1);
-        if (!content) {
-            printf("S1: forward_command: Malloc failed\n");
-            close(serverfd);
-            send(clientfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
-            return -1;
-        }
-        
-        size_t total = 0;
-        printf("S1: forward_command: Receiving %zu bytes\n", content_len);
-        while (total < content_len) {
-            int n = recv(clientfd, content + total, content_len - total, 0);
-            if (n <= 0) {
-                printf("S1: forward_command: Recv content failed: %s\n", n == 0 ? "closed" : strerror(errno));
-                free(content);
-                close(serverfd);
-                send(clientfd, "ERROR: Failed to receive content", strlen("ERROR: Failed to receive content"), 0);
-                return -1;
-            }
-            total += n;
+    // Error replies have no newline and end when the backend closes
+    size_t i = 0;
+    while (i < hsize - 1) {
+        int n = recv(serverfd, &header[i], 1, 0);
+        if (n <= 0 || header[i] == '\n') {
+            break;
         }
-        content[total] = '\0';
-        printf("S1: forward_command: Received %zu bytes\n", total);
-        
-        printf("S1: forward_command: Sending length to server: %s\n", len_str);
-        if (send(serverfd, len_str, strlen(len_str), 0) < 0) {
-            printf("S1: forward_command: Send length failed: %s\n", strerror(errno));
-            free(content);
-            close(serverfd);
-            send(clientfd, "ERROR: Failed to send length to server", strlen("ERROR: Failed to send length to server"), 0);
-            return -1;
+        i++;
+    }
+    header[i] = '\0';
+    if (strncmp(header, "FILE_INFO:", 10) != 0 && strncmp(header, "TAR_FILE:", 9) != 0) {
+        if (i == 0) {
+            snprintf(header, hsize, "ERROR: No response from server");
         }
-        
-        printf("S1: forward_command: Sending content to server\n");
-        if (send(serverfd, content, total, 0) < 0) {
-            printf("S1: forward_command: Send content failed: %s\n", strerror(errno));
+        load_end(backend);
+        close(serverfd);
+        return 0;
+    }
+    
+    char len_str[32];
+    if (recv_line(serverfd, len_str, sizeof(len_str)) < 0) {
+        snprintf(header, hsize, "ERROR: Failed to receive length");
+        load_end(backend);
+        close(serverfd);
+        return 0;
+    }
+    size_t content_len = strtoull(len_str, NULL, 10);
+    char *content = malloc(content_len + 1);
+    if (!content) {
+        snprintf(header, hsize, "ERROR: Memory allocation failed");
+        load_end(backend);
+        close(serverfd);
+        return 0;
+    }
+    
+    size_t total = 0;
+    while (total < content_len) {
+        int n = recv(serverfd, content + total, content_len - total, 0);
+        if (n <= 0) {
+            log_debug("S1: backend_fetch: %s sent %zu/%zu bytes", backend->name, total, content_len);
+            snprintf(header, hsize, "ERROR: Failed to receive content");
             free(content);
+            load_end(backend);
             close(serverfd);
-            send(clientfd, "ERROR: Failed to send content to server", strlen("ERROR: Failed to send content to server"), 0);
-            return -1;
+            return 0;
         }
+        total += n;
+    }
+    uint32_t crc = crc32c(0, content, total), expected;
+    if (crc_recv_trailer(serverfd, &expected) < 0 || crc != expected) {
+        log_warn("S1: backend_fetch: Bad checksum from %s (%08x)", backend->name, crc);
+        snprintf(header, hsize, "ERROR: Checksum mismatch from %s", backend->name);
         free(content);
+        load_end(backend);
+        close(serverfd);
+        return 0;
     }
+    load_end(backend);
+    close(serverfd);
     
-    char response[MAXCONTENT] = {0};
-    int offset = 0;
-    printf("S1: forward_command: Waiting for server response\n");
-    while (offset < MAXCONTENT - 1) {
-        int n = recv(serverfd, response + offset, MAXCONTENT - offset - 1, 0);
-        if (n <= 0) {
-            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-                printf("S1: forward_command: Recv response failed: %s\n", strerror(errno));
-            } else if (n == 0) {
-                printf("S1: forward_command: Server closed connection\n");
+    *data = content;
+    *len = total;
+    return 1;
+}
+
+// Relay a backend's response to the client until the backend closes,
+// starting with n bytes already read into first
+int relay_response(int serverfd, int clientfd, const char *first, size_t n) {
+    char response[64 * MAXLINE];
+    size_t relayed = 0;
+    if (n > 0) {
+        if (send(clientfd, first, n, 0) < 0) {
+            log_warn("S1: relay_response: Send to client failed: %s", strerror(errno));
+            return -1;
+        }
+        relayed = n;
+    }
+    while (1) {
+        int got = recv(serverfd, response, sizeof(response), 0);
+        if (got <= 0) {
+            if (got < 0) {
+                log_warn("S1: relay_response: Recv response failed: %s", strerror(errno));
             }
             break;
         }
-        offset += n;
-        response[offset] = '\0';
-        printf("S1: forward_command: Received %d bytes\n", n);
-        
-        if (strstr(response, "FILE_INFO:") || strstr(response, "TAR_FILE:") || strstr(response, "ERROR:") ||
-            strcmp(cmd, "dispfnames") == 0 || strcmp(cmd, "removef") == 0) {
-            break;
+        if (send(clientfd, response, got, 0) < 0) {
+            log_warn("S1: relay_response: Send to client failed: %s", strerror(errno));
+            return -1;
         }
+        relayed += got;
     }
     
-    if (offset > 0) {
-        printf("S1: forward_command: Sending response to client (%d bytes)\n", offset);
-        if (send(clientfd, response, offset, 0) < 0) {
-            printf("S1: forward_command: Send to client failed: %s\n", strerror(errno));
-            close(serverfd);
-            return -1;
-        }
-    } else {
-        printf("S1: forward_command: No response from server\n");
+    if (relayed == 0) {
+        log_warn("S1: relay_response: No response from server");
         send(clientfd, "ERROR: No response from server", strlen("ERROR: No response from server"), 0);
+    } else {
+        log_debug("S1: relay_response: Relayed %zu bytes to client", relayed);
+        count_sent(relayed);
     }
-    
-    printf("S1: forward_command: Closing server connection\n");
-    close(serverfd);
     return 0;
 }
 
-// Handle downlf command locally for .c files
-int handle_downlf(int connfd, const char *filename) {
-    printf("S1: handle_downlf: Starting for %s\n", filename);
-    if (!filename || strlen(filename) == 0) {
-        printf("S1: handle_downlf: No filename\n");
-        send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
+// Receive the "NEED <flags>" line that answers a delta upload into buf.
+// Returns its length, or -1 if the peer closed or sent something else
+// (an error reply, left in buf).
+int recv_need(int sockfd, char *buf, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        int n = recv(sockfd, buf + len, size - 1 - len, 0);
+        if (n <= 0) {
+            buf[len] = '\0';
+            return -1;
+        }
+        len += n;
+        buf[len] = '\0';
+        if (strncmp(buf, "NEED ", len < 5 ? len : 5) != 0) {
+            return -1;
+        }
+        char *nl = memchr(buf, '\n', len);
+        if (nl) {
+            return nl - buf + 1;
+        }
+    }
+    return -1;
+}
+
+// Relay a delta upload (see cdc.h) from the client to a backend: the chunk
+// list goes to the backend, its NEED line back to the client, and then
+// the chunks it asked for. Returns 0 once they have been relayed, or -1
+// after the client has been sent an error.
+int relay_delta_upload(int clientfd, int serverfd, const char *header) {
+    size_t total;
+    int n;
+    if (sscanf(header, "CDC %zu %d", &total, &n) != 2 || total == 0 || total >= MAXCONTENT ||
+        n <= 0 || (size_t)n > total / CDC_MIN + 1) {
+        log_warn("S1: forward_command: Bad delta header: %s", header);
+        send(clientfd, "ERROR: Invalid delta manifest", strlen("ERROR: Invalid delta manifest"), 0);
         return -1;
     }
-    
-    char *ext = strrchr(filename, '.');
-    if (!ext || strcmp(ext, ".c") != 0) {
-        printf("S1: handle_downlf: Not a .c file: %s\n", filename);
-        send(connfd, "ERROR: Only .c files supported on S1", strlen("ERROR: Only .c files supported on S1"), 0);
+
+    size_t cap = 64 + (size_t)n * (2 * CDC_HASH_LEN + 16);
+    char *manifest = malloc(cap);
+    uint32_t *lens = malloc(n * sizeof(uint32_t));
+    char *need = malloc(n + 16);
+    if (!manifest || !lens || !need) {
+        log_warn("S1: forward_command: Malloc failed");
+        free(manifest);
+        free(lens);
+        free(need);
+        send(clientfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
         return -1;
     }
-    
-    char buffer[MAXLINE] = {0};
-    char content[MAXCONTENT] = {0};
-    char full_path[MAXPATH] = {0};
-    
-    printf("S1: handle_downlf: Constructing path\n");
-    if (filename[0] == '/') {
-        snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, filename);
-    } else {
-        snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, filename);
+
+    int status = 0;
+    size_t mlen = snprintf(manifest, cap, "%s\n", header);
+    char line[MAXLINE];
+    for (int i = 0; i < n; i++) {
+        cdc_chunk_t c;
+        if (recv_line(clientfd, line, sizeof(line)) < 0 || cdc_parse_line(line, &c) < 0 ||
+            mlen + strlen(line) + 2 > cap) {
+            log_warn("S1: forward_command: Bad delta chunk %d", i);
+            send(clientfd, "ERROR: Invalid delta manifest", strlen("ERROR: Invalid delta manifest"), 0);
+            status = -1;
+            break;
+        }
+        lens[i] = c.len;
+        mlen += snprintf(manifest + mlen, cap - mlen, "%s\n", line);
     }
-    clean_path(full_path);
-    printf("S1: handle_downlf: Checking %s\n", full_path);
-    
-    if (access(full_path, F_OK) != 0) {
-        printf("S1: handle_downlf: File not found: %s\n", full_path);
-        snprintf(buffer, sizeof(buffer), "ERROR: File not found");
-        send(connfd, buffer, strlen(buffer), 0);
-        return -1;
+
+    int got = -1;
+    if (status == 0) {
+        log_debug("S1: forward_command: Sending %d chunk hashes (%zu bytes)", n, mlen);
+        if (send(serverfd, manifest, mlen, 0) < 0) {
+            log_warn("S1: forward_command: Send manifest failed: %s", strerror(errno));
+            send(clientfd, "ERROR: Failed to send to server", strlen("ERROR: Failed to send to server"), 0);
+            status = -1;
+        } else if ((got = recv_need(serverfd, need, n + 16)) != n + 6) {
+            log_warn("S1: forward_command: No chunk request from server");
+            if (got < 0 && need[0]) {
+                send(clientfd, need, strlen(need), 0);
+            } else {
+                send(clientfd, "ERROR: No response from server", strlen("ERROR: No response from server"), 0);
+            }
+            status = -1;
+        } else if (send(clientfd, need, got, 0) < 0) {
+            log_warn("S1: forward_command: Send chunk request failed: %s", strerror(errno));
+            status = -1;
+        }
     }
-    
-    FILE *fp = fopen(full_path, "rb");
-    if (!fp) {
-        printf("S1: handle_downlf: Open failed: %s\n", strerror(errno));
-        snprintf(buffer, sizeof(buffer), "ERROR: Failed to open file");
-        send(connfd, buffer, strlen(buffer), 0);
-        return -1;
+
+    // The chunks arrive back to back; only their total length matters here
+    size_t wanted = 0;
+    for (int i = 0; i < n && status == 0; i++) {
+        if (need[5 + i] == '1') wanted += lens[i];
     }
-    
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    if (file_size > MAXCONTENT) {
-        fclose(fp);
-        printf("S1: handle_downlf: File too large: %ld\n", file_size);
-        snprintf(buffer, sizeof(buffer), "ERROR: File too large to transfer");
-        send(connfd, buffer, strlen(buffer), 0);
-        return -1;
+    char buf[64 * MAXLINE];
+    size_t relayed = 0;
+    while (status == 0 && relayed < wanted) {
+        size_t want = wanted - relayed < sizeof(buf) ? wanted - relayed : sizeof(buf);
+        int r = recv(clientfd, buf, want, 0);
+        if (r <= 0 || send(serverfd, buf, r, 0) < 0) {
+            log_warn("S1: forward_command: Relaying chunks failed: %s", r == 0 ? "closed" : strerror(errno));
+            status = -1;
+            break;
+        }
+        relayed += r;
     }
-    
-    size_t bytes_read = fread(content, 1, file_size, fp);
-    fclose(fp);
-    
-    if (bytes_read != file_size) {
-        printf("S1: handle_downlf: Read failed: %zu/%ld\n", bytes_read, file_size);
-        snprintf(buffer, sizeof(buffer), "ERROR: Failed to read complete file");
-        send(connfd, buffer, strlen(buffer), 0);
-        return -1;
+    if (status == 0) {
+        log_debug("S1: forward_command: Relayed %zu of %zu bytes", relayed, total);
+        metrics_add(M_BYTES_IN, relayed);
     }
-    
-    snprintf(buffer, sizeof(buffer), "FILE_INFO:%s", filename);
-    printf("S1: handle_downlf: Sending info: %s\n", buffer);
-    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        printf("S1: handle_downlf: Send info failed: %s\n", strerror(errno));
+
+    free(manifest);
+    free(lens);
+    free(need);
+    return status;
+}
+
+// Forward command to a backend server and relay its response
+int forward_command(int clientfd, char *cmd, char *fname, char *dpath, const backend_t *backend) {
+    if (!cmd || !fname || !dpath || !backend) {
+        log_warn("S1: forward_command: Invalid arguments");
+        send(clientfd, "ERROR: Invalid command arguments", strlen("ERROR: Invalid command arguments"), 0);
         return -1;
     }
     
-    snprintf(buffer, sizeof(buffer), "%zu\n", bytes_read);
-    printf("S1: handle_downlf: Sending size: %s\n", buffer);
-    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        printf("S1: handle_downlf: Send size failed: %s\n", strerror(errno));
+    log_debug("S1: forward_command: %s %s %s to %s", cmd, fname, dpath, backend->name);
+    
+    long long phase_start = hist_now_us();
+    int serverfd = connect_to_server(backend);
+    if (serverfd < 0) {
+        log_warn("S1: forward_command: Connection to %s failed", backend->name);
+        send(clientfd, "ERROR: Failed to connect to server", strlen("ERROR: Failed to connect to server"), 0);
         return -1;
     }
+    phase_start = phase_done(PHASE_CONNECT, phase_start);
     
-    printf("S1: handle_downlf: Sending %zu bytes\n", bytes_read);
-    if (send(connfd, content, bytes_read, 0) < 0) {
-        printf("S1: handle_downlf: Send content failed: %s\n", strerror(errno));
+    char buffer[MAXLINE] = {0};
+    snprintf(buffer, sizeof(buffer), "%s %s %s\n", cmd, fname, dpath);
+    log_debug("S1: forward_command: Sending: %s", buffer);
+    if (send(serverfd, buffer, strlen(buffer), 0) < 0) {
+        log_warn("S1: forward_command: Send failed: %s", strerror(errno));
+        close(serverfd);
+        send(clientfd, "ERROR: Failed to send to server", strlen("ERROR: Failed to send to server"), 0);
         return -1;
     }
     
-    printf("S1: handle_downlf: Sent %zu bytes\n", bytes_read);
-    return 0;
-}
-
-// Handle dispfnames command locally for .c files
-int handle_dispfnames(int connfd, const char *pathname) {
-    printf("S1: handle_dispfnames: Starting for %s\n", pathname);
-    if (!pathname || strlen(pathname) == 0) {
-        printf("S1: handle_dispfnames: No path\n");
-        send(connfd, "ERROR: Path not specified", strlen("ERROR: Path not specified"), 0);
+    if (strcmp(cmd, "uploadf") == 0) {
+        char len_str[32] = {0};
+        log_debug("S1: forward_command: Waiting for content length");
+        if (recv_line(clientfd, len_str, sizeof(len_str)) < 0) {
+            log_warn("S1: forward_command: Recv length failed");
+            close(serverfd);
+            send(clientfd, "ERROR: Invalid content length", strlen("ERROR: Invalid content length"), 0);
+            return -1;
+        }
+        upload_size = atoll(len_str + (strncmp(len_str, "CDC ", 4) == 0 ? 4 : 0));
+        
+        if (strncmp(len_str, "CDC ", 4) == 0) {
+            if (relay_delta_upload(clientfd, serverfd, len_str) < 0) {
+                close(serverfd);
+                return -1;
+            }
+        } else {
+            size_t content_len = atoi(len_str);
+            log_debug("S1: forward_command: Content length: %zu", content_len);
+            if (content_len == 0 || content_len >= MAXCONTENT) {
+                log_warn("S1: forward_command: Invalid content length: %zu", content_len);
+                close(serverfd);
+                send(clientfd, content_len == 0 ? "ERROR: Invalid content length" : 
+                     "ERROR: Content too large", strlen(content_len == 0 ? 
+                     "ERROR: Invalid content length" : "ERROR: Content too large"), 0);
+                return -1;
+            }
+        
+            char *content = malloc(content_len + 1);
+            if (!content) {
+                log_warn("S1: forward_command: Malloc failed");
+                close(serverfd);
+                send(clientfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+                return -1;
+            }
+        
+            size_t total = 0;
+            log_debug("S1: forward_command: Receiving %zu bytes", content_len);
+            while (total < content_len) {
+                int n = recv(clientfd, content + total, content_len - total, 0);
+                if (n <= 0) {
+                    log_warn("S1: forward_command: Recv content failed: %s", n == 0 ? "closed" : strerror(errno));
+                    free(content);
+                    close(serverfd);
+                    send(clientfd, "ERROR: Failed to receive content", strlen("ERROR: Failed to receive content"), 0);
+                    return -1;
+                }
+                total += n;
+            }
+            content[total] = '\0';
+            log_debug("S1: forward_command: Received %zu bytes", total);
+            metrics_add(M_BYTES_IN, total);
+            
+            uint32_t crc = crc32c(0, content, total), expected;
+            if (crc_recv_trailer(clientfd, &expected) < 0 || crc != expected) {
+                log_warn("S1: forward_command: Bad checksum (%08x)", crc);
+                free(content);
+                close(serverfd);
+                send(clientfd, "ERROR: Checksum mismatch, upload damaged in transit",
+                     strlen("ERROR: Checksum mismatch, upload damaged in transit"), 0);
+                return -1;
+            }
+        
+            snprintf(len_str, sizeof(len_str), "%zu\n", total);
+            log_debug("S1: forward_command: Sending length to server: %zu", total);
+            if (send(serverfd, len_str, strlen(len_str), 0) < 0) {
+                log_warn("S1: forward_command: Send length failed: %s", strerror(errno));
+                free(content);
+                close(serverfd);
+                send(clientfd, "ERROR: Failed to send length to server", strlen("ERROR: Failed to send length to server"), 0);
+                return -1;
+            }
+        
+            log_debug("S1: forward_command: Sending content to server");
+            if (send(serverfd, content, total, 0) < 0 || crc_send_trailer(serverfd, crc) < 0) {
+                log_warn("S1: forward_command: Send content failed: %s", strerror(errno));
+                free(content);
+                close(serverfd);
+                send(clientfd, "ERROR: Failed to send content to server", strlen("ERROR: Failed to send content to server"), 0);
+                return -1;
+            }
+            free(content);
+        }
+    }
+    
+    // One request per backend connection: closing our write side lets the
+    // backend finish its loop, and its close marks the end of the response
+    shutdown(serverfd, SHUT_WR);
+    phase_start = phase_done(PHASE_SEND, phase_start);
+    
+    char first[MAXLINE];
+    int n = recv(serverfd, first, sizeof(first), 0);
+    phase_start = phase_done(PHASE_WAIT, phase_start);
+    
+    // A reply that is an error counts as a failed request
+    int status = -1;
+    if (n < 0) {
+        log_warn("S1: forward_command: Recv response failed: %s", strerror(errno));
+        send(clientfd, "ERROR: No response from server", strlen("ERROR: No response from server"), 0);
+    } else {
+        log_debug("S1: forward_command: Relaying server response");
+        status = relay_response(serverfd, clientfd, first, n);
+        if (n == 0 || (n >= 6 && strncmp(first, "ERROR:", 6) == 0)) {
+            status = -1;
+        }
+    }
+    phase_done(PHASE_RELAY, phase_start);
+    log_debug("S1: forward_command: Closing server connection");
+    close(serverfd);
+    return status;
+}
+
+// Bytes of a size-byte file covered by downlf's optional offset and
+// length arguments, or -1 if offset lies beyond its end
+long long range_count(long long size, long long offset, long long length) {
+    if (offset < 0 || offset > size) {
+        return -1;
+    }
+    long long count = size - offset;
+    return length >= 0 && length < count ? length : count;
+}
+
+// Handle downlf command locally for file types routed to S1, sending the
+// length bytes from offset (all of the rest when length is -1) straight
+// from the page cache
+int handle_downlf(int connfd, const char *filename, long long offset, long long length) {
+    log_debug("S1: handle_downlf: Starting for %s", filename);
+    if (!filename || strlen(filename) == 0) {
+        log_warn("S1: handle_downlf: No filename");
+        send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
         return -1;
     }
     
-    char buffer[MAXCONTENT] = {0};
+    char buffer[MAXLINE] = {0};
     char full_path[MAXPATH] = {0};
     
-    if (pathname[0] == '/') {
-        snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, pathname);
+    log_debug("S1: handle_downlf: Constructing path");
+    long long step_us = hist_now_us();
+    if (filename[0] == '/') {
+        snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, filename);
     } else {
-        snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, pathname);
+        snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, filename);
     }
     clean_path(full_path);
-    printf("S1: handle_dispfnames: Checking %s\n", full_path);
+    log_debug("S1: handle_downlf: Checking %s", full_path);
     
-    struct stat st;
-    if (stat(full_path, &st) != 0 || !S_ISDIR(st.st_mode)) {
-        printf("S1: handle_dispfnames: Not a directory: %s\n", full_path);
-        snprintf(buffer, sizeof(buffer), "ERROR: Directory %s does not exist", pathname);
+    if (!store_exists(&pack, full_path)) {
+        log_warn("S1: handle_downlf: File not found: %s", full_path);
+        snprintf(buffer, sizeof(buffer), "ERROR: File not found");
         send(connfd, buffer, strlen(buffer), 0);
         return -1;
     }
     
-    char c_files[MAX_FILES][512] = {0};
-    int c_file_count = 0;
-    printf("S1: handle_dispfnames: Collecting .c files\n");
-    if (collect_files_recursive(full_path, s1_dir, ".c", c_files, &c_file_count, MAX_FILES) < 0) {
-        printf("S1: handle_dispfnames: Collect failed\n");
-        snprintf(buffer, sizeof(buffer), "ERROR: Failed to collect files");
+    long file_size = store_stat(&pack, full_path, NULL);
+    if (file_size < 0) {
+        log_warn("S1: handle_downlf: Stat failed: %s", strerror(errno));
+        snprintf(buffer, sizeof(buffer), "ERROR: Failed to read complete file");
         send(connfd, buffer, strlen(buffer), 0);
         return -1;
     }
-    
-    int offset = 0;
-    for (int i = 0; i < c_file_count && offset < sizeof(buffer) - 1; i++) {
-        char *filename = strrchr(c_files[i], '/') ? strrchr(c_files[i], '/') + 1 : c_files[i];
-        offset += snprintf(buffer + offset, sizeof(buffer) - offset, "%s\n", filename);
+    long long count = range_count(file_size, offset, length);
+    if (count < 0) {
+        log_warn("S1: handle_downlf: Offset %lld beyond %ld bytes", offset, file_size);
+        snprintf(buffer, sizeof(buffer), "ERROR: Offset %lld is beyond the end of the file (%ld bytes)",
+                 offset, file_size);
+        send(connfd, buffer, strlen(buffer), 0);
+        return -1;
     }
+    step_us = trace_span("lookup", step_us);
     
-    if (offset == 0) {
-        snprintf(buffer, sizeof(buffer), "No .c files found in %s", pathname);
+    snprintf(buffer, sizeof(buffer), "FILE_INFO:%s\n", filename);
+    log_debug("S1: handle_downlf: Sending info: %s", buffer);
+    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
+        log_warn("S1: handle_downlf: Send info failed: %s", strerror(errno));
+        return -1;
     }
     
-    printf("S1: handle_dispfnames: Sending list: %s\n", buffer);
+    snprintf(buffer, sizeof(buffer), "%lld\n", count);
+    log_debug("S1: handle_downlf: Sending size: %s", buffer);
     if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        printf("S1: handle_dispfnames: Send failed: %s\n", strerror(errno));
+        log_warn("S1: handle_downlf: Send size failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    log_debug("S1: handle_downlf: Sending %lld bytes from offset %lld", count, offset);
+    uint32_t crc;
+    if (store_send(&store, &pack, full_path, connfd, offset, count, &crc) < 0 ||
+        crc_send_trailer(connfd, crc) < 0) {
+        log_warn("S1: handle_downlf: Send content failed: %s", strerror(errno));
         return -1;
     }
     
-    printf("S1: handle_dispfnames: Done\n");
+    // Plain files go out with sendfile, so reading and sending are one step
+    trace_span("disk read + send", step_us);
+    log_debug("S1: handle_downlf: Sent %lld bytes, CRC32C %08x", count, crc);
+    count_sent(count);
     return 0;
 }
 
-// Handle removef command locally for .c files
-int handle_removef(int connfd, const char *filename) {
-    printf("S1: handle_removef: Starting for %s\n", filename);
-    if (!filename || strlen(filename) == 0) {
-        printf("S1: handle_removef: No filename\n");
-        send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
+// Append the names of files with extension ext under full_path to buffer
+size_t list_local_files(const char *full_path, const char *pathname, const char *ext, char *buffer, size_t size) {
+    char files[MAX_FILES][512];
+    int file_count = 0;
+    size_t offset = 0;
+    log_debug("S1: list_local_files: Collecting %s files", ext);
+    if (walk_collect(full_path, ext, files, &file_count) < 0) {
+        log_warn("S1: list_local_files: Collect failed");
+        return snprintf(buffer, size, "ERROR: Failed to collect %s files\n", ext);
+    }
+    pack_collect(&pack, full_path, ext, files, &file_count, MAX_FILES);
+    
+    for (int i = 0; i < file_count && offset < size - 1; i++) {
+        char *filename = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+        offset += snprintf(buffer + offset, size - offset, "%s\n", filename);
+    }
+    
+    if (offset == 0) {
+        offset = snprintf(buffer, size, "No %s files found in %s\n", ext, pathname);
+    }
+    return offset < size ? offset : size - 1;
+}
+
+// Drop the lines of buffer[start, end) already listed before start, so a
+// file kept on several replicas is listed once. Returns the new end.
+size_t drop_listed_lines(char *buffer, size_t start, size_t end) {
+    tar_names_t listed = {0};
+    for (size_t i = 0; i < start; ) {
+        char *nl = memchr(buffer + i, '\n', start - i);
+        size_t len = nl ? (size_t)(nl - (buffer + i)) : start - i;
+        tar_names_add(&listed, tar_name_hash(buffer + i, len));
+        i += len + 1;
+    }
+    
+    size_t out = start;
+    for (size_t i = start; i < end; ) {
+        char *nl = memchr(buffer + i, '\n', end - i);
+        size_t len = nl ? (size_t)(nl - (buffer + i)) : end - i;
+        size_t span = nl ? len + 1 : len;
+        if (!tar_names_has(&listed, tar_name_hash(buffer + i, len))) {
+            memmove(buffer + out, buffer + i, span);
+            out += span;
+        }
+        i += span;
+    }
+    tar_names_free(&listed);
+    return out;
+}
+
+// Handle dispfnames command: list files kept on S1 and on every backend
+int handle_dispfnames(int connfd, const char *pathname) {
+    log_debug("S1: handle_dispfnames: Starting for %s", pathname);
+    if (!pathname || strlen(pathname) == 0) {
+        log_warn("S1: handle_dispfnames: No path");
+        send(connfd, "ERROR: Path not specified", strlen("ERROR: Path not specified"), 0);
         return -1;
     }
     
-    char *ext = strrchr(filename, '.');
-    if (!ext || strcmp(ext, ".c") != 0) {
-        printf("S1: handle_removef: Not a .c file: %s\n", filename);
-        send(connfd, "ERROR: Only .c files supported on S1", strlen("ERROR: Only .c files supported on S1"), 0);
+    char *buffer = malloc(MAXCONTENT);
+    if (!buffer) {
+        log_warn("S1: handle_dispfnames: Malloc failed");
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
         return -1;
     }
+    size_t offset = 0;
+    buffer[0] = '\0';
     
-    char buffer[MAXLINE] = {0};
     char full_path[MAXPATH] = {0};
+    if (pathname[0] == '/') {
+        snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, pathname);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, pathname);
+    }
+    clean_path(full_path);
+    log_debug("S1: handle_dispfnames: Checking %s", full_path);
+    
+    long long step_us = hist_now_us();
+    struct stat st;
+    int local_dir = stat(full_path, &st) == 0 && S_ISDIR(st.st_mode);
+    int reported_missing = 0;
+    
+    // Types stored on S1, each extension listed once
+    char exts[ROUTE_MAX_ROUTES][ROUTE_EXT_LEN];
+    int nexts = 0;
+    pthread_rwlock_rdlock(&routes_lock);
+    for (int i = 0; i < routes.nroutes; i++) {
+        const route_t *r = &routes.routes[i];
+        int listed = 0;
+        for (int j = 0; j < nexts; j++) {
+            if (strcmp(exts[j], r->ext) == 0) {
+                listed = 1;
+            }
+        }
+        if (!listed && route_has_local(&routes, r)) {
+            snprintf(exts[nexts++], ROUTE_EXT_LEN, "%s", r->ext);
+        }
+    }
+    pthread_rwlock_unlock(&routes_lock);
+    for (int i = 0; i < nexts; i++) {
+        if (!local_dir) {
+            if (!reported_missing) {
+                log_warn("S1: handle_dispfnames: Not a directory: %s", full_path);
+                offset += snprintf(buffer + offset, MAXCONTENT - offset,
+                                   "ERROR: Directory %s does not exist\n", pathname);
+                reported_missing = 1;
+            }
+            continue;
+        }
+        offset += list_local_files(full_path, pathname, exts[i], buffer + offset, MAXCONTENT - offset);
+    }
+    step_us = trace_span("lookup", step_us);
+    
+    // Every storage server lists the types it holds
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "dispfnames %s", pathname);
+    int nbackends = routes_backend_count();
+    for (int i = 0; i < nbackends && offset < MAXCONTENT - 1; i++) {
+        const backend_t *b = &routes.backends[i];
+        if (b->local) continue;
+        size_t start = offset;
+        int n = backend_request(b, line, buffer + offset, MAXCONTENT - offset);
+        step_us = trace_span_of("list", b->name, step_us);
+        if (n < 0) {
+            n = snprintf(buffer + offset, MAXCONTENT - offset, "ERROR: Failed to connect to %s\n", b->name);
+        }
+        offset += n;
+        if (offset >= MAXCONTENT - 1) {
+            offset = MAXCONTENT - 1;
+            break;
+        }
+        if (n > 0 && buffer[offset - 1] != '\n') {
+            buffer[offset++] = '\n';
+        }
+        offset = drop_listed_lines(buffer, start, offset);
+    }
+    buffer[offset] = '\0';
+    
+    if (send(connfd, buffer, offset, 0) < 0) {
+        log_warn("S1: handle_dispfnames: Send failed: %s", strerror(errno));
+        free(buffer);
+        return -1;
+    }
+    trace_span("send", step_us);
     
+    free(buffer);
+    log_debug("S1: handle_dispfnames: Done");
+    return 0;
+}
+
+// Delete a file stored on S1, leaving the reply for the client in buffer
+int remove_local_file(const char *filename, char *buffer, size_t size) {
+    char full_path[MAXPATH] = {0};
     if (filename[0] == '/') {
         snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, filename);
     } else {
         snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, filename);
     }
     clean_path(full_path);
-    printf("S1: handle_removef: Checking %s\n", full_path);
+    log_debug("S1: remove_local_file: Checking %s", full_path);
     
-    struct stat st;
-    if (stat(full_path, &st) != 0) {
-        printf("S1: handle_removef: File not found: %s\n", full_path);
-        snprintf(buffer, sizeof(buffer), "ERROR: File %s does not exist", filename);
-        send(connfd, buffer, strlen(buffer), 0);
+    if (!store_exists(&pack, full_path)) {
+        log_warn("S1: remove_local_file: File not found: %s", full_path);
+        snprintf(buffer, size, "ERROR: File %s does not exist", filename);
         return -1;
     }
     
-    if (unlink(full_path) != 0) {
-        printf("S1: handle_removef: Delete failed: %s\n", strerror(errno));
-        snprintf(buffer, sizeof(buffer), "ERROR: Failed to delete file %s: %s", filename, strerror(errno));
-        send(connfd, buffer, strlen(buffer), 0);
+    if (store_remove(&store, &pack, full_path) != 0) {
+        log_warn("S1: remove_local_file: Delete failed: %s", strerror(errno));
+        snprintf(buffer, size, "ERROR: Failed to delete file %s: %s", filename, strerror(errno));
         return -1;
     }
     
-    printf("S1: handle_removef: Deleted %s\n", full_path);
-    snprintf(buffer, sizeof(buffer), "File %s deleted from S1", filename);
-    send(connfd, buffer, strlen(buffer), 0);
+    if (wal.enabled && wal_append(&wal, WAL_DEL, full_path, 0, 0) < 0) {
+        log_warn("S1: remove_local_file: Logging removal failed: %s", strerror(errno));
+    }
+    log_debug("S1: remove_local_file: Deleted %s", full_path);
+    snprintf(buffer, size, "File %s deleted from S1", filename);
     return 0;
 }
 
-// Handle downltar command locally for .c files
-int handle_downltar(int connfd, const char *filetype) {
-    printf("S1: handle_downltar: Starting for %s\n", filetype);
-    if (!filetype || strcmp(filetype, ".c") != 0) {
-        printf("S1: handle_downltar: Invalid filetype: %s\n", filetype ? filetype : "null");
-        send(connfd, "ERROR: Only .c filetype supported on S1", strlen("ERROR: Only .c filetype supported on S1"), 0);
+// Handle removef command locally for file types routed to S1
+int handle_removef(int connfd, const char *filename) {
+    log_debug("S1: handle_removef: Starting for %s", filename);
+    if (!filename || strlen(filename) == 0) {
+        log_warn("S1: handle_removef: No filename");
+        send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
         return -1;
     }
     
     char buffer[MAXLINE] = {0};
-    char content[MAXCONTENT] = {0};
+    int status = remove_local_file(filename, buffer, sizeof(buffer));
+    send(connfd, buffer, strlen(buffer), 0);
+    return status;
+}
+
+// Write a tar of the given files, named relative to base, to out_path.
+// Used instead of running tar when files may be chunk store manifests or
+// packed, which have to be reassembled first. Returns 0 on success.
+int write_store_tar(char files[][512], int count, const char *base, const char *out_path) {
+    char *archive = malloc(TARFILE_SIZE);
+    char *data = malloc(MAXCONTENT);
+    long len = archive && data ? 0 : -1;
+    for (int i = 0; i < count && len >= 0; i++) {
+        const char *rel = files[i] + strlen(base);
+        while (*rel == '/') rel++;
+        time_t mtime;
+        long size = store_load(&store, &pack, files[i], data, MAXCONTENT);
+        if (size < 0 || store_stat(&pack, files[i], &mtime) < 0) {
+            log_warn("S1: write_store_tar: Cannot read %s: %s", files[i], strerror(errno));
+            free(archive);
+            free(data);
+            return -1;
+        }
+        len = tar_add_file(archive, len, TARFILE_SIZE, rel, data, size, mtime);
+    }
+    if (len >= 0) {
+        len = tar_finish(archive, len, TARFILE_SIZE);
+    }
+    int status = -1;
+    if (len < 0) {
+        log_warn("S1: write_store_tar: %s", archive && data ? "Archive too large" : "Out of memory");
+    } else {
+        status = cas_write_all(out_path, archive, len);
+    }
+    free(archive);
+    free(data);
+    return status;
+}
+
+// Create a tar of the filetype files stored on S1 in content. Returns the
+// tar size, 0 if S1 has no such files, or -1 with a message in errbuf.
+long build_local_tar(const char *filetype, char *content, size_t cap, char *errbuf, size_t errsize) {
+    log_debug("S1: build_local_tar: Starting for %s", filetype);
     char c_files[MAX_FILES][512] = {0};
     int file_count = 0;
     
-    printf("S1: handle_downltar: Collecting .c files\n");
-    if (collect_files_recursive(s1_dir, s1_dir, ".c", c_files, &file_count, MAX_FILES) < 0) {
-        printf("S1: handle_downltar: Collect failed\n");
-        send(connfd, "ERROR: Failed to collect .c files", strlen("ERROR: Failed to collect .c files"), 0);
+    log_debug("S1: build_local_tar: Collecting %s files", filetype);
+    if (walk_collect(s1_dir, filetype, c_files, &file_count) < 0) {
+        log_warn("S1: build_local_tar: Collect failed");
+        snprintf(errbuf, errsize, "ERROR: Failed to collect %s files", filetype);
         return -1;
     }
+    pack_collect(&pack, s1_dir, filetype, c_files, &file_count, MAX_FILES);
     
     if (file_count == 0) {
-        printf("S1: handle_downltar: No .c files\n");
-        send(connfd, "ERROR: No .c files found in S1", strlen("ERROR: No .c files found in S1"), 0);
-        return -1;
+        log_warn("S1: build_local_tar: No %s files", filetype);
+        return 0;
     }
     
     char filelist_path[256];
     time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+    struct tm t;
+    localtime_r(&now, &t);
     char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", t);
-    snprintf(filelist_path, sizeof(filelist_path), "/tmp/c_filelist_%s.txt", timestamp);
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &t);
+    // Requests are served concurrently, so the names also carry a sequence
+    // number that two archives built in the same second cannot share
+    static unsigned tar_seq;
+    unsigned seq = __atomic_fetch_add(&tar_seq, 1, __ATOMIC_RELAXED);
+    snprintf(filelist_path, sizeof(filelist_path), "/tmp/%s_filelist_%s_%d_%u.txt", filetype + 1, timestamp,
+             (int)getpid(), seq);
     
     FILE *filelist = fopen(filelist_path, "w");
     if (!filelist) {
-        printf("S1: handle_downltar: Create filelist failed: %s\n", strerror(errno));
-        send(connfd, "ERROR: Failed to prepare tar file", strlen("ERROR: Failed to prepare tar file"), 0);
+        log_warn("S1: build_local_tar: Create filelist failed: %s", strerror(errno));
+        snprintf(errbuf, errsize, "ERROR: Failed to prepare tar file");
         return -1;
     }
     
+    // Entries are named relative to the storage directory, so copies of a
+    // file held by different replicas share a name and merge into one
     for (int i = 0; i < file_count; i++) {
-        fprintf(filelist, "%s\n", c_files[i]);
+        const char *rel = c_files[i] + strlen(s1_dir);
+        while (*rel == '/') rel++;
+        fprintf(filelist, "%s\n", rel);
     }
     fclose(filelist);
     
     char tar_filename[256];
-    snprintf(tar_filename, sizeof(tar_filename), "/tmp/c_files_%s.tar", timestamp);
-    char tar_cmd[512];
-    snprintf(tar_cmd, sizeof(tar_cmd), "tar -cf %s -T %s", tar_filename, filelist_path);
-    
-    printf("S1: handle_downltar: Running: %s\n", tar_cmd);
-    if (system(tar_cmd) != 0) {
-        printf("S1: handle_downltar: Tar failed\n");
+    snprintf(tar_filename, sizeof(tar_filename), "/tmp/%s_files_%s_%d_%u.tar", filetype + 1, timestamp,
+             (int)getpid(), seq);
+    char tar_cmd[1024];
+    snprintf(tar_cmd, sizeof(tar_cmd), "tar -cf %s -C %s -T %s", tar_filename, s1_dir, filelist_path);
+    
+    int tar_result;
+    if (store.enabled || pack.enabled) {
+        tar_result = write_store_tar(c_files, file_count, s1_dir, tar_filename);
+    } else {
+        log_debug("S1: build_local_tar: Running: %s", tar_cmd);
+        tar_result = system(tar_cmd);
+    }
+    if (tar_result != 0) {
+        log_warn("S1: build_local_tar: Tar failed");
         unlink(filelist_path);
-        send(connfd, "ERROR: Failed to create tar file", strlen("ERROR: Failed to create tar file"), 0);
+        snprintf(errbuf, errsize, "ERROR: Failed to create tar file");
         return -1;
     }
     
@@ -654,9 +1504,9 @@ int handle_downltar(int connfd, const char *filetype) {
     
     FILE *tar_fp = fopen(tar_filename, "rb");
     if (!tar_fp) {
-        printf("S1: handle_downltar: Open tar failed: %s\n", strerror(errno));
+        log_warn("S1: build_local_tar: Open tar failed: %s", strerror(errno));
         unlink(tar_filename);
-        send(connfd, "ERROR: Failed to read tar file", strlen("ERROR: Failed to read tar file"), 0);
+        snprintf(errbuf, errsize, "ERROR: Failed to read tar file");
         return -1;
     }
     
@@ -664,365 +1514,2427 @@ int handle_downltar(int connfd, const char *filetype) {
     long tar_size = ftell(tar_fp);
     fseek(tar_fp, 0, SEEK_SET);
     
-    if (tar_size > TARFILE_SIZE) {
+    if (tar_size > (long)cap) {
         fclose(tar_fp);
         unlink(tar_filename);
-        printf("S1: handle_downltar: Tar too large: %ld\n", tar_size);
-        send(connfd, "ERROR: Tar file too large to transfer", strlen("ERROR: Tar file too large to transfer"), 0);
+        log_warn("S1: build_local_tar: Tar too large: %ld", tar_size);
+        snprintf(errbuf, errsize, "ERROR: Tar file too large to transfer");
         return -1;
     }
     
     size_t bytes_read = fread(content, 1, tar_size, tar_fp);
     fclose(tar_fp);
+    unlink(tar_filename);
     
     if (bytes_read != tar_size) {
-        printf("S1: handle_downltar: Read tar failed: %zu/%ld\n", bytes_read, tar_size);
-        unlink(tar_filename);
-        send(connfd, "ERROR: Failed to read complete tar file", strlen("ERROR: Failed to read complete tar file"), 0);
+        log_warn("S1: build_local_tar: Read tar failed: %zu/%ld", bytes_read, tar_size);
+        snprintf(errbuf, errsize, "ERROR: Failed to read complete tar file");
         return -1;
     }
     
-    snprintf(buffer, sizeof(buffer), "TAR_FILE:c_files.tar");
-    printf("S1: handle_downltar: Sending info: %s\n", buffer);
-    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        printf("S1: handle_downltar: Send info failed: %s\n", strerror(errno));
-        unlink(tar_filename);
-        return -1;
+    log_debug("S1: build_local_tar: Built %zu bytes", bytes_read);
+    return bytes_read;
+}
+
+// Erasure-coded objects are stored as one stripe per server, each an
+// ordinary file under the object's name starting with this header:
+//
+//     magic[8] k m index reserved stripe_len:u32 object_len:u64 object_hash:u64
+//
+// with integers little-endian. The object hash tells stripes of different
+// versions of a file apart.
+#define EC_MAGIC "S1STRIPE"
+#define EC_HEADER 32
+
+typedef struct {
+    int k, m, index;
+    size_t stripe_len;
+    uint64_t object_len;
+    uint64_t object_hash;
+} ec_stripe_t;
+
+void ec_put(unsigned char *p, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
     }
-    
-    snprintf(buffer, sizeof(buffer), "%zu\n", bytes_read);
-    printf("S1: handle_downltar: Sending size: %s\n", buffer);
-    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        printf("S1: handle_downltar: Send size failed: %s\n", strerror(errno));
-        unlink(tar_filename);
+}
+
+uint64_t ec_get(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+uint64_t ec_object_hash(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Parse the header of a stored stripe, returning -1 if data is not one
+int ec_parse(const char *data, size_t len, ec_stripe_t *s) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (len < EC_HEADER || memcmp(p, EC_MAGIC, 8) != 0) {
         return -1;
     }
-    
-    printf("S1: handle_downltar: Sending %zu bytes\n", bytes_read);
-    if (send(connfd, content, bytes_read, 0) < 0) {
-        printf("S1: handle_downltar: Send content failed: %s\n", strerror(errno));
-        unlink(tar_filename);
+    s->k = p[8];
+    s->m = p[9];
+    s->index = p[10];
+    s->stripe_len = ec_get(p + 12, 4);
+    s->object_len = ec_get(p + 16, 8);
+    s->object_hash = ec_get(p + 24, 8);
+    if (s->k < 1 || s->k + s->m > RS_MAX_SHARDS || s->index >= s->k + s->m ||
+        len != EC_HEADER + s->stripe_len || s->object_len > (uint64_t)s->k * s->stripe_len) {
         return -1;
     }
-    
-    printf("S1: handle_downltar: Sent %zu bytes\n", bytes_read);
-    unlink(tar_filename);
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <S1_port> <S2_port> <S3_port> <S4_port>\n", argv[0]);
-        exit(1);
+// Split content into k data and m parity stripes, each with its header.
+// Returns the malloc'd buffer holding them all, with stripe i at
+// stripes[i] and every stripe *size bytes long.
+char *ec_encode(const char *content, size_t len, int k, int m, char *stripes[], size_t *size) {
+    rs_code_t rs;
+    if (rs_init(&rs, k, m) < 0) {
+        return NULL;
     }
-
-    printf("S1: Parsing arguments\n");
-    int port = atoi(argv[1]);
-    S2_PORT = atoi(argv[2]);
-    S3_PORT = atoi(argv[3]);
-    S4_PORT = atoi(argv[4]);
-
-    printf("S1: Ports - S1:%d, S2:%d, S3:%d, S4:%d\n", port, S2_PORT, S3_PORT, S4_PORT);
-
-    if (port <= 0 || port > 65535 || 
-        S2_PORT <= 0 || S2_PORT > 65535 ||
-        S3_PORT <= 0 || S3_PORT > 65535 ||
-        S4_PORT <= 0 || S4_PORT > 65535) {
-        fprintf(stderr, "S1: Invalid port number(s)\n");
-        exit(1);
+    size_t stripe_len = (len + k - 1) / k;
+    size_t stride = EC_HEADER + stripe_len;
+    char *buffer = calloc(k + m, stride);
+    if (!buffer) {
+        return NULL;
     }
-
-    printf("S1: Setting up SIGPIPE handler\n");
-    signal(SIGPIPE, handle_sigpipe);
-
-    printf("S1: Getting HOME\n");
-    char *home = getenv("HOME");
-    if (!home) {
-        fprintf(stderr, "S1: Error: HOME not set\n");
-        exit(1);
+    
+    uint64_t hash = ec_object_hash(content, len);
+    uint8_t *data[RS_MAX_SHARDS], *parity[RS_MAX_SHARDS];
+    for (int i = 0; i < k + m; i++) {
+        unsigned char *p = (unsigned char *)buffer + i * stride;
+        memcpy(p, EC_MAGIC, 8);
+        p[8] = k;
+        p[9] = m;
+        p[10] = i;
+        ec_put(p + 12, stripe_len, 4);
+        ec_put(p + 16, len, 8);
+        ec_put(p + 24, hash, 8);
+        stripes[i] = (char *)p;
+        if (i < k) {
+            size_t off = i * stripe_len;
+            if (off < len) {
+                memcpy(p + EC_HEADER, content + off, len - off < stripe_len ? len - off : stripe_len);
+            }
+            data[i] = p + EC_HEADER;
+        } else {
+            parity[i - k] = p + EC_HEADER;
+        }
     }
+    rs_encode(&rs, data, parity, stripe_len);
+    *size = stride;
+    return buffer;
+}
 
-    printf("S1: HOME=%s\n", home);
-    snprintf(s1_dir, sizeof(s1_dir), "%s/S1", home);
-    clean_path(s1_dir);
-    printf("S1: Creating base directory: %s\n", s1_dir);
+// Rebuild an object from whatever stripes were fetched. stripes may hold
+// stripes of several versions; the version with the most stripes is used.
+// Returns the malloc'd object, or NULL if fewer than k stripes match.
+char *ec_decode(char *const stripes[], const size_t lens[], int n, size_t *len) {
+    ec_stripe_t hdr[ROUTE_MAX_TARGETS];
+    int valid[ROUTE_MAX_TARGETS];
+    for (int i = 0; i < n; i++) {
+        valid[i] = stripes[i] && ec_parse(stripes[i], lens[i], &hdr[i]) == 0;
+    }
     
-    if (mkdir(s1_dir, 0755) < 0 && errno != EEXIST) {
-        perror("S1: Failed to create S1 directory");
-        exit(1);
+    int best = -1, best_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (!valid[i]) continue;
+        int count = 0;
+        for (int j = 0; j < n; j++) {
+            if (valid[j] && hdr[j].object_hash == hdr[i].object_hash) count++;
+        }
+        if (count > best_count) {
+            best = i;
+            best_count = count;
+        }
     }
-
-    printf("S1: Creating socket\n");
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("S1: Socket creation failed");
-        exit(1);
+    if (best < 0 || best_count < hdr[best].k) {
+        return NULL;
     }
-
-    printf("S1: Setting socket options\n");
-    int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("S1: setsockopt(SO_REUSEADDR) failed");
-        close(sockfd);
-        exit(1);
+    
+    const ec_stripe_t *ref = &hdr[best];
+    rs_code_t rs;
+    if (rs_init(&rs, ref->k, ref->m) < 0) {
+        return NULL;
     }
-
-    printf("S1: Binding to port %d\n", port);
-    struct sockaddr_in servaddr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
-    if (bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        perror("S1: Bind failed");
-        close(sockfd);
-        exit(1);
+    char *object = malloc(ref->k * ref->stripe_len + 1);
+    if (!object) {
+        return NULL;
     }
-
-    printf("S1: Listening on port %d\n", port);
-    if (listen(sockfd, 5) < 0) {
-        perror("S1: Listen failed");
-        close(sockfd);
-        exit(1);
+    
+    uint8_t *shards[RS_MAX_SHARDS];
+    int present[RS_MAX_SHARDS] = {0};
+    for (int d = 0; d < ref->k; d++) {
+        shards[d] = (uint8_t *)object + d * ref->stripe_len;
     }
-
-    printf("S1: Server running, waiting for connections...\n");
-
-    while (1) {
-        struct sockaddr_in cliaddr;
-        socklen_t len = sizeof(cliaddr);
-        printf("S1: Waiting for client connection\n");
-        int connfd = accept(sockfd, (struct sockaddr*)&cliaddr, &len);
-        if (connfd < 0) {
-            printf("S1: Accept failed: %s\n", strerror(errno));
+    for (int i = 0; i < n; i++) {
+        const ec_stripe_t *s = &hdr[i];
+        if (!valid[i] || s->object_hash != ref->object_hash || s->k != ref->k || s->m != ref->m ||
+            s->stripe_len != ref->stripe_len || present[s->index]) {
             continue;
         }
+        present[s->index] = 1;
+        if (s->index < ref->k) {
+            memcpy(shards[s->index], stripes[i] + EC_HEADER, s->stripe_len);
+        } else {
+            shards[s->index] = (uint8_t *)stripes[i] + EC_HEADER;
+        }
+    }
+    if (rs_decode(&rs, shards, present, ref->stripe_len) < 0) {
+        free(object);
+        return NULL;
+    }
+    *len = ref->object_len;
+    return object;
+}
 
-        printf("S1: Connection from %s:%d\n", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
+// Stripe entries set aside while merging archives, rebuilt at the end
+typedef struct {
+    uint64_t name_hash;
+    char *headers;              // the entry's tar headers, then its stripe
+    size_t headers_len;
+    size_t stripe_len;
+} tar_stripe_t;
 
-        if (set_socket_timeout(connfd, 30) < 0) {
-            printf("S1: Set timeout failed: %s\n", strerror(errno));
-            close(connfd);
+typedef struct {
+    tar_stripe_t *items;
+    int count, cap;
+} stripe_stash_t;
+
+// Move the stripe entries of archive data into stash, compacting the rest
+// in place. Returns the length of the remaining entries or -1.
+long take_stripes(char *data, long len, stripe_stash_t *stash) {
+    tar_entry_t e;
+    size_t out = 0;
+    int status;
+    for (size_t off = 0; (status = tar_next(data, len, off, &e)) > 0; off = e.end) {
+        const char *body = data + e.header + TAR_BLOCK;
+        ec_stripe_t s;
+        if (ec_parse(body, e.size, &s) < 0) {
+            memmove(data + out, data + e.start, e.end - e.start);
+            out += e.end - e.start;
             continue;
         }
+        if (stash->count == stash->cap) {
+            int cap = stash->cap ? stash->cap * 2 : 16;
+            tar_stripe_t *items = realloc(stash->items, cap * sizeof(tar_stripe_t));
+            if (!items) return -1;
+            stash->items = items;
+            stash->cap = cap;
+        }
+        tar_stripe_t *t = &stash->items[stash->count];
+        t->headers_len = e.header + TAR_BLOCK - e.start;
+        t->stripe_len = e.size;
+        t->name_hash = e.name_hash;
+        t->headers = malloc(t->headers_len + e.size);
+        if (!t->headers) return -1;
+        memcpy(t->headers, data + e.start, t->headers_len + e.size);
+        stash->count++;
+    }
+    return status < 0 ? -1 : (long)out;
+}
 
-        char buffer[MAXLINE] = {0};
-        char content[MAXCONTENT] = {0};
+// Rebuild the stashed objects and append them to the archive in dst unless
+// an entry of the same name is already there. Returns the new length or -1.
+long append_stripes(char *dst, size_t dst_len, size_t cap, stripe_stash_t *stash, tar_names_t *names) {
+    for (int i = 0; i < stash->count; i++) {
+        tar_stripe_t *first = &stash->items[i];
+        if (!first->headers) continue;
         
-        while (1) {
-            printf("S1: Waiting for command\n");
-            int n = recv(connfd, buffer, MAXLINE - 1, 0);
-            if (n <= 0) {
-                if (n < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        printf("S1: Receive timeout\n");
-                    } else {
-                        printf("S1: Recv failed: %s\n", strerror(errno));
-                    }
-                } else {
-                    printf("S1: Client closed connection\n");
-                }
-                break;
+        char *stripes[ROUTE_MAX_TARGETS];
+        size_t lens[ROUTE_MAX_TARGETS];
+        int n = 0;
+        for (int j = i; j < stash->count && n < ROUTE_MAX_TARGETS; j++) {
+            tar_stripe_t *t = &stash->items[j];
+            if (t->headers && t->name_hash == first->name_hash) {
+                stripes[n] = t->headers + t->headers_len;
+                lens[n++] = t->stripe_len;
             }
-            
-            buffer[n] = '\0';
-            printf("S1: Received: %s\n", buffer);
+        }
+        
+        size_t len = 0;
+        char *object = tar_names_has(names, first->name_hash) ? NULL : ec_decode(stripes, lens, n, &len);
+        if (object) {
+            size_t padded = ((len + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+            if (dst_len + first->headers_len + padded > cap) {
+                free(object);
+                return -1;
+            }
+            memcpy(dst + dst_len, first->headers, first->headers_len);
+            tar_set_size((unsigned char *)dst + dst_len + first->headers_len - TAR_BLOCK, len);
+            dst_len += first->headers_len;
+            memcpy(dst + dst_len, object, len);
+            memset(dst + dst_len + len, 0, padded - len);
+            dst_len += padded;
+            tar_names_add(names, first->name_hash);
+            free(object);
+        } else if (!tar_names_has(names, first->name_hash)) {
+            log_warn("S1: append_stripes: Cannot rebuild an object from %d stripes", n);
+        }
+        
+        uint64_t hash = first->name_hash;
+        for (int j = i; j < stash->count; j++) {
+            tar_stripe_t *t = &stash->items[j];
+            if (t->headers && t->name_hash == hash) {
+                free(t->headers);
+                t->headers = NULL;
+            }
+        }
+    }
+    return dst_len;
+}
 
-            char cmd[50] = {0}, fname[100] = {0}, dpath[200] = {0};
-            sscanf(buffer, "%49s %99s %199s", cmd, fname, dpath);
-            printf("S1: Parsed - cmd:%s, fname:%s, dpath:%s\n", cmd, fname, dpath);
+void free_stripes(stripe_stash_t *stash) {
+    for (int i = 0; i < stash->count; i++) {
+        free(stash->items[i].headers);
+    }
+    free(stash->items);
+    memset(stash, 0, sizeof(*stash));
+}
 
-            if (strcmp(cmd, "downlf") == 0) {
-                if (strlen(fname) == 0) {
-                    printf("S1: downlf: No filename\n");
-                    send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
-                    continue;
+// Handle downltar command: merge the archives of every server holding
+// filetype, whether S1 itself or the shards of the type's routes
+int handle_downltar(int connfd, const char *filetype) {
+    log_debug("S1: handle_downltar: Starting for %s", filetype);
+    if (!filetype || filetype[0] != '.' || strchr(filetype, '/')) {
+        log_warn("S1: handle_downltar: Invalid filetype: %s", filetype ? filetype : "null");
+        send(connfd, "ERROR: Invalid filetype", strlen("ERROR: Invalid filetype"), 0);
+        return -1;
+    }
+    
+    // Every backend of the type's routes, each once
+    int targets[ROUTE_MAX_BACKENDS];
+    int ntargets = 0;
+    int seen[ROUTE_MAX_BACKENDS] = {0};
+    pthread_rwlock_rdlock(&routes_lock);
+    const route_t *first = route_first(&routes, filetype);
+    for (const route_t *r = first; r; r = r->next >= 0 ? &routes.routes[r->next] : NULL) {
+        for (int i = 0; i < r->ntargets; i++) {
+            if (!seen[r->targets[i]]) {
+                seen[r->targets[i]] = 1;
+                targets[ntargets++] = r->targets[i];
+            }
+        }
+    }
+    pthread_rwlock_unlock(&routes_lock);
+    if (!first) {
+        log_warn("S1: handle_downltar: Bad filetype: %s", filetype);
+        send(connfd, "ERROR: Unsupported file type", strlen("ERROR: Unsupported file type"), 0);
+        return -1;
+    }
+    
+    long long tar_start = hist_now_us();
+    char buffer[MAXLINE] = {0};
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "downltar %s", filetype);
+    
+    char *merged = malloc(TARFILE_SIZE);
+    char *part = malloc(TARFILE_SIZE);
+    if (!merged || !part) {
+        free(merged);
+        free(part);
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+        return -1;
+    }
+    
+    size_t merged_len = 0;
+    long long step_us = tar_start;
+    tar_names_t names = {0};    // replicas return the same entries
+    stripe_stash_t stash = {0}; // stripes of erasure-coded files
+    for (int i = 0; i < ntargets; i++) {
+        const backend_t *b = &routes.backends[targets[i]];
+        char *data = part;
+        long len;
+        if (b->local) {
+            len = build_local_tar(filetype, part, TARFILE_SIZE, buffer, sizeof(buffer));
+        } else {
+            size_t fetched = 0;
+            int status = backend_fetch(b, line, buffer, sizeof(buffer), &data, &fetched);
+            if (status < 0) {
+                snprintf(buffer, sizeof(buffer), "ERROR: Failed to connect to server");
+                len = -1;
+            } else if (status == 0) {
+                // A shard without files of this type is simply empty
+                len = strncmp(buffer, "ERROR: No ", 10) == 0 ? 0 : -1;
+            } else {
+                len = fetched;
+            }
+        }
+        
+        long kept = len > 0 ? take_stripes(data, len, &stash) : 0;
+        long merged_new = kept > 0 ? tar_append(merged, merged_len, TARFILE_SIZE - 2 * TAR_BLOCK, data, kept, &names) : (long)merged_len;
+        if (data != part) {
+            free(data);
+        }
+        if (len > 0 && kept < 0) {
+            snprintf(buffer, sizeof(buffer), "ERROR: Failed to read tar file");
+            len = -1;
+        } else if (len > 0 && merged_new < 0) {
+            snprintf(buffer, sizeof(buffer), "ERROR: Tar file too large to transfer");
+            len = -1;
+        }
+        if (len < 0) {
+            log_warn("S1: handle_downltar: %s failed: %s", b->name, buffer);
+            send(connfd, buffer, strlen(buffer), 0);
+            free_stripes(&stash);
+            tar_names_free(&names);
+            free(merged);
+            free(part);
+            return -1;
+        }
+        log_debug("S1: handle_downltar: %s contributed %ld bytes", b->name, len);
+        merged_len = merged_new;
+        step_us = trace_span_of("fetch", b->name, step_us);
+    }
+    free(part);
+    
+    long rebuilt = append_stripes(merged, merged_len, TARFILE_SIZE - 2 * TAR_BLOCK, &stash, &names);
+    free_stripes(&stash);
+    tar_names_free(&names);
+    if (rebuilt < 0) {
+        log_warn("S1: handle_downltar: Rebuilt files do not fit");
+        send(connfd, "ERROR: Tar file too large to transfer", strlen("ERROR: Tar file too large to transfer"), 0);
+        free(merged);
+        return -1;
+    }
+    merged_len = rebuilt;
+    
+    if (merged_len == 0) {
+        log_warn("S1: handle_downltar: No %s files", filetype);
+        snprintf(buffer, sizeof(buffer), "ERROR: No %s files found", filetype);
+        send(connfd, buffer, strlen(buffer), 0);
+        free(merged);
+        return -1;
+    }
+    merged_len = tar_finish(merged, merged_len, TARFILE_SIZE);
+    hist_record(&tar_hist, hist_now_us() - tar_start);
+    step_us = trace_span("merge", step_us);
+    
+    snprintf(buffer, sizeof(buffer), "TAR_FILE:%s_files.tar\n", filetype + 1);
+    log_debug("S1: handle_downltar: Sending info: %s", buffer);
+    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
+        log_warn("S1: handle_downltar: Send info failed: %s", strerror(errno));
+        free(merged);
+        return -1;
+    }
+    
+    snprintf(buffer, sizeof(buffer), "%zu\n", merged_len);
+    log_debug("S1: handle_downltar: Sending size: %s", buffer);
+    if (send(connfd, buffer, strlen(buffer), 0) < 0) {
+        log_warn("S1: handle_downltar: Send size failed: %s", strerror(errno));
+        free(merged);
+        return -1;
+    }
+    
+    log_debug("S1: handle_downltar: Sending %zu bytes", merged_len);
+    if (send(connfd, merged, merged_len, 0) < 0 || crc_send_trailer(connfd, crc32c(0, merged, merged_len)) < 0) {
+        log_warn("S1: handle_downltar: Send content failed: %s", strerror(errno));
+        free(merged);
+        return -1;
+    }
+    
+    trace_span("send", step_us);
+    log_debug("S1: handle_downltar: Sent %zu bytes", merged_len);
+    count_sent(merged_len);
+    free(merged);
+    return 0;
+}
+
+// Receive the "len\n", content and checksum trailer that follow an uploadf
+// command into a malloc'd buffer. A delta upload is resolved against the
+// file at path, if given. On failure the client has already been sent an
+// error.
+char *recv_upload(int connfd, const char *path, size_t *len) {
+    char len_str[32] = {0};
+    log_debug("S1: uploadf: Waiting for length");
+    if (recv_line(connfd, len_str, sizeof(len_str)) < 0) {
+        log_warn("S1: uploadf: Bad length");
+        send(connfd, "ERROR: Failed to receive length", 
+             strlen("ERROR: Failed to receive length"), 0);
+        return NULL;
+    }
+    upload_size = atoll(len_str + (strncmp(len_str, "CDC ", 4) == 0 ? 4 : 0));
+
+    if (strncmp(len_str, "CDC ", 4) == 0) {
+        char *content = malloc(MAXCONTENT);
+        if (!content) {
+            log_warn("S1: uploadf: Malloc failed");
+            send(connfd, "ERROR: Memory allocation failed", 
+                 strlen("ERROR: Memory allocation failed"), 0);
+            return NULL;
+        }
+        char *old = path ? malloc(MAXCONTENT) : NULL;
+        long old_len = old ? store_load(&store, &pack, path, old, MAXCONTENT) : -1;
+        size_t wanted = 0;
+        long got = cdc_recv_upload("S1", connfd, len_str, old, old_len, content, MAXCONTENT, &wanted);
+        free(old);
+        if (got < 0) {
+            free(content);
+            return NULL;
+        }
+        metrics_add(M_BYTES_IN, wanted);
+        *len = got;
+        return content;
+    }
+    
+    size_t content_len = atoi(len_str);
+    log_debug("S1: uploadf: Content length: %zu", content_len);
+
+    if (content_len == 0 || content_len >= MAXCONTENT) {
+        log_warn("S1: uploadf: Invalid length: %zu", content_len);
+        send(connfd, content_len == 0 ? "ERROR: Invalid content length" : 
+             "ERROR: Content too large", strlen(content_len == 0 ? 
+             "ERROR: Invalid content length" : "ERROR: Content too large"), 0);
+        return NULL;
+    }
+
+    char *content = malloc(content_len);
+    if (!content) {
+        log_warn("S1: uploadf: Malloc failed");
+        send(connfd, "ERROR: Memory allocation failed", 
+             strlen("ERROR: Memory allocation failed"), 0);
+        return NULL;
+    }
+
+    size_t total = 0;
+    log_debug("S1: uploadf: Receiving %zu bytes", content_len);
+    while (total < content_len) {
+        int n = recv(connfd, content + total, content_len - total, 0);
+        if (n <= 0) {
+            log_warn("S1: uploadf: Recv content failed: %s", n == 0 ? "closed" : strerror(errno));
+            send(connfd, "ERROR: Failed to receive content", 
+                 strlen("ERROR: Failed to receive content"), 0);
+            free(content);
+            return NULL;
+        }
+        total += n;
+    }
+    
+    uint32_t crc = crc32c(0, content, total), expected;
+    if (crc_recv_trailer(connfd, &expected) < 0 || crc != expected) {
+        log_warn("S1: uploadf: Bad checksum (%08x)", crc);
+        send(connfd, "ERROR: Checksum mismatch, upload damaged in transit", 
+             strlen("ERROR: Checksum mismatch, upload damaged in transit"), 0);
+        free(content);
+        return NULL;
+    }
+    
+    log_debug("S1: uploadf: Received %zu bytes, CRC32C %08x", total, crc);
+    metrics_add(M_BYTES_IN, total);
+    *len = total;
+    return content;
+}
+
+// Save an uploaded file under S1's directory, leaving the reply for the
+// client in reply
+int store_local_file(const char *fname, const char *dpath, const char *content, size_t total,
+                     char *reply, size_t rsize) {
+    char dirpath[512] = {0};
+    snprintf(dirpath, sizeof(dirpath), "%s/%s", s1_dir, dpath);
+    clean_path(dirpath);
+    
+    log_debug("S1: uploadf: Creating %s", dirpath);
+    if (create_dirs(dirpath) < 0) {
+        log_warn("S1: uploadf: Create dir failed");
+        snprintf(reply, rsize, "ERROR: Failed to create directories");
+        return -1;
+    }
+    
+    char filepath[1024] = {0};
+    snprintf(filepath, sizeof(filepath), "%s/%s", dirpath, fname);
+    clean_path(filepath);
+    log_debug("S1: uploadf: Saving to %s", filepath);
+    
+    if (store_save(&store, &pack, filepath, content, total) != 0) {
+        log_warn("S1: uploadf: Save failed: %s", strerror(errno));
+        snprintf(reply, rsize, "ERROR: Failed to save file");
+        return -1;
+    }
+
+    if (wal.enabled) {
+        long long lsn = wal_append(&wal, WAL_PUT, filepath, total, crc32c(0, content, total));
+        if (lsn < 0) {
+            log_warn("S1: uploadf: Logging failed: %s", strerror(errno));
+            snprintf(reply, rsize, "ERROR: Failed to save file");
+            return -1;
+        }
+        wal_wait(&wal, lsn);
+    }
+    
+    log_info("S1: uploadf: Saved %s (%zu bytes)", filepath, total);
+    snprintf(reply, rsize, "File saved successfully in S1");
+    return 0;
+}
+
+// Handle uploadf command locally for file types routed to S1
+int handle_uploadf(int connfd, const char *fname, const char *dpath) {
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s/%s", s1_dir, dpath, fname);
+    clean_path(filepath);
+
+    size_t total;
+    char *content = recv_upload(connfd, filepath, &total);
+    if (!content) {
+        return -1;
+    }
+    
+    char reply[MAXLINE];
+    int status = store_local_file(fname, dpath, content, total, reply, sizeof(reply));
+    free(content);
+    send(connfd, reply, strlen(reply), 0);
+    return status;
+}
+
+// State shared by the threads that write one upload to several servers,
+// whether whole replicas or erasure-coded stripes. The client handler and
+// every writer hold a reference; the last one frees it.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    char fname[100];
+    char dpath[200];
+    char *content;              // holds what every writer sends
+    int acks;                   // servers that stored their copy
+    int failures;               // servers that did not
+    int refs;
+    char reply[MAXLINE];        // first acknowledgement
+    char error[MAXLINE];        // first failure
+} replica_write_t;
+
+typedef struct {
+    replica_write_t *write;
+    const backend_t *backend;
+    const char *data;           // within write->content
+    size_t len;
+    char rid[TRACE_RID];        // request the write is part of
+} replica_task_t;
+
+void replica_write_release(replica_write_t *w) {
+    pthread_mutex_lock(&w->lock);
+    int last = --w->refs == 0;
+    pthread_mutex_unlock(&w->lock);
+    if (last) {
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->done);
+        free(w->content);
+        free(w);
+    }
+}
+
+// Upload data as dpath/fname to a storage server, leaving its reply in
+// reply. Returns 0 if the server saved the file.
+int backend_upload(const backend_t *backend, const char *fname, const char *dpath, const char *data,
+                   size_t len, char *reply, size_t rsize) {
+    int serverfd = connect_to_server(backend);
+    if (serverfd < 0) {
+        snprintf(reply, rsize, "ERROR: Failed to connect to %s", backend->name);
+        return -1;
+    }
+    load_begin(backend);
+    
+    char header[MAXLINE];
+    snprintf(header, sizeof(header), "uploadf %s %s\n%zu\n", fname, dpath, len);
+    if (send(serverfd, header, strlen(header), 0) < 0 || send(serverfd, data, len, 0) < 0 ||
+        crc_send_trailer(serverfd, crc32c(0, data, len)) < 0) {
+        log_warn("S1: backend_upload: Send to %s failed: %s", backend->name, strerror(errno));
+        snprintf(reply, rsize, "ERROR: Failed to send to %s", backend->name);
+        load_end(backend);
+        close(serverfd);
+        return -1;
+    }
+    shutdown(serverfd, SHUT_WR);
+    
+    size_t offset = 0;
+    while (offset < rsize - 1) {
+        int n = recv(serverfd, reply + offset, rsize - offset - 1, 0);
+        if (n <= 0) {
+            break;
+        }
+        offset += n;
+    }
+    reply[offset] = '\0';
+    load_end(backend);
+    close(serverfd);
+    
+    if (offset == 0) {
+        snprintf(reply, rsize, "ERROR: No response from %s", backend->name);
+        return -1;
+    }
+    return strncmp(reply, "File saved", 10) == 0 ? 0 : -1;
+}
+
+// Store one copy of an upload, leaving the server's reply in reply
+int write_replica(const backend_t *backend, const replica_write_t *w, const char *data, size_t len,
+                  char *reply, size_t rsize) {
+    if (backend->local) {
+        return store_local_file(w->fname, w->dpath, data, len, reply, rsize);
+    }
+    return backend_upload(backend, w->fname, w->dpath, data, len, reply, rsize);
+}
+
+void *replica_writer(void *arg) {
+    replica_task_t *task = arg;
+    replica_write_t *w = task->write;
+    trace_adopt(task->rid);
+    
+    char reply[MAXLINE];
+    long long start_us = hist_now_us();
+    int status = write_replica(task->backend, w, task->data, task->len, reply, sizeof(reply));
+    trace_span_of("write", task->backend->name, start_us);
+    log_debug("S1: replica_writer: %s: %s", task->backend->name, reply);
+    
+    pthread_mutex_lock(&w->lock);
+    if (status == 0) {
+        if (w->acks++ == 0) {
+            snprintf(w->reply, sizeof(w->reply), "%s", reply);
+        }
+    } else if (w->failures++ == 0) {
+        snprintf(w->error, sizeof(w->error), "%s", reply);
+    }
+    pthread_cond_broadcast(&w->done);
+    pthread_mutex_unlock(&w->lock);
+    
+    replica_write_release(w);
+    free(task);
+    return NULL;
+}
+
+// Write data[i] to backend nodes[i] for n servers in parallel and answer
+// the client as soon as quorum of them have stored it; slower writes finish
+// in the background. Takes ownership of content, which holds every data[i].
+// unit names what each server keeps in the reply ("replicas", "stripes").
+int write_parallel(int connfd, const char *fname, const char *dpath, char *content, const int nodes[],
+                   char *const data[], const size_t lens[], int n, int quorum, const char *unit) {
+    replica_write_t *w = calloc(1, sizeof(*w));
+    if (!w) {
+        log_warn("S1: write_parallel: Malloc failed");
+        free(content);
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+        return -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->done, NULL);
+    snprintf(w->fname, sizeof(w->fname), "%s", fname);
+    snprintf(w->dpath, sizeof(w->dpath), "%s", dpath);
+    w->content = content;
+    w->refs = 1;
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < n; i++) {
+        const backend_t *b = &routes.backends[nodes[i]];
+        replica_task_t *task = malloc(sizeof(*task));
+        pthread_t tid;
+        pthread_mutex_lock(&w->lock);
+        w->refs++;
+        pthread_mutex_unlock(&w->lock);
+        if (task) {
+            task->write = w;
+            task->backend = b;
+            task->data = data[i];
+            task->len = lens[i];
+            snprintf(task->rid, sizeof(task->rid), "%s", trace_rid);
+        }
+        if (!task || pthread_create(&tid, &attr, replica_writer, task) != 0) {
+            log_warn("S1: write_parallel: Cannot start writer for %s", b->name);
+            free(task);
+            pthread_mutex_lock(&w->lock);
+            w->refs--;
+            if (w->failures++ == 0) {
+                snprintf(w->error, sizeof(w->error), "ERROR: Failed to start write to %s", b->name);
+            }
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    
+    char reply[2 * MAXLINE];
+    pthread_mutex_lock(&w->lock);
+    while (w->acks < quorum && w->failures <= n - quorum) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    int status = w->acks >= quorum ? 0 : -1;
+    if (status == 0) {
+        snprintf(reply, sizeof(reply), "%s (%d of %d %s)", w->reply, w->acks, n, unit);
+    } else {
+        snprintf(reply, sizeof(reply), "ERROR: Stored on %d of %d %s, %d required: %s",
+                 w->acks, n, unit, quorum, w->error);
+    }
+    pthread_mutex_unlock(&w->lock);
+    replica_write_release(w);
+    
+    log_debug("S1: write_parallel: %s", reply);
+    send(connfd, reply, strlen(reply), 0);
+    return status;
+}
+
+// Store an upload already received in content on the file's replicas
+int replicate_content(int connfd, const char *fname, const char *dpath, const route_t *r,
+                      char *content, size_t len) {
+    int replicas[ROUTE_MAX_TARGETS];
+    int nrep = route_replicas(r, fname, replicas);
+    char *data[ROUTE_MAX_TARGETS];
+    size_t lens[ROUTE_MAX_TARGETS];
+    for (int i = 0; i < nrep; i++) {
+        data[i] = content;
+        lens[i] = len;
+    }
+    int quorum = r->write_quorum < nrep ? r->write_quorum : nrep;
+    return write_parallel(connfd, fname, dpath, content, replicas, data, lens, nrep, quorum, "replicas");
+}
+
+// Handle uploadf for a replicated route: write the file to all of its
+// replicas in parallel and answer the client as soon as the route's write
+// quorum has stored it
+int handle_replicated_upload(int connfd, const char *fname, const char *dpath, const route_t *r) {
+    size_t len;
+    char *content = recv_upload(connfd, NULL, &len);
+    if (!content) {
+        return -1;
+    }
+    return replicate_content(connfd, fname, dpath, r, content, len);
+}
+
+// State of an online rebalance, which adds a server to a route and moves
+// the files it now owns onto it in the background. Until it finishes,
+// reads and removes also try each file's owners under the old layout.
+typedef struct {
+    pthread_mutex_t lock;
+    int active;                 // rebalancer thread running
+    int started;                // a rebalance has run since S1 started
+    int route;                  // index of the route being rebalanced
+    int added;                  // backend index of the new server
+    long gen;                   // routes_gen with the new server added
+    route_t before;             // the route without the new server
+    route_t after;              // the route with it
+    double rate;                // bytes per ms, 0 for no limit
+    double start_ms, end_ms;
+    int files_total, files_moved, files_failed;
+    long long bytes_total, bytes_moved;
+    tar_names_t dirty;          // names uploaded or removed meanwhile
+} migration_t;
+
+migration_t migration = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Record that a client wrote or removed fname, so the rebalancer does not
+// overwrite the new copy with the old one. A command routed by the table
+// from before the rebalance wrote to the old owners; it is done before the
+// rebalancer lists the files, which then moves its copy like any other.
+void migration_mark(const char *fname) {
+    const char *slash = strrchr(fname, '/');
+    const char *name = slash ? slash + 1 : fname;
+    pthread_mutex_lock(&migration.lock);
+    if (migration.active && command_gen == migration.gen) {
+        tar_names_add(&migration.dirty, tar_name_hash(name, strlen(name)));
+    }
+    pthread_mutex_unlock(&migration.lock);
+}
+
+// Return 1 if r, a copy of a route, is the one being rebalanced. Called
+// with migration.lock held. A route is identified by its ext and prefix.
+int migration_is_route_locked(const route_t *r) {
+    return migration.active && strcmp(r->ext, migration.before.ext) == 0 &&
+           strcmp(r->prefix, migration.before.prefix) == 0;
+}
+
+// Return 1 if route r is being rebalanced
+int migration_covers(const route_t *r) {
+    pthread_mutex_lock(&migration.lock);
+    int covers = migration_is_route_locked(r);
+    pthread_mutex_unlock(&migration.lock);
+    return covers;
+}
+
+// Append the owners fname had before the rebalance of r to the n backends
+// in nodes, skipping ones already there. Returns the new count.
+int migration_add_old_owners(const route_t *r, const char *fname, int nodes[], int n) {
+    int old[ROUTE_MAX_TARGETS];
+    int nold = 0;
+    pthread_mutex_lock(&migration.lock);
+    if (migration_is_route_locked(r)) {
+        nold = route_replicas(&migration.before, fname, old);
+    }
+    pthread_mutex_unlock(&migration.lock);
+    
+    for (int i = 0; i < nold && n < ROUTE_MAX_TARGETS; i++) {
+        int j = 0;
+        while (j < n && nodes[j] != old[i]) j++;
+        if (j == n) {
+            nodes[n++] = old[i];
+        }
+    }
+    return n;
+}
+
+// Rotates among equally loaded replicas so all copies share the load
+unsigned int read_rotor;
+
+// Return 1 if filename is stored on S1
+int local_file_exists(const char *filename) {
+    char full_path[MAXPATH] = {0};
+    if (filename[0] == '/') {
+        snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, filename);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, filename);
+    }
+    clean_path(full_path);
+    return store_exists(&pack, full_path);
+}
+
+// A read sent to one replica and waiting for its first bytes
+typedef struct {
+    int fd;
+    const backend_t *backend;
+    double sent_ms;
+} pending_read_t;
+
+// Send line to a backend, returning the socket to read the reply from
+int start_read(const backend_t *b, const char *line) {
+    int serverfd = connect_to_server(b);
+    if (serverfd < 0) {
+        return -1;
+    }
+    if (send(serverfd, line, strlen(line), 0) < 0) {
+        log_warn("S1: start_read: Send to %s failed: %s", b->name, strerror(errno));
+        close(serverfd);
+        return -1;
+    }
+    shutdown(serverfd, SHUT_WR);
+    load_begin(b);
+    return serverfd;
+}
+
+// Give up on a read, counting the time it waited as a latency sample
+void cancel_read(pending_read_t *p) {
+    log_debug("S1: cancel_read: Cancelling read from %s", p->backend->name);
+    load_sample(p->backend, now_ms() - p->sent_ms);
+    load_end(p->backend);
+    close(p->fd);
+}
+
+// Handle downlf for a replicated route. Replicas are tried from the least
+// loaded one. If it has not started answering within its p95 latency, the
+// read is hedged to the next replica and whichever answers first is
+// relayed while the other is cancelled. A replica that is down or lacks
+// the file is skipped. During a rebalance the file's old owners are tried
+// after its new ones. offset and length select a byte range as for
+// handle_downlf.
+int handle_replicated_read(int connfd, const char *fname, long long offset, long long length,
+                           const route_t *r) {
+    int replicas[ROUTE_MAX_TARGETS];
+    int nrep = route_replicas(r, fname, replicas);
+    
+    // Rotate, then stable-sort by load so ties still alternate. Servers
+    // late with their heartbeat go after the others.
+    int order[ROUTE_MAX_TARGETS];
+    double score[ROUTE_MAX_TARGETS];
+    unsigned int start = __atomic_fetch_add(&read_rotor, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < nrep; i++) {
+        order[i] = replicas[(start + i) % nrep];
+        score[i] = load_score(&routes.backends[order[i]]);
+        if (member_state(&routes.backends[order[i]]) >= MEMBER_SUSPECT) {
+            score[i] += 1e12;
+        }
+        for (int j = i; j > 0 && score[j] < score[j - 1]; j--) {
+            int o = order[j]; order[j] = order[j - 1]; order[j - 1] = o;
+            double s = score[j]; score[j] = score[j - 1]; score[j - 1] = s;
+        }
+    }
+    nrep = migration_add_old_owners(r, fname, order, nrep);
+    
+    char error[MAXLINE];
+    snprintf(error, sizeof(error), "ERROR: File not found");
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "downlf %s %lld %lld\n", fname, offset, length);
+    
+    pending_read_t pending[2];
+    int npending = 0;
+    int next = 0;
+    while (npending > 0 || next < nrep) {
+        // Keep one read in flight, plus one hedge once the first is late
+        if (npending == 0) {
+            const backend_t *b = &routes.backends[order[next++]];
+            if (b->local) {
+                if (local_file_exists(fname)) {
+                    return handle_downlf(connfd, fname, offset, length);
                 }
-                char *ext = strrchr(fname, '.');
-                if (ext && strcmp(ext, ".c") == 0) {
-                    handle_downlf(connfd, fname);
-                } else if (ext && strcmp(ext, ".pdf") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S2_PORT);
-                } else if (ext && strcmp(ext, ".txt") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S3_PORT);
-                } else if (ext && strcmp(ext, ".zip") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S4_PORT);
-                } else {
-                    printf("S1: downlf: Bad file type: %s\n", fname);
-                    send(connfd, "ERROR: Unsupported file type", strlen("ERROR: Unsupported file type"), 0);
+                log_warn("S1: replicated_read: %s not on S1", fname);
+                continue;
+            }
+            int fd = start_read(b, line);
+            if (fd < 0) {
+                snprintf(error, sizeof(error), "ERROR: Failed to connect to server");
+                continue;
+            }
+            pending[npending++] = (pending_read_t){ fd, b, now_ms() };
+        }
+        
+        int hedge = npending == 1 && next < nrep && !routes.backends[order[next]].local;
+        double waited = now_ms() - pending[0].sent_ms;
+        double hedge_wait = hedge_delay_ms(pending[0].backend) - waited;
+        int timeout = hedge ? (int)(hedge_wait + 0.999) : 30000 - (int)(now_ms() - pending[npending - 1].sent_ms);
+        // Wake up in time to notice a server that stops sending heartbeats
+        if (timeout > HEARTBEAT_DEAD_MS) timeout = HEARTBEAT_DEAD_MS;
+        if (timeout < 0) timeout = 0;
+        
+        struct pollfd fds[2];
+        for (int i = 0; i < npending; i++) {
+            fds[i].fd = pending[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        int rc = poll(fds, npending, timeout);
+        if (rc == 0) {
+            int dropped = 0;
+            for (int i = 0; i < npending; i++) {
+                if (member_state(pending[i].backend) == MEMBER_DEAD) {
+                    log_warn("S1: replicated_read: %s is down, dropping its read", pending[i].backend->name);
+                    snprintf(error, sizeof(error), "ERROR: Server %s is down", pending[i].backend->name);
+                    cancel_read(&pending[i]);
+                    pending[i--] = pending[--npending];
+                    dropped = 1;
                 }
-            } else if (strcmp(cmd, "uploadf") == 0) {
-                if (strlen(fname) == 0 || strlen(dpath) == 0) {
-                    printf("S1: uploadf: Missing filename or path\n");
-                    send(connfd, "ERROR: Filename and path must be specified", 
-                         strlen("ERROR: Filename and path must be specified"), 0);
+            }
+            if (dropped) {
+                continue;
+            }
+        }
+        if (rc == 0 && hedge && now_ms() - pending[0].sent_ms >= hedge_delay_ms(pending[0].backend)) {
+            const backend_t *b = &routes.backends[order[next++]];
+            log_warn("S1: replicated_read: %s slow after %.1f ms, hedging to %s",
+                   pending[0].backend->name, now_ms() - pending[0].sent_ms, b->name);
+            int fd = start_read(b, line);
+            if (fd >= 0) {
+                pending[npending++] = (pending_read_t){ fd, b, now_ms() };
+            }
+            continue;
+        }
+        if (rc == 0 && now_ms() - pending[npending - 1].sent_ms < 30000) {
+            continue;
+        }
+        if (rc <= 0) {
+            log_warn("S1: replicated_read: No reply for %s", fname);
+            for (int i = 0; i < npending; i++) {
+                cancel_read(&pending[i]);
+            }
+            npending = 0;
+            snprintf(error, sizeof(error), "ERROR: No response from server");
+            continue;
+        }
+        
+        for (int i = 0; i < npending; i++) {
+            if (!fds[i].revents) continue;
+            pending_read_t p = pending[i];
+            char first[MAXLINE];
+            int n = recv(p.fd, first, sizeof(first) - 1, 0);
+            load_sample(p.backend, now_ms() - p.sent_ms);
+            // Tell an error from a file only once its first 6 bytes are in
+            for (int k; n > 0 && n < 6 && (k = recv(p.fd, first + n, sizeof(first) - 1 - n, 0)) > 0;) {
+                n += k;
+            }
+            if (n >= 0) {
+                first[n] = '\0';
+            }
+            
+            if (n >= 6 && strncmp(first, "ERROR:", 6) != 0) {
+                for (int j = 0; j < npending; j++) {
+                    if (j != i) cancel_read(&pending[j]);
+                }
+                log_debug("S1: replicated_read: Serving %s from %s", fname, p.backend->name);
+                int status = relay_response(p.fd, connfd, first, n);
+                load_end(p.backend);
+                close(p.fd);
+                return status;
+            }
+            
+            if (n > 0) {
+                snprintf(error, sizeof(error), "%s", first);
+            }
+            log_warn("S1: replicated_read: %s cannot serve %s", p.backend->name, fname);
+            load_end(p.backend);
+            close(p.fd);
+            pending[i] = pending[--npending];
+            fds[i] = fds[npending];
+            i--;
+        }
+    }
+    
+    send(connfd, error, strlen(error), 0);
+    return -1;
+}
+
+// Handle removef for a replicated or erasure-coded route: delete every
+// copy or stripe, succeeding if any server held the file. During a
+// rebalance copies on the file's old owners are deleted too.
+int handle_replicated_remove(int connfd, const char *fname, const route_t *r) {
+    int replicas[ROUTE_MAX_TARGETS];
+    int nrep = r->ec_data ? route_stripes(r, fname, replicas) : route_replicas(r, fname, replicas);
+    nrep = migration_add_old_owners(r, fname, replicas, nrep);
+    
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "removef %s", fname);
+    char first_ok[MAXLINE] = {0}, first_error[MAXLINE] = {0};
+    int removed = 0;
+    
+    for (int i = 0; i < nrep; i++) {
+        const backend_t *b = &routes.backends[replicas[i]];
+        char reply[MAXLINE];
+        if (b->local) {
+            remove_local_file(fname, reply, sizeof(reply));
+        } else if (backend_request(b, line, reply, sizeof(reply)) <= 0) {
+            snprintf(reply, sizeof(reply), "ERROR: Failed to connect to %s", b->name);
+        }
+        log_debug("S1: replicated_remove: %s: %s", b->name, reply);
+        
+        if (strncmp(reply, "ERROR", 5) != 0) {
+            if (removed++ == 0) {
+                snprintf(first_ok, sizeof(first_ok), "%s", reply);
+            }
+        } else if (first_error[0] == '\0') {
+            snprintf(first_error, sizeof(first_error), "%s", reply);
+        }
+    }
+    
+    char buffer[2 * MAXLINE];
+    if (removed > 0) {
+        snprintf(buffer, sizeof(buffer), "%s (%d of %d %s)", first_ok, removed, nrep,
+                 r->ec_data ? "servers" : "replicas");
+    } else {
+        snprintf(buffer, sizeof(buffer), "%s", first_error);
+    }
+    send(connfd, buffer, strlen(buffer), 0);
+    return removed > 0 ? 0 : -1;
+}
+
+// Read a file stored on S1 into a malloc'd buffer, as backend_fetch does
+// for a storage server. Returns 1 on success, 0 if the file is missing.
+int fetch_local_file(const char *filename, char *error, size_t esize, char **data, size_t *len) {
+    char full_path[MAXPATH] = {0};
+    if (filename[0] == '/') {
+        snprintf(full_path, sizeof(full_path), "%s%s", s1_dir, filename);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", s1_dir, filename);
+    }
+    clean_path(full_path);
+    
+    long size = store_stat(&pack, full_path, NULL);
+    if (size < 0) {
+        snprintf(error, esize, "ERROR: File not found");
+        return 0;
+    }
+    char *content = size <= MAXCONTENT ? malloc(size + 1) : NULL;
+    if (!content || store_load(&store, &pack, full_path, content, size) != size) {
+        snprintf(error, esize, "ERROR: Failed to read complete file");
+        free(content);
+        return 0;
+    }
+    *data = content;
+    *len = size;
+    return 1;
+}
+
+// State shared by the threads fetching the stripes of one object. The
+// client handler and every fetch hold a reference; the last one frees it.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int refs;
+    int pending;                // fetches still running
+    int n;
+    char *data[ROUTE_MAX_TARGETS];
+    size_t lens[ROUTE_MAX_TARGETS];
+    char error[MAXLINE];        // first error reply
+} ec_read_t;
+
+typedef struct {
+    ec_read_t *read;
+    const backend_t *backend;
+    int slot;
+    char fname[100];
+    char rid[TRACE_RID];        // request the fetch is part of
+} ec_fetch_t;
+
+void ec_read_release(ec_read_t *rd) {
+    pthread_mutex_lock(&rd->lock);
+    int last = --rd->refs == 0;
+    pthread_mutex_unlock(&rd->lock);
+    if (last) {
+        for (int i = 0; i < rd->n; i++) {
+            free(rd->data[i]);
+        }
+        pthread_mutex_destroy(&rd->lock);
+        pthread_cond_destroy(&rd->done);
+        free(rd);
+    }
+}
+
+void *stripe_fetcher(void *arg) {
+    ec_fetch_t *f = arg;
+    ec_read_t *rd = f->read;
+    trace_adopt(f->rid);
+    long long start_us = hist_now_us();
+    
+    char header[MAXLINE];
+    char *data = NULL;
+    size_t len = 0;
+    int status;
+    if (f->backend->local) {
+        status = fetch_local_file(f->fname, header, sizeof(header), &data, &len);
+    } else {
+        char line[MAXLINE];
+        snprintf(line, sizeof(line), "downlf %s", f->fname);
+        status = backend_fetch(f->backend, line, header, sizeof(header), &data, &len);
+        if (status < 0) {
+            snprintf(header, sizeof(header), "ERROR: Failed to connect to server");
+        }
+    }
+    
+    trace_span_of("fetch", f->backend->name, start_us);
+    
+    pthread_mutex_lock(&rd->lock);
+    if (status == 1) {
+        rd->data[f->slot] = data;
+        rd->lens[f->slot] = len;
+    } else if (rd->error[0] == '\0') {
+        snprintf(rd->error, sizeof(rd->error), "%s", header);
+    }
+    rd->pending--;
+    pthread_cond_broadcast(&rd->done);
+    pthread_mutex_unlock(&rd->lock);
+    
+    ec_read_release(rd);
+    free(f);
+    return NULL;
+}
+
+// Return 1 once the fetched pieces are enough to answer: a whole file, or
+// k stripes of one version of the object
+int ec_read_ready(const ec_read_t *rd) {
+    for (int i = 0; i < rd->n; i++) {
+        ec_stripe_t s;
+        if (!rd->data[i]) continue;
+        if (ec_parse(rd->data[i], rd->lens[i], &s) < 0) {
+            return 1;
+        }
+        int count = 0;
+        for (int j = 0; j < rd->n; j++) {
+            ec_stripe_t t;
+            if (rd->data[j] && ec_parse(rd->data[j], rd->lens[j], &t) == 0 && t.object_hash == s.object_hash) {
+                count++;
+            }
+        }
+        if (count >= s.k) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Send a downloaded file, or the byte range of it selected by offset and
+// length, to the client the way storage servers do
+int send_file_reply(int connfd, const char *fname, const char *data, size_t len,
+                    long long offset, long long length) {
+    char buffer[MAXLINE];
+    long long count = range_count(len, offset, length);
+    if (count < 0) {
+        snprintf(buffer, sizeof(buffer), "ERROR: Offset %lld is beyond the end of the file (%zu bytes)",
+                 offset, len);
+        send(connfd, buffer, strlen(buffer), 0);
+        return -1;
+    }
+    data += offset;
+    len = count;
+    snprintf(buffer, sizeof(buffer), "FILE_INFO:%s\n%zu\n", fname, len);
+    if (send(connfd, buffer, strlen(buffer), 0) < 0 || send(connfd, data, len, 0) < 0 ||
+        crc_send_trailer(connfd, crc32c(0, data, len)) < 0) {
+        log_warn("S1: send_file_reply: Send failed: %s", strerror(errno));
+        return -1;
+    }
+    log_debug("S1: send_file_reply: Sent %s (%zu bytes)", fname, len);
+    count_sent(len);
+    return 0;
+}
+
+// Handle downlf for an erasure-coded route: fetch from every server of the
+// file's stripe set in parallel and answer from the first k matching
+// stripes, or from a whole copy if the file was too small to be coded.
+// A byte range is cut from the rebuilt file.
+int handle_ec_read(int connfd, const char *fname, long long offset, long long length, const route_t *r) {
+    int nodes[ROUTE_MAX_TARGETS];
+    int n = route_stripes(r, fname, nodes);
+    
+    ec_read_t *rd = calloc(1, sizeof(*rd));
+    if (!rd) {
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+        return -1;
+    }
+    pthread_mutex_init(&rd->lock, NULL);
+    pthread_cond_init(&rd->done, NULL);
+    rd->refs = 1;
+    rd->n = n;
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < n; i++) {
+        ec_fetch_t *f = malloc(sizeof(*f));
+        pthread_t tid;
+        pthread_mutex_lock(&rd->lock);
+        rd->refs++;
+        rd->pending++;
+        pthread_mutex_unlock(&rd->lock);
+        if (f) {
+            f->read = rd;
+            f->backend = &routes.backends[nodes[i]];
+            f->slot = i;
+            snprintf(f->fname, sizeof(f->fname), "%s", fname);
+            snprintf(f->rid, sizeof(f->rid), "%s", trace_rid);
+        }
+        if (!f || pthread_create(&tid, &attr, stripe_fetcher, f) != 0) {
+            log_warn("S1: ec_read: Cannot start fetch from %s", routes.backends[nodes[i]].name);
+            free(f);
+            pthread_mutex_lock(&rd->lock);
+            rd->refs--;
+            rd->pending--;
+            pthread_mutex_unlock(&rd->lock);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    
+    // Fetches still running when enough pieces are in are left to finish
+    // on their own; their results are freed with the shared state
+    char *data[ROUTE_MAX_TARGETS];
+    size_t lens[ROUTE_MAX_TARGETS];
+    char error[MAXLINE];
+    pthread_mutex_lock(&rd->lock);
+    while (rd->pending > 0 && !ec_read_ready(rd)) {
+        pthread_cond_wait(&rd->done, &rd->lock);
+    }
+    memcpy(data, rd->data, sizeof(data));
+    memcpy(lens, rd->lens, sizeof(lens));
+    snprintf(error, sizeof(error), "%s", rd->error[0] ? rd->error : "ERROR: File not found");
+    pthread_mutex_unlock(&rd->lock);
+    
+    int status = -1;
+    int whole = -1;
+    for (int i = 0; i < n && whole < 0; i++) {
+        ec_stripe_t s;
+        if (data[i] && ec_parse(data[i], lens[i], &s) < 0) {
+            whole = i;
+        }
+    }
+    if (whole >= 0) {
+        log_debug("S1: ec_read: %s is stored whole on %s", fname, routes.backends[nodes[whole]].name);
+        status = send_file_reply(connfd, fname, data[whole], lens[whole], offset, length);
+    } else {
+        size_t len;
+        char *object = ec_decode(data, lens, n, &len);
+        if (object) {
+            log_debug("S1: ec_read: Rebuilt %s from stripes", fname);
+            status = send_file_reply(connfd, fname, object, len, offset, length);
+            free(object);
+        } else {
+            log_warn("S1: ec_read: Not enough stripes for %s: %s", fname, error);
+            send(connfd, error, strlen(error), 0);
+        }
+    }
+    ec_read_release(rd);
+    return status;
+}
+
+// Handle uploadf for an erasure-coded route. Files of at least the route's
+// ec_min bytes are split into k data and m parity stripes written to k + m
+// servers in parallel; smaller ones are stored like replicated files.
+int handle_ec_upload(int connfd, const char *fname, const char *dpath, const route_t *r) {
+    size_t len;
+    char *content = recv_upload(connfd, NULL, &len);
+    if (!content) {
+        return -1;
+    }
+    if (len < r->ec_min) {
+        return replicate_content(connfd, fname, dpath, r, content, len);
+    }
+    
+    char *stripes[ROUTE_MAX_TARGETS];
+    size_t size;
+    char *buffer = ec_encode(content, len, r->ec_data, r->ec_parity, stripes, &size);
+    free(content);
+    if (!buffer) {
+        log_warn("S1: ec_upload: Encode failed");
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+        return -1;
+    }
+    
+    int nodes[ROUTE_MAX_TARGETS];
+    size_t lens[ROUTE_MAX_TARGETS];
+    int n = route_stripes(r, fname, nodes);
+    for (int i = 0; i < n; i++) {
+        lens[i] = size;
+    }
+    log_debug("S1: ec_upload: %s as %d+%d stripes of %zu bytes", fname, r->ec_data, r->ec_parity, size);
+    return write_parallel(connfd, fname, dpath, buffer, nodes, stripes, lens, n, r->ec_quorum, "stripes");
+}
+
+// A file the rebalancer has to move off its current server
+typedef struct {
+    int source;                 // backend index
+    char path[MAXPATH];         // relative to the server's base directory
+    long long size;
+} move_t;
+
+// Find the files on the route's servers that the new layout places
+// elsewhere. Returns a malloc'd array of *n moves.
+move_t *plan_moves(const route_t *before, const route_t *after, int route, int *n, long long *bytes) {
+    char *list = malloc(MAXCONTENT);
+    move_t *moves = NULL;
+    int count = 0, cap = 0;
+    *bytes = 0;
+    if (!list) {
+        *n = 0;
+        return NULL;
+    }
+    
+    for (int i = 0; i < before->ntargets; i++) {
+        int source = before->targets[i];
+        const backend_t *b = &routes.backends[source];
+        if (backend_request(b, "listfiles", list, MAXCONTENT) < 0) {
+            log_warn("S1: rebalance: Cannot list files on %s", b->name);
+            continue;
+        }
+        
+        for (char *line = list, *end; *line; line = end) {
+            end = strchr(line, '\n');
+            if (!end) break;
+            *end++ = '\0';
+            char *path;
+            long long size = strtoll(line, &path, 10);
+            if (*path++ != ' ' || strncmp(path, "ERROR", 5) == 0) {
+                continue;
+            }
+            const char *slash = strrchr(path, '/');
+            const char *fname = slash ? slash + 1 : path;
+            
+            // Files under another route's prefix are not this route's
+            pthread_rwlock_rdlock(&routes_lock);
+            int ours = route_lookup(&routes, strrchr(fname, '.'), path) == &routes.routes[route];
+            pthread_rwlock_unlock(&routes_lock);
+            if (!ours) {
+                continue;
+            }
+            int owners[ROUTE_MAX_TARGETS];
+            int nowners = route_replicas(after, fname, owners);
+            int keep = 0;
+            for (int j = 0; j < nowners; j++) {
+                if (owners[j] == source) keep = 1;
+            }
+            if (keep) {
+                continue;
+            }
+            
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                move_t *grown = realloc(moves, cap * sizeof(move_t));
+                if (!grown) break;
+                moves = grown;
+            }
+            moves[count].source = source;
+            snprintf(moves[count].path, sizeof(moves[count].path), "%s", path);
+            moves[count].size = size;
+            *bytes += size;
+            count++;
+        }
+    }
+    free(list);
+    *n = count;
+    return moves;
+}
+
+// Copy one file to the owners the new layout adds for it, then delete it
+// from the server it is leaving. A file a client wrote or removed since
+// the rebalance started is only deleted: its owners already have the
+// current state. Returns 0 on success.
+int move_file(const move_t *mv, const route_t *before, const route_t *after) {
+    const backend_t *src = &routes.backends[mv->source];
+    const char *slash = strrchr(mv->path, '/');
+    const char *fname = slash ? slash + 1 : mv->path;
+    char dpath[MAXPATH];
+    if (slash) {
+        snprintf(dpath, sizeof(dpath), "%.*s", (int)(slash - mv->path + 1), mv->path);
+    } else {
+        snprintf(dpath, sizeof(dpath), "./");
+    }
+    
+    pthread_mutex_lock(&migration.lock);
+    int dirty = tar_names_has(&migration.dirty, tar_name_hash(fname, strlen(fname)));
+    pthread_mutex_unlock(&migration.lock);
+    
+    char line[MAXLINE];
+    char reply[MAXLINE];
+    if (!dirty) {
+        char *data;
+        size_t len;
+        snprintf(line, sizeof(line), "getfile %s", mv->path);
+        if (backend_fetch(src, line, reply, sizeof(reply), &data, &len) != 1) {
+            log_warn("S1: rebalance: Cannot read %s from %s: %s", mv->path, src->name, reply);
+            return -1;
+        }
+        
+        int old[ROUTE_MAX_TARGETS], owners[ROUTE_MAX_TARGETS];
+        int nold = route_replicas(before, fname, old);
+        int nowners = route_replicas(after, fname, owners);
+        for (int i = 0; i < nowners; i++) {
+            int j = 0;
+            while (j < nold && old[j] != owners[i]) j++;
+            if (j < nold) continue;
+            const backend_t *dst = &routes.backends[owners[i]];
+            if (backend_upload(dst, fname, dpath, data, len, reply, sizeof(reply)) < 0) {
+                log_warn("S1: rebalance: Cannot copy %s to %s: %s", mv->path, dst->name, reply);
+                free(data);
+                return -1;
+            }
+        }
+        free(data);
+    }
+    
+    snprintf(line, sizeof(line), "delfile %s", mv->path);
+    if (backend_request(src, line, reply, sizeof(reply)) <= 0 || strncmp(reply, "ERROR", 5) == 0) {
+        // A removef during the move may have deleted it already
+        log_warn("S1: rebalance: Cannot delete %s from %s: %s", mv->path, src->name, reply);
+        return dirty ? 0 : -1;
+    }
+    return 0;
+}
+
+// Rebalancer thread: move every file whose owner changed, one at a time,
+// sleeping as needed to keep to the configured rate
+void *rebalancer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&migration.lock);
+    route_t *before = &migration.before, *after = &migration.after;
+    int route = migration.route;
+    long gen = migration.gen;
+    double rate = migration.rate;
+    pthread_mutex_unlock(&migration.lock);
+    
+    // Commands still writing by the old layout would put files where the
+    // listing below has already looked
+    routes_drain(gen);
+    int nmoves;
+    long long bytes;
+    move_t *moves = plan_moves(before, after, route, &nmoves, &bytes);
+    log_info("S1: rebalance: %d files (%lld bytes) to move", nmoves, bytes);
+    pthread_mutex_lock(&migration.lock);
+    migration.files_total = nmoves;
+    migration.bytes_total = bytes;
+    pthread_mutex_unlock(&migration.lock);
+    
+    long long moved_bytes = 0;
+    for (int i = 0; i < nmoves; i++) {
+        int status = move_file(&moves[i], before, after);
+        log_info("S1: rebalance: %s %s from %s", status == 0 ? "Moved" : "Failed to move",
+               moves[i].path, routes.backends[moves[i].source].name);
+        
+        pthread_mutex_lock(&migration.lock);
+        if (status == 0) {
+            migration.files_moved++;
+            migration.bytes_moved += moves[i].size;
+        } else {
+            migration.files_failed++;
+        }
+        double start = migration.start_ms;
+        pthread_mutex_unlock(&migration.lock);
+        
+        // Sleep until the bytes copied so far fit the budget
+        moved_bytes += moves[i].size;
+        if (rate > 0) {
+            double ahead = start + moved_bytes / rate - now_ms();
+            if (ahead > 0) {
+                usleep((useconds_t)(ahead * 1000));
+            }
+        }
+    }
+    free(moves);
+    
+    pthread_mutex_lock(&migration.lock);
+    migration.active = 0;
+    migration.end_ms = now_ms();
+    tar_names_free(&migration.dirty);
+    log_info("S1: rebalance: Done, %d moved, %d failed", migration.files_moved, migration.files_failed);
+    pthread_mutex_unlock(&migration.lock);
+    return NULL;
+}
+
+// Handle "rebalance status"
+int handle_rebalance_status(int connfd) {
+    char buffer[2 * MAXLINE];
+    pthread_mutex_lock(&migration.lock);
+    if (!migration.started) {
+        snprintf(buffer, sizeof(buffer), "No rebalance has run");
+    } else {
+        double elapsed = ((migration.active ? now_ms() : migration.end_ms) - migration.start_ms) / 1000;
+        snprintf(buffer, sizeof(buffer),
+                 "Rebalance of %s onto %s: %s\n"
+                 "Files: %d of %d moved, %d failed\n"
+                 "Bytes: %lld of %lld moved\n"
+                 "Elapsed: %.1f s, %.2f MB/s\n",
+                 migration.before.ext, routes.backends[migration.added].name,
+                 migration.active ? "running" : "done",
+                 migration.files_moved, migration.files_total, migration.files_failed,
+                 migration.bytes_moved, migration.bytes_total,
+                 elapsed, elapsed > 0 ? migration.bytes_moved / elapsed / (1 << 20) : 0.0);
+    }
+    pthread_mutex_unlock(&migration.lock);
+    send(connfd, buffer, strlen(buffer), 0);
+    return 0;
+}
+
+// Handle rebalance command: add a storage server to the default route of
+// ext and move the files it now owns onto it in the background, at most
+// KB/s kilobytes per second if a rate is given. Requests keep being served
+// meanwhile; see migration_t.
+int handle_rebalance(int connfd, const char *ext, const char *spec, const char *line) {
+    if (strcmp(ext, "status") == 0) {
+        return handle_rebalance_status(connfd);
+    }
+    if (strlen(ext) == 0 || strlen(spec) == 0) {
+        send(connfd, "ERROR: Usage: rebalance <.ext> <host:port> [KB/s] | rebalance status",
+             strlen("ERROR: Usage: rebalance <.ext> <host:port> [KB/s] | rebalance status"), 0);
+        return -1;
+    }
+    double kbps = 0;
+    sscanf(line, "%*s %*s %*s %lf", &kbps);
+    
+    // Taken before migration.lock, so no command copies the route between
+    // the change and the start of its migration
+    pthread_rwlock_wrlock(&routes_lock);
+    int route = -1;
+    for (int i = 0; i < routes.nroutes; i++) {
+        if (strcmp(routes.routes[i].ext, ext) == 0 && routes.routes[i].prefix_len == 0) {
+            route = i;
+        }
+    }
+    
+    char buffer[MAXLINE];
+    route_t *r = route >= 0 ? &routes.routes[route] : NULL;
+    int has_local = strcmp(spec, "local") == 0;
+    for (int i = 0; r && i < r->ntargets; i++) {
+        has_local |= routes.backends[r->targets[i]].local;
+    }
+    
+    pthread_mutex_lock(&migration.lock);
+    if (!r) {
+        snprintf(buffer, sizeof(buffer), "ERROR: No route for %s", ext);
+    } else if (migration.active) {
+        snprintf(buffer, sizeof(buffer), "ERROR: A rebalance is already running");
+    } else if (r->ec_data) {
+        snprintf(buffer, sizeof(buffer), "ERROR: Erasure-coded routes cannot be rebalanced");
+    } else if (has_local) {
+        snprintf(buffer, sizeof(buffer), "ERROR: Only routes between storage servers can be rebalanced");
+    } else {
+        route_t before = *r;
+        int added = route_add_target(&routes, route, spec);
+        if (added < 0) {
+            snprintf(buffer, sizeof(buffer), "ERROR: Cannot add %s to %s", spec, ext);
+        } else {
+            migration.before = before;
+            migration.after = *r;
+            migration.route = route;
+            migration.added = added;
+            migration.rate = kbps * 1024 / 1000;
+            migration.start_ms = now_ms();
+            migration.files_total = migration.files_moved = migration.files_failed = 0;
+            migration.bytes_total = migration.bytes_moved = 0;
+            
+            pthread_t tid;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            migration.active = 1;
+            if (pthread_create(&tid, &attr, rebalancer, NULL) != 0) {
+                migration.active = 0;
+                *r = before;
+                snprintf(buffer, sizeof(buffer), "ERROR: Cannot start rebalance");
+            } else {
+                migration.started = 1;
+                migration.gen = ++routes_gen;
+                snprintf(buffer, sizeof(buffer), "Rebalancing %s onto %s", ext, spec);
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    pthread_mutex_unlock(&migration.lock);
+    pthread_rwlock_unlock(&routes_lock);
+    
+    log_info("S1: rebalance: %s", buffer);
+    send(connfd, buffer, strlen(buffer), 0);
+    return strncmp(buffer, "ERROR", 5) == 0 ? -1 : 0;
+}
+
+// Handle mpinit: start a multipart upload on the storage server a file is
+// routed to and tell the client the upload id and server, which it then
+// sends the parts to directly. Files kept on S1, replicated, erasure coded
+// or being moved by a rebalance get an error, and the client uses uploadf.
+int handle_mpinit(int connfd, const char *fname, const char *dpath, long long size) {
+    char reply[MAXLINE];
+    route_t route;
+    const route_t *r = routes_get(strrchr(fname, '.'), dpath, &route) == 0 ? &route : NULL;
+    if (!r) {
+        log_warn("S1: mpinit: Bad file type: %s", fname);
+        send(connfd, "ERROR: Unsupported file type", strlen("ERROR: Unsupported file type"), 0);
+        return -1;
+    }
+    const backend_t *b = &routes.backends[route_shard(r, fname)];
+    if (r->ec_data || r->replicas > 1 || migration_covers(r) || b->local) {
+        snprintf(reply, sizeof(reply), "ERROR: %s cannot be uploaded in parts", fname);
+        send(connfd, reply, strlen(reply), 0);
+        return -1;
+    }
+    
+    char line[MAXLINE];
+    char resp[MAXLINE];
+    snprintf(line, sizeof(line), "mpinit %s %s %lld", fname, dpath, size);
+    if (backend_request(b, line, resp, sizeof(resp)) <= 0) {
+        log_warn("S1: mpinit: %s unavailable", b->name);
+        send(connfd, "ERROR: Storage server unavailable", strlen("ERROR: Storage server unavailable"), 0);
+        return -1;
+    }
+    if (strncmp(resp, "UPLOAD:", 7) != 0) {
+        send(connfd, resp, strlen(resp), 0);
+        return -1;
+    }
+    resp[strcspn(resp, "\n")] = '\0';
+    snprintf(reply, sizeof(reply), "MULTIPART:%.64s %s\n", resp + 7, b->name);
+    log_debug("S1: mpinit: %s", reply);
+    send(connfd, reply, strlen(reply), 0);
+    return 0;
+}
+
+// Handle locate: tell a client doing a parallel download which storage
+// servers hold a file, with its size and checksum, so it can fetch ranges
+// from them directly instead of through S1. Only copies whose checksum
+// matches the first one are listed. Files kept on S1, erasure coded or
+// being moved by a rebalance get an error, and the client uses downlf.
+int handle_locate(int connfd, const char *fname) {
+    char reply[MAXLINE];
+    route_t route;
+    const route_t *r = routes_get(strrchr(fname, '.'), fname, &route) == 0 ? &route : NULL;
+    if (!r) {
+        log_warn("S1: locate: Bad file type: %s", fname);
+        send(connfd, "ERROR: Unsupported file type", strlen("ERROR: Unsupported file type"), 0);
+        return -1;
+    }
+    if (r->ec_data || migration_covers(r)) {
+        snprintf(reply, sizeof(reply), "ERROR: %s cannot be downloaded in parallel", fname);
+        send(connfd, reply, strlen(reply), 0);
+        return -1;
+    }
+    
+    int owners[ROUTE_MAX_TARGETS];
+    int n = route_replicas(r, fname, owners);
+    snprintf(reply, sizeof(reply), "ERROR: File not found");
+    
+    // Ask every copy at once, since each has to read the whole file
+    int fds[ROUTE_MAX_TARGETS];
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "checksumf %s\n", fname);
+    for (int i = 0; i < n; i++) {
+        const backend_t *b = &routes.backends[owners[i]];
+        fds[i] = -1;
+        if (b->local) {
+            snprintf(reply, sizeof(reply), "ERROR: %s cannot be downloaded in parallel", fname);
+        } else if (member_state(b) != MEMBER_DEAD && (fds[i] = connect_to_server(b)) >= 0) {
+            if (send(fds[i], line, strlen(line), 0) < 0) {
+                close(fds[i]);
+                fds[i] = -1;
+            } else {
+                shutdown(fds[i], SHUT_WR);
+            }
+        }
+    }
+    
+    char checksum[MAXLINE] = {0};
+    char servers[MAXLINE] = {0};
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        if (fds[i] < 0) continue;
+        const backend_t *b = &routes.backends[owners[i]];
+        char resp[MAXLINE];
+        int got = 0, k;
+        while (got < (int)sizeof(resp) - 1 && (k = recv(fds[i], resp + got, sizeof(resp) - 1 - got, 0)) > 0) {
+            got += k;
+        }
+        resp[got] = '\0';
+        close(fds[i]);
+        if (strncmp(resp, "CHECKSUM:", 9) != 0) {
+            log_warn("S1: locate: %s cannot serve %s", b->name, fname);
+            continue;
+        }
+        resp[strcspn(resp, "\n")] = '\0';
+        if (!checksum[0]) {
+            snprintf(checksum, sizeof(checksum), "%s", resp + 9);
+        } else if (strcmp(checksum, resp + 9) != 0) {
+            log_warn("S1: locate: Copy of %s on %s differs, skipping it", fname, b->name);
+            continue;
+        }
+        len += snprintf(servers + len, sizeof(servers) - len, " %s", b->name);
+    }
+    
+    if (len > 0) {
+        snprintf(reply, sizeof(reply), "LOCATION:%s%s\n", checksum, servers);
+    }
+    log_debug("S1: locate: %s", reply);
+    send(connfd, reply, strlen(reply), 0);
+    return len > 0 ? 0 : -1;
+}
+
+// Handle dedupstats command: chunk store figures for S1 and every
+// storage server
+int handle_dedupstats(int connfd) {
+    char buffer[MAXCONTENT / 64];
+    cas_stats(&store, "S1", buffer, sizeof(buffer));
+    if (pack.enabled) {
+        pack_stats(&pack, "S1", buffer + strlen(buffer), sizeof(buffer) - strlen(buffer));
+    }
+    if (wal.enabled) {
+        wal_stats(&wal, "S1", buffer + strlen(buffer), sizeof(buffer) - strlen(buffer));
+    }
+    size_t offset = strlen(buffer);
+    int nbackends = routes_backend_count();
+    for (int i = 0; i < nbackends && offset < sizeof(buffer) - MAXLINE; i++) {
+        const backend_t *b = &routes.backends[i];
+        if (b->local) continue;
+        char reply[MAXLINE];
+        if (backend_request(b, "dedupstats", reply, sizeof(reply)) <= 0) {
+            snprintf(reply, sizeof(reply), "no response\n");
+        }
+        offset += snprintf(buffer + offset, sizeof(buffer) - offset, "%s %s", b->name, reply);
+    }
+    send(connfd, buffer, offset, 0);
+    return 0;
+}
+
+// Handle scrubstats command: integrity scrubber progress and corrupt files
+// for every storage server
+int handle_scrubstats(int connfd) {
+    char buffer[MAXCONTENT / 64];
+    size_t offset = 0;
+    buffer[0] = '\0';
+    int nbackends = routes_backend_count();
+    for (int i = 0; i < nbackends && offset < sizeof(buffer) - 1; i++) {
+        const backend_t *b = &routes.backends[i];
+        if (b->local) continue;
+        char reply[16 * MAXLINE];
+        if (backend_request(b, "scrubstats", reply, sizeof(reply)) <= 0) {
+            snprintf(reply, sizeof(reply), "no response\n");
+        }
+        offset += snprintf(buffer + offset, sizeof(buffer) - offset, "%s %s", b->name, reply);
+    }
+    if (offset >= sizeof(buffer)) {
+        offset = sizeof(buffer) - 1;
+    }
+    if (offset == 0) {
+        snprintf(buffer, sizeof(buffer), "No storage servers\n");
+        offset = strlen(buffer);
+    }
+    send(connfd, buffer, offset, 0);
+    return 0;
+}
+
+// Handle stats command: latency of S1's commands and forward phases, then
+// of the storage servers' commands, added up across all of them
+int handle_stats(int connfd) {
+    char buffer[MAXCONTENT / 64];
+    size_t offset = 0;
+    for (int i = 0; i < NSTATS && offset < sizeof(buffer); i++) {
+        offset += hist_summary(&stat_hist[i], "S1", stat_names[i], buffer + offset, sizeof(buffer) - offset);
+    }
+    for (int i = 0; i < NPHASES && offset < sizeof(buffer); i++) {
+        offset += hist_summary(&phase_hist[i], "S1", phase_names[i], buffer + offset, sizeof(buffer) - offset);
+    }
+
+    hist_t cluster[NSTATS];
+    memset(cluster, 0, sizeof(cluster));
+    int remote = 0, answered = 0;
+    int nbackends = routes_backend_count();
+    for (int i = 0; i < nbackends; i++) {
+        const backend_t *b = &routes.backends[i];
+        if (b->local) continue;
+        remote++;
+        char reply[NSTATS * 16 * MAXLINE];
+        if (backend_request(b, "stats raw", reply, sizeof(reply)) <= 0 || strncmp(reply, "HIST ", 5) != 0) {
+            log_warn("S1: stats: No histograms from %s", b->name);
+            continue;
+        }
+        answered++;
+        char *save, *line = strtok_r(reply, "\n", &save);
+        for (; line; line = strtok_r(NULL, "\n", &save)) {
+            for (int j = 0; j < NSTATS; j++) {
+                if (hist_load(&cluster[j], stat_names[j], line) != 0) break;
+            }
+        }
+    }
+    if (remote > 0) {
+        char label[64];
+        snprintf(label, sizeof(label), "Storage servers (%d of %d reporting)", answered, remote);
+        for (int i = 0; i < NSTATS && offset < sizeof(buffer); i++) {
+            offset += hist_summary(&cluster[i], label, stat_names[i], buffer + offset, sizeof(buffer) - offset);
+        }
+    }
+    if (offset >= sizeof(buffer)) {
+        offset = sizeof(buffer) - 1;
+    }
+    send(connfd, buffer, offset, 0);
+    return 0;
+}
+
+// Handle trace command: the spans S1 and every storage server recorded,
+// of request rid only if given, sent as a Chrome trace file
+int handle_trace(int connfd, const char *rid) {
+    size_t lsize = TRACE_SPANS * 96;
+    char *lines = malloc(lsize);
+    trace_json_t j = { malloc(MAXCONTENT), 0, MAXCONTENT, 0 };
+    if (!lines || !j.p) {
+        free(lines);
+        free(j.p);
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+        return -1;
+    }
+    trace_json_begin(&j);
+    trace_dump(rid, lines, lsize);
+    int spans = trace_json_server(&j, 1, "S1", lines);
+
+    char line[MAXLINE];
+    snprintf(line, sizeof(line), "trace %s", rid);
+    int nbackends = routes_backend_count();
+    for (int i = 0; i < nbackends; i++) {
+        const backend_t *b = &routes.backends[i];
+        if (b->local) continue;
+        char name[32] = "", label[96];
+        if (backend_request(b, line, lines, lsize) <= 0 || sscanf(lines, "TRACE %31s", name) != 1) {
+            log_warn("S1: trace: No spans from %s", b->name);
+            continue;
+        }
+        snprintf(label, sizeof(label), "%s %s", name, b->name);
+        spans += trace_json_server(&j, i + 2, label, lines);
+    }
+    trace_json_end(&j);
+    free(lines);
+
+    char buffer[MAXLINE];
+    snprintf(buffer, sizeof(buffer), "TRACE_FILE:trace%s%s.json\n%zu\n", rid[0] ? "-" : "", rid, j.len);
+    int status = 0;
+    if (send(connfd, buffer, strlen(buffer), 0) < 0 || send(connfd, j.p, j.len, 0) < 0 ||
+        crc_send_trailer(connfd, crc32c(0, j.p, j.len)) < 0) {
+        log_warn("S1: trace: Send failed: %s", strerror(errno));
+        status = -1;
+    } else {
+        log_debug("S1: trace: Sent %d spans (%zu bytes)", spans, j.len);
+    }
+    free(j.p);
+    return status;
+}
+
+// Render the reply to a scrape of the metrics port
+void render_metrics(metrics_buf_t *b) {
+    char labels[96];
+    metrics_family(b, "dfs_requests_total", "counter", "Requests handled, by command and result.");
+    for (int i = 0; i < NSTATS; i++) {
+        metrics_printf(b, "dfs_requests_total{command=\"%s\",result=\"ok\"} %lld\n", stat_names[i],
+                       metrics_get(M_REQUESTS + 2 * i));
+        metrics_printf(b, "dfs_requests_total{command=\"%s\",result=\"error\"} %lld\n", stat_names[i],
+                       metrics_get(M_REQUESTS + 2 * i + 1));
+    }
+    metrics_family(b, "dfs_request_duration_seconds", "histogram", "Time from a command's arrival until it was answered.");
+    for (int i = 0; i < NSTATS; i++) {
+        snprintf(labels, sizeof(labels), "command=\"%s\"", stat_names[i]);
+        metrics_hist(b, "dfs_request_duration_seconds", labels, &stat_hist[i]);
+    }
+    static const char *phases[NPHASES] = { "connect", "send", "backend_wait", "relay" };
+    metrics_family(b, "dfs_forward_phase_duration_seconds", "histogram",
+                   "Time spent in each phase of a request passed to a storage server.");
+    for (int i = 0; i < NPHASES; i++) {
+        snprintf(labels, sizeof(labels), "phase=\"%s\"", phases[i]);
+        metrics_hist(b, "dfs_forward_phase_duration_seconds", labels, &phase_hist[i]);
+    }
+    metrics_family(b, "dfs_backend_connect_failures_total", "counter", "Failed connects to each storage server.");
+    int nbackends = routes_backend_count();
+    for (int i = 0; i < nbackends; i++) {
+        if (routes.backends[i].local) continue;
+        metrics_printf(b, "dfs_backend_connect_failures_total{backend=\"%s\"} %lld\n", routes.backends[i].name,
+                       metrics_get(M_CONNECT_FAILURES + i));
+    }
+    metrics_family(b, "dfs_backend_breaker_rejections_total", "counter",
+                   "Requests failed at once because a storage server's circuit breaker was open.");
+    for (int i = 0; i < nbackends; i++) {
+        if (routes.backends[i].local) continue;
+        metrics_printf(b, "dfs_backend_breaker_rejections_total{backend=\"%s\"} %lld\n", routes.backends[i].name,
+                       metrics_get(M_BREAKER_REJECTS + i));
+    }
+    metrics_family(b, "dfs_received_bytes_total", "counter", "File bytes received in uploads.");
+    metrics_printf(b, "dfs_received_bytes_total %lld\n", metrics_get(M_BYTES_IN));
+    metrics_family(b, "dfs_sent_bytes_total", "counter", "Bytes of files, archives and relayed replies sent to clients.");
+    metrics_printf(b, "dfs_sent_bytes_total %lld\n", metrics_get(M_BYTES_OUT));
+    metrics_family(b, "dfs_active_connections", "gauge", "Client connections being served.");
+    metrics_printf(b, "dfs_active_connections %lld\n", metrics_get(M_CONNECTIONS));
+    metrics_family(b, "dfs_dir_walk_duration_seconds", "histogram", "Time to list files under S1's directory.");
+    metrics_hist(b, "dfs_dir_walk_duration_seconds", "", &walk_hist);
+    metrics_family(b, "dfs_tar_build_duration_seconds", "histogram",
+                   "Time to gather and merge the archives for a downltar.");
+    metrics_hist(b, "dfs_tar_build_duration_seconds", "", &tar_hist);
+    if (store.enabled) {
+        unsigned long long puts = __atomic_load_n(&store.chunk_puts, __ATOMIC_RELAXED);
+        unsigned long long hits = __atomic_load_n(&store.chunk_hits, __ATOMIC_RELAXED);
+        metrics_family(b, "dfs_chunk_lookups_total", "counter",
+                       "Chunks of uploaded files, by whether the chunk store already held them.");
+        metrics_printf(b, "dfs_chunk_lookups_total{result=\"hit\"} %llu\n", hits);
+        metrics_printf(b, "dfs_chunk_lookups_total{result=\"miss\"} %llu\n", puts - hits);
+    }
+}
+
+// Build the default routes used when S1 is started with plain port arguments
+int load_default_routes(char *ports[]) {
+    static const char *exts[] = { ".pdf", ".txt", ".zip" };
+    char spec[32];
+    char *specs[1] = { spec };
+
+    snprintf(spec, sizeof(spec), "local");
+    if (route_add(&routes, ".c", "", specs, 1, 0, 0) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        int port = atoi(ports[i]);
+        if (port <= 0 || port > 65535) {
+            return -1;
+        }
+        snprintf(spec, sizeof(spec), "127.0.0.1:%d", port);
+        if (route_add(&routes, exts[i], "", specs, 1, 0, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Apply a record found in the write-ahead log at startup: redo a removal,
+// or check that an acknowledged upload survived in full
+int wal_apply(int type, const char *path, const wal_put_t *put) {
+    if (type == WAL_DEL) {
+        return store_remove(&store, &pack, path) == 0 || errno == ENOENT ? 0 : -1;
+    }
+    uint32_t crc;
+    long long len = store_checksum(&store, &pack, path, NULL, &crc);
+    if (len != (long long)put->size || crc != put->crc) {
+        log_error("S1: %s does not hold its last acknowledged upload", path);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Serve one client connection until it closes, on a thread of its own.
+// Clients are served side by side, so a slow download or an upload
+// waiting for its log record to be synced does not hold up anyone else,
+// and the uploads of concurrent clients share the same sync.
+void *serve_client(void *arg) {
+    int connfd = (int)(intptr_t)arg;
+    if (set_socket_timeout(connfd, 30) < 0) {
+        log_warn("S1: Set timeout failed: %s", strerror(errno));
+        close(connfd);
+        return NULL;
+    }
+    metrics_add(M_CONNECTIONS, 1);
+
+    char buffer[MAXLINE] = {0};
+    int timed = -1;             // stat_hist entry of the command being served
+    int failed = 0;
+    long long started_us = 0;
+    
+    while (1) {
+        // A command is done once the next one is awaited
+        routes_release();
+        if (timed >= 0) {
+            stat_done(timed, started_us, failed);
+            if (capture.fp) {
+                capture_done(&capture, buffer, started_us, failed, upload_size, reply_bytes);
+            }
+            timed = -1;
+        }
+        log_debug("S1: Waiting for command");
+        errno = 0;
+        int n = recv_line(connfd, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log_warn("S1: Receive timeout");
+            } else {
+                log_debug("S1: Client closed connection");
+            }
+            break;
+        }
+        
+        started_us = hist_now_us();
+        // The client's request id, or a new one
+        trace_take(buffer, 1);
+        log_info("S1: Received: %s @%s", buffer, trace_rid);
+
+        char cmd[50] = {0}, fname[100] = {0}, dpath[200] = {0};
+        sscanf(buffer, "%49s %99s %199s", cmd, fname, dpath);
+        trace_span("parse", started_us);
+        timed = stat_index(cmd);
+        failed = 1;             // until a handler reports success
+        upload_size = 0;
+        reply_bytes = 0;
+        log_debug("S1: Parsed - cmd:%s, fname:%s, dpath:%s", cmd, fname, dpath);
+
+        if (strcmp(cmd, "downlf") == 0 || strcmp(cmd, "removef") == 0) {
+            if (strlen(fname) == 0) {
+                log_warn("S1: %s: No filename", cmd);
+                send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
+                continue;
+            }
+            // Optional byte range: downlf <file> <offset> [<length>],
+            // passed on to storage servers in place of dpath
+            long long offset = 0, length = -1;
+            if (strcmp(cmd, "downlf") == 0) {
+                sscanf(buffer, "%*s %*s %lld %lld", &offset, &length);
+                if (offset < 0) {
+                    log_warn("S1: downlf: Bad range: %s", buffer);
+                    send(connfd, "ERROR: Invalid range", strlen("ERROR: Invalid range"), 0);
                     continue;
                 }
-                
-                char *ext = strrchr(fname, '.');
-                if (ext && strcmp(ext, ".c") == 0) {
-                    char len_str[32] = {0};
-                    printf("S1: uploadf: Waiting for length\n");
-                    int i = 0;
-                    while (i < sizeof(len_str) - 1) {
-                        n = recv(connfd, &len_str[i], 1, 0);
-                        if (n <= 0) {
-                            printf("S1: uploadf: Recv length failed: %s\n", n == 0 ? "closed" : strerror(errno));
-                            send(connfd, "ERROR: Failed to receive length", 
-                                 strlen("ERROR: Failed to receive length"), 0);
-                            break;
-                        }
-                        if (len_str[i] == '\n') {
-                            len_str[i] = '\0';
-                            break;
-                        }
-                        i++;
-                    }
-                    
-                    if (n <= 0 || i >= sizeof(len_str) - 1) {
-                        printf("S1: uploadf: Bad length\n");
-                        continue;
-                    }
-                    
-                    size_t content_len = atoi(len_str);
-                    printf("S1: uploadf: Content length: %zu\n", content_len);
-
-                    if (content_len == 0 || content_len >= MAXCONTENT) {
-                        printf("S1: uploadf: Invalid length: %zu\n", content_len);
-                        send(connfd, content_len == 0 ? "ERROR: Invalid content length" : 
-                             "ERROR: Content too large", strlen(content_len == 0 ? 
-                             "ERROR: Invalid content length" : "ERROR: Content too large"), 0);
-                        continue;
-                    }
-
-                    size_t total = 0;
-                    printf("S1: uploadf: Receiving %zu bytes\n", content_len);
-                    while (total < content_len) {
-                        n = recv(connfd, content + total, content_len - total, 0);
-                        if (n <= 0) {
-                            printf("S1: uploadf: Recv content failed: %s\n", n == 0 ? "closed" : strerror(errno));
-                            send(connfd, "ERROR: Failed to receive content", 
-                                 strlen("ERROR: Failed to receive content"), 0);
-                            break;
-                        }
-                        total += n;
-                    }
-                    
-                    if (total < content_len) {
-                        printf("S1: uploadf: Got %zu/%zu bytes\n", total, content_len);
-                        continue;
-                    }
-                    
-                    printf("S1: uploadf: Received %zu bytes\n", total);
-
-                    char dirpath[512] = {0};
-                    snprintf(dirpath, sizeof(dirpath), "%s/%s", s1_dir, dpath);
-                    clean_path(dirpath);
-                    
-                    printf("S1: uploadf: Creating %s\n", dirpath);
-                    if (create_dirs(dirpath) < 0) {
-                        printf("S1: uploadf: Create dir failed\n");
-                        send(connfd, "ERROR: Failed to create directories", 
-                             strlen("ERROR: Failed to create directories"), 0);
-                        continue;
-                    }
-                    
-                    char filepath[512] = {0};
-                    snprintf(filepath, sizeof(filepath), "%s/%s", dirpath, fname);
-                    clean_path(filepath);
-                    printf("S1: uploadf: Saving to %s\n", filepath);
-                    
-                    FILE *fp = fopen(filepath, "wb");
-                    if (!fp) {
-                        printf("S1: uploadf: Open failed: %s\n", strerror(errno));
-                        send(connfd, "ERROR: Failed to save file", 
-                             strlen("ERROR: Failed to save file"), 0);
-                        continue;
-                    }
-                    
-                    size_t written = fwrite(content, 1, total, fp);
-                    fclose(fp);
-                    
-                    if (written != total) {
-                        printf("S1: uploadf: Write failed: %zu/%zu\n", written, total);
-                        send(connfd, "ERROR: Partial file write", 
-                             strlen("ERROR: Partial file write"), 0);
-                        continue;
-                    }
-                    
-                    printf("S1: uploadf: Saved %s (%zu bytes)\n", filepath, written);
-                    send(connfd, "File saved successfully in S1", 
-                         strlen("File saved successfully in S1"), 0);
-                } else if (ext && strcmp(ext, ".pdf") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S2_PORT);
-                } else if (ext && strcmp(ext, ".txt") == 0) {
-                    printf("hiiiiiiiiii XOXOXOXO \n");
-                    printf("%d %d %s %s %s \n", connfd, S3_PORT, fname, dpath, cmd);
-                    forward_command(connfd, cmd, fname, dpath, S3_PORT);
-                } else if (ext && strcmp(ext, ".zip") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S4_PORT);
+                snprintf(dpath, sizeof(dpath), "%lld %lld", offset, length);
+            }
+            route_t route;
+            const route_t *r = routes_get(strrchr(fname, '.'), fname, &route) == 0 ? &route : NULL;
+            if (!r) {
+                log_warn("S1: %s: Bad file type: %s", cmd, fname);
+                send(connfd, "ERROR: Unsupported file type", strlen("ERROR: Unsupported file type"), 0);
+            } else if (r->ec_data) {
+                if (strcmp(cmd, "downlf") == 0) {
+                    failed = handle_ec_read(connfd, fname, offset, length, r) < 0;
                 } else {
-                    printf("S1: uploadf: Bad file type: %s\n", fname);
-                    send(connfd, "ERROR: Unsupported file type", 
-                         strlen("ERROR: Unsupported file type"), 0);
+                    failed = handle_replicated_remove(connfd, fname, r) < 0;
                 }
-            } else if (strcmp(cmd, "dispfnames") == 0) {
-                if (strlen(fname) == 0) {
-                    printf("S1: dispfnames: No path\n");
-                    send(connfd, "ERROR: Path not specified", 
-                         strlen("ERROR: Path not specified"), 0);
-                    continue;
-                }
-                handle_dispfnames(connfd, fname);
-                forward_command(connfd, cmd, fname, dpath, S2_PORT);
-                forward_command(connfd, cmd, fname, dpath, S3_PORT);
-                forward_command(connfd, cmd, fname, dpath, S4_PORT);
-            } else if (strcmp(cmd, "removef") == 0) {
-                if (strlen(fname) == 0) {
-                    printf("S1: removef: No filename\n");
-                    send(connfd, "ERROR: Filename not specified", 
-                         strlen("ERROR: Filename not specified"), 0);
-                    continue;
+            } else if (r->replicas > 1 || migration_covers(r)) {
+                if (strcmp(cmd, "removef") == 0) {
+                    migration_mark(fname);
                 }
-                char *ext = strrchr(fname, '.');
-                if (ext && strcmp(ext, ".c") == 0) {
-                    handle_removef(connfd, fname);
-                } else if (ext && strcmp(ext, ".pdf") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S2_PORT);
-                } else if (ext && strcmp(ext, ".txt") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S3_PORT);
-                } else if (ext && strcmp(ext, ".zip") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S4_PORT);
+                if (strcmp(cmd, "downlf") == 0) {
+                    failed = handle_replicated_read(connfd, fname, offset, length, r) < 0;
                 } else {
-                    printf("S1: removef: Bad file type: %s\n", fname);
-                    send(connfd, "ERROR: Unsupported file type", 
-                         strlen("ERROR: Unsupported file type"), 0);
-                }
-            } else if (strcmp(cmd, "downltar") == 0) {
-                if (strlen(fname) == 0) {
-                    printf("S1: downltar: No filetype\n");
-                    send(connfd, "ERROR: Filetype not specified", 
-                         strlen("ERROR: Filetype not specified"), 0);
-                    continue;
+                    failed = handle_replicated_remove(connfd, fname, r) < 0;
                 }
-                if (strcmp(fname, ".c") == 0) {
-                    handle_downltar(connfd, fname);
-                } else if (strcmp(fname, ".pdf") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S2_PORT);
-                } else if (strcmp(fname, ".txt") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S3_PORT);
-                } else if (strcmp(fname, ".zip") == 0) {
-                    forward_command(connfd, cmd, fname, dpath, S4_PORT);
+            } else if (routes.backends[route_shard(r, fname)].local) {
+                if (strcmp(cmd, "downlf") == 0) {
+                    failed = handle_downlf(connfd, fname, offset, length) < 0;
                 } else {
-                    printf("S1: downltar: Bad filetype: %s\n", fname);
-                    send(connfd, "ERROR: Unsupported file type", 
-                         strlen("ERROR: Unsupported file type"), 0);
+                    failed = handle_removef(connfd, fname) < 0;
                 }
             } else {
-                printf("S1: Unknown command: %s\n", cmd);
-                send(connfd, "ERROR: Unknown command", 
-                     strlen("ERROR: Unknown command"), 0);
+                failed = forward_command(connfd, cmd, fname, dpath, &routes.backends[route_shard(r, fname)]) < 0;
+            }
+        } else if (strcmp(cmd, "uploadf") == 0) {
+            if (strlen(fname) == 0 || strlen(dpath) == 0) {
+                log_warn("S1: uploadf: Missing filename or path");
+                send(connfd, "ERROR: Filename and path must be specified", 
+                     strlen("ERROR: Filename and path must be specified"), 0);
+                continue;
+            }
+            
+            route_t route;
+            const route_t *r = routes_get(strrchr(fname, '.'), dpath, &route) == 0 ? &route : NULL;
+            if (!r) {
+                log_warn("S1: uploadf: Bad file type: %s", fname);
+                send(connfd, "ERROR: Unsupported file type", 
+                     strlen("ERROR: Unsupported file type"), 0);
+            } else if (r->ec_data) {
+                failed = handle_ec_upload(connfd, fname, dpath, r) < 0;
+            } else if (r->replicas > 1 || migration_covers(r)) {
+                migration_mark(fname);
+                failed = handle_replicated_upload(connfd, fname, dpath, r) < 0;
+            } else if (routes.backends[route_shard(r, fname)].local) {
+                failed = handle_uploadf(connfd, fname, dpath) < 0;
+            } else {
+                failed = forward_command(connfd, cmd, fname, dpath, &routes.backends[route_shard(r, fname)]) < 0;
+            }
+        } else if (strcmp(cmd, "dispfnames") == 0) {
+            if (strlen(fname) == 0) {
+                log_warn("S1: dispfnames: No path");
+                send(connfd, "ERROR: Path not specified", 
+                     strlen("ERROR: Path not specified"), 0);
+                continue;
+            }
+            failed = handle_dispfnames(connfd, fname) < 0;
+        } else if (strcmp(cmd, "downltar") == 0) {
+            if (strlen(fname) == 0) {
+                log_warn("S1: downltar: No filetype");
+                send(connfd, "ERROR: Filetype not specified", 
+                     strlen("ERROR: Filetype not specified"), 0);
+                continue;
+            }
+            failed = handle_downltar(connfd, fname) < 0;
+        } else if (strcmp(cmd, "dedupstats") == 0) {
+            handle_dedupstats(connfd);
+        } else if (strcmp(cmd, "scrubstats") == 0) {
+            handle_scrubstats(connfd);
+        } else if (strcmp(cmd, "stats") == 0) {
+            handle_stats(connfd);
+        } else if (strcmp(cmd, "trace") == 0) {
+            handle_trace(connfd, fname);
+        } else if (strcmp(cmd, "mpinit") == 0) {
+            long long size = -1;
+            sscanf(buffer, "%*s %*s %*s %lld", &size);
+            if (strlen(fname) == 0 || strlen(dpath) == 0 || size < 0) {
+                send(connfd, "ERROR: Filename, path and size must be specified", 
+                     strlen("ERROR: Filename, path and size must be specified"), 0);
+                continue;
             }
+            handle_mpinit(connfd, fname, dpath, size);
+        } else if (strcmp(cmd, "locate") == 0) {
+            if (strlen(fname) == 0) {
+                send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
+                continue;
+            }
+            handle_locate(connfd, fname);
+        } else if (strcmp(cmd, "members") == 0) {
+            handle_members(connfd);
+        } else if (strcmp(cmd, "rebalance") == 0) {
+            handle_rebalance(connfd, fname, dpath, buffer);
+        } else {
+            log_warn("S1: Unknown command: %s", cmd);
+            send(connfd, "ERROR: Unknown command", 
+                 strlen("ERROR: Unknown command"), 0);
         }
-        
-        printf("S1: Closing client connection\n");
-        close(connfd);
+    }
+    
+    log_info("S1: Closing client connection");
+    close(connfd);
+    metrics_add(M_CONNECTIONS, -1);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    // Leading flags: -d for the chunk store, -p to pack small files, -w
+    // with a group-commit window in microseconds for durable uploads, -m
+    // with a local port to serve metrics on, -l with the log level, -r
+    // with a file to capture commands into
+    int dedup = 0, packed = 0, metrics_port = 0;
+    long wal_window = -1;
+    const char *capture_path = NULL;
+    while (argc > 1 && (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "-p") == 0 ||
+                        ((strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "-m") == 0 ||
+                          strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "-r") == 0) && argc > 2))) {
+        if (argv[1][1] == 'w' || argv[1][1] == 'm' || argv[1][1] == 'l' || argv[1][1] == 'r') {
+            if (argv[1][1] == 'w') {
+                wal_window = atol(argv[2]);
+            } else if (argv[1][1] == 'm') {
+                metrics_port = atoi(argv[2]);
+            } else if (argv[1][1] == 'r') {
+                capture_path = argv[2];
+            } else if (log_set_level(argv[2]) < 0) {
+                fprintf(stderr, "S1: Unknown log level %s (error, warn, info or debug)\n", argv[2]);
+                exit(1);
+            }
+            argv[2] = argv[0];
+            argv++;
+            argc--;
+        } else if (argv[1][1] == 'd') {
+            dedup = 1;
+        } else {
+            packed = 1;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc != 5 && !(argc == 4 && strcmp(argv[2], "-c") == 0)) {
+        fprintf(stderr, "Usage: %s [-d] [-p] [-w window_us] [-m metrics_port] [-l level] [-r capture_file] <S1_port> <S2_port> <S3_port> <S4_port>\n", argv[0]);
+        fprintf(stderr, "       %s [-d] [-p] [-w window_us] [-m metrics_port] [-l level] [-r capture_file] <S1_port> -c <routes.conf>\n", argv[0]);
+        exit(1);
+    }
+
+    log_debug("S1: Parsing arguments");
+    int port = atoi(argv[1]);
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "S1: Invalid port number(s)\n");
+        exit(1);
+    }
+
+    route_init(&routes);
+    if (argc == 4) {
+        log_info("S1: Loading routes from %s", argv[3]);
+        if (route_load(&routes, argv[3]) <= 0) {
+            fprintf(stderr, "S1: No usable routes in %s\n", argv[3]);
+            exit(1);
+        }
+    } else if (load_default_routes(&argv[2]) < 0) {
+        fprintf(stderr, "S1: Invalid port number(s)\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < routes.nroutes; i++) {
+        const route_t *r = &routes.routes[i];
+        char line[MAXLINE];
+        size_t len = snprintf(line, sizeof(line), "%s%s%s", r->ext, r->prefix_len ? " prefix=" : "", r->prefix);
+        if (r->replicas > 1) {
+            len += snprintf(line + len, sizeof(line) - len, " replicas=%d quorum=%d", r->replicas, r->write_quorum);
+        }
+        if (r->ec_data) {
+            len += snprintf(line + len, sizeof(line) - len, " ec=%d+%d ec_min=%zu ec_quorum=%d",
+                            r->ec_data, r->ec_parity, r->ec_min, r->ec_quorum);
+        }
+        len += snprintf(line + len, sizeof(line) - len, " ->");
+        for (int j = 0; j < r->ntargets && len < sizeof(line); j++) {
+            len += snprintf(line + len, sizeof(line) - len, " %s", routes.backends[r->targets[j]].name);
+        }
+        log_info("S1: Route %s", line);
+    }
+
+    // Erasure-coding and checksum tables are built before any request
+    // thread runs
+    gf_init();
+    crc_init();
+
+    // A rebalance waiting to change a route goes ahead of commands that
+    // arrive after it, so a busy S1 cannot hold it off indefinitely
+    pthread_rwlockattr_t rwattr;
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&routes_lock, &rwattr);
+    pthread_rwlockattr_destroy(&rwattr);
+
+    // A client or server that goes away mid-reply makes send() fail with
+    // EPIPE, which the caller logs; a handler could only interrupt a
+    // thread in the middle of a log call
+    signal(SIGPIPE, SIG_IGN);
+
+    log_debug("S1: Getting HOME");
+    char *home = getenv("HOME");
+    if (!home) {
+        fprintf(stderr, "S1: Error: HOME not set\n");
+        exit(1);
+    }
+
+    log_info("S1: HOME=%s", home);
+    snprintf(s1_dir, sizeof(s1_dir), "%s/S1", home);
+    clean_path(s1_dir);
+    log_info("S1: Creating base directory: %s", s1_dir);
+    
+    if (mkdir(s1_dir, 0755) < 0 && errno != EEXIST) {
+        log_error("S1: Failed to create S1 directory: %s", strerror(errno));
+        exit(1);
+    }
+
+    if (dedup) {
+        if (cas_open(&store, s1_dir) < 0) {
+            log_error("S1: Failed to open chunk store: %s", strerror(errno));
+            exit(1);
+        }
+        char summary[MAXLINE];
+        cas_stats(&store, "S1: Chunk store", summary, sizeof(summary));
+        log_info("%s", summary);
+    }
+
+    if (packed) {
+        if (pack_open(&pack, s1_dir) < 0) {
+            log_error("S1: Failed to open packed segments: %s", strerror(errno));
+            exit(1);
+        }
+        char summary[MAXLINE];
+        pack_stats(&pack, "S1: Packed files", summary, sizeof(summary));
+        log_info("%s", summary);
+    }
+
+    if (wal_window >= 0) {
+        if (wal_open(&wal, s1_dir, wal_window, wal_apply) < 0) {
+            log_error("S1: Failed to open write-ahead log: %s", strerror(errno));
+            exit(1);
+        }
+        log_info("S1: Durable uploads, group commit window %ld us", wal_window);
+    }
+
+    if (metrics_port > 0) {
+        if (metrics_start(metrics_port, render_metrics) < 0) {
+            log_error("S1: Failed to start metrics listener: %s", strerror(errno));
+            exit(1);
+        }
+        log_info("S1: Metrics at http://127.0.0.1:%d/metrics", metrics_port);
+    }
+
+    if (capture_path) {
+        if (capture_open(&capture, capture_path) < 0) {
+            log_error("S1: Failed to open capture file %s: %s", capture_path, strerror(errno));
+            exit(1);
+        }
+        log_info("S1: Capturing commands to %s", capture_path);
+    }
+
+    log_debug("S1: Creating socket");
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        log_error("S1: Socket creation failed: %s", strerror(errno));
+        exit(1);
+    }
+
+    log_debug("S1: Setting socket options");
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        log_error("S1: setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+        close(sockfd);
+        exit(1);
+    }
+
+    log_debug("S1: Binding to port %d", port);
+    struct sockaddr_in servaddr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    if (bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+        log_error("S1: Bind failed: %s", strerror(errno));
+        close(sockfd);
+        exit(1);
+    }
+
+    log_info("S1: Listening on port %d", port);
+    if (listen(sockfd, SOMAXCONN) < 0) {
+        log_error("S1: Listen failed: %s", strerror(errno));
+        close(sockfd);
+        exit(1);
+    }
+
+    // Storage servers send heartbeats to the same port number over UDP
+    if (start_heartbeat_listener(port) < 0) {
+        log_warn("S1: Cannot listen for heartbeats on UDP port %d: %s", port, strerror(errno));
+    }
+
+    log_info("S1: Server running, waiting for connections...");
+
+    while (1) {
+        struct sockaddr_in cliaddr;
+        socklen_t len = sizeof(cliaddr);
+        log_debug("S1: Waiting for client connection");
+        int connfd = accept(sockfd, (struct sockaddr*)&cliaddr, &len);
+        if (connfd < 0) {
+            log_warn("S1: Accept failed: %s", strerror(errno));
+            continue;
+        }
+
+        log_info("S1: Connection from %s:%d", inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, serve_client, (void *)(intptr_t)connfd) != 0) {
+            log_warn("S1: Cannot start a thread for the connection: %s", strerror(errno));
+            close(connfd);
+            continue;
+        }
+        pthread_detach(tid);
     }
 
     close(sockfd);
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // O_TMPFILE and fallocate for atomic uploads
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +14,19 @@
 #include <dirent.h>
 #include <time.h>
 #include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/statvfs.h>
+
+#include "tar.h"
+#include "cas.h"
+#include "pack.h"
+#include "wal.h"
+#include "scrub.h"
+#include "hist.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
 
 #define MAXLINE 1024
 #define MAXCONTENT 5242880 // 5MB for tar files
@@ -22,9 +37,45 @@
 // Global variable for S3 directory
 char s3_dir[256];
 
-// Signal handling
-void handle_sigpipe(int signum) {
-    printf("S3: Caught SIGPIPE signal. S1 likely disconnected unexpectedly.\n");
+// Deduplicating chunk store, enabled with -d
+cas_t store;
+
+// Segments holding small files, enabled with -p
+pack_t pack;
+
+// Write-ahead log for durable uploads, enabled with -w
+wal_t wal;
+
+// Background integrity scrubber, enabled with -s
+scrub_t scrub;
+
+// Latency of the commands S1 forwards, reported by stats
+const char *stat_names[] = { "downlf", "uploadf", "dispfnames", "removef", "downltar" };
+#define NSTATS (int)(sizeof(stat_names) / sizeof(stat_names[0]))
+hist_t stat_hist[NSTATS];
+
+int stat_index(const char *cmd) {
+    for (int i = 0; i < NSTATS; i++) {
+        if (strcmp(cmd, stat_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Counters served on the metrics port, enabled with -m
+enum {
+    M_REQUESTS,                             // ok and failed for each stat_names entry
+    M_BYTES_IN = M_REQUESTS + 2 * NSTATS,   // file bytes uploaded
+    M_BYTES_OUT,                            // file and tar bytes sent
+    M_CONNECTIONS,                          // gauge
+};
+hist_t walk_hist;                           // whole-tree directory walks
+hist_t tar_hist;                            // collecting files into a tar
+
+// Record a finished command
+void stat_done(int i, long long started_us, int failed) {
+    hist_record(&stat_hist[i], hist_now_us() - started_us);
+    trace_span(stat_names[i], started_us);
+    metrics_add(M_REQUESTS + 2 * i + (failed != 0), 1);
 }
 
 // Set socket timeout
@@ -35,6 +86,27 @@ int set_socket_timeout(int sockfd, int seconds) {
     return setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 }
 
+// Receive a newline-terminated line, returning its length or -1
+int recv_line(int sockfd, char *buf, size_t size) {
+    size_t i = 0;
+    while (i < size - 1) {
+        int n = recv(sockfd, &buf[i], 1, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        if (buf[i] == '\n') {
+            buf[i] = '\0';
+            if (i > 0 && buf[i - 1] == '\r') {
+                buf[--i] = '\0';
+            }
+            return i;
+        }
+        i++;
+    }
+    buf[i] = '\0';
+    return -1;
+}
+
 // Function to recursively search for a file
 int find_file(const char *dirname, const char *filename, char *found_path, size_t path_size, const char *base_dir) {
     DIR *dir;
@@ -47,19 +119,21 @@ int find_file(const char *dirname, const char *filename, char *found_path, size_
     }
     
     if ((dir = opendir(dirname)) == NULL) {
-        perror("opendir");
+        log_error("S3: opendir: %s", strerror(errno));
         return -1;
     }
     
     while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, CAS_DIR) == 0 || strcmp(entry->d_name, PACK_DIR) == 0 ||
+            strcmp(entry->d_name, WAL_DIR) == 0)
             continue;
         
         char path[MAXPATH];
         snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
         
         if (stat(path, &statbuf) == -1) {
-            perror("stat");
+            log_error("S3: stat: %s", strerror(errno));
             continue;
         }
         
@@ -122,7 +196,7 @@ int create_dirs(const char *path) {
         if (*p == '/') {
             *p = '\0';
             if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
-                perror("mkdir failed");
+                log_error("S3: mkdir failed: %s", strerror(errno));
                 return -1;
             }
             *p = '/';
@@ -130,7 +204,7 @@ int create_dirs(const char *path) {
     }
     
     if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
-        perror("mkdir failed");
+        log_error("S3: mkdir failed: %s", strerror(errno));
         return -1;
     }
     
@@ -149,19 +223,21 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
     struct stat statbuf;
     
     if ((dir = opendir(dirname)) == NULL) {
-        perror("opendir");
+        log_error("S3: opendir: %s", strerror(errno));
         return -1;
     }
     
     while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, CAS_DIR) == 0 || strcmp(entry->d_name, PACK_DIR) == 0 ||
+            strcmp(entry->d_name, WAL_DIR) == 0)
             continue;
         
         char path[MAXPATH];
         snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
         
         if (stat(path, &statbuf) == -1) {
-            perror("stat");
+            log_error("S3: stat: %s", strerror(errno));
             continue;
         }
         
@@ -173,7 +249,7 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
                     files[*file_count][511] = '\0';
                     (*file_count)++;
                 } else {
-                    fprintf(stderr, "Warning: Maximum file count reached\n");
+                    log_warn("S3: Maximum file count reached");
                     closedir(dir);
                     return 0;
                 }
@@ -187,106 +263,517 @@ int collect_files_recursive(const char *dirname, const char *base_dir, const cha
     return 0;
 }
 
+// find_file and collect_files_recursive from the top of the tree, timed
+// for the metrics
+int walk_find(const char *filename, char *found_path, size_t path_size) {
+    long long start = hist_now_us();
+    int found = find_file(s3_dir, filename, found_path, path_size, s3_dir);
+    hist_record(&walk_hist, hist_now_us() - start);
+    return found;
+}
+
+int walk_collect(const char *dirname, char files[][512], int *file_count) {
+    long long start = hist_now_us();
+    int status = collect_files_recursive(dirname, s3_dir, ".txt", files, file_count, MAX_FILES);
+    hist_record(&walk_hist, hist_now_us() - start);
+    return status;
+}
+
 // Handle downlf command
-int handle_downlf(int connfd, const char *filename) {
-    if (!filename || strlen(filename) == 0) {
-        send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
-        return -1;
-    }
-    
-    char *ext = strrchr(filename, '.');
-    if (!ext || strcmp(ext, ".txt") != 0) {
-        send(connfd, "ERROR: Only .txt files supported", strlen("ERROR: Only .txt files supported"), 0);
+// Bytes of a size-byte file covered by downlf's optional offset and
+// length arguments, or -1 if offset lies beyond its end
+long long range_count(long long size, long long offset, long long length) {
+    if (offset < 0 || offset > size) {
         return -1;
     }
-    
-    char buffer[MAXLINE];
-    char content[MAXCONTENT];
-    char found_path[MAXPATH] = {0};
-    char full_path[MAXPATH];
+    long long count = size - offset;
+    return length >= 0 && length < count ? length : count;
+}
+
+// Resolve a filename given to downlf (a ~/S3/ path, an absolute path, or a
+// name searched for under s3_dir) to full_path, and the name reported back
+// to found_path. Both hold MAXPATH bytes. Returns 1 if the file exists.
+int resolve_file(const char *filename, char *full_path, char *found_path) {
     int found = 0;
-    
-    printf("S3: Processing downlf for file %s\n", filename);
-    
     if (strncmp(filename, "~/S3/", 5) == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/%s", getenv("HOME"), filename + 2);
-        if (access(full_path, F_OK) == 0) {
+        snprintf(full_path, MAXPATH, "%s/%s", s3_dir, filename + 5);
+        if (store_exists(&pack, full_path)) {
             found = 1;
-            strncpy(found_path, filename, sizeof(found_path)-1);
+            strncpy(found_path, filename, MAXPATH-1);
         }
     } else if (filename[0] == '/') {
-        strncpy(full_path, filename, sizeof(full_path)-1);
-        if (access(full_path, F_OK) == 0) {
+        strncpy(full_path, filename, MAXPATH-1);
+        if (store_exists(&pack, full_path)) {
             found = 1;
-            strncpy(found_path, filename, sizeof(found_path)-1);
+            strncpy(found_path, filename, MAXPATH-1);
         }
     } else {
-        found = find_file(s3_dir, filename, found_path, sizeof(found_path), s3_dir);
+        found = walk_find(filename, found_path, MAXPATH);
+        if (found != 1) {
+            found = pack_find(&pack, s3_dir, filename, found_path, MAXPATH);
+        }
         if (found == 1) {
-            snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, found_path);
+            snprintf(full_path, MAXPATH, "%s/%s", s3_dir, found_path);
         } else {
-            snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, filename);
-            if (access(full_path, F_OK) == 0) {
+            snprintf(full_path, MAXPATH, "%s/%s", s3_dir, filename);
+            if (store_exists(&pack, full_path)) {
                 found = 1;
-                strncpy(found_path, filename, sizeof(found_path)-1);
+                strncpy(found_path, filename, MAXPATH-1);
             }
         }
     }
-    
-    if (!found || access(full_path, F_OK) != 0) {
-        snprintf(buffer, sizeof(buffer), "ERROR: File not found");
-        send(connfd, buffer, strlen(buffer), 0);
+
+    return found && store_exists(&pack, full_path);
+}
+
+// Send a file, or the length bytes of it from offset (all of the rest when
+// length is -1), straight from the page cache
+int handle_downlf(int connfd, const char *filename, long long offset, long long length) {
+    if (!filename || strlen(filename) == 0) {
+        send(connfd, "ERROR: Filename not specified", strlen("ERROR: Filename not specified"), 0);
         return -1;
     }
     
-    printf("S3: Found file at: %s\n", full_path);
-    
-    FILE *fp = fopen(full_path, "rb");
-    if (!fp) {
-        perror("File open failed");
-        snprintf(buffer, sizeof(buffer), "ERROR: Failed to open file");
-        send(connfd, buffer, strlen(buffer), 0);
+    char *ext = strrchr(filename, '.');
+    if (!ext || strcmp(ext, ".txt") != 0) {
+        send(connfd, "ERROR: Only .txt files supported", strlen("ERROR: Only .txt files supported"), 0);
         return -1;
     }
     
-    fseek(fp, 0, SEEK_END);
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    char buffer[MAXLINE];
+    char found_path[MAXPATH] = {0};
+    char full_path[MAXPATH];
+    
+    log_debug("S3: Processing downlf for file %s", filename);
+    long long step_us = hist_now_us();
     
-    if (file_size > MAXCONTENT) {
-        fclose(fp);
-        snprintf(buffer, sizeof(buffer), "ERROR: File too large to transfer");
+    if (!resolve_file(filename, full_path, found_path)) {
+        snprintf(buffer, sizeof(buffer), "ERROR: File not found");
         send(connfd, buffer, strlen(buffer), 0);
         return -1;
     }
     
-    size_t bytes_read = fread(content, 1, file_size, fp);
-    fclose(fp);
+    log_debug("S3: Found file at: %s", full_path);
     
-    if (bytes_read != file_size) {
+    long file_size = store_stat(&pack, full_path, NULL);
+    if (file_size < 0) {
+        log_error("S3: File stat failed: %s", strerror(errno));
         snprintf(buffer, sizeof(buffer), "ERROR: Failed to read complete file");
         send(connfd, buffer, strlen(buffer), 0);
         return -1;
     }
+    long long count = range_count(file_size, offset, length);
+    if (count < 0) {
+        snprintf(buffer, sizeof(buffer), "ERROR: Offset %lld is beyond the end of the file (%ld bytes)",
+                 offset, file_size);
+        send(connfd, buffer, strlen(buffer), 0);
+        return -1;
+    }
+    step_us = trace_span("lookup", step_us);
     
-    snprintf(buffer, sizeof(buffer), "FILE_INFO:%s", found_path);
+    snprintf(buffer, sizeof(buffer), "FILE_INFO:%s\n", found_path);
     if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        perror("send file info failed");
+        log_error("S3: send file info failed: %s", strerror(errno));
         return -1;
     }
     
-    snprintf(buffer, sizeof(buffer), "%zu\n", bytes_read);
+    snprintf(buffer, sizeof(buffer), "%lld\n", count);
     if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        perror("send file size failed");
+        log_error("S3: send file size failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    uint32_t crc;
+    if (store_send(&store, &pack, full_path, connfd, offset, count, &crc) < 0) {
+        log_error("S3: send file content failed: %s", strerror(errno));
+        return -1;
+    }
+    if (crc_send_trailer(connfd, crc) < 0) {
+        log_error("S3: send checksum failed: %s", strerror(errno));
+        return -1;
+    }
+    // Plain files go out with sendfile, so reading and sending are one step
+    trace_span("disk read + send", step_us);
+    
+    metrics_add(M_BYTES_OUT, count);
+    log_info("S3: Sent file to S1 (%lld bytes from offset %lld, CRC32C %08x)", count, offset, crc);
+    return 0;
+}
+
+typedef struct {
+    int connfd;
+    char fname[100];
+    long long offset;
+    long long length;
+    long long started_us;       // when the request arrived
+    char rid[TRACE_RID];
+} download_t;
+
+void *download_thread(void *arg) {
+    download_t *d = arg;
+    trace_adopt(d->rid);
+    int status = handle_downlf(d->connfd, d->fname, d->offset, d->length);
+    close(d->connfd);
+    metrics_add(M_CONNECTIONS, -1);
+    stat_done(stat_index("downlf"), d->started_us, status < 0);
+    free(d);
+    return NULL;
+}
+
+// Serve a download on its own thread, which closes the connection when
+// done, so the ranges of a parallel download are sent concurrently.
+// Returns 0 once started.
+int start_download(int connfd, const char *fname, long long offset, long long length, long long started_us) {
+    download_t *d = malloc(sizeof(download_t));
+    if (!d) {
+        return -1;
+    }
+    d->connfd = connfd;
+    snprintf(d->fname, sizeof(d->fname), "%s", fname);
+    d->offset = offset;
+    d->length = length;
+    d->started_us = started_us;
+    snprintf(d->rid, sizeof(d->rid), "%s", trace_rid);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, download_thread, d) != 0) {
+        free(d);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Reply with the size and BLAKE2b checksum of a file, which a parallel
+// download checks the assembled file against
+int handle_checksumf(int connfd, const char *filename) {
+    char buffer[MAXLINE];
+    char found_path[MAXPATH] = {0};
+    char full_path[MAXPATH];
+    
+    if (!resolve_file(filename, full_path, found_path)) {
+        send(connfd, "ERROR: File not found", strlen("ERROR: File not found"), 0);
         return -1;
     }
     
-    if (send(connfd, content, bytes_read, 0) < 0) {
-        perror("send file content failed");
+    uint8_t hash[CDC_HASH_LEN];
+    long long size = store_checksum(&store, &pack, full_path, hash, NULL);
+    if (size < 0) {
+        log_error("S3: Checksum failed: %s", strerror(errno));
+        send(connfd, "ERROR: Failed to read complete file", strlen("ERROR: Failed to read complete file"), 0);
+        return -1;
+    }
+    char hex[2 * CDC_HASH_LEN + 1];
+    cdc_hex(hash, hex);
+    snprintf(buffer, sizeof(buffer), "CHECKSUM:%lld %s\n", size, hex);
+    send(connfd, buffer, strlen(buffer), 0);
+    log_debug("S3: Checksum of %s: %s", full_path, hex);
+    return 0;
+}
+
+// Multipart uploads: mpinit opens a temporary file for the whole upload,
+// mppart writes one part of it at its offset (on its own connection and
+// thread, so parts arrive in parallel and in any order, and a failed part
+// can simply be sent again), and mpcommit checks the checksum of the
+// assembled file before putting it in place. Uploads in progress are kept
+// only in memory and are lost on restart; abandoned ones expire.
+#define MP_SLOTS 64
+#define MP_EXPIRE_SEC 3600
+#define MP_PART_BUF 1048576
+
+typedef struct {
+    int used;
+    char id[33];
+    char path[MAXPATH];
+    long long size;
+    int busy;                   // parts being written
+    int committing;
+    time_t last;
+    cas_tmp_t tmp;
+} mp_upload_t;
+
+mp_upload_t uploads[MP_SLOTS];
+pthread_mutex_t uploads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find an upload by id and drop expired ones. Caller holds uploads_lock.
+mp_upload_t *mp_find_locked(const char *id) {
+    time_t now = time(NULL);
+    mp_upload_t *found = NULL;
+    for (int i = 0; i < MP_SLOTS; i++) {
+        mp_upload_t *u = &uploads[i];
+        if (!u->used) continue;
+        if (!u->busy && !u->committing && now - u->last > MP_EXPIRE_SEC) {
+            log_warn("S3: Multipart upload %s of %s expired", u->id, u->path);
+            cas_tmp_discard(&u->tmp);
+            u->used = 0;
+        } else if (id && strcmp(u->id, id) == 0) {
+            found = u;
+        }
+    }
+    return found;
+}
+
+// Handle mpinit command: reply with the id of a new upload of size bytes
+int handle_mpinit(int connfd, const char *fname, const char *dpath, long long size) {
+    char *ext = strrchr(fname, '.');
+    if (!ext || strcmp(ext, ".txt") != 0) {
+        send(connfd, "ERROR: Only .txt files supported", strlen("ERROR: Only .txt files supported"), 0);
+        return -1;
+    }
+    if (size < 0) {
+        send(connfd, "ERROR: Invalid size", strlen("ERROR: Invalid size"), 0);
+        return -1;
+    }
+    
+    char filepath[MAXPATH];
+    char dirpath[MAXPATH];
+    snprintf(filepath, sizeof(filepath), "%s/%s%s", s3_dir, dpath, fname);
+    snprintf(dirpath, sizeof(dirpath), "%s/%s", s3_dir, dpath);
+    if (create_dirs(dirpath) < 0) {
+        log_error("S3: Failed to create directories: %s", strerror(errno));
+        send(connfd, "ERROR: Failed to create directories", strlen("ERROR: Failed to create directories"), 0);
+        return -1;
+    }
+    
+    pthread_mutex_lock(&uploads_lock);
+    mp_find_locked(NULL);
+    mp_upload_t *u = NULL;
+    for (int i = 0; i < MP_SLOTS && !u; i++) {
+        if (!uploads[i].used) u = &uploads[i];
+    }
+    if (!u) {
+        pthread_mutex_unlock(&uploads_lock);
+        send(connfd, "ERROR: Too many uploads in progress", strlen("ERROR: Too many uploads in progress"), 0);
+        return -1;
+    }
+    if (cas_tmp_open(&u->tmp, filepath, size) < 0) {
+        pthread_mutex_unlock(&uploads_lock);
+        log_error("S3: Failed to create file: %s", strerror(errno));
+        send(connfd, "ERROR: Failed to create file", strlen("ERROR: Failed to create file"), 0);
+        return -1;
+    }
+    
+    // Ids stay unique across restarts so a stale one is never mistaken
+    // for a new upload
+    static unsigned seq;
+    struct {
+        struct timespec ts;
+        pid_t pid;
+        unsigned seq;
+    } seed;
+    memset(&seed, 0, sizeof(seed));
+    clock_gettime(CLOCK_REALTIME, &seed.ts);
+    seed.pid = getpid();
+    seed.seq = seq++;
+    uint8_t hash[CDC_HASH_LEN];
+    char hex[2 * CDC_HASH_LEN + 1];
+    cdc_hash(&seed, sizeof(seed), hash);
+    cdc_hex(hash, hex);
+    
+    u->used = 1;
+    snprintf(u->id, sizeof(u->id), "%.32s", hex);
+    snprintf(u->path, sizeof(u->path), "%s", filepath);
+    u->size = size;
+    u->busy = 0;
+    u->committing = 0;
+    u->last = time(NULL);
+    pthread_mutex_unlock(&uploads_lock);
+    
+    char buffer[MAXLINE];
+    snprintf(buffer, sizeof(buffer), "UPLOAD:%s\n", u->id);
+    send(connfd, buffer, strlen(buffer), 0);
+    log_info("S3: Multipart upload %s of %s (%lld bytes)", u->id, filepath, size);
+    return 0;
+}
+
+// Handle mppart command: write the len bytes that follow at offset
+int handle_mppart(int connfd, const char *id, long long offset, long long len) {
+    const char *error = NULL;
+    int fd = -1;
+    pthread_mutex_lock(&uploads_lock);
+    mp_upload_t *u = mp_find_locked(id);
+    if (!u) {
+        error = "ERROR: Unknown upload";
+    } else if (u->committing) {
+        error = "ERROR: Upload is being committed";
+    } else if (offset < 0 || len < 0 || offset + len > u->size) {
+        error = "ERROR: Part outside the file";
+    } else {
+        u->busy++;
+        u->last = time(NULL);
+        fd = u->tmp.fd;
+    }
+    pthread_mutex_unlock(&uploads_lock);
+    if (error) {
+        send(connfd, error, strlen(error), 0);
         return -1;
     }
     
-    printf("S3: Sent file to S1 (%zu bytes)\n", bytes_read);
+    char *buf = malloc(MP_PART_BUF);
+    long long done = 0;
+    while (buf && done < len) {
+        ssize_t n = recv(connfd, buf, len - done < MP_PART_BUF ? len - done : MP_PART_BUF, 0);
+        if (n <= 0) {
+            break;
+        }
+        ssize_t w = 0;
+        while (w < n) {
+            ssize_t k = pwrite(fd, buf + w, n - w, offset + done + w);
+            if (k <= 0) break;
+            w += k;
+        }
+        if (w < n) {
+            log_error("S3: Write part failed: %s", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    free(buf);
+    
+    pthread_mutex_lock(&uploads_lock);
+    u->busy--;
+    u->last = time(NULL);
+    pthread_mutex_unlock(&uploads_lock);
+    
+    if (done < len) {
+        log_warn("S3: Part of %s at %lld incomplete (%lld of %lld bytes)", id, offset, done, len);
+        send(connfd, "ERROR: Failed to receive part", strlen("ERROR: Failed to receive part"), 0);
+        return -1;
+    }
+    metrics_add(M_BYTES_IN, len);
+    send(connfd, "PART OK\n", strlen("PART OK\n"), 0);
+    return 0;
+}
+
+typedef struct {
+    int connfd;
+    char id[100];
+    long long offset;
+    long long len;
+} part_t;
+
+void *part_thread(void *arg) {
+    part_t *p = arg;
+    handle_mppart(p->connfd, p->id, p->offset, p->len);
+    close(p->connfd);
+    metrics_add(M_CONNECTIONS, -1);
+    free(p);
+    return NULL;
+}
+
+// Receive a part on its own thread, which closes the connection when done.
+// Returns 0 once started.
+int start_part(int connfd, const char *id, long long offset, long long len) {
+    part_t *p = malloc(sizeof(part_t));
+    if (!p) {
+        return -1;
+    }
+    p->connfd = connfd;
+    snprintf(p->id, sizeof(p->id), "%s", id);
+    p->offset = offset;
+    p->len = len;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, part_thread, p) != 0) {
+        free(p);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Handle mpcommit command: check the assembled file against the client's
+// checksum and store it. On a mismatch the upload is kept so the bad parts
+// can be sent again.
+int handle_mpcommit(int connfd, const char *id, const char *checksum) {
+    pthread_mutex_lock(&uploads_lock);
+    mp_upload_t *u = mp_find_locked(id);
+    int busy = u && (u->busy || u->committing);
+    if (u && !busy) {
+        u->committing = 1;
+    }
+    pthread_mutex_unlock(&uploads_lock);
+    if (!u) {
+        send(connfd, "ERROR: Unknown upload", strlen("ERROR: Unknown upload"), 0);
+        return -1;
+    }
+    if (busy) {
+        send(connfd, "ERROR: Upload has parts in progress", strlen("ERROR: Upload has parts in progress"), 0);
+        return -1;
+    }
+    
+    cdc_hash_t h;
+    cdc_hash_init(&h);
+    uint32_t crc = 0;
+    char *buf = malloc(MP_PART_BUF);
+    long long off = 0;
+    while (buf && off < u->size) {
+        ssize_t n = pread(u->tmp.fd, buf, u->size - off < MP_PART_BUF ? u->size - off : MP_PART_BUF, off);
+        if (n <= 0) break;
+        cdc_hash_update(&h, buf, n);
+        crc = crc32c(crc, buf, n);
+        off += n;
+    }
+    free(buf);
+    uint8_t hash[CDC_HASH_LEN];
+    char hex[2 * CDC_HASH_LEN + 1];
+    cdc_hash_final(&h, hash);
+    cdc_hex(hash, hex);
+    
+    if (off < u->size || strcmp(hex, checksum) != 0) {
+        pthread_mutex_lock(&uploads_lock);
+        u->committing = 0;
+        u->last = time(NULL);
+        pthread_mutex_unlock(&uploads_lock);
+        log_warn("S3: Multipart upload %s does not match its checksum", id);
+        send(connfd, "ERROR: Checksum mismatch", strlen("ERROR: Checksum mismatch"), 0);
+        return -1;
+    }
+    
+    long long lsn = 0;
+    cas_crc_tag(u->tmp.fd, crc, u->size);
+    int status = store_save_tmp(&store, &pack, &u->tmp, u->path, u->size);
+    if (status == 0 && wal.enabled) {
+        lsn = wal_append(&wal, WAL_PUT, u->path, u->size, crc);
+        if (lsn <= 0) status = -1;
+    }
+    if (status == 0) {
+        log_info("S3: Saved %s (%lld bytes) from multipart upload %s", u->path, u->size, id);
+        if (wal.enabled) {
+            wal_ack(&wal, lsn, connfd, "File saved successfully in S3");
+        } else {
+            send(connfd, "File saved successfully in S3", strlen("File saved successfully in S3"), 0);
+        }
+    } else {
+        log_error("S3: File save failed: %s", strerror(errno));
+        send(connfd, "ERROR: Failed to save file", strlen("ERROR: Failed to save file"), 0);
+    }
+    
+    pthread_mutex_lock(&uploads_lock);
+    u->used = 0;
+    u->committing = 0;
+    pthread_mutex_unlock(&uploads_lock);
+    return status;
+}
+
+// Handle mpabort command
+int handle_mpabort(int connfd, const char *id) {
+    pthread_mutex_lock(&uploads_lock);
+    mp_upload_t *u = mp_find_locked(id);
+    int busy = u && (u->busy || u->committing);
+    if (u && !busy) {
+        cas_tmp_discard(&u->tmp);
+        u->used = 0;
+    }
+    pthread_mutex_unlock(&uploads_lock);
+    if (!u) {
+        send(connfd, "ERROR: Unknown upload", strlen("ERROR: Unknown upload"), 0);
+        return -1;
+    }
+    if (busy) {
+        send(connfd, "ERROR: Upload has parts in progress", strlen("ERROR: Upload has parts in progress"), 0);
+        return -1;
+    }
+    log_warn("S3: Multipart upload %s aborted", id);
+    send(connfd, "Upload aborted", strlen("Upload aborted"), 0);
     return 0;
 }
 
@@ -300,18 +787,19 @@ int handle_dispfnames(int connfd, const char *pathname) {
     char buffer[MAXCONTENT] = {0};
     char full_path[MAXPATH];
     
-    printf("S3: Processing dispfnames for path %s\n", pathname);
+    log_debug("S3: Processing dispfnames for path %s", pathname);
+    long long step_us = hist_now_us();
     
     // Construct the full path for S3
     if (strncmp(pathname, "~/S3/", 5) == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/%s", getenv("HOME"), pathname + 2);
+        snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, pathname + 5);
     } else if (pathname[0] == '/') {
         snprintf(full_path, sizeof(full_path), "%s", pathname);
     } else {
         snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, pathname);
     }
     
-    printf("S3: Searching in directory %s\n", full_path);
+    log_debug("S3: Searching in directory %s", full_path);
     
     // Check if the directory exists
     struct stat st;
@@ -325,7 +813,9 @@ int handle_dispfnames(int connfd, const char *pathname) {
     // Collect .txt files
     char txt_files[MAX_FILES][512];
     int txt_file_count = 0;
-    collect_files_recursive(full_path, s3_dir, ".txt", txt_files, &txt_file_count, MAX_FILES);
+    walk_collect(full_path, txt_files, &txt_file_count);
+    pack_collect(&pack, full_path, ".txt", txt_files, &txt_file_count, MAX_FILES);
+    step_us = trace_span("lookup", step_us);
     
     // Prepare output
     int offset = 0;
@@ -340,9 +830,10 @@ int handle_dispfnames(int connfd, const char *pathname) {
     
     // Send result
     if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        perror("send failed");
+        log_error("S3: send failed: %s", strerror(errno));
         return -1;
     }
+    trace_span("send", step_us);
     
     return 0;
 }
@@ -364,31 +855,34 @@ int handle_removef(int connfd, const char *filename) {
     char full_path[MAXPATH];
     char found_path[MAXPATH] = {0};
     
-    printf("S3: Processing removef for file %s\n", filename);
+    log_debug("S3: Processing removef for file %s", filename);
     
     if (strncmp(filename, "~/S3/", 5) == 0) {
-        snprintf(full_path, sizeof(full_path), "%s/%s", getenv("HOME"), filename + 2);
+        snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, filename + 5);
     } else if (filename[0] == '/') {
         snprintf(full_path, sizeof(full_path), "%s", filename);
     } else {
-        if (find_file(s3_dir, filename, found_path, sizeof(found_path), s3_dir) == 1) {
+        if (walk_find(filename, found_path, sizeof(found_path)) == 1 ||
+            pack_find(&pack, s3_dir, filename, found_path, sizeof(found_path)) == 1) {
             snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, found_path);
         } else {
             snprintf(full_path, sizeof(full_path), "%s/%s", s3_dir, filename);
         }
     }
     
-    printf("S3: Full path for removal: %s\n", full_path);
+    log_debug("S3: Full path for removal: %s", full_path);
     
-    struct stat st;
-    if (stat(full_path, &st) == -1) {
+    if (!store_exists(&pack, full_path)) {
         char error_msg[100];
         snprintf(error_msg, sizeof(error_msg), "ERROR: File %s does not exist", filename);
         send(connfd, error_msg, strlen(error_msg), 0);
         return -1;
     }
     
-    if (unlink(full_path) == 0) {
+    if (store_remove(&store, &pack, full_path) == 0) {
+        if (wal.enabled && wal_append(&wal, WAL_DEL, full_path, 0, 0) < 0) {
+            log_error("S3: Logging removal failed: %s", strerror(errno));
+        }
         snprintf(buffer, sizeof(buffer), "File %s deleted from S3", filename);
         send(connfd, buffer, strlen(buffer), 0);
         return 0;
@@ -400,6 +894,34 @@ int handle_removef(int connfd, const char *filename) {
     }
 }
 
+// Write a tar of the given files, named relative to base, to out_path.
+// Used instead of running tar when files may be chunk store manifests or
+// packed, which have to be reassembled first. Returns 0 on success.
+int write_store_tar(char files[][512], int count, const char *base, const char *out_path) {
+    static char archive[TARFILE_SIZE];
+    static char data[MAXCONTENT];
+    long len = 0;
+    for (int i = 0; i < count && len >= 0; i++) {
+        const char *rel = files[i] + strlen(base);
+        while (*rel == '/') rel++;
+        time_t mtime;
+        long size = store_load(&store, &pack, files[i], data, sizeof(data));
+        if (size < 0 || store_stat(&pack, files[i], &mtime) < 0) {
+            log_warn("S3: write_store_tar: Cannot read %s: %s", files[i], strerror(errno));
+            return -1;
+        }
+        len = tar_add_file(archive, len, sizeof(archive), rel, data, size, mtime);
+    }
+    if (len >= 0) {
+        len = tar_finish(archive, len, sizeof(archive));
+    }
+    if (len < 0) {
+        log_warn("S3: write_store_tar: Archive too large");
+        return -1;
+    }
+    return cas_write_all(out_path, archive, len);
+}
+
 // Handle downltar command
 int handle_downltar(int connfd, const char *filetype) {
     if (!filetype || strcmp(filetype, ".txt") != 0) {
@@ -412,13 +934,16 @@ int handle_downltar(int connfd, const char *filetype) {
     char txt_files[MAX_FILES][512];
     int file_count = 0;
     
-    printf("S3: Processing downltar for filetype %s\n", filetype);
+    log_debug("S3: Processing downltar for filetype %s", filetype);
+    long long tar_start = hist_now_us();
     
-    if (collect_files_recursive(s3_dir, s3_dir, ".txt", txt_files, &file_count, MAX_FILES) < 0) {
+    if (walk_collect(s3_dir, txt_files, &file_count) < 0) {
         send(connfd, "ERROR: Failed to collect .txt files", 
              strlen("ERROR: Failed to collect .txt files"), 0);
         return -1;
     }
+    pack_collect(&pack, s3_dir, ".txt", txt_files, &file_count, MAX_FILES);
+    long long step_us = trace_span("lookup", tar_start);
     
     if (file_count == 0) {
         send(connfd, "ERROR: No .txt files found in S3", 
@@ -431,27 +956,32 @@ int handle_downltar(int connfd, const char *filetype) {
     struct tm *t = localtime(&now);
     char timestamp[32];
     strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", t);
-    snprintf(filelist_path, sizeof(filelist_path), "/tmp/txt_filelist_%s.txt", timestamp);
+    // Several instances may share /tmp, so names carry the process id
+    snprintf(filelist_path, sizeof(filelist_path), "/tmp/txt_filelist_%s_%d.txt", timestamp, (int)getpid());
     
     FILE *filelist = fopen(filelist_path, "w");
     if (!filelist) {
-        perror("Failed to create file list");
+        log_error("S3: Failed to create file list: %s", strerror(errno));
         send(connfd, "ERROR: Failed to prepare tar file", 
              strlen("ERROR: Failed to prepare tar file"), 0);
         return -1;
     }
     
+    // Entries are named relative to the storage directory, so copies of a
+    // file held by different replicas share a name and S1 merges them
     for (int i = 0; i < file_count; i++) {
-        fprintf(filelist, "%s\n", txt_files[i]);
+        const char *rel = txt_files[i] + strlen(s3_dir);
+        while (*rel == '/') rel++;
+        fprintf(filelist, "%s\n", rel);
     }
     fclose(filelist);
     
     char tar_filename[256];
-    snprintf(tar_filename, sizeof(tar_filename), "/tmp/txt_files_%s.tar", timestamp);
-    char tar_cmd[512];
-    snprintf(tar_cmd, sizeof(tar_cmd), "tar -cf %s -T %s", tar_filename, filelist_path);
+    snprintf(tar_filename, sizeof(tar_filename), "/tmp/txt_files_%s_%d.tar", timestamp, (int)getpid());
+    char tar_cmd[1024];
+    snprintf(tar_cmd, sizeof(tar_cmd), "tar -cf %s -C %s -T %s", tar_filename, s3_dir, filelist_path);
     
-    int tar_result = system(tar_cmd);
+    int tar_result = store.enabled || pack.enabled ? write_store_tar(txt_files, file_count, s3_dir, tar_filename) : system(tar_cmd);
     if (tar_result != 0) {
         unlink(filelist_path);
         send(connfd, "ERROR: Failed to create tar file", 
@@ -463,7 +993,7 @@ int handle_downltar(int connfd, const char *filetype) {
     
     FILE *tar_fp = fopen(tar_filename, "rb");
     if (!tar_fp) {
-        perror("Failed to open tar file");
+        log_error("S3: Failed to open tar file: %s", strerror(errno));
         unlink(tar_filename);
         send(connfd, "ERROR: Failed to read tar file", 
              strlen("ERROR: Failed to read tar file"), 0);
@@ -494,36 +1024,284 @@ int handle_downltar(int connfd, const char *filetype) {
              strlen("ERROR: Failed to read complete tar file"), 0);
         return -1;
     }
+    hist_record(&tar_hist, hist_now_us() - tar_start);
+    step_us = trace_span("disk read", step_us);
     
-    snprintf(buffer, sizeof(buffer), "TAR_FILE:%s", client_filename);
+    snprintf(buffer, sizeof(buffer), "TAR_FILE:%s\n", client_filename);
     if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        perror("Send tar info failed");
+        log_error("S3: Send tar info failed: %s", strerror(errno));
         unlink(tar_filename);
         return -1;
     }
     
     snprintf(buffer, sizeof(buffer), "%zu\n", bytes_read);
     if (send(connfd, buffer, strlen(buffer), 0) < 0) {
-        perror("Send tar size failed");
+        log_error("S3: Send tar size failed: %s", strerror(errno));
         unlink(tar_filename);
         return -1;
     }
     
-    if (send(connfd, content, bytes_read, 0) < 0) {
-        perror("Send tar content failed");
+    if (send(connfd, content, bytes_read, 0) < 0 || crc_send_trailer(connfd, crc32c(0, content, bytes_read)) < 0) {
+        log_error("S3: Send tar content failed: %s", strerror(errno));
         unlink(tar_filename);
         return -1;
     }
     
-    printf("S3: Sent tar file %s (%zu bytes) to S1\n", tar_filename, bytes_read);
+    trace_span("send", step_us);
+    metrics_add(M_BYTES_OUT, bytes_read);
+    log_info("S3: Sent tar file %s (%zu bytes) to S1", tar_filename, bytes_read);
     
     unlink(tar_filename);
     return 0;
 }
 
+// Handle listfiles command: every stored .txt file as "<size> <path>"
+// lines, path relative to the base directory. S1 uses it to find the
+// files a rebalance has to move.
+int handle_listfiles(int connfd) {
+    static char txt_files[MAX_FILES][512];
+    static char buffer[MAXCONTENT];
+    int file_count = 0;
+
+    log_debug("S3: Processing listfiles");
+
+    if (walk_collect(s3_dir, txt_files, &file_count) < 0) {
+        send(connfd, "ERROR: Failed to collect .txt files",
+             strlen("ERROR: Failed to collect .txt files"), 0);
+        return -1;
+    }
+    pack_collect(&pack, s3_dir, ".txt", txt_files, &file_count, MAX_FILES);
+
+    size_t offset = 0;
+    for (int i = 0; i < file_count; i++) {
+        long size = store_stat(&pack, txt_files[i], NULL);
+        if (size < 0) {
+            continue;
+        }
+        const char *rel = txt_files[i] + strlen(s3_dir);
+        while (*rel == '/') rel++;
+        int n = snprintf(buffer + offset, sizeof(buffer) - offset, "%ld %s\n", size, rel);
+        if (n < 0 || (size_t)n >= sizeof(buffer) - offset) {
+            break;
+        }
+        offset += n;
+    }
+
+    if (offset > 0 && send(connfd, buffer, offset, 0) < 0) {
+        log_error("S3: send failed: %s", strerror(errno));
+        return -1;
+    }
+    log_debug("S3: Listed %d files", file_count);
+    return 0;
+}
+
+// Handle stats command: latency of each command, or with "raw" the
+// histograms themselves for S1 to add up
+int handle_stats(int connfd, int raw) {
+    char buffer[NSTATS * 16 * MAXLINE];
+    size_t offset = 0;
+    for (int i = 0; i < NSTATS && offset < sizeof(buffer); i++) {
+        if (raw) {
+            offset += hist_dump(&stat_hist[i], stat_names[i], buffer + offset, sizeof(buffer) - offset);
+        } else {
+            offset += hist_summary(&stat_hist[i], "S3", stat_names[i], buffer + offset, sizeof(buffer) - offset);
+        }
+    }
+    if (offset >= sizeof(buffer)) {
+        offset = sizeof(buffer) - 1;
+    }
+    if (send(connfd, buffer, offset, 0) < 0) {
+        log_error("S3: send failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Handle trace command: the recorded spans, of request rid only if given,
+// as SPAN lines under a "TRACE S3" line for S1 to gather
+int handle_trace(int connfd, const char *rid) {
+    size_t size = TRACE_SPANS * 96;
+    char *buffer = malloc(size);
+    if (!buffer) {
+        send(connfd, "ERROR: Memory allocation failed", strlen("ERROR: Memory allocation failed"), 0);
+        return -1;
+    }
+    size_t offset = snprintf(buffer, size, "TRACE S3\n");
+    offset += trace_dump(rid, buffer + offset, size - offset);
+    int status = send(connfd, buffer, offset, 0) < 0 ? -1 : 0;
+    if (status < 0) {
+        log_error("S3: send failed: %s", strerror(errno));
+    }
+    free(buffer);
+    return status;
+}
+
+// Render the reply to a scrape of the metrics port
+void render_metrics(metrics_buf_t *b) {
+    char labels[64];
+    metrics_family(b, "dfs_requests_total", "counter", "Requests handled, by command and result.");
+    for (int i = 0; i < NSTATS; i++) {
+        metrics_printf(b, "dfs_requests_total{command=\"%s\",result=\"ok\"} %lld\n", stat_names[i],
+                       metrics_get(M_REQUESTS + 2 * i));
+        metrics_printf(b, "dfs_requests_total{command=\"%s\",result=\"error\"} %lld\n", stat_names[i],
+                       metrics_get(M_REQUESTS + 2 * i + 1));
+    }
+    metrics_family(b, "dfs_request_duration_seconds", "histogram", "Time from a command's arrival until it was answered.");
+    for (int i = 0; i < NSTATS; i++) {
+        snprintf(labels, sizeof(labels), "command=\"%s\"", stat_names[i]);
+        metrics_hist(b, "dfs_request_duration_seconds", labels, &stat_hist[i]);
+    }
+    metrics_family(b, "dfs_received_bytes_total", "counter", "File bytes received in uploads.");
+    metrics_printf(b, "dfs_received_bytes_total %lld\n", metrics_get(M_BYTES_IN));
+    metrics_family(b, "dfs_sent_bytes_total", "counter", "File and tar bytes sent.");
+    metrics_printf(b, "dfs_sent_bytes_total %lld\n", metrics_get(M_BYTES_OUT));
+    metrics_family(b, "dfs_active_connections", "gauge", "Connections being served.");
+    metrics_printf(b, "dfs_active_connections %lld\n", metrics_get(M_CONNECTIONS));
+    metrics_family(b, "dfs_dir_walk_duration_seconds", "histogram", "Time to search or list the storage tree.");
+    metrics_hist(b, "dfs_dir_walk_duration_seconds", "", &walk_hist);
+    metrics_family(b, "dfs_tar_build_duration_seconds", "histogram", "Time to collect files into a tar archive.");
+    metrics_hist(b, "dfs_tar_build_duration_seconds", "", &tar_hist);
+    if (store.enabled) {
+        unsigned long long puts = __atomic_load_n(&store.chunk_puts, __ATOMIC_RELAXED);
+        unsigned long long hits = __atomic_load_n(&store.chunk_hits, __ATOMIC_RELAXED);
+        metrics_family(b, "dfs_chunk_lookups_total", "counter",
+                       "Chunks of uploaded files, by whether the chunk store already held them.");
+        metrics_printf(b, "dfs_chunk_lookups_total{result=\"hit\"} %llu\n", hits);
+        metrics_printf(b, "dfs_chunk_lookups_total{result=\"miss\"} %llu\n", puts - hits);
+    }
+}
+
+// Map a path from listfiles back to the ~/S3/ form downlf and removef
+// take, refusing anything that could leave the base directory
+int rel_to_s3_path(const char *rel, char *out, size_t size) {
+    if (rel[0] == '/' || strstr(rel, "..") != NULL) {
+        return -1;
+    }
+    snprintf(out, size, "~/S3/%s", rel);
+    return 0;
+}
+
+// Heartbeats to S1: every HEARTBEAT_MS a UDP datagram
+// "HEARTBEAT <port> <busy_ms> <served> <free_kb>" with how long the
+// current request has been running, how many requests were handled and
+// the free space under s3_dir. S1 marks the server down when they stop.
+#define HEARTBEAT_MS 100
+
+int s3_port;
+struct sockaddr_in s1_addr;
+volatile long long busy_since_ms;   // start of the current request, 0 when idle
+volatile long long requests_served;
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void *heartbeat_sender(void *arg) {
+    (void)arg;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        log_error("S3: Heartbeat socket failed: %s", strerror(errno));
+        return NULL;
+    }
+    while (1) {
+        struct statvfs vfs;
+        unsigned long long free_kb = 0;
+        if (statvfs(s3_dir, &vfs) == 0) {
+            free_kb = (unsigned long long)vfs.f_bavail * vfs.f_frsize / 1024;
+        }
+        long long since = busy_since_ms;
+        char msg[128];
+        snprintf(msg, sizeof(msg), "HEARTBEAT %d %lld %lld %llu", s3_port,
+                 since ? now_ms() - since : 0, requests_served, free_kb);
+        sendto(fd, msg, strlen(msg), 0, (struct sockaddr *)&s1_addr, sizeof(s1_addr));
+        usleep(HEARTBEAT_MS * 1000);
+    }
+    return NULL;
+}
+
+// Resolve S1's "host:port" and start sending it heartbeats
+int start_heartbeats(const char *spec) {
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        fprintf(stderr, "S3: S1 address must be host:port: %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM }, *res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        fprintf(stderr, "S3: Cannot resolve %s\n", host);
+        return -1;
+    }
+    memcpy(&s1_addr, res->ai_addr, sizeof(s1_addr));
+    freeaddrinfo(res);
+    
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, heartbeat_sender, NULL) != 0) {
+        log_error("S3: Heartbeat thread failed: %s", strerror(errno));
+        return -1;
+    }
+    pthread_detach(tid);
+    log_info("S3: Sending heartbeats to %s", spec);
+    return 0;
+}
+
+// Apply a record found in the write-ahead log at startup: redo a removal,
+// or check that an acknowledged upload survived in full
+int wal_apply(int type, const char *path, const wal_put_t *put) {
+    if (type == WAL_DEL) {
+        return store_remove(&store, &pack, path) == 0 || errno == ENOENT ? 0 : -1;
+    }
+    uint32_t crc;
+    long long len = store_checksum(&store, &pack, path, NULL, &crc);
+    if (len != (long long)put->size || crc != put->crc) {
+        log_error("S3: %s does not hold its last acknowledged upload", path);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <S3_port>\n", argv[0]);
+    // Leading flags: -d for the chunk store, -p to pack small files, -w
+    // with a group-commit window in microseconds for durable uploads, -s
+    // with the MB/s the integrity scrubber may read, -m with a local port
+    // to serve metrics on, -l with the log level
+    int dedup = 0, packed = 0, metrics_port = 0;
+    long wal_window = -1;
+    double scrub_mbps = 0;
+    while (argc > 1 && (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "-p") == 0 ||
+                        ((strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "-s") == 0 ||
+                          strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-l") == 0) && argc > 2))) {
+        if (argv[1][1] == 'w' || argv[1][1] == 's' || argv[1][1] == 'm' || argv[1][1] == 'l') {
+            if (argv[1][1] == 'w') {
+                wal_window = atol(argv[2]);
+            } else if (argv[1][1] == 's') {
+                scrub_mbps = atof(argv[2]);
+            } else if (argv[1][1] == 'm') {
+                metrics_port = atoi(argv[2]);
+            } else if (log_set_level(argv[2]) < 0) {
+                fprintf(stderr, "S3: Unknown log level %s (error, warn, info or debug)\n", argv[2]);
+                exit(1);
+            }
+            argv[2] = argv[0];
+            argv++;
+            argc--;
+        } else if (argv[1][1] == 'd') {
+            dedup = 1;
+        } else {
+            packed = 1;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s [-d] [-p] [-w window_us] [-s scrub_MBps] [-m metrics_port] [-l level] <S3_port> [base_dir] [S1_host:port]\n", argv[0]);
         exit(1);
     }
 
@@ -533,85 +1311,162 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // Set up signal handler
-    signal(SIGPIPE, handle_sigpipe);
+    // S1 going away mid-reply makes send() fail with EPIPE, which the
+    // caller logs; a handler could only interrupt a thread in the middle
+    // of a log call
+    signal(SIGPIPE, SIG_IGN);
+    crc_init();
+
+    s3_port = port;
 
-    // Create ~/S3 directory
-    snprintf(s3_dir, sizeof(s3_dir), "%s/S3", getenv("HOME"));
-    printf("S3: Creating base directory: %s\n", s3_dir);
+    // Create the base directory, ~/S3 unless another one (e.g. on a
+    // different disk) is given for this instance
+    if (argc >= 3) {
+        snprintf(s3_dir, sizeof(s3_dir), "%s", argv[2]);
+    } else {
+        snprintf(s3_dir, sizeof(s3_dir), "%s/S3", getenv("HOME"));
+    }
+    log_info("S3: Creating base directory: %s", s3_dir);
     
     if (mkdir(s3_dir, 0755) < 0 && errno != EEXIST) {
-        perror("Failed to create S3 directory");
+        log_error("S3: Failed to create S3 directory: %s", strerror(errno));
         exit(1);
     }
 
+    if (dedup) {
+        if (cas_open(&store, s3_dir) < 0) {
+            log_error("S3: Failed to open chunk store: %s", strerror(errno));
+            exit(1);
+        }
+        char summary[MAXLINE];
+        cas_stats(&store, "S3: Chunk store", summary, sizeof(summary));
+        log_info("%s", summary);
+    }
+
+    if (packed) {
+        if (pack_open(&pack, s3_dir) < 0) {
+            log_error("S3: Failed to open packed segments: %s", strerror(errno));
+            exit(1);
+        }
+        char summary[MAXLINE];
+        pack_stats(&pack, "S3: Packed files", summary, sizeof(summary));
+        log_info("%s", summary);
+    }
+
+    if (wal_window >= 0) {
+        if (wal_open(&wal, s3_dir, wal_window, wal_apply) < 0) {
+            log_error("S3: Failed to open write-ahead log: %s", strerror(errno));
+            exit(1);
+        }
+        log_info("S3: Durable uploads, group commit window %ld us", wal_window);
+    }
+
+    if (scrub_mbps > 0) {
+        if (scrub_start(&scrub, s3_dir, scrub_mbps, &pack) < 0) {
+            log_error("S3: Failed to start scrubber: %s", strerror(errno));
+            exit(1);
+        }
+        log_info("S3: Scrubbing stored files at up to %.0f MB/s", scrub_mbps);
+    }
+
+    if (metrics_port > 0) {
+        if (metrics_start(metrics_port, render_metrics) < 0) {
+            log_error("S3: Failed to start metrics listener: %s", strerror(errno));
+            exit(1);
+        }
+        log_info("S3: Metrics at http://127.0.0.1:%d/metrics", metrics_port);
+    }
+
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
-        perror("Socket creation failed");
+        log_error("S3: Socket creation failed: %s", strerror(errno));
         exit(1);
     }
 
     int opt = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
+        log_error("S3: setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
     }
 
     struct sockaddr_in servaddr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
     if (bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        perror("Bind failed");
+        log_error("S3: Bind failed: %s", strerror(errno));
         exit(1);
     }
 
-    if (listen(sockfd, 5) < 0) {
-        perror("Listen failed");
+    // S1 serves its clients concurrently, so as many connections as it has
+    // clients can arrive at once
+    if (listen(sockfd, SOMAXCONN) < 0) {
+        log_error("S3: Listen failed: %s", strerror(errno));
         exit(1);
     }
 
-    printf("S3: Listening on port %d...\n", port);
+    log_info("S3: Listening on port %d...", port);
+
+    if (argc == 4 && start_heartbeats(argv[3]) < 0) {
+        exit(1);
+    }
 
     while (1) {
         struct sockaddr_in cliaddr;
         socklen_t len = sizeof(cliaddr);
         int connfd = accept(sockfd, (struct sockaddr*)&cliaddr, &len);
         if (connfd < 0) {
-            perror("Accept failed");
+            log_error("S3: Accept failed: %s", strerror(errno));
             continue;
         }
 
-        printf("S3: Connection from %s:%d (S1)\n", 
+        log_info("S3: Connection from %s:%d (S1)", 
                inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port));
 
         // Set client socket timeout
         if (set_socket_timeout(connfd, 30) < 0) {
-            perror("set client socket timeout");
+            log_error("S3: set client socket timeout: %s", strerror(errno));
             close(connfd);
             continue;
         }
+        metrics_add(M_CONNECTIONS, 1);
 
         char buffer[MAXLINE];
-        char content[MAXCONTENT];
+        // Upload buffer lives outside the stack, which the handlers' own
+        // 5MB buffers already mostly use up
+        static char content[MAXCONTENT];
+        int timed = -1;             // stat_hist entry of the command being served
+        int failed = 0;
+        long long started_us = 0;
         
         while (1) {
-            memset(buffer, 0, sizeof(buffer));
-            int n = recv(connfd, buffer, MAXLINE - 1, 0);
-            if (n <= 0) {
-                if (n < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        printf("S3: Receive timeout, closing connection\n");
-                    } else {
-                        perror("Receive command failed");
-                    }
+            // A command is done once the next one is awaited
+            if (timed >= 0) {
+                stat_done(timed, started_us, failed);
+                timed = -1;
+            }
+            busy_since_ms = 0;
+            errno = 0;
+            int n = recv_line(connfd, buffer, sizeof(buffer));
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    log_warn("S3: Receive timeout, closing connection");
+                } else if (errno != 0) {
+                    log_error("S3: Receive command failed: %s", strerror(errno));
                 }
-                printf("S3: Connection closed\n");
+                log_info("S3: Connection closed");
                 break;
             }
             
-            buffer[n] = '\0';
-            printf("S3: Received: %s\n", buffer);
+            busy_since_ms = now_ms();
+            started_us = hist_now_us();
+            requests_served++;
+            // S1 puts the id of the request this is part of in front
+            trace_take(buffer, 0);
+            log_info("S3: Received: %s%s%s", buffer, trace_rid[0] ? " @" : "", trace_rid);
 
             char cmd[50], fname[100], dpath[200];
             cmd[0] = fname[0] = dpath[0] = '\0';
             sscanf(buffer, "%49s %99s %199s", cmd, fname, dpath);
+            long long step_us = trace_span("parse", started_us);
+            timed = stat_index(cmd);
+            failed = 1;             // until a handler reports success
 
             if (strcmp(cmd, "downlf") == 0) {
                 if (strlen(fname) == 0) {
@@ -619,7 +1474,27 @@ int main(int argc, char *argv[]) {
                          strlen("ERROR: Filename not specified"), 0);
                     continue;
                 }
-                handle_downlf(connfd, fname);
+                // Optional byte range: downlf <file> <offset> [<length>]
+                long long offset = 0, length = -1;
+                sscanf(buffer, "%*s %*s %lld %lld", &offset, &length);
+                if (offset < 0) {
+                    send(connfd, "ERROR: Invalid range", strlen("ERROR: Invalid range"), 0);
+                    continue;
+                }
+                // A download is the last request on its connection
+                if (start_download(connfd, fname, offset, length, started_us) == 0) {
+                    timed = -1;
+                    connfd = -1;
+                    break;
+                }
+                failed = handle_downlf(connfd, fname, offset, length) < 0;
+            } else if (strcmp(cmd, "checksumf") == 0) {
+                if (strlen(fname) == 0) {
+                    send(connfd, "ERROR: Filename not specified", 
+                         strlen("ERROR: Filename not specified"), 0);
+                    continue;
+                }
+                handle_checksumf(connfd, fname);
             } else if (strcmp(cmd, "uploadf") == 0) {
                 if (strlen(fname) == 0 || strlen(dpath) == 0) {
                     send(connfd, "ERROR: Filename and path must be specified", 
@@ -634,13 +1509,16 @@ int main(int argc, char *argv[]) {
                     continue;
                 }
                 
+                char filepath[512];
+                snprintf(filepath, sizeof(filepath), "%s/%s%s", s3_dir, dpath, fname);
+
                 char len_str[32] = {0};
                 int i = 0;
                 while (i < sizeof(len_str) - 1) {
                     n = recv(connfd, &len_str[i], 1, 0);
                     if (n <= 0) {
-                        if (n < 0) perror("Receive length failed");
-                        else printf("S3: S1 disconnected\n");
+                        if (n < 0) log_error("S3: Receive length failed: %s", strerror(errno));
+                        else log_warn("S3: S1 disconnected");
                         send(connfd, "ERROR: Failed to receive length", 
                              strlen("ERROR: Failed to receive length"), 0);
                         break;
@@ -653,105 +1531,202 @@ int main(int argc, char *argv[]) {
                 }
                 
                 if (n <= 0 || i >= sizeof(len_str) - 1) {
-                    printf("S3: Invalid content length\n");
+                    log_warn("S3: Invalid content length");
                     continue;
                 }
                 
-                size_t content_len = atoi(len_str);
-                printf("S3: Content length: %zu\n", content_len);
+                size_t total = 0;
+                if (strncmp(len_str, "CDC ", 4) == 0) {
+                    char *old = malloc(sizeof(content));
+                    long old_len = old ? store_load(&store, &pack, filepath, old, sizeof(content)) : -1;
+                    size_t wanted = 0;
+                    long got = cdc_recv_upload("S3", connfd, len_str, old, old_len, content, sizeof(content), &wanted);
+                    free(old);
+                    if (got < 0) {
+                        continue;
+                    }
+                    metrics_add(M_BYTES_IN, wanted);
+                    total = got;
+                } else {
+                    size_t content_len = atoi(len_str);
+                    log_debug("S3: Content length: %zu", content_len);
 
-                if (content_len >= MAXCONTENT) {
-                    printf("S3: Content too large\n");
-                    send(connfd, "ERROR: Content too large", 
-                         strlen("ERROR: Content too large"), 0);
-                    continue;
-                }
+                    if (content_len >= MAXCONTENT) {
+                        log_warn("S3: Content too large");
+                        send(connfd, "ERROR: Content too large", 
+                             strlen("ERROR: Content too large"), 0);
+                        continue;
+                    }
 
-                memset(content, 0, sizeof(content));
-                size_t total = 0;
-                while (total < content_len) {
-                    n = recv(connfd, content + total, content_len - total, 0);
-                    if (n <= 0) {
-                        if (n < 0) perror("Receive content failed");
-                        else printf("S3: S1 disconnected\n");
-                        send(connfd, "ERROR: Failed to receive content", 
-                             strlen("ERROR: Failed to receive content"), 0);
-                        break;
+                    memset(content, 0, sizeof(content));
+                    while (total < content_len) {
+                        n = recv(connfd, content + total, content_len - total, 0);
+                        if (n <= 0) {
+                            if (n < 0) log_error("S3: Receive content failed: %s", strerror(errno));
+                            else log_warn("S3: S1 disconnected");
+                            send(connfd, "ERROR: Failed to receive content", 
+                                 strlen("ERROR: Failed to receive content"), 0);
+                            break;
+                        }
+                        total += n;
                     }
-                    total += n;
-                }
                 
-                if (total < content_len) {
-                    printf("S3: Incomplete content received\n");
-                    continue;
+                    if (total < content_len) {
+                        log_warn("S3: Incomplete content received");
+                        continue;
+                    }
+                    
+                    metrics_add(M_BYTES_IN, total);
+                    uint32_t crc, expected;
+                    if (crc_recv_trailer(connfd, &expected) < 0) {
+                        log_warn("S3: Missing checksum trailer");
+                        send(connfd, "ERROR: Missing checksum", 
+                             strlen("ERROR: Missing checksum"), 0);
+                        continue;
+                    }
+                    if ((crc = crc32c(0, content, total)) != expected) {
+                        log_warn("S3: Checksum mismatch: got %08x, expected %08x", crc, expected);
+                        send(connfd, "ERROR: Checksum mismatch, upload damaged in transit", 
+                             strlen("ERROR: Checksum mismatch, upload damaged in transit"), 0);
+                        continue;
+                    }
                 }
                 
-                printf("S3: Received %zu bytes of content\n", total);
+                log_debug("S3: Received %zu bytes of content", total);
+                step_us = trace_span("receive", step_us);
 
                 char dirpath[512];
                 snprintf(dirpath, sizeof(dirpath), "%s/%s", s3_dir, dpath);
                 
-                printf("S3: Creating directory: %s\n", dirpath);
+                log_debug("S3: Creating directory: %s", dirpath);
                 if (create_dirs(dirpath) < 0) {
-                    perror("Failed to create directories");
+                    log_error("S3: Failed to create directories: %s", strerror(errno));
                     send(connfd, "ERROR: Failed to create directories", 
                          strlen("ERROR: Failed to create directories"), 0);
                     continue;
                 }
                 
-                char filepath[512];
-                snprintf(filepath, sizeof(filepath), "%s/%s%s", s3_dir, dpath, fname);
-                printf("S3: Saving file to: %s\n", filepath);
+                log_debug("S3: Saving file to: %s", filepath);
                 
-                FILE *fp = fopen(filepath, "wb");
-                if (fp) {
-                    size_t written = fwrite(content, 1, total, fp);
-                    fclose(fp);
-                    
-                    if (written == total) {
-                        printf("S3: Saved %s (%zu bytes)\n", filepath, written);
+                long long lsn = 0;
+                if (store_save(&store, &pack, filepath, content, total) == 0 &&
+                    (!wal.enabled || (lsn = wal_append(&wal, WAL_PUT, filepath, total, crc32c(0, content, total))) > 0)) {
+                    trace_span("disk write", step_us);
+                    log_info("S3: Saved %s (%zu bytes)", filepath, total);
+                    failed = 0;
+                    if (wal.enabled) {
+                        // Acknowledged by the commit thread once the log
+                        // is synced, so the next upload can be served meanwhile
+                        wal_ack(&wal, lsn, connfd, "File saved successfully in S3");
+                    } else {
                         send(connfd, "File saved successfully in S3", 
                              strlen("File saved successfully in S3"), 0);
-                    } else {
-                        printf("S3: Partial write: %zu of %zu bytes\n", written, total);
-                        send(connfd, "ERROR: Partial file write", 
-                             strlen("ERROR: Partial file write"), 0);
                     }
                 } else {
-                    perror("File save failed");
+                    log_error("S3: File save failed: %s", strerror(errno));
                     send(connfd, "ERROR: Failed to save file", 
                          strlen("ERROR: Failed to save file"), 0);
                 }
+            } else if (strcmp(cmd, "mpinit") == 0) {
+                long long size = -1;
+                sscanf(buffer, "%*s %*s %*s %lld", &size);
+                if (strlen(fname) == 0 || strlen(dpath) == 0) {
+                    send(connfd, "ERROR: Filename and path must be specified", 
+                         strlen("ERROR: Filename and path must be specified"), 0);
+                    continue;
+                }
+                handle_mpinit(connfd, fname, dpath, size);
+            } else if (strcmp(cmd, "mppart") == 0) {
+                // mppart <id> <offset> <len>, followed by the data; a part
+                // is the last request on its connection
+                long long offset = -1, len = -1;
+                sscanf(buffer, "%*s %*s %lld %lld", &offset, &len);
+                if (start_part(connfd, fname, offset, len) == 0) {
+                    connfd = -1;
+                    break;
+                }
+                handle_mppart(connfd, fname, offset, len);
+            } else if (strcmp(cmd, "mpcommit") == 0) {
+                if (strlen(fname) == 0 || strlen(dpath) == 0) {
+                    send(connfd, "ERROR: Upload and checksum must be specified", 
+                         strlen("ERROR: Upload and checksum must be specified"), 0);
+                    continue;
+                }
+                handle_mpcommit(connfd, fname, dpath);
+            } else if (strcmp(cmd, "mpabort") == 0) {
+                handle_mpabort(connfd, fname);
             } else if (strcmp(cmd, "dispfnames") == 0) {
                 if (strlen(fname) == 0) {
                     send(connfd, "ERROR: Path not specified", 
                          strlen("ERROR: Path not specified"), 0);
                     continue;
                 }
-                handle_dispfnames(connfd, fname);
+                failed = handle_dispfnames(connfd, fname) < 0;
             } else if (strcmp(cmd, "removef") == 0) {
                 if (strlen(fname) == 0) {
                     send(connfd, "ERROR: Filename not specified", 
                          strlen("ERROR: Filename not specified"), 0);
                     continue;
                 }
-                handle_removef(connfd, fname);
+                failed = handle_removef(connfd, fname) < 0;
             } else if (strcmp(cmd, "downltar") == 0) {
                 if (strlen(fname) == 0) {
                     send(connfd, "ERROR: Filetype not specified", 
                          strlen("ERROR: Filetype not specified"), 0);
                     continue;
                 }
-                handle_downltar(connfd, fname);
+                failed = handle_downltar(connfd, fname) < 0;
+            } else if (strcmp(cmd, "dedupstats") == 0) {
+                char stats[3 * MAXLINE];
+                cas_stats(&store, "S3", stats, MAXLINE);
+                if (pack.enabled) {
+                    pack_stats(&pack, "S3", stats + strlen(stats), MAXLINE);
+                }
+                if (wal.enabled) {
+                    wal_stats(&wal, "S3", stats + strlen(stats), MAXLINE);
+                }
+                send(connfd, stats, strlen(stats), 0);
+            } else if (strcmp(cmd, "scrubstats") == 0) {
+                char stats[16 * MAXLINE];
+                if (scrub.enabled) {
+                    scrub_stats(&scrub, "S3", stats, sizeof(stats));
+                } else {
+                    snprintf(stats, sizeof(stats), "S3: Scrubber not running\n");
+                }
+                send(connfd, stats, strlen(stats), 0);
+            } else if (strcmp(cmd, "stats") == 0) {
+                handle_stats(connfd, strcmp(fname, "raw") == 0);
+            } else if (strcmp(cmd, "trace") == 0) {
+                handle_trace(connfd, fname);
+            } else if (strcmp(cmd, "listfiles") == 0) {
+                handle_listfiles(connfd);
+            } else if (strcmp(cmd, "getfile") == 0 || strcmp(cmd, "delfile") == 0) {
+                // Exact-path download and delete, for files S1 moves
+                // between servers
+                char path[MAXPATH];
+                if (strlen(fname) == 0 || rel_to_s3_path(fname, path, sizeof(path)) < 0) {
+                    send(connfd, "ERROR: Invalid path",
+                         strlen("ERROR: Invalid path"), 0);
+                    continue;
+                }
+                if (cmd[0] == 'g') {
+                    handle_downlf(connfd, path, 0, -1);
+                } else {
+                    handle_removef(connfd, path);
+                }
             } else {
-                printf("S3: Unknown command: %s\n", cmd);
+                log_warn("S3: Unknown command: %s", cmd);
                 send(connfd, "ERROR: Unknown command", 
                      strlen("ERROR: Unknown command"), 0);
             }
         }
         
-        close(connfd);
-        printf("S3: Connection closed\n");
+        if (connfd >= 0) {
+            close(connfd);
+            metrics_add(M_CONNECTIONS, -1);
+        }
+        busy_since_ms = 0;
+        log_info("S3: Connection closed");
     }
 
     close(sockfd);
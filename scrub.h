@@ -0,0 +1,362 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+// Background integrity scrubber, optionally run by S2-S4 so that data
+// rotting on disk is found before a client downloads it.
+//
+// A low-priority thread walks the base directory pass after pass and
+// re-reads every stored file in large sequential reads, checking it
+// against the checksum tag it was written with (see cas.h): plain files
+// and chunks against their own CRC32C, chunk store manifests by parsing
+// them (their chunks are checked on their own), and pack segments record
+// by record against the check each record carries. A file with no
+// current tag, written before tagging or changed in place since, is
+// tagged with what it holds now.
+//
+// Pages are dropped from the page cache with posix_fadvise(DONTNEED) as
+// they are read, so a pass does not push out the files being served, and
+// reads are paced to stay within the configured MB/s. Corrupt files are
+// listed by scrubstats until a later pass finds them intact or gone.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "pack.h"
+#include "wal.h"
+#include "log.h"
+
+#define SCRUB_BLOCK (4 << 20)       // bytes per read
+#define SCRUB_PAUSE 60              // seconds between passes
+#define SCRUB_MAX_BAD 64            // corrupt files listed
+
+typedef struct {
+    char path[1024];
+    char why[96];
+    int seen;                   // found again in the current pass
+} scrub_bad_t;
+
+typedef struct {
+    int enabled;
+    char base[256];
+    double budget;              // bytes per second
+    pack_t *pack;
+    pthread_mutex_t lock;
+    char *buf;
+    struct timespec pass_start;
+    unsigned long long paced;   // bytes read since pass_start
+    unsigned long long passes;  // completed
+    unsigned long long files;   // checked in the current pass
+    unsigned long long bytes;
+    unsigned long long last_files, last_bytes;
+    double last_secs;
+    unsigned long long tagged;  // files given a tag
+    unsigned long long untagged;  // files that could not be given one
+    int tag_errno;              // why the last of those could not
+    unsigned long long found;   // corruptions found in all passes
+    scrub_bad_t bad[SCRUB_MAX_BAD];
+    int nbad;
+} scrub_t;
+
+static inline double scrub_since(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// Account for n bytes read, sleeping as long as the pass is ahead of the
+// budget
+static inline void scrub_pace(scrub_t *s, size_t n) {
+    s->paced += n;
+    double ahead = s->paced / s->budget - scrub_since(&s->pass_start);
+    if (ahead > 0) {
+        usleep(ahead > 1 ? 1000000 : (useconds_t)(ahead * 1e6));
+    }
+}
+
+// Read up to len bytes at the file position, dropping them from the page
+// cache again and pacing the scrub
+static inline ssize_t scrub_read(scrub_t *s, int fd, char *buf, size_t len, off_t at) {
+    ssize_t n = read(fd, buf, len);
+    if (n > 0) {
+        posix_fadvise(fd, at, n, POSIX_FADV_DONTNEED);
+        scrub_pace(s, n);
+    }
+    return n;
+}
+
+// Record the outcome of checking bytes bytes of path: why it is corrupt,
+// or NULL if it is intact
+static inline void scrub_result(scrub_t *s, const char *path, const char *why, unsigned long long bytes) {
+    pthread_mutex_lock(&s->lock);
+    s->files++;
+    s->bytes += bytes;
+    int i = 0;
+    while (i < s->nbad && strcmp(s->bad[i].path, path) != 0) i++;
+    if (!why) {
+        if (i < s->nbad) s->bad[i] = s->bad[--s->nbad];
+    } else {
+        if (i == s->nbad) {
+            s->found++;
+            if (s->nbad < SCRUB_MAX_BAD) {
+                snprintf(s->bad[s->nbad++].path, sizeof(s->bad[0].path), "%s", path);
+            }
+        }
+        if (i < s->nbad) {
+            snprintf(s->bad[i].why, sizeof(s->bad[i].why), "%s", why);
+            s->bad[i].seen = 1;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (why) {
+        log_warn("scrub: %s is corrupt: %s", path, why);
+    }
+}
+
+// Check a plain file, chunk or manifest against its tag
+static inline void scrub_file(scrub_t *s, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    cas_crc_tag_t tag;
+    int64_t mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    int tagged = fgetxattr(fd, CAS_CRC_XATTR, &tag, sizeof(tag)) == sizeof(tag) &&
+                 tag.st_size == (uint64_t)st.st_size && tag.mtime_ns == mtime_ns;
+
+    uint32_t crc = 0;
+    off_t off = 0;
+    int manifest = 0;
+    ssize_t n;
+    while ((n = scrub_read(s, fd, s->buf, SCRUB_BLOCK, off)) > 0) {
+        if (off == 0 && (size_t)n >= strlen(CAS_MAGIC) && memcmp(s->buf, CAS_MAGIC, strlen(CAS_MAGIC)) == 0) {
+            manifest = 1;
+            break;
+        }
+        crc = crc32c(crc, s->buf, n);
+        off += n;
+    }
+
+    char why[96] = "";
+    if (manifest) {
+        cas_ref_t *refs;
+        int nrefs;
+        uint64_t size;
+        if (cas_read_manifest(path, &refs, &nrefs, &size) != 1) {
+            snprintf(why, sizeof(why), "unreadable chunk store manifest");
+        } else {
+            free(refs);
+        }
+    } else if (n < 0) {
+        snprintf(why, sizeof(why), "read failed: %s", strerror(errno));
+    } else if (tagged && crc != tag.crc) {
+        snprintf(why, sizeof(why), "CRC32C %08x, tagged %08x", crc, tag.crc);
+    } else if (!tagged) {
+        // Only tag what was read if the file did not change meanwhile
+        struct stat now;
+        if (fstat(fd, &now) == 0 && now.st_size == st.st_size && now.st_size == off &&
+            now.st_mtim.tv_sec == st.st_mtim.tv_sec && now.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+            int status = cas_crc_tag(fd, crc, off);
+            int err = errno;
+            pthread_mutex_lock(&s->lock);
+            if (status == 0) {
+                s->tagged++;
+            } else {
+                s->untagged++;
+                s->tag_errno = err;
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+    close(fd);
+    scrub_result(s, path, why[0] ? why : NULL, off);
+}
+
+// Check the records in the first limit bytes of a pack segment (all of it
+// if limit is -1)
+static inline void scrub_segment(scrub_t *s, const char *path, off_t limit) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char why[96] = "";
+    off_t base = 0, read_to = 0;    // file offsets of buf[0] and of its end
+    size_t have = 0, pos = 0;
+    while (!why[0]) {
+        pack_rec_t rec;
+        size_t need = sizeof(rec);
+        if (have - pos >= sizeof(rec)) {
+            memcpy(&rec, s->buf + pos, sizeof(rec));
+            if (memcmp(rec.magic, PACK_MAGIC, 4) != 0 || rec.path_len == 0 || rec.path_len >= PACK_MAX_PATH ||
+                rec.data_len > PACK_MAX_FILE) {
+                snprintf(why, sizeof(why), "bad record header at %llu", (unsigned long long)(base + pos));
+                break;
+            }
+            need += rec.path_len + rec.data_len;
+        }
+        if (have - pos < need) {
+            memmove(s->buf, s->buf + pos, have - pos);
+            base += pos;
+            have -= pos;
+            pos = 0;
+            size_t want = SCRUB_BLOCK - have;
+            if (limit >= 0 && (off_t)want > limit - read_to) {
+                want = limit - read_to;
+            }
+            ssize_t n = want ? scrub_read(s, fd, s->buf + have, want, read_to) : 0;
+            if (n < 0) {
+                snprintf(why, sizeof(why), "read failed: %s", strerror(errno));
+            } else if (n == 0 && have > 0) {
+                snprintf(why, sizeof(why), "torn record at %llu", (unsigned long long)base);
+            } else if (n == 0) {
+                break;
+            }
+            read_to += n > 0 ? n : 0;
+            have += n > 0 ? n : 0;
+            continue;
+        }
+        const char *rpath = s->buf + pos + sizeof(rec);
+        if (pack_check(&rec, rpath, rpath + rec.path_len) != rec.check) {
+            snprintf(why, sizeof(why), "record at %llu (%.*s) fails its check", (unsigned long long)(base + pos),
+                     rec.path_len < 40 ? (int)rec.path_len : 40, rpath);
+        }
+        pos += need;
+    }
+    close(fd);
+    scrub_result(s, path, why[0] ? why : NULL, read_to);
+}
+
+static inline void scrub_dir(scrub_t *s, const char *dir, int in_pack) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+    // Only the records already complete in the segment packing appends to
+    // are read
+    uint32_t current = 0;
+    off_t current_size = -1;
+    if (in_pack && s->pack && s->pack->enabled) {
+        pthread_mutex_lock(&s->pack->lock);
+        if (s->pack->nsegs > 0) {
+            current = s->pack->segs[s->pack->nsegs - 1].id;
+            current_size = s->pack->segs[s->pack->nsegs - 1].size;
+        }
+        pthread_mutex_unlock(&s->pack->lock);
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 ||
+            strcmp(e->d_name, WAL_DIR) == 0 || strstr(e->d_name, ".tmp.")) {
+            continue;
+        }
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        struct stat st;
+        if (lstat(path, &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            scrub_dir(s, path, strcmp(e->d_name, PACK_DIR) == 0);
+        } else if (S_ISREG(st.st_mode) && in_pack) {
+            unsigned id;
+            if (sscanf(e->d_name, "seg-%u", &id) == 1) {
+                scrub_segment(s, path, id == current ? current_size : -1);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            scrub_file(s, path);
+        }
+    }
+    closedir(d);
+}
+
+static inline void *scrub_thread(void *arg) {
+    scrub_t *s = arg;
+    // Idle CPU and I/O priority, so requests always come first
+    pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, 1, tid, 3 << 13);       // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+#endif
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < s->nbad; i++) s->bad[i].seen = 0;
+        pthread_mutex_unlock(&s->lock);
+        clock_gettime(CLOCK_MONOTONIC, &s->pass_start);
+        s->paced = 0;
+
+        scrub_dir(s, s->base, 0);
+
+        // Drop what this pass no longer found
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < s->nbad;) {
+            if (!s->bad[i].seen) s->bad[i] = s->bad[--s->nbad];
+            else i++;
+        }
+        s->passes++;
+        s->last_files = s->files;
+        s->last_bytes = s->bytes;
+        s->files = s->bytes = 0;
+        s->last_secs = scrub_since(&s->pass_start);
+        pthread_mutex_unlock(&s->lock);
+        sleep(SCRUB_PAUSE);
+    }
+    return NULL;
+}
+
+// Start scrubbing base at up to mbps MB/s. pack, if given, is the pack
+// store kept there.
+static inline int scrub_start(scrub_t *s, const char *base, double mbps, pack_t *pack) {
+    memset(s, 0, sizeof(*s));
+    snprintf(s->base, sizeof(s->base), "%s", base);
+    s->budget = mbps * 1e6;
+    s->pack = pack;
+    s->buf = malloc(SCRUB_BLOCK);
+    if (!s->buf || mbps <= 0) {
+        free(s->buf);
+        errno = s->buf ? EINVAL : ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, scrub_thread, s) != 0) {
+        free(s->buf);
+        return -1;
+    }
+    pthread_detach(tid);
+    s->enabled = 1;
+    return 0;
+}
+
+static inline void scrub_stats(scrub_t *s, const char *label, char *out, size_t size) {
+    pthread_mutex_lock(&s->lock);
+    size_t len = snprintf(out, size, "%s: Scrubbing at %.0f MB/s, pass %llu: %llu files (%.1f MB) checked; "
+                          "last pass %llu files (%.1f MB) in %.0fs; %llu files tagged, %llu corruptions found, "
+                          "%d corrupt now\n",
+                          label, s->budget / 1e6, s->passes + 1, s->files, s->bytes / 1e6, s->last_files,
+                          s->last_bytes / 1e6, s->last_secs, s->tagged, s->found, s->nbad);
+    if (s->untagged > 0 && len < size) {
+        len += snprintf(out + len, size - len, "%s: %llu files could not be tagged (%s)\n", label, s->untagged,
+                        s->tag_errno == ENOTSUP ? "no xattr support" : strerror(s->tag_errno));
+    }
+    for (int i = 0; i < s->nbad && len < size; i++) {
+        len += snprintf(out + len, size - len, "%s: Corrupt: %s (%s)\n", label, s->bad[i].path, s->bad[i].why);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+#endif
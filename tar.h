@@ -0,0 +1,265 @@
+#ifndef TAR_H
+#define TAR_H
+
+// Helpers for combining tar archives. S1 uses them to merge the archives
+// returned by several storage servers into the single tar a client expects.
+//
+// An archive is a sequence of 512-byte blocks: a header per entry followed
+// by its data rounded up to a whole block, terminated by two zero blocks
+// and usually padded to a 10KB record. Concatenating archives only needs
+// the entries of each one followed by a single terminator.
+//
+// Replicated types return the same file from several servers; appending
+// through a tar_names_t set keeps only the first entry for each name.
+// Servers whose files may be chunk store manifests build their archives
+// with tar_add_file instead of running tar.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAR_BLOCK 512
+
+// Parse a numeric header field: octal text, or GNU base-256 when the high
+// bit of the first byte is set
+static inline uint64_t tar_field(const unsigned char *p, size_t n) {
+    uint64_t v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7f;
+        for (size_t i = 1; i < n; i++) {
+            v = (v << 8) | p[i];
+        }
+        return v;
+    }
+    for (size_t i = 0; i < n && p[i]; i++) {
+        if (p[i] >= '0' && p[i] <= '7') {
+            v = (v << 3) | (uint64_t)(p[i] - '0');
+        }
+    }
+    return v;
+}
+
+static inline int tar_zero_block(const unsigned char *p) {
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        if (p[i]) return 0;
+    }
+    return 1;
+}
+
+// Length of the entries in an archive, excluding the end-of-archive blocks
+// and record padding. Returns -1 if the archive is truncated.
+static inline long tar_entries_len(const char *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t off = 0;
+    while (off + TAR_BLOCK <= len) {
+        if (tar_zero_block(p + off)) {
+            return off;
+        }
+        uint64_t size = tar_field(p + off + 124, 12);
+        uint64_t span = TAR_BLOCK + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+        if (span > len - off) {
+            return -1;
+        }
+        off += span;
+    }
+    return off == len ? (long)off : -1;
+}
+
+// Set of entry names (as 64-bit hashes) already written to an archive
+typedef struct {
+    uint64_t *slots;            // 0 marks an empty slot
+    size_t cap;                 // power of two
+    size_t count;
+} tar_names_t;
+
+static inline uint64_t tar_name_hash(const char *s, size_t n) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+    return h ? h : 1;
+}
+
+static inline int tar_names_has(const tar_names_t *set, uint64_t h) {
+    if (!set->cap) return 0;
+    for (size_t j = h & (set->cap - 1); set->slots[j]; j = (j + 1) & (set->cap - 1)) {
+        if (set->slots[j] == h) return 1;
+    }
+    return 0;
+}
+
+// Add a name hash to the set, returning 0 if it was already there
+static inline int tar_names_add(tar_names_t *set, uint64_t h) {
+    if (set->count * 2 >= set->cap) {
+        size_t cap = set->cap ? set->cap * 2 : 256;
+        uint64_t *slots = calloc(cap, sizeof(uint64_t));
+        if (!slots) return 1;
+        for (size_t i = 0; i < set->cap; i++) {
+            if (!set->slots[i]) continue;
+            size_t j = set->slots[i] & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->cap = cap;
+    }
+    size_t j = h & (set->cap - 1);
+    while (set->slots[j]) {
+        if (set->slots[j] == h) return 0;
+        j = (j + 1) & (set->cap - 1);
+    }
+    set->slots[j] = h;
+    set->count++;
+    return 1;
+}
+
+static inline void tar_names_free(tar_names_t *set) {
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// One entry of an archive, located by tar_next
+typedef struct {
+    size_t start;               // first block, including extension headers
+    size_t header;              // the entry's own ustar header
+    size_t end;                 // just past its data
+    uint64_t size;
+    uint64_t name_hash;
+} tar_entry_t;
+
+// Hash of the name stored in a ustar header (prefix/name)
+static inline uint64_t tar_header_name_hash(const unsigned char *h) {
+    char name[256];
+    size_t plen = strnlen((const char *)h + 345, 155);
+    size_t nlen = strnlen((const char *)h, 100);
+    size_t len = 0;
+    if (plen) {
+        memcpy(name, h + 345, plen);
+        name[plen] = '/';
+        len = plen + 1;
+    }
+    memcpy(name + len, h, nlen);
+    return tar_name_hash(name, len + nlen);
+}
+
+// Parse the entry starting at off, together with any GNU long-name or pax
+// headers in front of it. Returns 1 for an entry, 0 at the end of the
+// archive, or -1 if it is truncated.
+static inline int tar_next(const char *data, size_t len, size_t off, tar_entry_t *e) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t long_name = 0;
+    e->start = off;
+    while (off + TAR_BLOCK <= len && !tar_zero_block(p + off)) {
+        const unsigned char *h = p + off;
+        uint64_t size = tar_field(h + 124, 12);
+        uint64_t span = TAR_BLOCK + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+        if (span > len - off) {
+            return -1;
+        }
+        char type = h[156];
+        if (type == 'L' || type == 'K' || type == 'x') {
+            if (type == 'L') {
+                long_name = tar_name_hash((const char *)h + TAR_BLOCK, strnlen((const char *)h + TAR_BLOCK, size));
+            }
+            off += span;
+            continue;
+        }
+        e->header = off;
+        e->size = size;
+        e->end = off + span;
+        e->name_hash = long_name ? long_name : tar_header_name_hash(h);
+        return 1;
+    }
+    return off == e->start ? 0 : -1;
+}
+
+// Rewrite the size field of a ustar header and its checksum
+static inline void tar_set_size(unsigned char *h, uint64_t size) {
+    char field[24];
+    snprintf(field, sizeof(field), "%011llo", (unsigned long long)size);
+    memcpy(h + 124, field, 12);
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += h[i];
+    }
+    snprintf(field, sizeof(field), "%06o", sum);
+    memcpy(h + 148, field, 7);
+}
+
+// Append the entries of archive src to dst, which holds dst_len bytes of
+// entries and has room for cap. With a names set, entries whose name was
+// already appended are skipped together with their GNU long-name or pax
+// headers. Returns the new length or -1.
+static inline long tar_append(char *dst, size_t dst_len, size_t cap, const char *src, size_t src_len, tar_names_t *names) {
+    if (tar_entries_len(src, src_len) < 0) {
+        return -1;
+    }
+
+    tar_entry_t e;
+    int status;
+    for (size_t off = 0; (status = tar_next(src, src_len, off, &e)) > 0; off = e.end) {
+        if (names && !tar_names_add(names, e.name_hash)) {
+            continue;
+        }
+        size_t n = e.end - e.start;
+        if (dst_len + n > cap) {
+            return -1;
+        }
+        memcpy(dst + dst_len, src + e.start, n);
+        dst_len += n;
+    }
+    return status < 0 ? -1 : (long)dst_len;
+}
+
+// Append a regular file entry named name holding size bytes of data, for
+// servers that build an archive themselves instead of running tar. Names
+// that do not fit a ustar header get a GNU long-name entry. Returns the new
+// length or -1 if it does not fit in cap.
+static inline long tar_add_file(char *dst, size_t len, size_t cap, const char *name, const char *data,
+                         size_t size, long mtime) {
+    size_t nlen = strlen(name);
+    size_t span = TAR_BLOCK + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+    size_t long_span = nlen > 100 ? TAR_BLOCK + ((nlen + 1 + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK : 0;
+    if (len + long_span + span > cap) {
+        return -1;
+    }
+
+    unsigned char *h = (unsigned char *)dst + len;
+    if (long_span) {
+        memset(h, 0, long_span);
+        strcpy((char *)h, "././@LongLink");
+        memcpy(h + 100, "0000644", 7);
+        memcpy(h + 257, "ustar  ", 8);
+        h[156] = 'L';
+        memcpy(h + TAR_BLOCK, name, nlen);
+        tar_set_size(h, nlen + 1);
+        h += long_span;
+    }
+
+    memset(h, 0, span);
+    memcpy(h, name, nlen > 100 ? 100 : nlen);
+    memcpy(h + 100, "0000644", 7);
+    memcpy(h + 108, "0000000", 7);
+    memcpy(h + 116, "0000000", 7);
+    snprintf((char *)h + 136, 12, "%011lo", (unsigned long)mtime);
+    h[156] = '0';
+    memcpy(h + 257, long_span ? "ustar  " : "ustar\0" "00", 8);
+    memcpy(h + TAR_BLOCK, data, size);
+    tar_set_size(h, size);
+    return len + long_span + span;
+}
+
+// Write the end-of-archive marker after len bytes of entries
+static inline long tar_finish(char *dst, size_t len, size_t cap) {
+    if (len + 2 * TAR_BLOCK > cap) {
+        return -1;
+    }
+    memset(dst + len, 0, 2 * TAR_BLOCK);
+    return len + 2 * TAR_BLOCK;
+}
+
+#endif
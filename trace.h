@@ -0,0 +1,221 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Request tracing.
+//
+// Every command carries a request id. The client puts "@<id> " in front
+// of its command line; S1 makes an id up when there is none, and sends
+// the same prefix ahead of every command it passes to a storage server
+// for that request. While a thread serves a request the id is in
+// trace_rid, and trace_span records the steps it goes through (parse,
+// lookup, disk read, send...) with monotonic timestamps into a ring of
+// the last TRACE_SPANS spans. Recording takes no lock: a writer claims a
+// slot with an atomic add and marks it complete with its sequence number,
+// and a reader skips slots that change while it copies them.
+//
+// S1's trace command gathers the spans of all servers into one file in
+// the Chrome trace event format, which chrome://tracing and Perfetto
+// open. Servers on one host share the monotonic clock, so their spans
+// line up on one timeline.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "hist.h"
+
+#define TRACE_SPANS 4096
+#define TRACE_RID 17                // ids are up to 16 characters
+#define TRACE_NAME 24
+
+typedef struct {
+    unsigned long long seq;         // position + 1 once written, 0 while being written
+    long long start_us;
+    long long dur_us;
+    int tid;
+    char rid[TRACE_RID];
+    char name[TRACE_NAME];
+} trace_span_t;
+
+static trace_span_t trace_spans[TRACE_SPANS];
+static unsigned long long trace_next;
+static __thread char trace_rid[TRACE_RID];     // request this thread is serving
+static __thread int trace_tid;
+
+// Make up a request id unique to this process and moment
+static inline void trace_new_id(char *rid) {
+    static unsigned long long counter;
+    unsigned long long n = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+    unsigned seed = (unsigned)getpid() * 2654435761u ^ (unsigned)time(NULL);
+    snprintf(rid, TRACE_RID, "%08x%08x", seed, (unsigned)n);
+}
+
+// Take an "@<id> " prefix off a command line into trace_rid. Without one,
+// or with an id that is not 1 to 16 letters, digits, '-' or '_', a new id
+// is made if make is set and trace_rid is cleared otherwise.
+static inline void trace_take(char *line, int make) {
+    trace_rid[0] = '\0';
+    if (line[0] == '@') {
+        size_t n = 1;
+        while (line[n] && line[n] != ' ') n++;
+        int ok = n > 1 && n - 1 < TRACE_RID;
+        for (size_t i = 1; ok && i < n; i++) {
+            ok = isalnum((unsigned char)line[i]) || line[i] == '-' || line[i] == '_';
+        }
+        if (ok) {
+            memcpy(trace_rid, line + 1, n - 1);
+            trace_rid[n - 1] = '\0';
+        }
+        while (line[n] == ' ') n++;
+        memmove(line, line + n, strlen(line + n) + 1);
+    }
+    if (!trace_rid[0] && make) {
+        trace_new_id(trace_rid);
+    }
+}
+
+// Serve the request rid on this thread, e.g. one handed to a worker
+static inline void trace_adopt(const char *rid) {
+    snprintf(trace_rid, TRACE_RID, "%s", rid);
+}
+
+// Record the step name of the current request as running from start_us
+// until now, and return now so steps can be chained
+static inline long long trace_span(const char *name, long long start_us) {
+    long long now = hist_now_us();
+    if (!trace_rid[0]) {
+        return now;
+    }
+    if (!trace_tid) {
+        trace_tid = syscall(SYS_gettid);
+    }
+    unsigned long long pos = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    trace_span_t *s = &trace_spans[pos % TRACE_SPANS];
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->start_us = start_us;
+    s->dur_us = now - start_us;
+    s->tid = trace_tid;
+    memcpy(s->rid, trace_rid, TRACE_RID);
+    snprintf(s->name, TRACE_NAME, "%s", name);
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return now;
+}
+
+// A span named for a step and what it acted on, as in "fetch host:port"
+static inline long long trace_span_of(const char *step, const char *what, long long start_us) {
+    char name[TRACE_NAME];
+    size_t n = strlen(step);
+    if (n > TRACE_NAME - 2) n = TRACE_NAME - 2;
+    memcpy(name, step, n);
+    name[n++] = ' ';
+    size_t w = strlen(what);
+    if (w > TRACE_NAME - 1 - n) w = TRACE_NAME - 1 - n;
+    memcpy(name + n, what, w);
+    name[n + w] = '\0';
+    return trace_span(name, start_us);
+}
+
+// Write the recorded spans, oldest first, as
+// "SPAN <rid> <start_us> <dur_us> <tid> <name>" lines; only those of
+// request rid unless it is NULL or empty. Returns the length written,
+// stopping at the last line that fits.
+static inline size_t trace_dump(const char *rid, char *out, size_t size) {
+    unsigned long long end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    unsigned long long pos = end > TRACE_SPANS ? end - TRACE_SPANS : 0;
+    size_t len = 0;
+    if (size) out[0] = '\0';
+    for (; pos < end; pos++) {
+        trace_span_t *slot = &trace_spans[pos % TRACE_SPANS], s;
+        unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        memcpy(&s, slot, sizeof(s));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != pos + 1 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        s.rid[TRACE_RID - 1] = s.name[TRACE_NAME - 1] = '\0';
+        if (rid && rid[0] && strcmp(rid, s.rid) != 0) {
+            continue;
+        }
+        int n = snprintf(out + len, size - len, "SPAN %s %lld %lld %d %s\n", s.rid, s.start_us, s.dur_us,
+                         s.tid, s.name);
+        if (n < 0 || (size_t)n >= size - len) {
+            out[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+// Chrome trace events, appended to out while they fit
+typedef struct {
+    char *p;
+    size_t len;
+    size_t size;
+    int events;
+} trace_json_t;
+
+static inline int trace_json_add(trace_json_t *j, const char *event) {
+    size_t n = strlen(event);
+    const char *sep = j->events ? ",\n" : "";
+    // Keep room for the closing "]}\n"
+    if (j->len + strlen(sep) + n + 4 > j->size) {
+        return -1;
+    }
+    j->len += sprintf(j->p + j->len, "%s%s", sep, event);
+    j->events++;
+    return 0;
+}
+
+static inline void trace_json_begin(trace_json_t *j) {
+    j->len = snprintf(j->p, j->size, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    j->events = 0;
+}
+
+static inline size_t trace_json_end(trace_json_t *j) {
+    j->len += snprintf(j->p + j->len, j->size - j->len, "\n]}\n");
+    return j->len;
+}
+
+// Add a server, shown as process pid named label, and the SPAN lines it
+// sent. Returns the number of spans added.
+static inline int trace_json_server(trace_json_t *j, int pid, const char *label, const char *lines) {
+    char event[256];
+    snprintf(event, sizeof(event), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+             pid, label);
+    trace_json_add(j, event);
+    snprintf(event, sizeof(event), "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"sort_index\":%d}}",
+             pid, pid);
+    trace_json_add(j, event);
+
+    int added = 0;
+    const char *p = lines;
+    while (p && *p) {
+        const char *eol = strchr(p, '\n');
+        char rid[TRACE_RID], name[TRACE_NAME];
+        long long start, dur;
+        int tid, used = 0;
+        if (sscanf(p, "SPAN %16s %lld %lld %d %n", rid, &start, &dur, &tid, &used) == 4 && used > 0) {
+            size_t n = eol ? (size_t)(eol - (p + used)) : strlen(p + used);
+            if (n >= TRACE_NAME) n = TRACE_NAME - 1;
+            memcpy(name, p + used, n);
+            name[n] = '\0';
+            snprintf(event, sizeof(event), "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lld,"
+                     "\"dur\":%lld,\"pid\":%d,\"tid\":%d,\"args\":{\"rid\":\"%s\"}}",
+                     name, start, dur, pid, tid, rid);
+            if (trace_json_add(j, event) < 0) {
+                break;
+            }
+            added++;
+        }
+        p = eol ? eol + 1 : NULL;
+    }
+    return added;
+}
+
+#endif
@@ -0,0 +1,397 @@
+#ifndef WAL_H
+#define WAL_H
+
+// Write-ahead log for durable uploads, optionally used by S1-S4.
+//
+// Uploaded files are written to their paths without fsync as before, then
+// a record of the upload (its path, size and CRC32C, not the data) is
+// appended to <base>/.wal/log, and the upload is only acknowledged once
+// the file and the record have reached the disk. A commit thread makes
+// that happen for every record appended within a window of each other
+// with a single syncfs, which writes out the files, the renames that
+// published them and the log together. The cost of a sync is shared by
+// all the uploads waiting on it, and file data is written only once.
+// Removals are logged too, without waiting.
+//
+// On startup the last complete record left in the log for each path is
+// applied again: a removal is redone, so a crash cannot bring a deleted
+// file back, and an upload is checked against the file, so an
+// acknowledged file that did not survive is reported. Once the log grows
+// past WAL_CHECKPOINT_BYTES and all of it is durable, the commit thread
+// empties it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "log.h"
+
+#define WAL_DIR ".wal"
+#define WAL_MAGIC "WAL2"
+#define WAL_PUT 1
+#define WAL_DEL 2
+#define WAL_CHECKPOINT_BYTES (1LL << 20)
+
+// Record header, followed by the path and, for WAL_PUT, a wal_put_t.
+// check is a hash of all three, taken with check = 0.
+typedef struct {
+    char magic[4];
+    uint32_t type;
+    uint32_t path_len;
+    uint32_t data_len;
+    uint64_t check;
+} wal_rec_t;
+
+typedef struct {
+    uint64_t size;
+    uint32_t crc;               // CRC32C of the file's data
+    uint32_t pad;
+} wal_put_t;
+
+// An acknowledgement held back until its record is durable
+typedef struct wal_ack {
+    struct wal_ack *next;
+    long long lsn;
+    int fd;                     // a dup of the connection, closed once sent
+    char msg[];
+} wal_ack_t;
+
+typedef struct {
+    int enabled;
+    int fd;
+    char path[300];
+    long window_us;             // how long a commit waits for more records
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // records appended
+    pthread_cond_t done;        // durable_lsn advanced
+    long long appended_lsn;
+    long long durable_lsn;
+    long long size;
+    wal_ack_t *acks;
+    // Totals for dedupstats
+    unsigned long long records;
+    unsigned long long syncs;
+    unsigned long long checkpoints;
+    double sync_ms;
+} wal_t;
+
+static inline uint64_t wal_check(const wal_rec_t *rec, const char *path, const char *data) {
+    wal_rec_t h = *rec;
+    h.check = 0;
+    uint64_t sum = 14695981039346656037ull;
+    const unsigned char *parts[3] = { (const unsigned char *)&h, (const unsigned char *)path,
+                                      (const unsigned char *)data };
+    size_t lens[3] = { sizeof(h), rec->path_len, rec->data_len };
+    for (int i = 0; i < 3; i++) {
+        for (size_t j = 0; j < lens[i]; j++) {
+            sum ^= parts[i][j];
+            sum *= 1099511628211ull;
+        }
+    }
+    return sum;
+}
+
+static inline double wal_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Empty the log once every record in it is durable. Called with the lock
+// held, so no record is appended meanwhile.
+static inline void wal_checkpoint(wal_t *w) {
+    if (ftruncate(w->fd, 0) < 0 || fsync(w->fd) < 0) {
+        log_warn("wal: Checkpoint failed: %s", strerror(errno));
+        return;
+    }
+    w->size = 0;
+    w->checkpoints++;
+}
+
+// Commit thread: one syncfs for all records appended within the window
+static void *wal_committer(void *arg) {
+    wal_t *w = arg;
+    while (1) {
+        pthread_mutex_lock(&w->lock);
+        while (w->durable_lsn == w->appended_lsn) {
+            pthread_cond_wait(&w->work, &w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (w->window_us > 0) {
+            usleep(w->window_us);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        long long target = w->appended_lsn;
+        pthread_mutex_unlock(&w->lock);
+
+        double t0 = wal_now_ms();
+        int ok = syncfs(w->fd) == 0;
+        double elapsed = wal_now_ms() - t0;
+        if (!ok) {
+            // Acknowledgements stay held back: the files may not be durable
+            log_warn("wal: syncfs failed: %s", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        w->durable_lsn = target;
+        w->syncs++;
+        w->sync_ms += elapsed;
+        wal_ack_t *ready = NULL, **a = &w->acks;
+        while (*a) {
+            if ((*a)->lsn <= target) {
+                wal_ack_t *r = *a;
+                *a = r->next;
+                r->next = ready;
+                ready = r;
+            } else {
+                a = &(*a)->next;
+            }
+        }
+        pthread_cond_broadcast(&w->done);
+        if (w->size >= WAL_CHECKPOINT_BYTES && w->durable_lsn == w->appended_lsn) {
+            wal_checkpoint(w);
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        while (ready) {
+            wal_ack_t *r = ready;
+            ready = r->next;
+            send(r->fd, r->msg, strlen(r->msg), 0);
+            close(r->fd);
+            free(r);
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint64_t path_hash;
+    int index;
+} wal_seen_t;
+
+static inline int wal_seen_cmp(const void *a, const void *b) {
+    const wal_seen_t *x = a, *y = b;
+    if (x->path_hash != y->path_hash) return x->path_hash < y->path_hash ? -1 : 1;
+    return x->index - y->index;
+}
+
+// Apply the last complete record in the log for each path with apply(type,
+// path, put), stopping at a torn or corrupt one. Runs twice: first
+// (with apply NULL) to find which records are the last for their path.
+// Returns the number applied.
+static inline int wal_scan(wal_t *w, int (*apply)(int, const char *, const wal_put_t *),
+                           wal_seen_t **seen, int *nseen) {
+    int applied = 0, index = 0, cap = 0;
+    off_t off = 0;
+    wal_rec_t rec;
+    while (pread(w->fd, &rec, sizeof(rec), off) == sizeof(rec)) {
+        if (memcmp(rec.magic, WAL_MAGIC, 4) != 0 || rec.path_len == 0 || rec.path_len > 4096 ||
+            rec.data_len != (rec.type == WAL_PUT ? sizeof(wal_put_t) : 0)) {
+            break;
+        }
+        char *path = malloc(rec.path_len + 1);
+        wal_put_t put;
+        int ok = path &&
+                 pread(w->fd, path, rec.path_len, off + sizeof(rec)) == rec.path_len &&
+                 pread(w->fd, &put, rec.data_len, off + sizeof(rec) + rec.path_len) == rec.data_len &&
+                 wal_check(&rec, path, (const char *)&put) == rec.check;
+        if (ok && !apply) {
+            if (*nseen == cap) {
+                cap = cap ? cap * 2 : 1024;
+                wal_seen_t *grown = realloc(*seen, cap * sizeof(wal_seen_t));
+                if (!grown) ok = 0; else *seen = grown;
+            }
+            if (ok) {
+                uint64_t h = 14695981039346656037ull;
+                for (uint32_t i = 0; i < rec.path_len; i++) {
+                    h = (h ^ (unsigned char)path[i]) * 1099511628211ull;
+                }
+                (*seen)[(*nseen)++] = (wal_seen_t){ h, index };
+            }
+        } else if (ok && (*seen)[index].index >= 0) {
+            path[rec.path_len] = '\0';
+            if (apply(rec.type, path, rec.type == WAL_PUT ? &put : NULL) < 0) {
+                log_warn("wal: Replaying %s failed: %s", path, strerror(errno));
+            }
+            applied++;
+        }
+        free(path);
+        if (!ok) break;
+        off += sizeof(rec) + rec.path_len + rec.data_len;
+        index++;
+    }
+    return applied;
+}
+
+static inline int wal_replay(wal_t *w, int (*apply)(int, const char *, const wal_put_t *)) {
+    wal_seen_t *seen = NULL;
+    int n = 0;
+    wal_scan(w, NULL, &seen, &n);
+    if (n == 0) {
+        free(seen);
+        return 0;
+    }
+
+    // keep[i] >= 0 marks record i as the last one for its path
+    wal_seen_t *sorted = malloc(n * sizeof(wal_seen_t));
+    if (!sorted) {
+        free(seen);
+        return -1;
+    }
+    memcpy(sorted, seen, n * sizeof(wal_seen_t));
+    qsort(sorted, n, sizeof(wal_seen_t), wal_seen_cmp);
+    for (int i = 0; i < n; i++) {
+        int last = i + 1 == n || sorted[i + 1].path_hash != sorted[i].path_hash;
+        seen[sorted[i].index].index = last ? sorted[i].index : -1;
+    }
+    free(sorted);
+
+    int applied = wal_scan(w, apply, &seen, &n);
+    free(seen);
+    return applied;
+}
+
+// Open the log of a server whose files live under base, replay what it
+// holds and start the commit thread. apply redoes a removal, or checks an
+// upload's file against its record (put), at startup.
+static inline int wal_open(wal_t *w, const char *base, long window_us,
+                           int (*apply)(int, const char *, const wal_put_t *)) {
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->window_us = window_us;
+    char dir[300];
+    snprintf(dir, sizeof(dir), "%s/%s", base, WAL_DIR);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    snprintf(w->path, sizeof(w->path), "%.290s/log", dir);
+    w->fd = open(w->path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (w->fd < 0) {
+        return -1;
+    }
+
+    int applied = wal_replay(w, apply);
+    if (applied > 0) {
+        log_info("wal: Replayed %d records", applied);
+    }
+    // Replayed removals have to be on disk before their records go
+    sync();
+    wal_checkpoint(w);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, wal_committer, w) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    w->enabled = 1;
+    return 0;
+}
+
+// Append a record of an upload of size bytes with checksum crc (WAL_PUT)
+// or of a removal (WAL_DEL), returning its sequence number (LSN) or -1.
+// Neither the record nor the file is durable until the commit thread has
+// synced them.
+static inline long long wal_append(wal_t *w, int type, const char *path, uint64_t size, uint32_t crc) {
+    wal_put_t put = { size, crc, 0 };
+    size_t len = type == WAL_PUT ? sizeof(put) : 0;
+    wal_rec_t rec;
+    memcpy(rec.magic, WAL_MAGIC, 4);
+    rec.type = type;
+    rec.path_len = strlen(path);
+    rec.data_len = len;
+    rec.check = wal_check(&rec, path, (const char *)&put);
+
+    pthread_mutex_lock(&w->lock);
+    const char *parts[3] = { (const char *)&rec, path, (const char *)&put };
+    size_t lens[3] = { sizeof(rec), rec.path_len, len };
+    long long lsn = -1;
+    int ok = 1;
+    for (int i = 0; i < 3 && ok; i++) {
+        size_t done = 0;
+        while (done < lens[i]) {
+            ssize_t n = write(w->fd, parts[i] + done, lens[i] - done);
+            if (n <= 0) {
+                ok = 0;
+                break;
+            }
+            done += n;
+        }
+    }
+    if (ok) {
+        w->size += sizeof(rec) + rec.path_len + len;
+        w->records++;
+        lsn = ++w->appended_lsn;
+        pthread_cond_signal(&w->work);
+    } else {
+        // Cut off the partial record so later ones stay reachable
+        int saved = errno;
+        if (ftruncate(w->fd, w->size) < 0) {
+            log_warn("wal: Cannot truncate log: %s", strerror(errno));
+        }
+        errno = saved;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return lsn;
+}
+
+// Wait until the record with sequence number lsn is durable
+static inline void wal_wait(wal_t *w, long long lsn) {
+    pthread_mutex_lock(&w->lock);
+    while (w->durable_lsn < lsn) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Send msg on connfd once the record with sequence number lsn is durable,
+// without waiting for it. The connection may be closed meanwhile.
+static inline int wal_ack(wal_t *w, long long lsn, int connfd, const char *msg) {
+    wal_ack_t *a = malloc(sizeof(wal_ack_t) + strlen(msg) + 1);
+    int fd = a ? dup(connfd) : -1;
+    if (fd < 0) {
+        free(a);
+        wal_wait(w, lsn);
+        send(connfd, msg, strlen(msg), 0);
+        return 0;
+    }
+    a->lsn = lsn;
+    a->fd = fd;
+    strcpy(a->msg, msg);
+    pthread_mutex_lock(&w->lock);
+    if (w->durable_lsn >= lsn) {
+        pthread_mutex_unlock(&w->lock);
+        send(fd, msg, strlen(msg), 0);
+        close(fd);
+        free(a);
+        return 0;
+    }
+    a->next = w->acks;
+    w->acks = a;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+// One-line summary of the log for dedupstats
+static inline void wal_stats(wal_t *w, const char *label, char *out, size_t size) {
+    pthread_mutex_lock(&w->lock);
+    snprintf(out, size, "%s: %llu records logged in %llu syncs (%.1f per sync, %.2f ms avg), "
+             "%llu checkpoints, window %ld us\n",
+             label, w->records, w->syncs, w->syncs ? (double)w->records / w->syncs : 0.0,
+             w->syncs ? w->sync_ms / w->syncs : 0.0, w->checkpoints, w->window_us);
+    pthread_mutex_unlock(&w->lock);
+}
+
+#endif
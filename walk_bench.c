@@ -0,0 +1,297 @@
+// Times S1's directory walks on synthetic trees: find_file looking up a
+// file that is there and one that is not, collect_files_recursive listing
+// the .c files, and build_local_tar archiving them as downltar does. The
+// functions are S1's own, compiled in from s1.c, so the figures follow
+// any change to them. S2-S4 walk their trees with copies of the same code.
+//
+// Each tree is built from a fixed recipe, so runs on the same machine and
+// filesystem are comparable across commits. -o saves the medians and -b
+// compares a run with saved ones. Cold runs drop the page cache before
+// every iteration; without permission to drop it (root), only the cached
+// file data is dropped, with posix_fadvise, and directories stay cached.
+
+#define main s1_main
+#include "s1.c"
+#undef main
+
+#include <ftw.h>
+
+#define MAX_ITERS 100
+
+typedef struct {
+    const char *name;
+    int dirs;                   // directories, nested or side by side
+    int nested;                 // each directory inside the previous one
+    int files;                  // files per directory
+    size_t size;                // bytes per file
+    int grow_dirs;              // -s scales dirs rather than files
+} shape_t;
+
+// Files cycle through .c, .txt, .pdf and .zip, so a quarter are listed
+// and archived.
+static const shape_t shapes[] = {
+    { "deep", 64, 1, 4, 4096, 0 },
+    { "wide", 500, 0, 4, 4096, 1 },
+    { "small", 40, 0, 250, 512, 0 },
+    { "large", 4, 0, 4, 1 << 20, 0 },
+};
+#define NSHAPES (int)(sizeof(shapes) / sizeof(shapes[0]))
+
+static const char *ops[] = { "find-hit", "find-miss", "list", "tar" };
+#define NOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+static char *payload;
+static int drop_mode = -1;      // 1 drop_caches, 0 fadvise
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, payload, size);
+    close(fd);
+    return n == (ssize_t)size ? 0 : -1;
+}
+
+// Build shape s under root. The file to look up, target.c, goes in the
+// last directory made; it is kept small so the large tree's .c files
+// still fit in one downltar reply. Returns 0 on success.
+static int build_tree(const shape_t *s, int scale, const char *root) {
+    static const char *exts[] = { ".c", ".txt", ".pdf", ".zip" };
+    int dirs = s->grow_dirs ? s->dirs * scale : s->dirs;
+    int files = s->grow_dirs ? s->files : s->files * scale;
+    char dir[MAXPATH], path[MAXPATH];
+    snprintf(dir, sizeof(dir), "%s", root);
+    if (create_dirs(dir) < 0) {
+        return -1;
+    }
+    for (int d = 0; d < dirs; d++) {
+        if (s->nested) {
+            size_t len = strlen(dir);
+            snprintf(dir + len, sizeof(dir) - len, "/d%02d", d % 100);
+        } else {
+            snprintf(dir, sizeof(dir), "%.480s/d%04d", root, d);
+        }
+        if (strlen(dir) > MAXPATH - 32 || create_dirs(dir) < 0) {
+            return -1;
+        }
+        for (int f = 0; f < files; f++) {
+            snprintf(path, sizeof(path), "%s/f%05d%s", dir, f, exts[f % 4]);
+            if (write_file(path, s->size) < 0) {
+                return -1;
+            }
+        }
+    }
+    snprintf(path, sizeof(path), "%s/target.c", dir);
+    return write_file(path, 4096);
+}
+
+static int fadvise_one(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_F) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+static void drop_cache(const char *root) {
+    sync();
+    if (drop_mode != 0) {
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        drop_mode = fd >= 0 && write(fd, "3", 1) == 1;
+        if (fd >= 0) close(fd);
+        if (drop_mode) return;
+    }
+    nftw(root, fadvise_one, 16, FTW_PHYS);
+}
+
+static int remove_one(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// Run op on the tree at root once. Returns what it found (files, bytes)
+// so a broken run is visible, or -1.
+static long run_op(int op, const char *root) {
+    static char files[MAX_FILES][512];
+    static char content[TARFILE_SIZE];
+    char found[MAXPATH], err[256];
+    int count = 0;
+    switch (op) {
+    case 0:
+        return find_file(root, "target.c", found, sizeof(found), root) == 1 ? 1 : -1;
+    case 1:
+        return find_file(root, "missing.c", found, sizeof(found), root) == 0 ? 0 : -1;
+    case 2:
+        return collect_files_recursive(root, root, ".c", files, &count, MAX_FILES) < 0 ? -1 : count;
+    default:
+        snprintf(s1_dir, sizeof(s1_dir), "%s", root);
+        return build_local_tar(".c", content, sizeof(content), err, sizeof(err));
+    }
+}
+
+// Median saved under key in a file written with -o, or -1
+static double baseline(const char *file, const char *key) {
+    FILE *fp = file ? fopen(file, "r") : NULL;
+    if (!fp) {
+        return -1;
+    }
+    char line[256];
+    double v = -1;
+    size_t n = strlen(key);
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, n) == 0 && line[n] == ' ') {
+            v = atof(line + n + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return v;
+}
+
+int main(int argc, char *argv[]) {
+    int iters = 5, scale = 1, warm = 1, cold = 1, keep = 0;
+    const char *only = NULL, *out_file = NULL, *base_file = NULL, *dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:c:t:o:b:d:k")) != -1) {
+        switch (opt) {
+        case 'n': iters = atoi(optarg); break;
+        case 's': scale = atoi(optarg); break;
+        case 'c':
+            warm = strcmp(optarg, "cold") != 0;
+            cold = strcmp(optarg, "warm") != 0;
+            break;
+        case 't': only = optarg; break;
+        case 'o': out_file = optarg; break;
+        case 'b': base_file = optarg; break;
+        case 'd': dir = optarg; break;
+        case 'k': keep = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-s scale] [-c warm|cold|both] [-t shape,...]\n"
+                            "       [-o results.txt] [-b baseline.txt] [-d work_dir] [-k]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (iters < 1 || iters > MAX_ITERS || scale < 1) {
+        fprintf(stderr, "walk_bench: need 1 <= iterations <= %d and scale >= 1\n", MAX_ITERS);
+        exit(1);
+    }
+    if (base_file && access(base_file, R_OK) < 0) {
+        fprintf(stderr, "walk_bench: cannot read %s: %s\n", base_file, strerror(errno));
+        exit(1);
+    }
+    // Only the measurements are of interest; find_file and the rest log
+    // at debug and warn level
+    log_set_level("error");
+
+    char root[MAXPATH];
+    if (dir) {
+        snprintf(root, sizeof(root), "%s/walk_bench.%d", dir, (int)getpid());
+        if (mkdir(root, 0755) < 0) {
+            fprintf(stderr, "walk_bench: cannot create %s: %s\n", root, strerror(errno));
+            exit(1);
+        }
+    } else {
+        snprintf(root, sizeof(root), "/tmp/walk_bench.XXXXXX");
+        if (!mkdtemp(root)) {
+            fprintf(stderr, "walk_bench: cannot create a directory in /tmp: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    payload = malloc(1 << 20);
+    if (!payload) {
+        fprintf(stderr, "walk_bench: out of memory\n");
+        exit(1);
+    }
+    srand(1);
+    for (int i = 0; i < 1 << 20; i++) {
+        payload[i] = rand();
+    }
+
+    FILE *out = NULL;
+    if (out_file && !(out = fopen(out_file, "w"))) {
+        fprintf(stderr, "walk_bench: cannot write %s: %s\n", out_file, strerror(errno));
+        exit(1);
+    }
+
+    printf("scale=%d, %d iterations, trees in %s\n", scale, iters, root);
+    printf("%-6s %-10s %-5s %7s %10s %10s %10s %8s\n", "tree", "op", "cache", "result", "min", "median",
+           "max", base_file ? "change" : "");
+    int failed = 0;
+    for (int s = 0; s < NSHAPES; s++) {
+        if (only && !strstr(only, shapes[s].name)) {
+            continue;
+        }
+        char tree[MAXPATH];
+        snprintf(tree, sizeof(tree), "%.480s/%.16s", root, shapes[s].name);
+        double t0 = now_sec();
+        if (build_tree(&shapes[s], scale, tree) < 0) {
+            fprintf(stderr, "walk_bench: cannot build the %s tree: %s\n", shapes[s].name, strerror(errno));
+            failed = 1;
+            break;
+        }
+        double built = now_sec() - t0;
+
+        for (int c = 0; c < 2; c++) {
+            if ((c == 0 && !warm) || (c == 1 && !cold)) {
+                continue;
+            }
+            const char *cache = c ? "cold" : "warm";
+            for (int op = 0; op < NOPS; op++) {
+                double times[MAX_ITERS];
+                long result = 0;
+                if (!c) {
+                    run_op(op, tree);   // fill the cache
+                }
+                for (int i = 0; i < iters; i++) {
+                    if (c) {
+                        drop_cache(tree);
+                    }
+                    t0 = now_sec();
+                    result = run_op(op, tree);
+                    times[i] = (now_sec() - t0) * 1e6;
+                }
+                qsort(times, iters, sizeof(times[0]), cmp_double);
+                double median = iters % 2 ? times[iters / 2] : (times[iters / 2 - 1] + times[iters / 2]) / 2;
+
+                char key[64], lo[16], mid[16], hi[16], change[16] = "";
+                snprintf(key, sizeof(key), "%s %s %s", shapes[s].name, ops[op], cache);
+                double was = baseline(base_file, key);
+                if (was > 0) {
+                    snprintf(change, sizeof(change), "%+.1f%%", (median - was) / was * 100);
+                }
+                printf("%-6s %-10s %-5s %7ld %10s %10s %10s %8s\n", shapes[s].name, ops[op], cache, result,
+                       hist_fmt(times[0], lo, 16), hist_fmt(median, mid, 16), hist_fmt(times[iters - 1], hi, 16),
+                       change);
+                if (out) {
+                    fprintf(out, "%s %.1f\n", key, median);
+                }
+                failed |= result < 0;
+            }
+        }
+        printf("%-6s built in %.2f s\n", shapes[s].name, built);
+    }
+    if (cold && drop_mode == 0) {
+        printf("Cold runs dropped cached file data only (no permission to drop the page cache)\n");
+    }
+    if (out) {
+        fclose(out);
+    }
+    if (!keep) {
+        nftw(root, remove_one, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return failed;
+}